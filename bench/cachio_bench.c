@@ -0,0 +1,293 @@
+/**
+ * Microbenchmarks of the hot internals, printed as one JSON object so runs can
+ * be compared across commits:
+ *
+ *   map       insert_map, lookup_map (hits and misses) and detach_map
+ *             throughput from 1K keys up to the maximum, growing 10x a step,
+ *             and the latency of single inserts into a growing map, which is
+ *             where help_resizing_map does its work
+ *   parse     parse_request on GET, SET and MSET frames
+ *   encoding  out_string and out_array into a reused Output
+ *
+ * Usage: cachio_bench [maximum number of keys, 1000000 by default]
+ *
+ * 100M keys take a few GB.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "command.h"
+#include "common.h"
+#include "encoding.h"
+#include "histogram.h"
+#include "map.h"
+#include "object.h"
+#include "request.h"
+
+#define K_STEP 2654435761u // A prime larger than any key count: i * K_STEP % n
+                           // visits every key once, in a cache-hostile order
+#define K_MIN_OPS 2000000  // Operations timed per measure, about
+#define K_FRAMES 4096      // Frames parsed per round
+
+#if defined(CACHIO_SWISS_MAP)
+#define K_ENGINE "swiss"
+#else
+#define K_ENGINE "chained"
+#endif
+
+typedef struct {
+  HashNode node;
+  uint64_t key;
+} BenchNode;
+
+static bool bench_node_eq(HashNode *a, HashNode *b) {
+  return ((BenchNode *)a)->key == ((BenchNode *)b)->key;
+}
+
+static void set_bench_key(BenchNode *node, uint64_t key) {
+  node->key = key;
+  node->node.hashcode = hash_string((const char *)&key, sizeof(key));
+}
+
+static double per_op(uint64_t start, uint64_t ops) {
+  return (double)(get_monotonic_ns() - start) / (double)ops;
+}
+
+static void print_latency(const char *name, const Histogram *latency) {
+  printf("\"%s\": {\"p50\": %llu, \"p99\": %llu, \"p99.99\": %llu, "
+         "\"max\": %llu}",
+         name, (unsigned long long)histogram_percentile(latency, 50),
+         (unsigned long long)histogram_percentile(latency, 99),
+         (unsigned long long)histogram_percentile(latency, 99.99),
+         (unsigned long long)latency->max);
+}
+
+/**
+ * Throughput of each operation on a map of n keys, in ns per operation.
+ * Inserts grow the map from empty, so they pay for the resizes; the lookups
+ * run once it is complete.
+ */
+static void bench_map(size_t n, bool first) {
+  BenchNode *nodes = (BenchNode *)malloc(n * sizeof(BenchNode));
+  for (size_t i = 0; i < n; i++) {
+    set_bench_key(&nodes[i], i);
+  }
+  Map map = {0};
+  uint64_t rounds = K_MIN_OPS / n + 1;
+
+  uint64_t start = get_monotonic_ns();
+  for (size_t i = 0; i < n; i++) {
+    insert_map(&map, &nodes[(uint64_t)i * K_STEP % n].node);
+  }
+  double insert = per_op(start, n);
+
+  volatile uintptr_t sink = 0;
+  BenchNode key;
+  start = get_monotonic_ns();
+  for (uint64_t r = 0; r < rounds; r++) {
+    for (size_t i = 0; i < n; i++) {
+      set_bench_key(&key, (uint64_t)(i + r) * K_STEP % n);
+      sink ^= (uintptr_t)lookup_map(&map, &key.node, bench_node_eq);
+    }
+  }
+  double hit = per_op(start, rounds * n);
+
+  start = get_monotonic_ns();
+  for (uint64_t r = 0; r < rounds; r++) {
+    for (size_t i = 0; i < n; i++) {
+      set_bench_key(&key, n + (uint64_t)(i + r) * K_STEP % n);
+      sink ^= (uintptr_t)lookup_map(&map, &key.node, bench_node_eq);
+    }
+  }
+  double miss = per_op(start, rounds * n);
+
+  start = get_monotonic_ns();
+  for (size_t i = 0; i < n; i++) {
+    set_bench_key(&key, (uint64_t)i * K_STEP % n);
+    sink ^= (uintptr_t)detach_map(&map, &key.node, bench_node_eq);
+  }
+  double detach = per_op(start, n);
+  (void)sink;
+
+  // Hashing the key is part of each lookup and detach, as in the store
+  printf("%s\n    {\"keys\": %zu, \"insert_ns\": %.2f, "
+         "\"lookup_hit_ns\": %.2f, \"lookup_miss_ns\": %.2f, "
+         "\"detach_ns\": %.2f}",
+         first ? "" : ",", n, insert, hit, miss, detach);
+  free_map(&map);
+  free(nodes);
+}
+
+/**
+ * Latency of each insert while the map grows to n keys, in ns. The tail is
+ * made of the inserts which start a resize or move nodes for it.
+ */
+static void bench_map_resizing(size_t n) {
+  BenchNode *nodes = (BenchNode *)malloc(n * sizeof(BenchNode));
+  for (size_t i = 0; i < n; i++) {
+    set_bench_key(&nodes[i], i);
+  }
+  Map map = {0};
+  Histogram inserts;
+  Histogram lookups;
+  initialize_histogram(&inserts);
+  initialize_histogram(&lookups);
+
+  volatile uintptr_t sink = 0;
+  BenchNode key;
+  for (size_t i = 0; i < n; i++) {
+    uint64_t start = get_monotonic_ns();
+    insert_map(&map, &nodes[(uint64_t)i * K_STEP % n].node);
+    uint64_t middle = get_monotonic_ns();
+    // A lookup also helps a resize in progress
+    set_bench_key(&key, (uint64_t)i * K_STEP % n);
+    sink ^= (uintptr_t)lookup_map(&map, &key.node, bench_node_eq);
+    uint64_t end = get_monotonic_ns();
+    histogram_record(&inserts, middle - start);
+    histogram_record(&lookups, end - middle);
+  }
+  (void)sink;
+
+  printf("  \"map_resizing\": {\"keys\": %zu, ", n);
+  print_latency("insert_ns", &inserts);
+  printf(", ");
+  print_latency("lookup_ns", &lookups);
+  printf("},\n");
+  free_map(&map);
+  free(nodes);
+}
+
+static size_t frame_request(uint8_t *dst, const StringView *args, uint32_t n) {
+  Output out;
+  initialize_output(&out);
+  out_request(&out, args, n);
+  memcpy(dst, out.chars, out.size);
+  size_t size = out.size;
+  free_output(&out);
+  return size;
+}
+
+/**
+ * parse_request on K_FRAMES frames of a kind, in ns per frame, the length
+ * prefix already stripped as the connection does
+ */
+static void bench_parse(const char *name, uint32_t nkeys, uint32_t value_size,
+                        const char *type, bool last) {
+  StringView args[1 + 2 * 16];
+  char keys[16][32];
+  char value[1024];
+  memset(value, 'v', sizeof(value));
+
+  size_t frame_capacity = 4 + 4 + 4 + 8 + nkeys * (8 + 32 + value_size);
+  uint8_t *frames = (uint8_t *)malloc(K_FRAMES * frame_capacity);
+  size_t *offsets = (size_t *)malloc(K_FRAMES * sizeof(size_t));
+  size_t size = 0;
+  for (uint32_t f = 0; f < K_FRAMES; f++) {
+    uint32_t n = 0;
+    args[n++] = (StringView){type, (uint32_t)strlen(type)};
+    for (uint32_t k = 0; k < nkeys; k++) {
+      uint32_t length = (uint32_t)snprintf(keys[k], sizeof(keys[k]),
+                                           "user:%u:session", f * nkeys + k);
+      args[n++] = (StringView){keys[k], length};
+      if (value_size) {
+        args[n++] = (StringView){value, value_size};
+      }
+    }
+    offsets[f] = size;
+    size += frame_request(&frames[size], args, n);
+  }
+
+  Command command;
+  initialize_command(&command);
+  uint64_t rounds = K_MIN_OPS / K_FRAMES + 1;
+  uint64_t start = get_monotonic_ns();
+  for (uint64_t r = 0; r < rounds; r++) {
+    for (uint32_t f = 0; f < K_FRAMES; f++) {
+      size_t end = f + 1 < K_FRAMES ? offsets[f + 1] : size;
+      clear_command(&command);
+      if (parse_request(&frames[offsets[f] + 4], end - offsets[f] - 4,
+                        &command)) {
+        die("parse_request()");
+      }
+    }
+  }
+  uint64_t elapsed = get_monotonic_ns() - start;
+
+  printf("    \"%s\": {\"ns\": %.2f, \"mb_per_s\": %.1f}%s\n", name,
+         (double)elapsed / (double)(rounds * K_FRAMES),
+         (double)(rounds * size) * 1e3 / (double)elapsed, last ? "" : ",");
+  free_command(&command);
+  free(offsets);
+  free(frames);
+}
+
+/**
+ * Encoding into an Output whose buffer is reused, as a connection does, in ns
+ * per value
+ */
+static void bench_encoding(void) {
+  char value[1024];
+  memset(value, 'v', sizeof(value));
+  Output out;
+  initialize_output(&out);
+  static const uint32_t K_SIZES[] = {16, 1024};
+
+  printf("  \"encoding\": {\n");
+  for (size_t s = 0; s < 2; s++) {
+    uint64_t start = get_monotonic_ns();
+    for (uint32_t r = 0; r < K_MIN_OPS / 1000; r++) {
+      out.size = 0;
+      for (uint32_t i = 0; i < 1000; i++) {
+        out_string(&out, value, K_SIZES[s]);
+      }
+    }
+    printf("    \"out_string_%u_ns\": %.2f,\n", K_SIZES[s],
+           per_op(start, K_MIN_OPS / 1000 * 1000));
+  }
+
+  // An MGET-like reply: a header, then 100 strings of 16 bytes
+  uint64_t start = get_monotonic_ns();
+  for (uint32_t r = 0; r < K_MIN_OPS / 100; r++) {
+    out.size = 0;
+    out_array(&out, 100);
+    for (uint32_t i = 0; i < 100; i++) {
+      out_string(&out, value, 16);
+    }
+  }
+  printf("    \"out_array_100_ns\": %.2f\n  }\n",
+         per_op(start, K_MIN_OPS / 100));
+  free_output(&out);
+}
+
+int main(int argc, char **argv) {
+  size_t max_keys = argc > 1 ? (size_t)atol(argv[1]) : 1000000;
+  if (max_keys < 1000) {
+    fprintf(stderr, "Usage: %s [maximum number of keys, at least 1000]\n",
+            argv[0]);
+    return 1;
+  }
+  initialize_hash_seed();
+
+  printf("{\n  \"engine\": \"%s\",\n  \"map\": [", K_ENGINE);
+  bool first = true;
+  for (size_t n = 1000; n <= max_keys; n *= 10) {
+    bench_map(n, first);
+    first = false;
+    fflush(stdout);
+  }
+  printf("\n  ],\n");
+  bench_map_resizing(max_keys);
+
+  printf("  \"parse_request\": {\n");
+  bench_parse("get", 1, 0, "get", false);
+  bench_parse("set_64", 1, 64, "set", false);
+  bench_parse("mset_16x64", 16, 64, "mset", true);
+  printf("  },\n");
+
+  bench_encoding();
+  printf("}\n");
+  return 0;
+}
@@ -0,0 +1,115 @@
+/**
+ * Microbenchmark and bucket-distribution report for hash_string, against the
+ * 32-bit FNV-1a it replaced. Keys are URL-like strings of 40-120 bytes.
+ *
+ * Usage: hash_bench [number of keys]
+ */
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "object.h"
+
+#define K_KEY_MAX 128
+
+static uint64_t fnv1a_32(const char *key, size_t length) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < length; i++) {
+    hash ^= (uint8_t)key[i];
+    hash *= 16777619;
+  }
+  return hash;
+}
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static size_t make_key(char *buf, size_t i) {
+  // 40-120 bytes, sharing long prefixes like real URLs
+  int n = snprintf(buf, K_KEY_MAX,
+                   "https://cdn.example.com/assets/user/%zu/profile/%zu.json",
+                   i % 100000, i);
+  size_t length = 40 + (i * 2654435761u) % 81;
+  for (size_t j = (size_t)n; j < length; j++) {
+    buf[j] = 'a' + (char)((i + j) % 26);
+  }
+  return length < (size_t)n ? (size_t)n : length;
+}
+
+static void bench(const char *name, uint64_t (*hash)(const char *, size_t),
+                  char *keys, size_t *lengths, size_t n) {
+  volatile uint64_t sink = 0;
+  size_t bytes = 0;
+  double start = now_ns();
+  for (int round = 0; round < 10; round++) {
+    for (size_t i = 0; i < n; i++) {
+      sink ^= hash(&keys[i * K_KEY_MAX], lengths[i]);
+      bytes += lengths[i];
+    }
+  }
+  double elapsed = now_ns() - start;
+  printf("%-10s %8.2f ns/hash %8.2f GB/s\n", name, elapsed / (10.0 * n),
+         (double)bytes / elapsed);
+  (void)sink;
+}
+
+static void distribution(const char *name,
+                         uint64_t (*hash)(const char *, size_t), char *keys,
+                         size_t *lengths, size_t n, int shift, int bits) {
+  size_t buckets = (size_t)1 << bits;
+  size_t *counts = calloc(buckets, sizeof(size_t));
+  for (size_t i = 0; i < n; i++) {
+    uint64_t h = hash(&keys[i * K_KEY_MAX], lengths[i]);
+    counts[(h >> shift) & (buckets - 1)]++;
+  }
+
+  double expected = (double)n / (double)buckets;
+  double chi2 = 0;
+  size_t empty = 0;
+  size_t max = 0;
+  for (size_t b = 0; b < buckets; b++) {
+    double d = (double)counts[b] - expected;
+    chi2 += d * d / expected;
+    empty += counts[b] == 0;
+    max = counts[b] > max ? counts[b] : max;
+  }
+
+  // chi2/(buckets-1) is ~1 for a uniform hash
+  printf("%-10s bits %2d-%2d: chi2/df %6.3f  empty %6.2f%% (ideal %6.2f%%)  "
+         "max %zu (mean %.1f)\n",
+         name, shift, shift + bits - 1, chi2 / (double)(buckets - 1),
+         100.0 * (double)empty / (double)buckets, 100.0 * exp(-expected), max,
+         expected);
+  free(counts);
+}
+
+int main(int argc, char **argv) {
+  size_t n = argc > 1 ? (size_t)atol(argv[1]) : 1000000;
+  initialize_hash_seed();
+
+  char *keys = malloc(n * K_KEY_MAX);
+  size_t *lengths = malloc(n * sizeof(size_t));
+  for (size_t i = 0; i < n; i++) {
+    lengths[i] = make_key(&keys[i * K_KEY_MAX], i);
+  }
+
+  printf("== throughput, %zu keys of 40-120 bytes\n", n);
+  bench("fnv1a-32", fnv1a_32, keys, lengths, n);
+  bench("hash", hash_string, keys, lengths, n);
+
+  printf("== bucket distribution, %zu keys into 2^16 buckets\n", n);
+  distribution("fnv1a-32", fnv1a_32, keys, lengths, n, 0, 16);
+  distribution("hash", hash_string, keys, lengths, n, 0, 16);
+  distribution("fnv1a-32", fnv1a_32, keys, lengths, n, 32, 16);
+  distribution("hash", hash_string, keys, lengths, n, 32, 16);
+
+  free(keys);
+  free(lengths);
+  return 0;
+}
@@ -0,0 +1,393 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "aof.h"
+#include "common.h"
+#include "request.h"
+#include "store.h"
+#include "worker.h"
+
+#define K_AOF_WRITER_SIZE (64 * 1024)
+
+// The log of the calling worker's shard
+static __thread struct {
+  int fd;                   // Open for appending, -1 if the log is disabled
+  bool loading;             // Replaying, writes are not logged again
+  Output buffer;            // Records not written yet
+  Output rewrite_buffer;    // Records logged since the rewrite child forked
+  pid_t rewrite_child;      // 0 if no rewrite is running
+  bool last_rewrite_failed; // Whether the last rewrite failed
+  uint64_t size;            // Bytes written to the file
+  uint64_t rewrite_size;    // Size of the file after the last rewrite
+  uint64_t replayed;        // Records replayed at startup
+} g_aof = {.fd = -1};
+
+// The fsync thread of the everysec policy syncs the logs of every shard. It
+// reads fd + 1 of each shard, 0 if none; a log swapped by a rewrite may get
+// one more harmless fdatasync() after it is closed.
+static atomic_int g_aof_fds[K_MAX_WORKERS];
+static atomic_bool g_aof_dirty[K_MAX_WORKERS];
+static pthread_once_t g_aof_once = PTHREAD_ONCE_INIT;
+static pthread_barrier_t g_aof_barrier; // Every shard replayed its logs
+
+/**
+ * Buffered writer of a log, which does not allocate so it can run in a forked
+ * child
+ */
+typedef struct {
+  int fd;
+  bool failed;
+  size_t used;
+  uint8_t buffer[K_AOF_WRITER_SIZE];
+} AofWriter;
+
+static void flush_aof_writer(AofWriter *writer) {
+  if (!writer->failed && write_all(writer->fd, writer->buffer, writer->used)) {
+    writer->failed = true;
+  }
+  writer->used = 0;
+}
+
+static void aof_writer_put(AofWriter *writer, const void *data, size_t length) {
+  if (writer->used + length > K_AOF_WRITER_SIZE) {
+    flush_aof_writer(writer);
+  }
+  if (length > K_AOF_WRITER_SIZE) {
+    // Too large to buffer, written as is
+    if (!writer->failed && write_all(writer->fd, data, length)) {
+      writer->failed = true;
+    }
+    return;
+  }
+  memcpy(&writer->buffer[writer->used], data, length);
+  writer->used += length;
+}
+
+static uint32_t record_length(const StringView *args, uint32_t n) {
+  uint32_t length = 4;
+  for (uint32_t i = 0; i < n; i++) {
+    length += 4 + args[i].length;
+  }
+  return length;
+}
+
+static void emit_to_writer(const StringView *args, uint32_t n, void *arg) {
+  AofWriter *writer = (AofWriter *)arg;
+  uint32_t length = record_length(args, n);
+  aof_writer_put(writer, &length, 4);
+  aof_writer_put(writer, &n, 4);
+  for (uint32_t i = 0; i < n; i++) {
+    aof_writer_put(writer, &args[i].length, 4);
+    aof_writer_put(writer, args[i].chars, args[i].length);
+  }
+}
+
+static void fill_aof_header(AofHeader *header) {
+  memset(header, 0, sizeof(*header));
+  memcpy(header->magic, K_AOF_MAGIC, 8);
+  header->version = K_AOF_VERSION;
+  header->shard = current_worker_id();
+  header->nshards = get_worker_count();
+}
+
+/**
+ * Write the commands rebuilding the shard to a new file at path
+ */
+static int write_shard_log(const char *path) {
+  AofWriter writer;
+  writer.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (writer.fd < 0) {
+    return -1;
+  }
+  writer.failed = false;
+  writer.used = 0;
+
+  AofHeader header;
+  fill_aof_header(&header);
+  aof_writer_put(&writer, &header, sizeof(header));
+  write_shard_commands(&emit_to_writer, &writer);
+  flush_aof_writer(&writer);
+
+  if (fsync(writer.fd)) {
+    writer.failed = true;
+  }
+  if (close(writer.fd) || writer.failed) {
+    unlink(path);
+    return -1;
+  }
+  return 0;
+}
+
+static bool is_aof_header_valid(const AofHeader *header) {
+  return memcmp(header->magic, K_AOF_MAGIC, 8) == 0 &&
+         header->version == K_AOF_VERSION && header->nshards > 0 &&
+         header->shard < header->nshards;
+}
+
+int read_aof_header(const char *path, AofHeader *header) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+  ssize_t rv = read(fd, header, sizeof(*header));
+  close(fd);
+  return rv == (ssize_t)sizeof(*header) && is_aof_header_valid(header) ? 0
+                                                                      : -1;
+}
+
+/**
+ * Execute the records of a log routed to the calling worker. A record cut
+ * short by a crash ends the replay.
+ */
+static void replay_aof_file(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return;
+  }
+  struct stat st;
+  if (fstat(fd, &st) || (size_t)st.st_size < sizeof(AofHeader)) {
+    close(fd);
+    return;
+  }
+  size_t size = (size_t)st.st_size;
+  const uint8_t *data = (const uint8_t *)mmap(
+      NULL, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return;
+  }
+
+  size_t position = sizeof(AofHeader);
+  execute_requests(&data[position], size - position, true, &g_aof.replayed);
+  munmap((void *)data, size);
+}
+
+static void *run_aof_fsync(void *arg) {
+  (void)arg;
+  while (true) {
+    // Group commit: one fdatasync() covers a second of writes
+    sleep(1);
+    for (uint32_t i = 0; i < get_worker_count(); i++) {
+      if (atomic_exchange(&g_aof_dirty[i], false)) {
+        int fd = atomic_load(&g_aof_fds[i]);
+        if (fd > 0) {
+          fdatasync(fd - 1);
+        }
+      }
+    }
+  }
+  return NULL;
+}
+
+static void initialize_aof_once(void) {
+  pthread_barrier_init(&g_aof_barrier, NULL, get_worker_count());
+  if (g_config.aof_fsync == AOF_FSYNC_EVERYSEC) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, run_aof_fsync, NULL)) {
+      die("pthread_create()");
+    }
+    pthread_detach(thread);
+  }
+}
+
+static void set_aof_fd(int fd) {
+  g_aof.fd = fd;
+  atomic_store(&g_aof_fds[current_worker_id()], fd + 1);
+}
+
+void open_aof(void) {
+  pthread_once(&g_aof_once, initialize_aof_once);
+
+  uint32_t shard = current_worker_id();
+  char path[PATH_MAX];
+  AofHeader first;
+  if (get_shard_path(path, sizeof(path), g_config.aof_path, 0)) {
+    die("append-only log path is too long");
+  }
+  bool exists = read_aof_header(path, &first) == 0;
+
+  // The hash seed is new, so the records of this shard may be in any log
+  g_aof.loading = true;
+  if (exists) {
+    for (uint32_t i = 0; i < first.nshards; i++) {
+      get_shard_path(path, sizeof(path), g_config.aof_path, i);
+      replay_aof_file(path);
+    }
+  } else {
+    load_snapshot();
+  }
+  g_aof.loading = false;
+
+  // Other workers may still be reading this worker's log
+  pthread_barrier_wait(&g_aof_barrier);
+
+  // Start a log of this seed from the data in memory
+  get_shard_path(path, sizeof(path), g_config.aof_path, shard);
+  char temporary[PATH_MAX + 16];
+  snprintf(temporary, sizeof(temporary), "%s.tmp-%d", path, (int)getpid());
+  if (write_shard_log(temporary) || rename(temporary, path)) {
+    die("writing the append-only log");
+  }
+
+  int fd = open(path, O_WRONLY | O_APPEND);
+  if (fd < 0) {
+    die("open() of the append-only log");
+  }
+  struct stat st;
+  fstat(fd, &st);
+  g_aof.size = (uint64_t)st.st_size;
+  g_aof.rewrite_size = g_aof.size;
+  set_aof_fd(fd);
+}
+
+bool is_aof_logging(void) { return g_aof.fd >= 0 && !g_aof.loading; }
+
+void aof_append(const void *record, size_t length) {
+  if (!is_aof_logging()) {
+    return;
+  }
+  out_raw(&g_aof.buffer, record, length);
+  if (g_aof.rewrite_child) {
+    out_raw(&g_aof.rewrite_buffer, record, length);
+  }
+}
+
+static void write_aof_buffer(void) {
+  if (g_aof.buffer.size == 0) {
+    return;
+  }
+  if (write_all(g_aof.fd, g_aof.buffer.chars, g_aof.buffer.size)) {
+    // Going on would acknowledge writes which are not logged
+    die("write() to the append-only log");
+  }
+  g_aof.size += g_aof.buffer.size;
+  g_aof.buffer.size = 0;
+
+  if (g_config.aof_fsync == AOF_FSYNC_ALWAYS) {
+    if (fdatasync(g_aof.fd)) {
+      die("fdatasync() of the append-only log");
+    }
+  } else if (g_config.aof_fsync == AOF_FSYNC_EVERYSEC) {
+    atomic_store(&g_aof_dirty[current_worker_id()], true);
+  }
+}
+
+void commit_aof(void) {
+  if (g_aof.buffer.size > 0 && (g_config.aof_fsync == AOF_FSYNC_ALWAYS ||
+                                g_aof.buffer.size >= K_AOF_FLUSH_SIZE)) {
+    write_aof_buffer();
+  }
+}
+
+static void get_rewrite_path(char *dst, size_t size, const char *path,
+                             pid_t child) {
+  snprintf(dst, size, "%s.rewrite-%d", path, (int)child);
+}
+
+/**
+ * Append the writes made during the rewrite to its file and swap it in
+ */
+static int finish_aof_rewrite(const char *temporary, const char *path) {
+  int fd = open(temporary, O_WRONLY | O_APPEND);
+  if (fd < 0) {
+    return -1;
+  }
+  if (write_all(fd, g_aof.rewrite_buffer.chars, g_aof.rewrite_buffer.size) ||
+      fdatasync(fd) || rename(temporary, path)) {
+    close(fd);
+    return -1;
+  }
+
+  close(g_aof.fd);
+  set_aof_fd(fd);
+  struct stat st;
+  fstat(fd, &st);
+  g_aof.size = (uint64_t)st.st_size;
+  g_aof.rewrite_size = g_aof.size;
+  return 0;
+}
+
+static void check_aof_rewrite(void) {
+  int status = 0;
+  pid_t pid = waitpid(g_aof.rewrite_child, &status, WNOHANG);
+  if (pid == 0 || (pid < 0 && errno == EINTR)) {
+    return; // Still running
+  }
+
+  char path[PATH_MAX];
+  char temporary[PATH_MAX + 32];
+  get_shard_path(path, sizeof(path), g_config.aof_path, current_worker_id());
+  get_rewrite_path(temporary, sizeof(temporary), path, g_aof.rewrite_child);
+
+  bool ok = pid > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0 &&
+            finish_aof_rewrite(temporary, path) == 0;
+  if (!ok) {
+    msg("Append-only log rewrite failed");
+    unlink(temporary);
+  }
+  g_aof.last_rewrite_failed = !ok;
+  g_aof.rewrite_child = 0;
+  free_output(&g_aof.rewrite_buffer);
+}
+
+void flush_aof(void) {
+  if (g_aof.fd < 0) {
+    return;
+  }
+
+  write_aof_buffer();
+  if (g_aof.rewrite_child) {
+    check_aof_rewrite();
+  } else if (g_aof.size >= K_AOF_REWRITE_MIN_SIZE &&
+             g_aof.size >= g_aof.rewrite_size * K_AOF_REWRITE_GROWTH) {
+    start_aof_rewrite();
+  }
+}
+
+int start_aof_rewrite(void) {
+  if (g_aof.fd < 0 || g_aof.rewrite_child) {
+    return -1;
+  }
+
+  // Whatever is logged from now on goes to the new file too
+  write_aof_buffer();
+  pid_t pid = fork();
+  if (pid < 0) {
+    return -1;
+  }
+  if (pid == 0) {
+    char path[PATH_MAX];
+    char temporary[PATH_MAX + 32];
+    get_shard_path(path, sizeof(path), g_config.aof_path, current_worker_id());
+    get_rewrite_path(temporary, sizeof(temporary), path, getpid());
+    _exit(write_shard_log(temporary) ? 1 : 0);
+  }
+
+  g_aof.rewrite_child = pid;
+  return 0;
+}
+
+void out_aof_info(Output *out, uint32_t *count) {
+  out_line(out, count, "aof_enabled:%d", g_aof.fd >= 0 ? 1 : 0);
+  if (g_aof.fd < 0) {
+    return;
+  }
+  out_line(out, count, "aof_fsync:%s", get_aof_fsync_name(g_config.aof_fsync));
+  out_line(out, count, "aof_size:%llu", (unsigned long long)g_aof.size);
+  out_line(out, count, "aof_buffer:%llu",
+           (unsigned long long)g_aof.buffer.size);
+  out_line(out, count, "aof_replayed:%llu", (unsigned long long)g_aof.replayed);
+  out_line(out, count, "aof_rewrite_in_progress:%d",
+           g_aof.rewrite_child ? 1 : 0);
+  out_line(out, count, "aof_last_rewrite_status:%s",
+           g_aof.last_rewrite_failed ? "err" : "ok");
+}
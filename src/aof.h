@@ -0,0 +1,89 @@
+#ifndef AOF_H
+#define AOF_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "encoding.h"
+
+#define K_AOF_MAGIC "CACHIOA1"
+#define K_AOF_VERSION 1
+#define K_AOF_FLUSH_SIZE (1 << 20) // Write the buffer early past this size
+#define K_AOF_REWRITE_MIN_SIZE (64ull << 20) // No automatic rewrite below
+#define K_AOF_REWRITE_GROWTH 2 // Rewrite once the log doubled since the last
+
+/**
+ * The append-only log of a shard, "<aof_path>.<shard>", is this header then
+ * one record per write, each framed like a request: a uint32 length then the
+ * argument count and the length-prefixed arguments. Records are effects
+ * rather than the commands clients sent: deadlines are absolute, batch
+ * commands only name the keys of the shard, and evictions and expirations are
+ * logged as deletions. Replaying a log therefore rebuilds the same shard,
+ * whatever the time and the command mix were.
+ */
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t shard;
+  uint32_t nshards;
+  uint32_t reserved;
+  uint64_t unused; // 0, was the hash seed
+} AofHeader;
+
+/**
+ * @brief Read the header of a log, without checking the rest.
+ *
+ * @return int 0 on success, -1 if the file is missing or not a log
+ */
+int read_aof_header(const char *path, AofHeader *header);
+
+/**
+ * @brief Fill the shard of the calling worker and open its log for appending.
+ * The records routed to the shard are replayed from every existing log;
+ * otherwise the snapshot is loaded. A new log is then written from the data.
+ * Called by each worker before it starts serving, when the log is enabled.
+ */
+void open_aof(void);
+
+/**
+ * @brief Whether writes are logged by the calling worker: the log is enabled,
+ * open and not being replayed.
+ */
+bool is_aof_logging(void);
+
+/**
+ * @brief Log a write of the calling worker's shard, a record framed by
+ * out_request(). The record is buffered and written by the next flush_aof().
+ */
+void aof_append(const void *record, size_t length);
+
+/**
+ * @brief Write the buffered records, then sync them if the policy is always.
+ * Called at the end of every write request, so with the always policy a
+ * write is on disk before its reply is sent; the other policies only write
+ * once the buffer is large.
+ */
+void commit_aof(void);
+
+/**
+ * @brief Write the buffered records, reap a finished rewrite and start one if
+ * the log has grown enough. Called by the worker before each poll.
+ */
+void flush_aof(void);
+
+/**
+ * @brief Compact the log in the background: a forked child writes the
+ * commands rebuilding the shard to a new file, while the writes made
+ * meanwhile are kept aside and appended to it before it replaces the log.
+ *
+ * @return int 0 if the rewrite started, -1 if one is running or fork() failed
+ */
+int start_aof_rewrite(void);
+
+/**
+ * @brief Report the state of the log as "aof_..." lines.
+ */
+void out_aof_info(Output *out, uint32_t *count);
+
+#endif /* AOF_H */
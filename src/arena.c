@@ -0,0 +1,76 @@
+#include "arena.h"
+#include "common.h"
+
+static __thread Arena t_request_arena;
+
+static ArenaChunk *create_chunk(size_t size) {
+  size_t capacity = size > K_ARENA_CHUNK_SIZE ? size : K_ARENA_CHUNK_SIZE;
+  ArenaChunk *chunk = (ArenaChunk *)malloc(sizeof(ArenaChunk) + capacity);
+  if (!chunk) {
+    die("malloc()");
+  }
+  chunk->next = NULL;
+  chunk->capacity = capacity;
+  chunk->used = 0;
+  return chunk;
+}
+
+void initialize_arena(Arena *arena) {
+  arena->head = NULL;
+  arena->used = 0;
+  arena->peak = 0;
+}
+
+void *arena_alloc(Arena *arena, size_t size) {
+  size = (size + 15) & ~(size_t)15;
+
+  ArenaChunk *chunk = arena->head;
+  if (!chunk || chunk->capacity - chunk->used < size) {
+    chunk = create_chunk(size);
+    chunk->next = arena->head;
+    arena->head = chunk;
+  }
+
+  void *ptr = &chunk->data[chunk->used];
+  chunk->used += size;
+  arena->used += size;
+  if (arena->used > arena->peak) {
+    arena->peak = arena->used;
+  }
+  return ptr;
+}
+
+void reset_arena(Arena *arena) {
+  if (arena->used == 0) {
+    return;
+  }
+
+  // Keep the oldest chunk, it has the default size
+  ArenaChunk *chunk = arena->head;
+  while (chunk && chunk->next) {
+    ArenaChunk *next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+  if (chunk && chunk->capacity > K_ARENA_CHUNK_SIZE) {
+    free(chunk);
+    chunk = NULL;
+  }
+  if (chunk) {
+    chunk->used = 0;
+  }
+  arena->head = chunk;
+  arena->used = 0;
+}
+
+void free_arena(Arena *arena) {
+  ArenaChunk *chunk = arena->head;
+  while (chunk) {
+    ArenaChunk *next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+  initialize_arena(arena);
+}
+
+Arena *request_arena(void) { return &t_request_arena; }
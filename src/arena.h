@@ -0,0 +1,46 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#define K_ARENA_CHUNK_SIZE (16 * 1024)
+
+typedef struct ArenaChunk {
+  struct ArenaChunk *next;
+  size_t capacity;
+  size_t used;
+  _Alignas(16) char data[];
+} ArenaChunk;
+
+/**
+ * A bump allocator for temporaries whose lifetime ends together, such as the
+ * scratch memory of one request. Memory is only given back by reset_arena(),
+ * which keeps the first chunk for the next user.
+ */
+typedef struct {
+  ArenaChunk *head; // Chunk being filled, the older chunks follow
+  size_t used;      // Bytes handed out since the last reset
+  size_t peak;      // Largest use between two resets
+} Arena;
+
+void initialize_arena(Arena *arena);
+
+/**
+ * @brief Get size bytes, 16-byte aligned, valid until the next reset.
+ */
+void *arena_alloc(Arena *arena, size_t size);
+
+/**
+ * @brief Release everything allocated from the arena, keeping one chunk.
+ */
+void reset_arena(Arena *arena);
+
+void free_arena(Arena *arena);
+
+/**
+ * @brief The scratch arena of the calling thread, reset after each request.
+ */
+Arena *request_arena(void);
+
+#endif /* ARENA_H */
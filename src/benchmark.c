@@ -0,0 +1,719 @@
+/**
+ * Load generator: drives a cachio server with GET/SET/DELETE requests over
+ * many pipelined connections, and reports the throughput and the latency
+ * percentiles.
+ *
+ * In the default closed loop, each connection keeps --pipeline requests in
+ * flight, so the load adapts to the server. With --rate, the loop is open:
+ * requests fall due at a fixed rate whatever the server does, and a request's
+ * latency is measured from when it fell due rather than from when a free
+ * pipeline slot let it go out. A stalled server is thus charged for every
+ * request it held back, which a closed loop would silently not send
+ * (coordinated omission).
+ */
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "event_loop.h"
+#include "histogram.h"
+
+#define K_BENCH_MAX_THREADS 64
+#define K_BENCH_KEY_MAX 32
+#define K_BENCH_DRAIN_NS 2000000000ull // Wait for late replies at the end
+#define K_BENCH_TICK_MS 100            // Longest wait of a closed loop
+#define K_BENCH_PREFILL_BATCH 1024     // Pipelined SETs of the prefill
+
+enum {
+  OP_GET,
+  OP_SET,
+  OP_DELETE,
+  OP_COUNT,
+};
+
+static const char *const K_OP_NAMES[OP_COUNT] = {"get", "set", "delete"};
+
+typedef struct {
+  const char *host;
+  uint16_t port;
+  uint32_t connections; // In total, split among the threads
+  uint32_t threads;
+  uint32_t pipeline; // Requests in flight per connection
+  double duration;   // Seconds
+  uint64_t requests; // Stop after as many, 0 for no limit
+  uint64_t keyspace;
+  bool zipf;
+  double zipf_theta;
+  uint32_t value_size;
+  uint32_t mix[OP_COUNT]; // Weights of the operations
+  double rate;            // Requests per second in total, 0 for a closed loop
+  bool prefill;           // SET every key before measuring
+  bool hdr;               // Print the whole percentile distribution
+} Options;
+
+static Options g_options = {
+    .host = "127.0.0.1",
+    .port = K_DEFAULT_PORT,
+    .connections = 50,
+    .threads = 1,
+    .pipeline = 1,
+    .duration = 10.0,
+    .requests = 0,
+    .keyspace = 100000,
+    .zipf = false,
+    .zipf_theta = 0.99,
+    .value_size = 32,
+    .mix = {80, 20, 0},
+    .rate = 0.0,
+    .prefill = false,
+    .hdr = false,
+};
+
+/**
+ * Zipfian ranks in [0, n), rank 0 being the most popular, after "Quickly
+ * Generating Billion-Record Synthetic Databases" (Gray et al.). The setup sums
+ * n terms once; each draw is then O(1).
+ */
+typedef struct {
+  uint64_t n;
+  double theta;
+  double alpha;
+  double zetan;
+  double eta;
+  double half_pow;
+} Zipf;
+
+static Zipf g_zipf;
+
+/**
+ * A connection to the server with the send times of its requests in flight,
+ * oldest first, which is the order of the replies
+ */
+typedef struct {
+  int fd;
+  char *wbuf; // Requests not written yet
+  size_t wsize;
+  size_t wsent;
+  size_t wcapacity;
+  uint8_t *rbuf; // Replies not parsed yet
+  size_t rsize;
+  size_t rcapacity;
+  uint64_t *stamps; // Ring of pipeline entries
+  uint8_t *ops;
+  uint32_t head;
+  uint32_t count;
+  uint64_t next_due_ns; // Open loop: when the next request falls due
+  uint64_t interval_ns;
+} BenchConnection;
+
+typedef struct {
+  pthread_t thread;
+  EventLoop loop;
+  BenchConnection *connections;
+  uint32_t nconnections;
+  BenchConnection **by_fd;
+  int max_fd;
+  uint64_t random;
+  uint64_t budget; // Requests this thread may send
+  uint64_t sent;
+  uint64_t done[OP_COUNT];
+  uint64_t hits; // GETs which found their key
+  uint64_t errors;
+  Histogram latency; // Nanoseconds
+} BenchThread;
+
+static char g_value[1 << 20];
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [--host HOST] [--port N] [--connections N] "
+          "[--threads N]\n"
+          "       [--pipeline N] [--duration SECONDS] [--requests N]\n"
+          "       [--keyspace N] [--distribution uniform|zipf] "
+          "[--zipf-theta T]\n"
+          "       [--value-size BYTES] [--mix GET:SET:DELETE] "
+          "[--rate REQUESTS/S]\n"
+          "       [--prefill] [--hdr]\n",
+          name);
+  exit(1);
+}
+
+static uint64_t next_random(uint64_t *state) {
+  // splitmix64
+  uint64_t z = (*state += 0x9e3779b97f4a7c15ull);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return z ^ (z >> 31);
+}
+
+static double next_uniform(uint64_t *state) {
+  return (double)(next_random(state) >> 11) * 0x1.0p-53;
+}
+
+static double zeta(uint64_t n, double theta) {
+  double sum = 0;
+  for (uint64_t i = 1; i <= n; i++) {
+    sum += 1.0 / pow((double)i, theta);
+  }
+  return sum;
+}
+
+static void initialize_zipf(Zipf *zipf, uint64_t n, double theta) {
+  zipf->n = n;
+  zipf->theta = theta;
+  zipf->alpha = 1.0 / (1.0 - theta);
+  zipf->zetan = zeta(n, theta);
+  zipf->eta = (1.0 - pow(2.0 / (double)n, 1.0 - theta)) /
+              (1.0 - zeta(2, theta) / zipf->zetan);
+  zipf->half_pow = 1.0 + pow(0.5, theta);
+}
+
+static uint64_t next_zipf(const Zipf *zipf, uint64_t *state) {
+  double u = next_uniform(state);
+  double uz = u * zipf->zetan;
+  if (uz < 1.0) {
+    return 0;
+  }
+  if (uz < zipf->half_pow) {
+    return 1;
+  }
+  uint64_t rank = (uint64_t)((double)zipf->n *
+                             pow(zipf->eta * u - zipf->eta + 1.0, zipf->alpha));
+  return rank < zipf->n ? rank : zipf->n - 1;
+}
+
+static uint64_t next_key(BenchThread *self) {
+  if (g_options.zipf) {
+    return next_zipf(&g_zipf, &self->random);
+  }
+  return next_random(&self->random) % g_options.keyspace;
+}
+
+static uint32_t next_op(BenchThread *self) {
+  uint32_t total = g_options.mix[OP_GET] + g_options.mix[OP_SET] +
+                   g_options.mix[OP_DELETE];
+  uint32_t pick = (uint32_t)(next_random(&self->random) % total);
+  for (uint32_t op = 0; op < OP_COUNT; op++) {
+    if (pick < g_options.mix[op]) {
+      return op;
+    }
+    pick -= g_options.mix[op];
+  }
+  return OP_GET;
+}
+
+static void *grow(void *buffer, size_t *capacity, size_t needed) {
+  if (needed <= *capacity) {
+    return buffer;
+  }
+  size_t size = *capacity ? *capacity : 4096;
+  while (size < needed) {
+    size *= 2;
+  }
+  buffer = realloc(buffer, size);
+  if (!buffer) {
+    die("realloc()");
+  }
+  *capacity = size;
+  return buffer;
+}
+
+/**
+ * Append a request in the wire format: a uint32 length, then the argument
+ * count and the length-prefixed arguments
+ */
+static void append_request(BenchConnection *conn, const char **args,
+                           const uint32_t *lengths, uint32_t n) {
+  uint32_t length = 4;
+  for (uint32_t i = 0; i < n; i++) {
+    length += 4 + lengths[i];
+  }
+  conn->wbuf = (char *)grow(conn->wbuf, &conn->wcapacity,
+                            conn->wsize + 4 + (size_t)length);
+  char *p = &conn->wbuf[conn->wsize];
+  memcpy(p, &length, 4);
+  memcpy(p + 4, &n, 4);
+  p += 8;
+  for (uint32_t i = 0; i < n; i++) {
+    memcpy(p, &lengths[i], 4);
+    memcpy(p + 4, args[i], lengths[i]);
+    p += 4 + lengths[i];
+  }
+  conn->wsize += 4 + (size_t)length;
+}
+
+static uint32_t format_key(char *dst, uint64_t key) {
+  return (uint32_t)snprintf(dst, K_BENCH_KEY_MAX, "key:%llu",
+                            (unsigned long long)key);
+}
+
+static void send_request(BenchThread *self, BenchConnection *conn,
+                         uint64_t stamp) {
+  char key[K_BENCH_KEY_MAX];
+  uint32_t op = next_op(self);
+  const char *args[3] = {K_OP_NAMES[op], key, g_value};
+  uint32_t lengths[3] = {(uint32_t)strlen(K_OP_NAMES[op]),
+                         format_key(key, next_key(self)), g_options.value_size};
+  append_request(conn, args, lengths, op == OP_SET ? 3 : 2);
+
+  uint32_t slot = (conn->head + conn->count) % g_options.pipeline;
+  conn->stamps[slot] = stamp;
+  conn->ops[slot] = (uint8_t)op;
+  conn->count++;
+  self->sent++;
+}
+
+/**
+ * Queue the requests the connection has room and is due for
+ */
+static void fill_connection(BenchThread *self, BenchConnection *conn,
+                            uint64_t now) {
+  while (conn->count < g_options.pipeline && self->sent < self->budget) {
+    if (g_options.rate <= 0) {
+      send_request(self, conn, now);
+      continue;
+    }
+    if (conn->next_due_ns > now) {
+      break;
+    }
+    // Late requests keep the time they fell due at
+    send_request(self, conn, conn->next_due_ns);
+    conn->next_due_ns += conn->interval_ns;
+  }
+}
+
+static int flush_connection(BenchConnection *conn) {
+  while (conn->wsent < conn->wsize) {
+    ssize_t rv =
+        write(conn->fd, &conn->wbuf[conn->wsent], conn->wsize - conn->wsent);
+    if (rv < 0 && errno == EINTR) {
+      continue;
+    }
+    if (rv < 0 && errno == EAGAIN) {
+      return 0; // The next EVENT_WRITE edge resumes
+    }
+    if (rv <= 0) {
+      return -1;
+    }
+    conn->wsent += (size_t)rv;
+  }
+  conn->wsize = conn->wsent = 0;
+  return 0;
+}
+
+static void complete_request(BenchThread *self, BenchConnection *conn,
+                             uint8_t type, uint64_t now) {
+  uint64_t stamp = conn->stamps[conn->head];
+  uint8_t op = conn->ops[conn->head];
+  conn->head = (conn->head + 1) % g_options.pipeline;
+  conn->count--;
+
+  histogram_record(&self->latency, now > stamp ? now - stamp : 0);
+  self->done[op]++;
+  if (type == SERIAL_ERROR) {
+    self->errors++;
+  } else if (op == OP_GET && type != SERIAL_NIL) {
+    self->hits++;
+  }
+}
+
+static int read_connection(BenchThread *self, BenchConnection *conn) {
+  while (true) {
+    conn->rbuf = (uint8_t *)grow(conn->rbuf, &conn->rcapacity,
+                                 conn->rsize + K_READ_SIZE);
+    ssize_t rv = read(conn->fd, &conn->rbuf[conn->rsize],
+                      conn->rcapacity - conn->rsize);
+    if (rv < 0 && errno == EINTR) {
+      continue;
+    }
+    if (rv < 0 && errno == EAGAIN) {
+      break;
+    }
+    if (rv <= 0) {
+      return -1;
+    }
+    conn->rsize += (size_t)rv;
+  }
+
+  uint64_t now = get_monotonic_ns();
+  size_t position = 0;
+  while (conn->rsize - position >= 4) {
+    uint32_t length = 0;
+    memcpy(&length, &conn->rbuf[position], 4);
+    if (conn->rsize - position - 4 < length) {
+      break;
+    }
+    if (length < 1 || conn->count == 0) {
+      return -1; // Not a reply to a request of ours
+    }
+    complete_request(self, conn, conn->rbuf[position + 4], now);
+    position += 4 + (size_t)length;
+  }
+  memmove(conn->rbuf, &conn->rbuf[position], conn->rsize - position);
+  conn->rsize -= position;
+  return 0;
+}
+
+static int connect_to_server(void) {
+  char port[8];
+  snprintf(port, sizeof(port), "%u", (unsigned)g_options.port);
+  struct addrinfo hints = {0};
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo *addresses = NULL;
+  if (getaddrinfo(g_options.host, port, &hints, &addresses)) {
+    die("getaddrinfo()");
+  }
+
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, addresses->ai_addr, addresses->ai_addrlen)) {
+    die("connect()");
+  }
+  freeaddrinfo(addresses);
+
+  int val = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+  return fd;
+}
+
+static void set_nonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+    die("fcntl()");
+  }
+}
+
+static void initialize_bench_thread(BenchThread *self, uint32_t id,
+                                    uint32_t nconnections, uint64_t budget) {
+  memset(self, 0, sizeof(*self));
+  self->random = 0x243f6a8885a308d3ull * (id + 1);
+  self->budget = budget;
+  self->nconnections = nconnections;
+  initialize_histogram(&self->latency);
+  initialize_event_loop(&self->loop);
+
+  self->connections =
+      (BenchConnection *)calloc(nconnections, sizeof(BenchConnection));
+  double rate = g_options.rate / (double)g_options.connections;
+  for (uint32_t i = 0; i < nconnections; i++) {
+    BenchConnection *conn = &self->connections[i];
+    conn->fd = connect_to_server();
+    set_nonblocking(conn->fd);
+    conn->stamps = (uint64_t *)calloc(g_options.pipeline, sizeof(uint64_t));
+    conn->ops = (uint8_t *)calloc(g_options.pipeline, 1);
+    if (rate > 0) {
+      conn->interval_ns = (uint64_t)(1e9 / rate);
+    }
+    if (event_loop_add(&self->loop, conn->fd, EVENT_READ | EVENT_WRITE)) {
+      die("epoll_ctl()");
+    }
+    self->max_fd = conn->fd > self->max_fd ? conn->fd : self->max_fd;
+  }
+
+  self->by_fd =
+      (BenchConnection **)calloc((size_t)self->max_fd + 1, sizeof(void *));
+  for (uint32_t i = 0; i < nconnections; i++) {
+    self->by_fd[self->connections[i].fd] = &self->connections[i];
+  }
+}
+
+/**
+ * Set when the first request of each connection of an open loop falls due,
+ * once all connections are open so their setup is not measured
+ */
+static void schedule_bench_thread(BenchThread *self, uint64_t start) {
+  for (uint32_t i = 0; i < self->nconnections; i++) {
+    // Stagger the connections so their requests do not fall due together
+    BenchConnection *conn = &self->connections[i];
+    conn->next_due_ns = start + conn->interval_ns * i / self->nconnections;
+  }
+}
+
+static uint64_t g_start_ns;
+static uint64_t g_end_ns;
+
+/**
+ * Milliseconds until a connection of an open loop has a request due
+ */
+static int next_timeout_ms(BenchThread *self, uint64_t now) {
+  if (g_options.rate <= 0) {
+    return K_BENCH_TICK_MS;
+  }
+  uint64_t wait = (uint64_t)K_BENCH_TICK_MS * 1000000;
+  for (uint32_t i = 0; i < self->nconnections; i++) {
+    BenchConnection *conn = &self->connections[i];
+    if (conn->count < g_options.pipeline) {
+      uint64_t due = conn->next_due_ns > now ? conn->next_due_ns - now : 0;
+      wait = due < wait ? due : wait;
+    }
+  }
+  // Rounded down: a request sent late is charged to the server, so the loop
+  // would rather spin than oversleep
+  return (int)(wait / 1000000);
+}
+
+static void *run_bench_thread(void *arg) {
+  BenchThread *self = (BenchThread *)arg;
+
+  while (true) {
+    uint64_t now = get_monotonic_ns();
+    bool sending = now < g_end_ns && self->sent < self->budget;
+    uint32_t in_flight = 0;
+    for (uint32_t i = 0; i < self->nconnections; i++) {
+      BenchConnection *conn = &self->connections[i];
+      if (sending) {
+        fill_connection(self, conn, now);
+      }
+      if (flush_connection(conn)) {
+        die("write()");
+      }
+      in_flight += conn->count;
+    }
+    if (!sending && (in_flight == 0 || now > g_end_ns + K_BENCH_DRAIN_NS)) {
+      break;
+    }
+
+    int n = event_loop_wait(&self->loop, sending ? next_timeout_ms(self, now)
+                                                 : K_BENCH_TICK_MS);
+    for (int i = 0; i < n; i++) {
+      FiredEvent *event = &self->loop.fired[i];
+      BenchConnection *conn = self->by_fd[event->fd];
+      if ((event->mask & EVENT_ERROR) || read_connection(self, conn)) {
+        die("Lost a connection to the server");
+      }
+    }
+  }
+  return NULL;
+}
+
+/**
+ * SET every key of the key space, so GETs hit from the start
+ */
+static void prefill(void) {
+  int fd = connect_to_server();
+  BenchConnection conn = {.fd = fd};
+  char key[K_BENCH_KEY_MAX];
+
+  for (uint64_t first = 0; first < g_options.keyspace;
+       first += K_BENCH_PREFILL_BATCH) {
+    uint64_t last = first + K_BENCH_PREFILL_BATCH;
+    last = last < g_options.keyspace ? last : g_options.keyspace;
+    for (uint64_t k = first; k < last; k++) {
+      const char *args[3] = {"set", key, g_value};
+      uint32_t lengths[3] = {3, format_key(key, k), g_options.value_size};
+      append_request(&conn, args, lengths, 3);
+    }
+    if (write_all(fd, conn.wbuf, conn.wsize)) {
+      die("write()");
+    }
+    conn.wsize = 0;
+
+    for (uint64_t k = first; k < last; k++) {
+      uint32_t length = 0;
+      uint8_t type = 0;
+      if (read_all(fd, &length, 4) || length < 1 || read_all(fd, &type, 1)) {
+        die("read()");
+      }
+      conn.rbuf = (uint8_t *)grow(conn.rbuf, &conn.rcapacity, length);
+      if (read_all(fd, conn.rbuf, length - 1)) {
+        die("read()");
+      }
+      if (type == SERIAL_ERROR) {
+        die("The server refused a SET of the prefill");
+      }
+    }
+  }
+  free(conn.wbuf);
+  free(conn.rbuf);
+  close(fd);
+}
+
+static void print_distribution(const Histogram *latency) {
+  // The ticks of HdrHistogram's percentile distribution: halving the distance
+  // to 100% at each step, five steps per halving
+  printf("%12s %14s %10s %14s\n", "Value(us)", "Percentile", "TotalCount",
+         "1/(1-Percentile)");
+  for (double half = 1.0; half > 1e-6; half /= 2) {
+    for (int step = 0; step < 5; step++) {
+      double fraction = 1.0 - half + half / 2 * step / 5.0;
+      double percentile = fraction * 100.0;
+      uint64_t count = (uint64_t)ceil(fraction * (double)latency->total);
+      printf("%12.3f %14.12f %10llu %14.2f\n",
+             (double)histogram_percentile(latency, percentile) / 1e3, fraction,
+             (unsigned long long)count, 1.0 / (1.0 - fraction));
+    }
+  }
+  printf("%12.3f %14.12f %10llu\n", (double)latency->max / 1e3, 1.0,
+         (unsigned long long)latency->total);
+}
+
+static void report(BenchThread *threads, uint32_t nthreads, double seconds) {
+  Histogram latency;
+  initialize_histogram(&latency);
+  uint64_t done[OP_COUNT] = {0};
+  uint64_t hits = 0;
+  uint64_t errors = 0;
+  for (uint32_t t = 0; t < nthreads; t++) {
+    histogram_merge(&latency, &threads[t].latency);
+    for (uint32_t op = 0; op < OP_COUNT; op++) {
+      done[op] += threads[t].done[op];
+    }
+    hits += threads[t].hits;
+    errors += threads[t].errors;
+  }
+
+  uint64_t total = done[OP_GET] + done[OP_SET] + done[OP_DELETE];
+  printf("%u connections on %u threads, pipeline %u, %s loop",
+         g_options.connections, nthreads, g_options.pipeline,
+         g_options.rate > 0 ? "open" : "closed");
+  if (g_options.rate > 0) {
+    printf(" at %.0f requests/s", g_options.rate);
+  }
+  printf("\n%llu keys, %s, %u-byte values, mix %u:%u:%u get:set:delete\n",
+         (unsigned long long)g_options.keyspace,
+         g_options.zipf ? "zipfian" : "uniform", g_options.value_size,
+         g_options.mix[OP_GET], g_options.mix[OP_SET],
+         g_options.mix[OP_DELETE]);
+  printf("requests:   %llu in %.2f s (get %llu, set %llu, delete %llu), "
+         "%llu errors\n",
+         (unsigned long long)total, seconds, (unsigned long long)done[OP_GET],
+         (unsigned long long)done[OP_SET], (unsigned long long)done[OP_DELETE],
+         (unsigned long long)errors);
+  printf("throughput: %.0f requests/s\n", (double)total / seconds);
+  if (done[OP_GET] > 0) {
+    printf("get hits:   %.2f%%\n", 100.0 * (double)hits / (double)done[OP_GET]);
+  }
+
+  static const double K_PERCENTILES[] = {50, 90, 99, 99.9, 99.99, 100};
+  printf("latency(us):");
+  for (size_t i = 0; i < sizeof(K_PERCENTILES) / sizeof(double); i++) {
+    double value = (double)histogram_percentile(&latency, K_PERCENTILES[i]);
+    printf(" p%g=%.3f", K_PERCENTILES[i], value / 1e3);
+  }
+  printf("\n");
+  if (g_options.hdr) {
+    print_distribution(&latency);
+  }
+}
+
+static void parse_options(int argc, char **argv) {
+  Options *o = &g_options;
+  for (int i = 1; i < argc; i++) {
+    const char *arg = argv[i];
+    bool has_value = i + 1 < argc;
+    if (strcmp(arg, "--host") == 0 && has_value) {
+      o->host = argv[++i];
+    } else if (strcmp(arg, "--port") == 0 && has_value) {
+      int n = atoi(argv[++i]);
+      if (n < 1 || n > 65535) {
+        usage(argv[0]);
+      }
+      o->port = (uint16_t)n;
+    } else if (strcmp(arg, "--connections") == 0 && has_value) {
+      o->connections = (uint32_t)atoi(argv[++i]);
+    } else if (strcmp(arg, "--threads") == 0 && has_value) {
+      o->threads = (uint32_t)atoi(argv[++i]);
+    } else if (strcmp(arg, "--pipeline") == 0 && has_value) {
+      o->pipeline = (uint32_t)atoi(argv[++i]);
+    } else if (strcmp(arg, "--duration") == 0 && has_value) {
+      o->duration = atof(argv[++i]);
+    } else if (strcmp(arg, "--requests") == 0 && has_value) {
+      o->requests = (uint64_t)atoll(argv[++i]);
+    } else if (strcmp(arg, "--keyspace") == 0 && has_value) {
+      o->keyspace = (uint64_t)atoll(argv[++i]);
+    } else if (strcmp(arg, "--distribution") == 0 && has_value) {
+      const char *name = argv[++i];
+      if (strcmp(name, "zipf") != 0 && strcmp(name, "uniform") != 0) {
+        usage(argv[0]);
+      }
+      o->zipf = strcmp(name, "zipf") == 0;
+    } else if (strcmp(arg, "--zipf-theta") == 0 && has_value) {
+      o->zipf_theta = atof(argv[++i]);
+    } else if (strcmp(arg, "--value-size") == 0 && has_value) {
+      o->value_size = (uint32_t)atoi(argv[++i]);
+    } else if (strcmp(arg, "--mix") == 0 && has_value) {
+      if (sscanf(argv[++i], "%u:%u:%u", &o->mix[OP_GET], &o->mix[OP_SET],
+                 &o->mix[OP_DELETE]) != 3) {
+        usage(argv[0]);
+      }
+    } else if (strcmp(arg, "--rate") == 0 && has_value) {
+      o->rate = atof(argv[++i]);
+    } else if (strcmp(arg, "--prefill") == 0) {
+      o->prefill = true;
+    } else if (strcmp(arg, "--hdr") == 0) {
+      o->hdr = true;
+    } else {
+      usage(argv[0]);
+    }
+  }
+
+  if (o->connections < 1 || o->threads < 1 ||
+      o->threads > K_BENCH_MAX_THREADS || o->pipeline < 1 ||
+      o->duration <= 0 || o->keyspace < 2 ||
+      !(o->zipf_theta > 0 && o->zipf_theta < 1) ||
+      o->value_size > sizeof(g_value) ||
+      o->mix[OP_GET] + o->mix[OP_SET] + o->mix[OP_DELETE] == 0 ||
+      o->rate < 0) {
+    usage(argv[0]);
+  }
+  if (o->threads > o->connections) {
+    o->threads = o->connections;
+  }
+}
+
+int main(int argc, char **argv) {
+  parse_options(argc, argv);
+  memset(g_value, 'x', sizeof(g_value));
+  if (g_options.zipf) {
+    initialize_zipf(&g_zipf, g_options.keyspace, g_options.zipf_theta);
+  }
+  if (g_options.prefill) {
+    prefill();
+  }
+
+  uint32_t nthreads = g_options.threads;
+  BenchThread *threads = (BenchThread *)calloc(nthreads, sizeof(BenchThread));
+  for (uint32_t t = 0; t < nthreads; t++) {
+    // Connections and requests are split as evenly as possible
+    uint32_t nconnections = g_options.connections / nthreads +
+                            (t < g_options.connections % nthreads ? 1 : 0);
+    uint64_t budget = UINT64_MAX;
+    if (g_options.requests) {
+      budget = g_options.requests / nthreads +
+               (t < g_options.requests % nthreads ? 1 : 0);
+    }
+    initialize_bench_thread(&threads[t], t, nconnections, budget);
+  }
+
+  g_start_ns = get_monotonic_ns();
+  g_end_ns = g_start_ns + (uint64_t)(g_options.duration * 1e9);
+  for (uint32_t t = 0; t < nthreads; t++) {
+    schedule_bench_thread(&threads[t], g_start_ns);
+  }
+
+  for (uint32_t t = 0; t < nthreads; t++) {
+    if (pthread_create(&threads[t].thread, NULL, run_bench_thread,
+                       &threads[t])) {
+      die("pthread_create()");
+    }
+  }
+  for (uint32_t t = 0; t < nthreads; t++) {
+    pthread_join(threads[t].thread, NULL);
+  }
+
+  double seconds = (double)(get_monotonic_ns() - g_start_ns) / 1e9;
+  report(threads, nthreads, seconds);
+  return 0;
+}
@@ -0,0 +1,86 @@
+#include <string.h>
+
+#include "buffer_pool.h"
+#include "common.h"
+
+typedef struct FreeBuffer {
+  struct FreeBuffer *next;
+} FreeBuffer;
+
+// Each worker thread recycles its own buffers, no locking needed
+static __thread struct {
+  FreeBuffer *free[K_POOL_CLASSES];
+  size_t count[K_POOL_CLASSES];
+} t_pool;
+
+static size_t size_class_shift(size_t size) {
+  size_t shift = K_POOL_MIN_SHIFT;
+  while (((size_t)1 << shift) < size) {
+    shift++;
+  }
+  return shift;
+}
+
+static size_t max_free(size_t shift) {
+  size_t n = K_POOL_MAX_FREE_BYTES >> shift;
+  if (n < 1) {
+    n = 1;
+  }
+  return n < K_POOL_MAX_FREE ? n : K_POOL_MAX_FREE;
+}
+
+uint8_t *acquire_buffer(size_t size, size_t *capacity) {
+  size_t shift = size_class_shift(size);
+  *capacity = (size_t)1 << shift;
+
+  if (shift <= K_POOL_MAX_SHIFT) {
+    size_t c = shift - K_POOL_MIN_SHIFT;
+    FreeBuffer *buffer = t_pool.free[c];
+    if (buffer) {
+      t_pool.free[c] = buffer->next;
+      t_pool.count[c]--;
+      return (uint8_t *)buffer;
+    }
+  }
+
+  uint8_t *buffer = (uint8_t *)malloc(*capacity);
+  if (!buffer) {
+    die("malloc()");
+  }
+  return buffer;
+}
+
+void release_buffer(uint8_t *buffer, size_t capacity) {
+  if (!buffer) {
+    return;
+  }
+
+  size_t shift = size_class_shift(capacity);
+  if (shift > K_POOL_MAX_SHIFT ||
+      t_pool.count[shift - K_POOL_MIN_SHIFT] >= max_free(shift)) {
+    free(buffer);
+    return;
+  }
+
+  size_t c = shift - K_POOL_MIN_SHIFT;
+  FreeBuffer *node = (FreeBuffer *)buffer;
+  node->next = t_pool.free[c];
+  t_pool.free[c] = node;
+  t_pool.count[c]++;
+}
+
+void reserve_buffer(uint8_t **buffer, size_t *capacity, size_t used,
+                    size_t size) {
+  if (*buffer && *capacity >= size) {
+    return;
+  }
+
+  size_t new_capacity = 0;
+  uint8_t *grown = acquire_buffer(size, &new_capacity);
+  if (used) {
+    memcpy(grown, *buffer, used);
+  }
+  release_buffer(*buffer, *capacity);
+  *buffer = grown;
+  *capacity = new_capacity;
+}
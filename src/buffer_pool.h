@@ -0,0 +1,48 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#define K_POOL_MIN_SHIFT 12 // Smallest class: 4 KB
+#define K_POOL_MAX_SHIFT 20 // Largest pooled class: 1 MB, larger are malloc'd
+#define K_POOL_CLASSES (K_POOL_MAX_SHIFT - K_POOL_MIN_SHIFT + 1)
+#define K_POOL_MAX_FREE 256 // Free buffers kept per class
+#define K_POOL_MAX_FREE_BYTES (2 << 20) // And bytes, so the large classes keep
+                                        // a few buffers only
+
+/**
+ * @brief Get a buffer of at least size bytes. The size is rounded up to a
+ * power-of-2 size class, and the buffer is taken from the calling thread's
+ * free list of that class when possible.
+ *
+ * @param size Minimum number of bytes
+ * @param capacity Set to the actual capacity of the buffer
+ *
+ * @return uint8_t* the buffer
+ */
+uint8_t *acquire_buffer(size_t size, size_t *capacity);
+
+/**
+ * @brief Give a buffer back to the pool of the calling thread. Buffers above
+ * the largest class, or beyond K_POOL_MAX_FREE or K_POOL_MAX_FREE_BYTES per
+ * class, are freed.
+ *
+ * @param buffer Buffer returned by acquire_buffer(), may be NULL
+ * @param capacity Capacity reported by acquire_buffer()
+ */
+void release_buffer(uint8_t *buffer, size_t capacity);
+
+/**
+ * @brief Make a buffer hold at least size bytes, keeping its first used bytes.
+ * Does nothing if the buffer is already large enough.
+ *
+ * @param buffer Pointer to the buffer, may point to NULL
+ * @param capacity Pointer to the capacity of the buffer
+ * @param used Number of bytes to keep
+ * @param size Minimum number of bytes
+ */
+void reserve_buffer(uint8_t **buffer, size_t *capacity, size_t used,
+                    size_t size);
+
+#endif /* BUFFER_POOL_H */
@@ -3,6 +3,7 @@
 #include <errno.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <unistd.h>
@@ -60,13 +61,16 @@ static int32_t write_full(int fd, const char *buf, size_t n) {
 static int32_t send_request(int fd, const Command *const command) {
   uint32_t length = 4;
   for (int i = 0; i < command->count; i++) {
-    length += 4 + strlen(command->strings[i]);
+    length += 4 + command->strings[i].length;
   }
-  if (length > K_MAX_MSG) {
+  if (length > g_config.max_msg) {
     return -1;
   }
 
-  char wbuf[4 + K_MAX_MSG];
+  char *wbuf = malloc(4 + length);
+  if (!wbuf) {
+    return -1;
+  }
   memcpy(&wbuf[0], &length, 4); // Little endian
 
   uint32_t n = command->count;
@@ -74,12 +78,14 @@ static int32_t send_request(int fd, const Command *const command) {
 
   size_t cur = 8;
   for (int i = 0; i < command->count; i++) {
-    uint32_t p = (uint32_t)strlen(command->strings[i]);
+    uint32_t p = command->strings[i].length;
     memcpy(&wbuf[cur], &p, 4);
-    memcpy(&wbuf[cur + 4], command->strings[i], p);
+    memcpy(&wbuf[cur + 4], command->strings[i].chars, p);
     cur += 4 + p;
   }
-  return write_full(fd, wbuf, 4 + length);
+  int32_t err = write_full(fd, wbuf, 4 + length);
+  free(wbuf);
+  return err;
 }
 
 static int32_t on_response(const uint8_t *data, size_t size) {
@@ -135,6 +141,17 @@ static int32_t on_response(const uint8_t *data, size_t size) {
       printf("(integer) %ld\n", val);
       return 1 + 8;
     }
+  case SERIAL_DOUBLE:
+    if (size < 1 + 8) {
+      msg("Bad Response");
+      return -1;
+    }
+    {
+      double val = 0;
+      memcpy(&val, &data[1], 8);
+      printf("(double) %.17g\n", val);
+      return 1 + 8;
+    }
 
   case SERIAL_ARRAY:
     if (size < 1 + 4) {
@@ -165,9 +182,9 @@ static int32_t on_response(const uint8_t *data, size_t size) {
 
 static int32_t read_response(int fd) {
   // 4-byte header
-  char rbuf[4 + K_MAX_MSG + 1];
+  char header[4];
   errno = 0;
-  int32_t err = read_full(fd, rbuf, 4);
+  int32_t err = read_full(fd, header, 4);
   if (err) {
     if (errno == 0) {
       msg("EOF");
@@ -178,25 +195,31 @@ static int32_t read_response(int fd) {
   }
 
   uint32_t length = 0;
-  memcpy(&length, rbuf, 4); // Little endian
-  if (length > K_MAX_MSG) {
+  memcpy(&length, header, 4); // Little endian
+  if (length > g_config.max_msg) {
     msg("CLIENT ERROR: Message too long");
     return -1;
   }
 
   // Reply body
-  err = read_full(fd, &rbuf[4], length);
+  char *rbuf = malloc(length + 1);
+  if (!rbuf) {
+    return -1;
+  }
+  err = read_full(fd, rbuf, length);
   if (err) {
     msg("CLIENT ERROR: read() error");
+    free(rbuf);
     return err;
   }
 
   // Print result
-  int32_t rv = on_response((uint8_t *)&rbuf[4], length);
+  int32_t rv = on_response((uint8_t *)rbuf, length);
   if (rv > 0 && (uint32_t)rv != length) {
     msg("Bad Response");
     rv = -1;
   }
+  free(rbuf);
   return rv;
 }
 
@@ -1,3 +1,4 @@
+#include <math.h>
 #include <string.h>
 
 #include "command.h"
@@ -9,35 +10,74 @@ void initialize_command(Command *command) {
   command->strings = NULL;
 }
 
-void add_to_command(Command *command, char *string, uint32_t length) {
+void add_to_command(Command *command, const char *string, uint32_t length) {
   if (command->capacity < command->count + 1) {
     // Grow
     if (command->capacity < 8) {
       command->capacity = 8;
-      command->strings = realloc(command->strings, 8 * sizeof(char *));
+      command->strings = realloc(command->strings, 8 * sizeof(StringView));
     } else {
       command->capacity = command->capacity * 2;
       command->strings =
-          realloc(command->strings, command->capacity * sizeof(char *));
+          realloc(command->strings, command->capacity * sizeof(StringView));
     }
   }
 
-  char *s = malloc((length + 1) * sizeof(char));
-  memcpy(s, string, length);
-  s[length] = '\0';
-
-  command->strings[command->count] = s;
+  command->strings[command->count].chars = string;
+  command->strings[command->count].length = length;
   command->count++;
 }
 
+void clear_command(Command *command) { command->count = 0; }
+
 void free_command(Command *command) {
-  for (int i = 0; i < command->count; i++) {
-    free(command->strings[i]);
-  }
   free(command->strings);
   initialize_command(command);
 }
 
 bool is_command_type(Command *command, const char *type) {
-  return memcmp(command->strings[0], type, strlen(type)) == 0;
+  size_t length = strlen(type);
+  return command->strings[0].length == length &&
+         memcmp(command->strings[0].chars, type, length) == 0;
+}
+
+bool view_to_int64(const StringView *view, int64_t *value) {
+  const char *chars = view->chars;
+  uint32_t length = view->length;
+  bool negative = length > 0 && chars[0] == '-';
+  uint32_t i = negative ? 1 : 0;
+  if (i == length || length - i > 19) {
+    return false;
+  }
+
+  uint64_t magnitude = 0;
+  for (; i < length; i++) {
+    if (chars[i] < '0' || chars[i] > '9') {
+      return false;
+    }
+    magnitude = magnitude * 10 + (uint64_t)(chars[i] - '0');
+  }
+  if (magnitude > (uint64_t)INT64_MAX + (negative ? 1 : 0)) {
+    return false;
+  }
+
+  *value = negative ? (int64_t)(0 - magnitude) : (int64_t)magnitude;
+  return true;
+}
+
+bool view_to_double(const StringView *view, double *value) {
+  char buffer[64];
+  if (view->length == 0 || view->length >= sizeof(buffer)) {
+    return false;
+  }
+  memcpy(buffer, view->chars, view->length);
+  buffer[view->length] = '\0';
+
+  char *end = NULL;
+  double parsed = strtod(buffer, &end);
+  if (end != &buffer[view->length] || isnan(parsed)) {
+    return false;
+  }
+  *value = parsed;
+  return true;
 }
@@ -4,18 +4,48 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+/**
+ * A view of a command argument: it points into the buffer the command was
+ * parsed from, is not NUL-terminated and may contain NUL bytes.
+ */
 typedef struct {
-  char **strings;
+  const char *chars;
+  uint32_t length;
+} StringView;
+
+typedef struct {
+  StringView *strings;
   int count;
   int capacity;
 } Command;
 
 void initialize_command(Command *command);
 
-void add_to_command(Command *command, char *string, uint32_t length);
+void add_to_command(Command *command, const char *string, uint32_t length);
+
+/**
+ * Forget the arguments but keep the array, so a command reused for the next
+ * request does not allocate.
+ */
+void clear_command(Command *command);
 
 void free_command(Command *command);
 
 bool is_command_type(Command *command, const char *type);
 
+/**
+ * @brief Parse a whole argument as a base-10 signed integer.
+ *
+ * @return bool false if the argument is not an integer or does not fit
+ */
+bool view_to_int64(const StringView *view, int64_t *value);
+
+/**
+ * @brief Parse a whole argument as a double, "inf", "+inf" and "-inf"
+ * included.
+ *
+ * @return bool false if the argument is not a number or is NaN
+ */
+bool view_to_double(const StringView *view, double *value);
+
 #endif /* COMMAND_H */
@@ -2,9 +2,105 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "common.h"
 
+Config g_config = {
+    .max_msg = K_MAX_MSG,
+    .max_memory = 0,
+    .eviction = EVICTION_NONE,
+    .snapshot_path = "dump.cachio",
+    .aof_path = NULL,
+    .aof_fsync = AOF_FSYNC_EVERYSEC,
+    .port = K_DEFAULT_PORT,
+    .primary_host = NULL,
+    .primary_port = K_DEFAULT_PORT,
+    .repl_backlog_size = K_REPL_BACKLOG_SIZE,
+    .repl_auth = NULL,
+    .rehash_budget_us = K_REHASH_BUDGET_US,
+};
+
+static const char *const K_EVICTION_POLICIES[] = {
+    [EVICTION_NONE] = "noeviction",
+    [EVICTION_ALLKEYS_LRU] = "allkeys-lru",
+    [EVICTION_ALLKEYS_LFU] = "allkeys-lfu",
+    [EVICTION_VOLATILE_TTL] = "volatile-ttl",
+};
+
+int parse_eviction_policy(const char *name, EvictionPolicy *policy) {
+  for (int i = 0; i <= EVICTION_VOLATILE_TTL; i++) {
+    if (strcmp(name, K_EVICTION_POLICIES[i]) == 0) {
+      *policy = (EvictionPolicy)i;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+const char *get_eviction_policy_name(EvictionPolicy policy) {
+  return K_EVICTION_POLICIES[policy];
+}
+
+static const char *const K_AOF_FSYNC_NAMES[] = {
+    [AOF_FSYNC_ALWAYS] = "always",
+    [AOF_FSYNC_EVERYSEC] = "everysec",
+    [AOF_FSYNC_NO] = "no",
+};
+
+int parse_aof_fsync(const char *name, AofFsync *fsync) {
+  for (int i = 0; i <= AOF_FSYNC_NO; i++) {
+    if (strcmp(name, K_AOF_FSYNC_NAMES[i]) == 0) {
+      *fsync = (AofFsync)i;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+const char *get_aof_fsync_name(AofFsync fsync) {
+  return K_AOF_FSYNC_NAMES[fsync];
+}
+
+int write_all(int fd, const void *data, size_t length) {
+  const uint8_t *bytes = (const uint8_t *)data;
+  while (length > 0) {
+    ssize_t rv = write(fd, bytes, length);
+    if (rv < 0 && errno == EINTR) {
+      continue;
+    }
+    if (rv <= 0) {
+      return -1;
+    }
+    bytes += rv;
+    length -= (size_t)rv;
+  }
+  return 0;
+}
+
+int read_all(int fd, void *data, size_t length) {
+  uint8_t *bytes = (uint8_t *)data;
+  while (length > 0) {
+    ssize_t rv = read(fd, bytes, length);
+    if (rv < 0 && errno == EINTR) {
+      continue;
+    }
+    if (rv <= 0) {
+      return -1; // Error, or the peer closed the connection
+    }
+    bytes += rv;
+    length -= (size_t)rv;
+  }
+  return 0;
+}
+
+int get_shard_path(char *dst, size_t size, const char *path, uint32_t shard) {
+  int rv = snprintf(dst, size, "%s.%u", path, shard);
+  return rv < 0 || (size_t)rv >= size ? -1 : 0;
+}
+
 void die(const char *msg) {
   int err = errno;
   fprintf(stderr, "[%d] Error in %s\n", err, msg);
@@ -13,6 +109,24 @@ void die(const char *msg) {
 
 void msg(const char *message) { fprintf(stderr, "%s\n", message); }
 
+uint64_t get_monotonic_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+int64_t get_realtime_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (int64_t)ts.tv_sec * 1000 + (int64_t)ts.tv_nsec / 1000000;
+}
+
+uint64_t get_monotonic_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
 void debug_msg(const char *const msg, ...) {
   printf("DEBUG: ");
   va_list argptr;
@@ -1,11 +1,39 @@
 #ifndef COMMON_H
 #define COMMON_H
 
+#include <stdint.h>
+#include <stdlib.h>
+
+/**
+ * This constant defines the default maximum message size for communication,
+ * see Config.max_msg
+ */
+#define K_MAX_MSG (1 << 20)
+#define K_MAX_MSG_LIMIT (1 << 30)
+
+/**
+ * Responses are batched in a connection's writing buffer up to this size
+ * before it is flushed
+ */
+#define K_PIPELINE_BUF_SIZE (64 * 1024)
+
+/**
+ * Room made in a connection's reading buffer before each read
+ */
+#define K_READ_SIZE 4096
+
+#define K_DEFAULT_PORT 4413
+
+/**
+ * Default bytes of writes each shard keeps for replicas to catch up from
+ */
+#define K_REPL_BACKLOG_SIZE (1 << 20)
+
 /**
- * This constant defines the maximum message size for communication
+ * Default time an idle worker spends finishing a resize of its keyspace
+ * before polling again
  */
-#define K_MAX_MSG 4096
-#define K_BUF_SIZE (K_MAX_MSG + 4)
+#define K_REHASH_BUDGET_US 1000
 
 #define DEBUG_MODE
 
@@ -15,8 +43,102 @@ typedef enum {
   SERIAL_STRING,
   SERIAL_INTEGER,
   SERIAL_ARRAY,
+  SERIAL_DOUBLE,
 } DataTypes;
 
+/**
+ * What a shard does when a write would take it over its memory limit
+ */
+typedef enum {
+  EVICTION_NONE,         // noeviction: refuse the write
+  EVICTION_ALLKEYS_LRU,  // Evict the least recently used keys
+  EVICTION_ALLKEYS_LFU,  // Evict the least frequently used keys
+  EVICTION_VOLATILE_TTL, // Evict the keys with the nearest deadline
+} EvictionPolicy;
+
+/**
+ * When the append-only log is synced to disk
+ */
+typedef enum {
+  AOF_FSYNC_ALWAYS,   // After every write request, before its reply
+  AOF_FSYNC_EVERYSEC, // Once a second, by a background thread
+  AOF_FSYNC_NO,       // Left to the kernel
+} AofFsync;
+
+/**
+ * Runtime settings, filled from the command line
+ */
+typedef struct {
+  uint32_t max_msg;    // Maximum size of a request or response message
+  uint64_t max_memory; // Bytes for the whole dataset, split among shards
+  EvictionPolicy eviction;
+  const char *snapshot_path; // Shard i is saved to "<snapshot_path>.<i>"
+  const char *aof_path;      // Append-only log, "<aof_path>.<i>", or NULL
+  AofFsync aof_fsync;
+  uint16_t port;
+  const char *primary_host; // Replicate this primary, read-only, or NULL
+  uint16_t primary_port;
+  uint64_t repl_backlog_size; // Per shard
+  const char *repl_auth;      // Secret of the replicas, NULL to refuse them
+  uint64_t rehash_budget_us;  // Idle time spent on resizes, 0 for none
+} Config;
+
+extern Config g_config;
+
+/**
+ * @brief Read an eviction policy from its name, such as "allkeys-lru".
+ *
+ * @return int 0 on success, -1 if the name is unknown
+ */
+int parse_eviction_policy(const char *name, EvictionPolicy *policy);
+
+const char *get_eviction_policy_name(EvictionPolicy policy);
+
+/**
+ * @brief Read an fsync policy from its name: "always", "everysec" or "no".
+ *
+ * @return int 0 on success, -1 if the name is unknown
+ */
+int parse_aof_fsync(const char *name, AofFsync *fsync);
+
+const char *get_aof_fsync_name(AofFsync fsync);
+
+/**
+ * @brief Milliseconds from a monotonic clock, for deadlines and timeouts.
+ */
+uint64_t get_monotonic_ms(void);
+
+/**
+ * @brief Milliseconds since the Unix epoch, for times saved to disk.
+ */
+int64_t get_realtime_ms(void);
+
+/**
+ * @brief Nanoseconds from a monotonic clock, to time commands.
+ */
+uint64_t get_monotonic_ns(void);
+
+/**
+ * @brief Write a whole buffer, retrying short writes and EINTR.
+ *
+ * @return int 0 on success, -1 on error
+ */
+int write_all(int fd, const void *data, size_t length);
+
+/**
+ * @brief Read exactly length bytes, retrying short reads and EINTR.
+ *
+ * @return int 0 on success, -1 on error or end of file
+ */
+int read_all(int fd, void *data, size_t length);
+
+/**
+ * @brief Name of the file of a shard, "<path>.<shard>".
+ *
+ * @return int 0 on success, -1 if the name does not fit in size bytes
+ */
+int get_shard_path(char *dst, size_t size, const char *path, uint32_t shard);
+
 void debug_msg(const char *const msg, ...);
 
 void die(const char *msg);
@@ -2,7 +2,6 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <poll.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,18 +9,36 @@
 #include <sys/socket.h>
 #include <unistd.h>
 
+#include "arena.h"
+#include "buffer_pool.h"
 #include "command.h"
 #include "common.h"
 #include "connection.h"
 #include "encoding.h"
+#include "event_loop.h"
 #include "request.h"
+#include "worker.h"
 
 void initialize_connection(Connection *connection) {
   connection->fd = -1;
   connection->state = 0;
+  connection->interest = 0;
+  connection->rbuf = NULL;
+  connection->rbuf_capacity = 0;
   connection->rbuf_size = 0;
+  connection->rbuf_read = 0;
+  connection->wbuf = NULL;
+  connection->wbuf_capacity = 0;
   connection->wbuf_size = 0;
   connection->wbuf_sent = 0;
+  initialize_command(&connection->command);
+  initialize_output(&connection->out);
+  connection->request_size = 0;
+  connection->pending = 0;
+  connection->flags = 0;
+  connection->inflight = 0;
+  connection->held_head = K_NO_BUFFER;
+  connection->held_tail = K_NO_BUFFER;
 }
 
 void initialize_connection_array(ConnectionArray *array) {
@@ -32,40 +49,67 @@ void initialize_connection_array(ConnectionArray *array) {
 
 void write_connection_array_with_fd(ConnectionArray *array,
                                     Connection *connection) {
-  if (array->capacity < (size_t)connection->fd) {
+  if (array->capacity <= connection->fd) {
     // Grow
+    int old_capacity = array->capacity;
     if (array->capacity == 0) {
       array->capacity = 8;
     }
-    while (array->capacity <= (size_t)connection->fd) {
+    while (array->capacity <= connection->fd) {
       array->capacity *= 2;
     }
     array->connections =
         realloc(array->connections, array->capacity * sizeof(Connection *));
+    memset(&array->connections[old_capacity], 0,
+           (array->capacity - old_capacity) * sizeof(Connection *));
   }
   array->connections[connection->fd] = connection;
-  array->count = array->count > connection->fd ? array->count : connection->fd;
+  array->count =
+      array->count > connection->fd + 1 ? array->count : connection->fd + 1;
 }
 
-int32_t accept_new_connection(ConnectionArray *fd_to_connection, int fd) {
+int32_t accept_new_connection(ConnectionArray *fd_to_connection,
+                              EventLoop *loop, int fd) {
   // Accept connection
   struct sockaddr_in client_addr = {};
   socklen_t socklen = sizeof(client_addr);
-  int connfd = accept(fd, (struct sockaddr *)&client_addr, &socklen);
+  int connfd = 0;
+  do {
+    connfd = accept(fd, (struct sockaddr *)&client_addr, &socklen);
+  } while (connfd < 0 && errno == EINTR);
+
   if (connfd < 0) {
-    msg("accept() error");
-    return -1; // Error
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      msg("accept() error");
+    }
+    return -1; // Error, or no more pending connections
   }
 
   // Set the new connection fd to non-blocking mode
   fd_set_nb(connfd);
 
+  if (event_loop_add(loop, connfd, EVENT_READ) != 0) {
+    close(connfd);
+    msg("epoll_ctl() error");
+    return -1;
+  }
+
+  Connection *conn = create_connection(fd_to_connection, connfd);
+  if (!conn) {
+    event_loop_delete(loop, connfd);
+    close(connfd);
+    return -1;
+  }
+  conn->interest = EVENT_READ;
+  return 0;
+}
+
+Connection *create_connection(ConnectionArray *fd_to_connection, int connfd) {
   // Creating the Connection struct
   Connection *conn = (Connection *)malloc(sizeof(Connection));
   if (!conn) {
-    close(connfd);
     msg("Failed to initialize a Connection struct");
-    return -1;
+    return NULL;
   }
   initialize_connection(conn);
   conn->fd = connfd;
@@ -73,43 +117,49 @@ int32_t accept_new_connection(ConnectionArray *fd_to_connection, int fd) {
 
   // Transfer ownership
   write_connection_array_with_fd(fd_to_connection, conn);
-  return 0;
+  return conn;
 }
 
-void free_connection_array(ConnectionArray *array) {
-  for (int i = 0; i < array->count; i++) {
-    free(array->connections[i]);
+void destroy_connection(ConnectionArray *fd_to_connection, EventLoop *loop,
+                        Connection *connection) {
+  if (loop) {
+    event_loop_delete(loop, connection->fd);
   }
-
-  free(array->connections);
-  initialize_connection_array(array);
+  fd_to_connection->connections[connection->fd] = NULL;
+  (void)close(connection->fd);
+  release_buffer(connection->rbuf, connection->rbuf_capacity);
+  release_buffer(connection->wbuf, connection->wbuf_capacity);
+  free_command(&connection->command);
+  free_output(&connection->out);
+  free(connection);
 }
 
-void initialize_poll_args(PollArgs *args) {
-  args->pfds = NULL;
-  args->count = 0;
-  args->capacity = 0;
+void update_connection_interest(EventLoop *loop, Connection *connection) {
+  if (connection->state == STATE_WAIT)
+    return; // Keep the interest until the request completes
+
+  uint32_t interest =
+      connection->state == STATE_RESPOND ? EVENT_WRITE : EVENT_READ;
+  if (interest == connection->interest)
+    return;
+
+  connection->interest = interest;
+  if (event_loop_modify(loop, connection->fd, interest) != 0) {
+    msg("epoll_ctl() error");
+    connection->state = STATE_END;
+  }
 }
 
-void write_poll_args(PollArgs *args, struct pollfd fd) {
-  if (args->capacity < args->count + 1) {
-    // Grow
-    if (args->capacity < 8) {
-      args->capacity = 8;
-      args->pfds = realloc(args->pfds, 8 * sizeof(struct pollfd));
-    } else {
-      args->capacity = args->capacity * 2;
-      args->pfds = realloc(args->pfds, args->capacity * sizeof(struct pollfd));
+void free_connection_array(ConnectionArray *array) {
+  for (int i = 0; i < array->count; i++) {
+    if (array->connections[i]) {
+      (void)close(array->connections[i]->fd);
+      free(array->connections[i]);
     }
   }
-  args->pfds[args->count] = fd;
-  args->count++;
-}
 
-void free_poll_args(PollArgs *args) {
-  if (args->pfds != NULL)
-    free(args->pfds);
-  initialize_poll_args(args);
+  free(array->connections);
+  initialize_connection_array(array);
 }
 
 void fd_set_nb(int fd) {
@@ -131,12 +181,33 @@ void fd_set_nb(int fd) {
   }
 }
 
+static bool has_response_room(Connection *conn) {
+  // Flush the batch once it is large enough, the buffer grows past it if needed
+  return conn->wbuf_size < K_PIPELINE_BUF_SIZE;
+}
+
+static bool has_complete_request(Connection *conn) {
+  size_t available = conn->rbuf_size - conn->rbuf_read;
+  if (available < 4) {
+    return false;
+  }
+  uint32_t len = 0;
+  memcpy(&len, &conn->rbuf[conn->rbuf_read], 4);
+  return 4 + (size_t)len <= available;
+}
+
 static bool try_flush_buffer(Connection *conn) {
+  // More requests are waiting for room: let the kernel coalesce the segments
+  int flags = MSG_NOSIGNAL;
+  if (has_complete_request(conn)) {
+    flags |= MSG_MORE;
+  }
+
   ssize_t rv = 0;
   // Try again if interrupted
   do {
     ssize_t remain = conn->wbuf_size - conn->wbuf_sent;
-    rv = write(conn->fd, &conn->wbuf[conn->wbuf_sent], remain);
+    rv = send(conn->fd, &conn->wbuf[conn->wbuf_sent], remain, flags);
   } while (rv < 0 && errno == EINTR);
 
   // Temporary unavailable, should retry later
@@ -151,7 +222,12 @@ static bool try_flush_buffer(Connection *conn) {
     return false;
   }
 
-  conn->wbuf_sent += (size_t)rv;
+  // Continue if there is still some data in write buffer
+  return connection_sent(conn, (size_t)rv);
+}
+
+bool connection_sent(Connection *conn, size_t n) {
+  conn->wbuf_sent += n;
   assert(conn->wbuf_sent <= conn->wbuf_size);
   if (conn->wbuf_sent == conn->wbuf_size) {
     // Respond was successfully sent, change state back
@@ -160,88 +236,181 @@ static bool try_flush_buffer(Connection *conn) {
     conn->wbuf_size = 0;
     return false;
   }
-
-  // There is still some data in write buffer, could try to write again
   return true;
 }
 
 static void state_respond(Connection *conn) {
+  if (conn->flags & CONN_ASYNC_IO) {
+    return; // The io_uring backend submits the write
+  }
   while (try_flush_buffer(conn)) {
   }
 }
 
+/**
+ * Lend the writing buffer to an Output, past room for the length prefix of the
+ * response.
+ */
+static void begin_response(Connection *conn, Output *out) {
+  reserve_buffer(&conn->wbuf, &conn->wbuf_capacity, conn->wbuf_size,
+                 conn->wbuf_size + 4);
+  out->chars = (char *)conn->wbuf;
+  out->capacity = conn->wbuf_capacity;
+  out->size = conn->wbuf_size + 4;
+}
+
+/**
+ * Take the writing buffer back from the Output, which may have grown it, and
+ * fill in the length prefix of the response.
+ */
+static void end_response(Connection *conn, Output *out) {
+  size_t length = out->size - conn->wbuf_size - 4;
+  if (length > g_config.max_msg) {
+    out->size = conn->wbuf_size + 4;
+    out_error(out, ERROR_TOO_BIG, "Response is too big");
+    length = out->size - conn->wbuf_size - 4;
+  }
+
+  conn->wbuf = (uint8_t *)out->chars;
+  conn->wbuf_capacity = out->capacity;
+  uint32_t wlen = (uint32_t)length;
+  memcpy(&conn->wbuf[conn->wbuf_size], &wlen, 4);
+  conn->wbuf_size = out->size;
+}
+
+static void finish_request(Connection *conn) {
+  // Skip the request, the buffer is compacted before the next read
+  conn->rbuf_read += conn->request_size;
+  conn->request_size = 0;
+
+  conn->state = STATE_REQUEST;
+  clear_command(&conn->command);
+}
+
 static bool try_one_request(Connection *conn) {
   // Try to parse a request from the buffer
 
-  if (conn->rbuf_size < 4) {
+  if (!has_response_room(conn)) {
+    // The responses batched so far must be sent first
+    return false;
+  }
+
+  size_t available = conn->rbuf_size - conn->rbuf_read;
+  if (available < 4) {
     // The read buffer does not have enough data for a request
     // Retry later
     return false;
   }
 
+  const uint8_t *frame = &conn->rbuf[conn->rbuf_read];
   uint32_t len = 0;
-  memcpy(&len, &conn->rbuf, 4);
-  if (len > K_MAX_MSG) {
+  memcpy(&len, frame, 4);
+  if (len > g_config.max_msg) {
     msg("Message too long");
     conn->state = STATE_END;
     return false;
   }
 
-  if (4 + len > conn->rbuf_size) {
+  if (4 + len > available) {
     // The request is not yet complete
     // Retry in next iteration
     return false;
   }
 
-  Command command;
-  initialize_command(&command);
+  // The command is reused across requests, its arguments are views of rbuf
+  Command *command = &conn->command;
+  clear_command(command);
 
-  if (0 != parse_request(&conn->rbuf[4], len, &command)) {
+  if (0 != parse_request(&frame[4], len, command)) {
     msg("Bad Request");
-    free_command(&command);
     conn->state = STATE_END;
     return false;
   }
+  conn->request_size = 4 + len;
 
+  initialize_output(&conn->out);
+  if (dispatch_request(conn)) {
+    // Executed by the shards owning the keys, completed on their reply
+    reset_arena(request_arena());
+    conn->state = STATE_WAIT;
+    return false;
+  }
+
+  // Serialize the response straight into the writing buffer
   Output out;
-  initialize_output(&out);
-  execute_request(&command, &out);
+  begin_response(conn, &out);
+  execute_request(command, &out);
+  end_response(conn, &out);
+  reset_arena(request_arena());
+  finish_request(conn);
 
-  // Pack the response into the buffer
-  if (4 + out.size > K_MAX_MSG) {
-    free_output(&out);
-    out_error(&out, ERROR_TOO_BIG, "Response is too big");
-  }
+  // Continue the outer loop if the process was fully processed
+  return (conn->state == STATE_REQUEST);
+}
 
-  uint32_t wlen = (uint32_t)out.size;
-  memcpy(&conn->wbuf[0], &wlen, 4);
-  memcpy(&conn->wbuf[4], out.chars, out.size);
-  conn->wbuf_size = 4 + wlen;
+void complete_request(Connection *conn) {
+  // The response was built by other shards, copy it once
+  Output out;
+  begin_response(conn, &out);
+  out_raw(&out, conn->out.chars, conn->out.size);
+  end_response(conn, &out);
+  free_output(&conn->out);
+  finish_request(conn);
+}
 
-  // remove request from buffer
-  size_t remain = conn->rbuf_size - 4 - len;
+static void compact_read_buffer(Connection *conn) {
+  if (conn->rbuf_read == 0) {
+    return;
+  }
+  size_t remain = conn->rbuf_size - conn->rbuf_read;
   if (remain) {
-    memmove(conn->rbuf, &conn->rbuf[4 + len], remain);
+    memmove(conn->rbuf, &conn->rbuf[conn->rbuf_read], remain);
   }
   conn->rbuf_size = remain;
+  conn->rbuf_read = 0;
+}
 
-  // Change state
-  conn->state = STATE_RESPOND;
-  state_respond(conn);
-  free_command(&command);
-  free_output(&out);
+static void reserve_read_buffer(Connection *conn, size_t size) {
+  if (size < K_READ_SIZE) {
+    size = K_READ_SIZE;
+  }
+  if (conn->rbuf_size >= 4) {
+    // Make room for the whole pending request at once
+    uint32_t len = 0;
+    memcpy(&len, conn->rbuf, 4);
+    if (len <= g_config.max_msg && 4 + (size_t)len > size) {
+      size = 4 + (size_t)len;
+    }
+  }
+  reserve_buffer(&conn->rbuf, &conn->rbuf_capacity, conn->rbuf_size, size);
+}
 
-  // Continue the outer loop if the process was fully processed
-  return (conn->state == STATE_REQUEST);
+void release_idle_buffers(Connection *conn) {
+  if (conn->state == STATE_WAIT) {
+    return; // The in-flight request still refers to the reading buffer
+  }
+  if (conn->rbuf && conn->rbuf_read == conn->rbuf_size) {
+    release_buffer(conn->rbuf, conn->rbuf_capacity);
+    conn->rbuf = NULL;
+    conn->rbuf_capacity = 0;
+    conn->rbuf_size = 0;
+    conn->rbuf_read = 0;
+  }
+  if (conn->wbuf && conn->wbuf_size == 0) {
+    release_buffer(conn->wbuf, conn->wbuf_capacity);
+    conn->wbuf = NULL;
+    conn->wbuf_capacity = 0;
+  }
 }
 
 static bool try_fill_buffer(Connection *conn) {
-  assert(conn->rbuf_size < sizeof(conn->rbuf));
+  compact_read_buffer(conn);
+  reserve_read_buffer(conn, conn->rbuf_size + 1);
   ssize_t rv = 0;
 
   // Loop if interrupted
   do {
-    size_t cap = sizeof(conn->rbuf) - conn->rbuf_size;
+    size_t cap = conn->rbuf_capacity - conn->rbuf_size;
     rv = read(conn->fd, &conn->rbuf[conn->rbuf_size], cap);
   } while (rv < 0 && errno == EINTR);
 
@@ -268,16 +437,71 @@ static bool try_fill_buffer(Connection *conn) {
   }
 
   conn->rbuf_size += (size_t)rv;
-  assert(conn->rbuf_size < sizeof(conn->rbuf));
+  assert(conn->rbuf_size <= conn->rbuf_capacity);
+  return true;
+}
 
-  while (try_one_request(conn)) {
+static void state_request(Connection *conn) {
+  bool drained = false; // The socket returned EAGAIN
+  while (conn->state == STATE_REQUEST) {
+    // Execute every complete request which has room for its response
+    while (try_one_request(conn)) {
+    }
+    if (conn->state != STATE_REQUEST) {
+      return;
+    }
+
+    // Keep reading as long as there is room
+    if (!drained && has_response_room(conn)) {
+      if (try_fill_buffer(conn)) {
+        continue;
+      }
+      if (conn->state != STATE_REQUEST) {
+        return;
+      }
+      drained = true;
+    }
+
+    // One write for the whole batch of responses
+    if (conn->wbuf_size == 0) {
+      break;
+    }
+    conn->state = STATE_RESPOND;
+    state_respond(conn);
+  }
+
+  if (drained) {
+    release_idle_buffers(conn);
   }
-  return (conn->state == STATE_REQUEST);
 }
 
-static void state_request(Connection *conn) {
-  while (try_fill_buffer(conn)) {
+void resume_connection(Connection *conn) {
+  if (conn->flags & CONN_ASYNC_IO) {
+    return; // Pumped by the io_uring backend
   }
+  // Serve requests already buffered, drain the socket until EAGAIN and flush
+  state_request(conn);
+}
+
+size_t connection_feed(Connection *conn, const uint8_t *data, size_t length) {
+  // Requests left over from before the last response come first
+  while (try_one_request(conn)) {
+  }
+  if (conn->state != STATE_REQUEST || !has_response_room(conn)) {
+    return 0;
+  }
+  if (length == 0) {
+    return 0;
+  }
+
+  compact_read_buffer(conn);
+  reserve_read_buffer(conn, conn->rbuf_size + length);
+  memcpy(&conn->rbuf[conn->rbuf_size], data, length);
+  conn->rbuf_size += length;
+
+  while (try_one_request(conn)) {
+  }
+  return length;
 }
 
 void connection_io(Connection *conn) {
@@ -285,6 +509,11 @@ void connection_io(Connection *conn) {
     state_request(conn);
   } else if (conn->state == STATE_RESPOND) {
     state_respond(conn);
+    if (conn->state == STATE_REQUEST) {
+      state_request(conn);
+    }
+  } else if (conn->state == STATE_WAIT) {
+    // Readiness is picked up by resume_connection() once the request completes
   } else {
     msg("Invalid Connection state");
     assert(0);
@@ -7,12 +7,30 @@
 #include <sys/socket.h>
 #include <unistd.h>
 
+#include "command.h"
+#include "common.h"
+#include "encoding.h"
+#include "event_loop.h"
+
 enum {
   STATE_REQUEST = 0,
   STATE_RESPOND = 1,
-  STATE_END = 2, // Mark connnection for deletion
+  STATE_END = 2,  // Mark connnection for deletion
+  STATE_WAIT = 3, // Waiting for other shards to execute the current request
 };
 
+enum {
+  CONN_ASYNC_IO = 1 << 0,   // Socket I/O is submitted by the io_uring backend
+  CONN_RECV_ARMED = 1 << 1, // A multishot recv is active
+  CONN_SENDING = 1 << 2,    // A send of the writing buffer is in flight
+  CONN_CLOSING = 1 << 3,    // Cancelled, freed once inflight drops to 0
+  CONN_STARVED = 1 << 4,    // recv stopped for lack of provided buffers
+  CONN_PEER_CLOSED = 1 << 5, // EOF or error in STATE_WAIT, closed once the
+                             // request completes
+};
+
+#define K_NO_BUFFER 0xFFFF
+
 /**
  * This structure represents a connection to a client. It contains the file
  * descriptor of the client socket, the state of the connection (either
@@ -20,17 +38,37 @@ enum {
  * The reading buffer is used to store the request from the client, and the
  * writing buffer is used to store the response to the client. This is due to
  * the connections being non-blocking, and the need to read and write in chunks.
+ * Both buffers start small, grow to fit the messages and go back to the buffer
+ * pool when they are empty, so idle connections hold no buffer. Every complete
+ * request in the reading buffer is executed before the batch of responses is
+ * flushed with a single write. The request being executed is kept in the
+ * connection, so it can be handed to the worker owning its keys while the
+ * connection is in STATE_WAIT.
  */
 typedef struct Connection {
   int fd;
-  uint32_t state; // Either STATE_REQ / STATE_RES
-  // reading buffer
+  uint32_t state;    // Either STATE_REQ / STATE_RES
+  uint32_t interest; // EVENT_* mask currently registered in the event loop
+  // reading buffer, from the buffer pool while there is data in it
+  uint8_t *rbuf;
+  size_t rbuf_capacity;
   size_t rbuf_size;
-  uint8_t rbuf[K_BUF_SIZE];
-  // writing buffer
+  size_t rbuf_read; // bytes of requests already executed
+  // writing buffer, from the buffer pool while there is data in it
+  uint8_t *wbuf;
+  size_t wbuf_capacity;
   size_t wbuf_size;
   size_t wbuf_sent;
-  uint8_t wbuf[K_BUF_SIZE];
+  // in-flight request
+  Command command;
+  Output out;
+  size_t request_size; // bytes of rbuf holding the request
+  uint32_t pending;    // replies still expected from other shards
+  // io_uring backend
+  uint32_t flags;     // CONN_* flags
+  uint32_t inflight;  // Submitted operations not completed yet
+  uint16_t held_head; // Provided buffers received but not consumed yet
+  uint16_t held_tail;
 } Connection;
 
 /**
@@ -44,12 +82,6 @@ typedef struct ConnectionArray {
   int count;
 } ConnectionArray;
 
-typedef struct PollArgs {
-  struct pollfd *pfds;
-  int capacity;
-  int count;
-} PollArgs;
-
 /**
  * @brief Initialize a connection. This function sets the file descriptor to -1,
  * the state to STATE_REQUEST, and the reading and writing buffers to zero.
@@ -80,52 +112,59 @@ void write_connection_array_with_fd(ConnectionArray *array,
 
 /**
  * @brief Accept a new connection. This function accepts a new connection on the
- * server socket, and adds the new connection to the connection array. If the
- * connection struct is NULL, it will return -1.
+ * server socket, adds the new connection to the connection array and registers
+ * it once in the event loop. If the connection struct is NULL, or there is no
+ * pending connection left (EAGAIN), it will return -1.
  *
  * @param fd_to_connection ConnectionArray to add the new connection to
+ * @param loop EventLoop to register the new connection in
  * @param fd File descriptor of the server socket
  *
  * @return int32_t 0 if the new connection was accepted successfully, -1
  * otherwise
  */
-int32_t accept_new_connection(ConnectionArray *fd_to_connection, int fd);
+int32_t accept_new_connection(ConnectionArray *fd_to_connection,
+                              EventLoop *loop, int fd);
 
 /**
- * @brief Free the whole ConnectionArray. This function frees all the
- * connections in the array, and then frees the array itself.
+ * @brief Create a connection in STATE_REQUEST for an accepted socket and add it
+ * to the connection array.
  *
- * @param array ConnectionArray to free
+ * @param fd_to_connection ConnectionArray to add the new connection to
+ * @param connfd File descriptor of the accepted socket
+ *
+ * @return Connection* the new connection, or NULL if it could not be allocated
  */
-void free_connection_array(ConnectionArray *array);
+Connection *create_connection(ConnectionArray *fd_to_connection, int connfd);
 
 /**
- * @brief Initialize a PollArgs structure. This function sets the capacity and
- * count to 0, and the file descriptor array to NULL.
+ * @brief Remove a connection from the event loop (if any) and the connection array,
+ * close its socket and free it.
  *
- * @param args PollArgs to initialize
+ * @param fd_to_connection ConnectionArray holding the connection
+ * @param loop EventLoop the connection is registered in
+ * @param connection Connection to destroy
  */
-void initialize_poll_args(PollArgs *args);
+void destroy_connection(ConnectionArray *fd_to_connection, EventLoop *loop,
+                        Connection *connection);
 
 /**
- * @brief Add a file descriptor to the PollArgs structure. This function adds a
- * file descriptor to the array of file descriptors, and increases the count of
- * file descriptors in the array. If the array is full, it reallocates the array
- * with double the capacity. If the array is currently NULL, it allocates the
- * array with an initial capacity of 8.
+ * @brief Re-arm the connection in the event loop if the interest implied by
+ * its state (EVENT_READ for STATE_REQUEST, EVENT_WRITE for STATE_RESPOND)
+ * differs from the registered one. Nothing is done otherwise.
  *
- * @param args PollArgs to add the file descriptor to
- * @param fd File descriptor to add to the array
+ * @param loop EventLoop the connection is registered in
+ * @param connection Connection to update
  */
-void write_poll_args(PollArgs *args, struct pollfd fd);
+void update_connection_interest(EventLoop *loop, Connection *connection);
 
 /**
- * @brief Free the whole PollArgs structure. This function frees the file
- * descriptor array.
+ * @brief Free the whole ConnectionArray. This function frees all the
+ * connections in the array, and then frees the array itself.
  *
- * @param args PollArgs to free
+ * @param array ConnectionArray to free
  */
-void free_poll_args(PollArgs *args);
+void free_connection_array(ConnectionArray *array);
 
 /**
  * @brief Set a file descriptor (fd) to non-blocking mode.
@@ -136,4 +175,51 @@ void fd_set_nb(int fd);
 
 void connection_io(Connection *connection);
 
+/**
+ * @brief Finish a request executed by other shards once connection->out holds
+ * its whole response: append the response to the writing buffer and drop the
+ * request from the reading buffer. Sending is left to the caller.
+ *
+ * @param connection Connection whose request is complete
+ */
+void complete_request(Connection *connection);
+
+/**
+ * @brief Continue serving a connection after its request completed outside of
+ * connection_io(): execute the requests already buffered, read the socket
+ * until it would block and flush the responses.
+ *
+ * @param connection Connection to resume
+ */
+void resume_connection(Connection *connection);
+
+/**
+ * @brief Hand received bytes to a connection whose socket I/O is done by the
+ * io_uring backend. Requests already buffered are executed first, then as much
+ * data as fits is appended to the reading buffer and executed.
+ *
+ * @param connection Connection in STATE_REQUEST
+ * @param data Received bytes
+ * @param length Number of received bytes
+ *
+ * @return size_t number of bytes consumed; 0 once the connection stopped
+ * accepting requests (e.g. a response is waiting to be sent)
+ */
+size_t connection_feed(Connection *connection, const uint8_t *data,
+                       size_t length);
+
+/**
+ * @brief Give the reading and writing buffers back to the buffer pool if they
+ * hold no pending data.
+ */
+void release_idle_buffers(Connection *connection);
+
+/**
+ * @brief Account for n bytes of the writing buffer having been sent. Switches
+ * the connection back to STATE_REQUEST once the whole response is sent.
+ *
+ * @return bool true if part of the response is still unsent
+ */
+bool connection_sent(Connection *connection, size_t n);
+
 #endif /* CONNECTION_H */
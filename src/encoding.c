@@ -1,5 +1,9 @@
 #include "encoding.h"
+#include "buffer_pool.h"
 #include "common.h"
+#include <assert.h>
+#include <stdarg.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,53 +15,181 @@ void initialize_output(Output *out) {
 }
 
 void free_output(Output *out) {
-  free(out->chars);
+  release_buffer((uint8_t *)out->chars, out->capacity);
   initialize_output(out);
 }
 
-static void resize_output(Output *out) {
-  if (out->size >= out->capacity) {
-    // Grow capacity
-    out->capacity = out->capacity == 0 ? 8 : out->capacity * 2;
-    out->chars = (char *)realloc(out->chars, sizeof(char) * out->capacity);
+void reserve_output(Output *out, size_t n) {
+  if (out->size + n <= out->capacity) {
+    return;
   }
+  // Grow through the buffer pool, the size classes double the capacity
+  uint8_t *chars = (uint8_t *)out->chars;
+  reserve_buffer(&chars, &out->capacity, out->size, out->size + n);
+  out->chars = (char *)chars;
 }
 
-static void push_to_output(Output *out, char c) {
-  resize_output(out);
-  out->chars[out->size] = c;
-  out->size++;
+static inline void put_to_output(Output *out, const void *chars,
+                                 size_t length) {
+  // Room must have been reserved
+  memcpy(&out->chars[out->size], chars, length);
+  out->size += length;
 }
 
-static void append_to_output(Output *out, const char *const chars,
-                             size_t length) {
-  for (size_t i = 0; i < length; i++) {
-    push_to_output(out, chars[i]);
-  }
+void out_raw(Output *out, const void *chars, size_t length) {
+  reserve_output(out, length);
+  put_to_output(out, chars, length);
 }
 
-void out_nil(Output *out) { push_to_output(out, SERIAL_NIL); }
+void out_nil(Output *out) {
+  reserve_output(out, 1);
+  out->chars[out->size++] = SERIAL_NIL;
+}
 
-void out_string(Output *out, char *value, uint32_t length) {
-  push_to_output(out, SERIAL_STRING);
-  append_to_output(out, (char *)&length, 4);
-  append_to_output(out, value, length);
+void out_string(Output *out, const char *value, uint32_t length) {
+  reserve_output(out, 1 + 4 + (size_t)length);
+  out->chars[out->size++] = SERIAL_STRING;
+  put_to_output(out, &length, 4);
+  put_to_output(out, value, length);
 }
 
 void out_integer(Output *out, int64_t value) {
-  push_to_output(out, SERIAL_INTEGER);
-  append_to_output(out, (char *)&value, 8);
+  reserve_output(out, 1 + 8);
+  out->chars[out->size++] = SERIAL_INTEGER;
+  put_to_output(out, &value, 8);
 }
 
 void out_error(Output *out, int32_t code, const char *const message) {
-  push_to_output(out, SERIAL_ERROR);
-  append_to_output(out, (char *)&code, 4);
   uint32_t len = (uint32_t)strlen(message);
-  append_to_output(out, (char *)&len, 4);
-  append_to_output(out, message, len);
+  reserve_output(out, 1 + 4 + 4 + (size_t)len);
+  out->chars[out->size++] = SERIAL_ERROR;
+  put_to_output(out, &code, 4);
+  put_to_output(out, &len, 4);
+  put_to_output(out, message, len);
 }
 
 void out_array(Output *out, uint32_t n) {
-  push_to_output(out, SERIAL_ARRAY);
-  append_to_output(out, (char *)&n, 4);
+  reserve_output(out, 1 + 4);
+  out->chars[out->size++] = SERIAL_ARRAY;
+  put_to_output(out, &n, 4);
+}
+
+void out_double(Output *out, double value) {
+  reserve_output(out, 1 + 8);
+  out->chars[out->size++] = SERIAL_DOUBLE;
+  put_to_output(out, &value, 8);
+}
+
+void out_line(Output *out, uint32_t *count, const char *format, ...) {
+  char line[256];
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(line, sizeof(line), format, args);
+  va_end(args);
+
+  if (length > (int)sizeof(line) - 1) {
+    length = (int)sizeof(line) - 1;
+  }
+  out_string(out, line, (uint32_t)length);
+  (*count)++;
+}
+
+void merge_array_output(Output *dst, const Output *src) {
+  assert(dst->size >= 5 && dst->chars[0] == SERIAL_ARRAY);
+  assert(src->size >= 5 && src->chars[0] == SERIAL_ARRAY);
+
+  uint32_t n = 0;
+  uint32_t m = 0;
+  memcpy(&n, &dst->chars[1], 4);
+  memcpy(&m, &src->chars[1], 4);
+  n += m;
+  memcpy(&dst->chars[1], &n, 4);
+  out_raw(dst, &src->chars[5], src->size - 5);
+}
+
+/**
+ * Keep the error if either reply is one, returns false if neither is
+ */
+static bool merge_error_output(Output *dst, const Output *src) {
+  if (dst->chars[0] == SERIAL_ERROR) {
+    return true;
+  }
+  if (src->chars[0] == SERIAL_ERROR) {
+    dst->size = 0;
+    out_raw(dst, src->chars, src->size);
+    return true;
+  }
+  return false;
+}
+
+void merge_integer_output(Output *dst, const Output *src) {
+  assert(dst->size > 0 && src->size > 0);
+  if (merge_error_output(dst, src)) {
+    return;
+  }
+  assert(dst->size == 9 && dst->chars[0] == SERIAL_INTEGER);
+  assert(src->size == 9 && src->chars[0] == SERIAL_INTEGER);
+
+  int64_t n = 0;
+  int64_t m = 0;
+  memcpy(&n, &dst->chars[1], 8);
+  memcpy(&m, &src->chars[1], 8);
+  n += m;
+  memcpy(&dst->chars[1], &n, 8);
+}
+
+/**
+ * Size of a serialized value which is not an array
+ */
+static size_t scalar_size(const char *chars) {
+  uint32_t length = 0;
+  switch (chars[0]) {
+  case SERIAL_NIL:
+    return 1;
+  case SERIAL_INTEGER:
+  case SERIAL_DOUBLE:
+    return 1 + 8;
+  case SERIAL_STRING:
+    memcpy(&length, &chars[1], 4);
+    return 1 + 4 + (size_t)length;
+  case SERIAL_ERROR:
+    memcpy(&length, &chars[5], 4);
+    return 1 + 4 + 4 + (size_t)length;
+  default:
+    assert(false && "nested arrays are not merged");
+    return 0;
+  }
+}
+
+void merge_element_output(Output *dst, const Output *src) {
+  assert(dst->size > 0 && src->size > 0);
+  if (merge_error_output(dst, src)) {
+    return;
+  }
+  assert(dst->size >= 5 && dst->chars[0] == SERIAL_ARRAY);
+  assert(src->size >= 5 && src->chars[0] == SERIAL_ARRAY);
+  assert(memcmp(&dst->chars[1], &src->chars[1], 4) == 0);
+
+  Output merged;
+  initialize_output(&merged);
+  reserve_output(&merged, dst->size + src->size);
+  put_to_output(&merged, dst->chars, 5);
+
+  size_t i = 5;
+  size_t j = 5;
+  while (i < dst->size) {
+    size_t n = scalar_size(&dst->chars[i]);
+    size_t m = scalar_size(&src->chars[j]);
+    if (dst->chars[i] == SERIAL_NIL) {
+      put_to_output(&merged, &src->chars[j], m);
+    } else {
+      put_to_output(&merged, &dst->chars[i], n);
+    }
+    i += n;
+    j += m;
+  }
+  assert(j == src->size);
+
+  free_output(dst);
+  *dst = merged;
 }
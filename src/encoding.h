@@ -4,6 +4,11 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+/**
+ * An output sink for serialized responses. Its buffer comes from the buffer
+ * pool; a connection lends its writing buffer to the Output so responses are
+ * serialized in place, with one memcpy per value.
+ */
 typedef struct {
   char *chars;
   size_t size;
@@ -14,9 +19,19 @@ void initialize_output(Output *out);
 
 void free_output(Output *out);
 
+/**
+ * Make room for n more bytes, so the following writes need no capacity check.
+ */
+void reserve_output(Output *out, size_t n);
+
+/**
+ * Append already serialized bytes.
+ */
+void out_raw(Output *out, const void *chars, size_t length);
+
 void out_nil(Output *out);
 
-void out_string(Output *out, char *value, uint32_t length);
+void out_string(Output *out, const char *value, uint32_t length);
 
 void out_integer(Output *out, int64_t value);
 
@@ -24,4 +39,32 @@ void out_error(Output *out, int32_t code, const char *const message);
 
 void out_array(Output *out, uint32_t n);
 
+void out_double(Output *out, double value);
+
+/**
+ * Append a printf-formatted string of at most 255 bytes, counting it in
+ * *count, for replies made of "name:value" lines.
+ */
+void out_line(Output *out, uint32_t *count, const char *format, ...);
+
+/**
+ * Append the elements of the array reply in src to the array reply in dst,
+ * adding up the element counts. Used to gather replies from several shards.
+ */
+void merge_array_output(Output *dst, const Output *src);
+
+/**
+ * Add the integer reply in src to the one in dst, for counts gathered from
+ * several shards. An error reply wins over an integer.
+ */
+void merge_integer_output(Output *dst, const Output *src);
+
+/**
+ * Merge two array replies of the same length element by element, each element
+ * being the one of src where dst has nil. Used to gather replies from shards
+ * which each answer for their own keys of a batch. An error reply wins over an
+ * array.
+ */
+void merge_element_output(Output *dst, const Output *src);
+
 #endif /* ENCODING_H */
@@ -1,6 +1,129 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
 #include "entry.h"
+#include "hash.h"
+#include "slab.h"
+#include "zset.h"
+
+static uint32_t inline_capacity(uint32_t length) {
+  // Round up so slightly longer values still fit, and room for a pointer
+  uint32_t capacity = (length + 7) & ~(uint32_t)7;
+  return capacity < sizeof(char *) ? (uint32_t)sizeof(char *) : capacity;
+}
+
+Entry *create_entry(const char *key, uint32_t key_length, const char *value,
+                    uint32_t value_length, uint64_t hashcode) {
+  // A number takes the 8 bytes of an empty inline value
+  Number number;
+  bool numeric = parse_number(value, value_length, &number);
+  if (numeric) {
+    value_length = 0;
+  }
+
+  bool external = value_length > K_ENTRY_INLINE_MAX;
+  uint32_t capacity = external ? value_length : inline_capacity(value_length);
+  size_t slot = external ? sizeof(char *) : capacity;
+
+  Entry *entry = (Entry *)slab_alloc(sizeof(Entry) + key_length + slot);
+  entry->node.next = NULL;
+  entry->node.hashcode = hashcode;
+  entry->key_length = key_length;
+  entry->value_length = value_length;
+  entry->value_capacity = capacity;
+  entry->type = OBJECT_STRING;
+  entry->flags = 0;
+  entry->slot_size = (uint16_t)slot;
+  entry->heap_index = 0;
+  entry->access = 0;
+  memcpy(entry->data, key, key_length);
+
+  if (external) {
+    char *storage = (char *)slab_alloc(value_length);
+    memcpy(&entry->data[key_length], &storage, sizeof(storage));
+    entry->flags |= ENTRY_VALUE_EXTERNAL;
+  }
+  if (numeric) {
+    set_entry_number(entry, &number);
+  } else if (value_length) {
+    memcpy(entry_value(entry), value, value_length);
+  }
+  return entry;
+}
+
+Entry *create_object_entry(const char *key, uint32_t key_length,
+                           ObjectType type, void *object, uint64_t hashcode) {
+  Entry *entry = create_entry(key, key_length, NULL, 0, hashcode);
+  entry->type = (uint8_t)type;
+  entry->value_capacity = 0;
+  memcpy(&entry->data[key_length], &object, sizeof(object));
+  return entry;
+}
+
+size_t entry_memory(Entry *entry) {
+  size_t size = sizeof(Entry) + entry->key_length + entry->slot_size;
+  if (entry->type == OBJECT_ZSET) {
+    size += get_zset_memory((ZSet *)entry_object(entry));
+  } else if (entry->type == OBJECT_HASH) {
+    size += get_hash_memory((Hash *)entry_object(entry));
+  } else if (entry->flags & ENTRY_VALUE_EXTERNAL) {
+    size += entry->value_capacity;
+  }
+  return size;
+}
+
+void set_entry_value(Entry *entry, const char *value, uint32_t length) {
+  Number number;
+  if (parse_number(value, length, &number)) {
+    return set_entry_number(entry, &number);
+  }
+  entry->type = OBJECT_STRING;
+  entry->flags &= (uint8_t)~ENTRY_NUMBER_DOUBLE;
+
+  if (length > entry->value_capacity) {
+    // Only external values can grow, inline storage has a fixed size. The old
+    // value is overwritten anyway, so nothing is copied over.
+    if (entry->flags & ENTRY_VALUE_EXTERNAL) {
+      slab_free(entry_value(entry), entry->value_capacity);
+    }
+    char *storage = (char *)slab_alloc(length);
+    memcpy(&entry->data[entry->key_length], &storage, sizeof(storage));
+    entry->flags |= ENTRY_VALUE_EXTERNAL;
+    entry->value_capacity = length;
+  }
+
+  memmove(entry_value(entry), value, length);
+  entry->value_length = length;
+}
+
+void set_entry_number(Entry *entry, const Number *number) {
+  if (entry->flags & ENTRY_VALUE_EXTERNAL) {
+    slab_free(entry_value(entry), entry->value_capacity);
+    entry->flags &= (uint8_t)~ENTRY_VALUE_EXTERNAL;
+  }
+  // The slot is free for a string again if the value changes back to one
+  entry->type = OBJECT_NUMBER;
+  entry->value_length = 0;
+  entry->value_capacity = entry->slot_size;
+
+  char *slot = &entry->data[entry->key_length];
+  if (number->is_double) {
+    entry->flags |= ENTRY_NUMBER_DOUBLE;
+    memcpy(slot, &number->real, sizeof(number->real));
+  } else {
+    entry->flags &= (uint8_t)~ENTRY_NUMBER_DOUBLE;
+    memcpy(slot, &number->integer, sizeof(number->integer));
+  }
+}
 
 void free_entry(Entry *entry) {
-  free_string(&entry->key);
-  free_string(&entry->value);
+  if (entry->type == OBJECT_ZSET) {
+    free_zset((ZSet *)entry_object(entry));
+  } else if (entry->type == OBJECT_HASH) {
+    free_hash((Hash *)entry_object(entry));
+  } else if (entry->flags & ENTRY_VALUE_EXTERNAL) {
+    slab_free(entry_value(entry), entry->value_capacity);
+  }
+  slab_free(entry, sizeof(Entry) + entry->key_length + entry->slot_size);
 }
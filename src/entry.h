@@ -2,18 +2,131 @@
 #define ENTRY_H
 
 #include <stddef.h>
+#include <stdint.h>
+#include <string.h>
 
 #include "map.h"
 #include "object.h"
 
 #define CONTAINER_OF(ptr, T, member) ((T *)((char *)ptr - offsetof(T, member)))
 
+/**
+ * Values up to this size are stored inline, right after the key
+ */
+#define K_ENTRY_INLINE_MAX 64
+
+enum {
+  ENTRY_VALUE_EXTERNAL = 1 << 0, // data holds a pointer to the value
+  ENTRY_NUMBER_DOUBLE = 1 << 1,  // The number of the entry is a double
+};
+
+/**
+ * A key/value pair in one allocation: the header is followed by the key bytes,
+ * then either the value bytes (inline) or a pointer to a separately allocated
+ * value (ENTRY_VALUE_EXTERNAL). value_capacity is the room available for the
+ * value, so a new value that fits is copied in place.
+ *
+ * A value which parses as a Number is stored unboxed instead, as the 8 bytes
+ * of an int64 or a double (ENTRY_NUMBER_DOUBLE) after the key, and the entry
+ * has type OBJECT_NUMBER. It reads as a string all the same.
+ *
+ * Entries of other types hold a pointer to their object after the key, see
+ * entry_object().
+ */
 typedef struct {
   HashNode node;
-  ObjectString key;
-  ObjectString value;
+  uint32_t key_length;
+  uint32_t value_length;
+  uint32_t value_capacity;
+  uint8_t type;  // ObjectType of the value
+  uint8_t flags; // ENTRY_* flags
+  uint16_t slot_size; // Bytes after the key, for the value or its pointer
+  uint32_t heap_index; // Position + 1 in the expiry heap, 0 without a TTL
+  uint32_t access;     // Last access (LRU) or access frequency (LFU)
+  char data[];
 } Entry;
 
+/**
+ * A key to look an Entry up with, without building one. Map callbacks compare
+ * a stored Entry (left) against an EntryKey (right).
+ */
+typedef struct {
+  HashNode node;
+  const char *key;
+  uint32_t length;
+} EntryKey;
+
+static inline const char *entry_key(const Entry *entry) { return entry->data; }
+
+static inline char *entry_value(Entry *entry) {
+  char *slot = &entry->data[entry->key_length];
+  if (entry->flags & ENTRY_VALUE_EXTERNAL) {
+    char *value = NULL;
+    memcpy(&value, slot, sizeof(value));
+    return value;
+  }
+  return slot;
+}
+
+/**
+ * @brief Whether an entry holds a string, possibly stored as a number.
+ */
+static inline bool is_string_entry(const Entry *entry) {
+  return entry->type == OBJECT_STRING || entry->type == OBJECT_NUMBER;
+}
+
+static inline Number entry_number(const Entry *entry) {
+  Number number = {0};
+  const char *slot = &entry->data[entry->key_length];
+  number.is_double = (entry->flags & ENTRY_NUMBER_DOUBLE) != 0;
+  if (number.is_double) {
+    memcpy(&number.real, slot, sizeof(number.real));
+  } else {
+    memcpy(&number.integer, slot, sizeof(number.integer));
+  }
+  return number;
+}
+
+/**
+ * @brief Allocate an entry holding copies of the key and the value, or the
+ * number the value parses as.
+ */
+Entry *create_entry(const char *key, uint32_t key_length, const char *value,
+                    uint32_t value_length, uint64_t hashcode);
+
+static inline void *entry_object(const Entry *entry) {
+  void *object = NULL;
+  memcpy(&object, &entry->data[entry->key_length], sizeof(object));
+  return object;
+}
+
+/**
+ * @brief Bytes allocated for an entry and its value.
+ */
+size_t entry_memory(Entry *entry);
+
+/**
+ * @brief Allocate an entry owning an object of another type than a string,
+ * such as a ZSet or a Hash.
+ */
+Entry *create_object_entry(const char *key, uint32_t key_length,
+                           ObjectType type, void *object, uint64_t hashcode);
+
+/**
+ * @brief Replace the value of an entry, in place when it fits. A value which
+ * parses as a number is stored as one.
+ */
+void set_entry_value(Entry *entry, const char *value, uint32_t length);
+
+/**
+ * @brief Replace the value of an entry by a number, freeing an external
+ * value.
+ */
+void set_entry_number(Entry *entry, const Number *number);
+
+/**
+ * @brief Free an entry and its external value or object, if any.
+ */
 void free_entry(Entry *entry);
 
 #endif /* ENTRY_H */
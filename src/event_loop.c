@@ -0,0 +1,71 @@
+#include <errno.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "event_loop.h"
+
+static uint32_t to_epoll_events(uint32_t mask) {
+  uint32_t events = EPOLLET | EPOLLERR | EPOLLHUP;
+  if (mask & EVENT_READ)
+    events |= EPOLLIN | EPOLLRDHUP;
+  if (mask & EVENT_WRITE)
+    events |= EPOLLOUT;
+  return events;
+}
+
+void initialize_event_loop(EventLoop *loop) {
+  loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (loop->epfd < 0) {
+    die("epoll_create1()");
+  }
+}
+
+void free_event_loop(EventLoop *loop) {
+  if (loop->epfd >= 0)
+    close(loop->epfd);
+  loop->epfd = -1;
+}
+
+int32_t event_loop_add(EventLoop *loop, int fd, uint32_t mask) {
+  struct epoll_event ev = {0};
+  ev.events = to_epoll_events(mask);
+  ev.data.fd = fd;
+  return epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) == 0 ? 0 : -1;
+}
+
+int32_t event_loop_modify(EventLoop *loop, int fd, uint32_t mask) {
+  struct epoll_event ev = {0};
+  ev.events = to_epoll_events(mask);
+  ev.data.fd = fd;
+  return epoll_ctl(loop->epfd, EPOLL_CTL_MOD, fd, &ev) == 0 ? 0 : -1;
+}
+
+void event_loop_delete(EventLoop *loop, int fd) {
+  (void)epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+int event_loop_wait(EventLoop *loop, int timeout_ms) {
+  struct epoll_event events[K_MAX_EVENTS];
+  int n = 0;
+  do {
+    n = epoll_wait(loop->epfd, events, K_MAX_EVENTS, timeout_ms);
+  } while (n < 0 && errno == EINTR);
+
+  if (n < 0) {
+    die("epoll_wait()");
+  }
+
+  for (int i = 0; i < n; i++) {
+    uint32_t mask = 0;
+    if (events[i].events & (EPOLLIN | EPOLLRDHUP))
+      mask |= EVENT_READ;
+    if (events[i].events & EPOLLOUT)
+      mask |= EVENT_WRITE;
+    if (events[i].events & (EPOLLERR | EPOLLHUP))
+      mask |= EVENT_ERROR;
+    loop->fired[i].fd = events[i].data.fd;
+    loop->fired[i].mask = mask;
+  }
+  return n;
+}
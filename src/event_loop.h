@@ -0,0 +1,78 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define K_MAX_EVENTS 256
+#define K_POLL_TIMEOUT_MS 1000 // Longest sleep of an idle worker
+
+enum {
+  EVENT_READ = 1 << 0,
+  EVENT_WRITE = 1 << 1,
+  EVENT_ERROR = 1 << 2,
+};
+
+/**
+ * A fired event: the file descriptor it belongs to and the mask of EVENT_*
+ * flags which became ready.
+ */
+typedef struct {
+  int fd;
+  uint32_t mask;
+} FiredEvent;
+
+/**
+ * This structure wraps an edge-triggered epoll instance. File descriptors are
+ * registered once and only re-armed when the interest changes, so waiting
+ * costs O(ready fds) instead of O(all fds).
+ */
+typedef struct EventLoop {
+  int epfd;
+  FiredEvent fired[K_MAX_EVENTS];
+} EventLoop;
+
+/**
+ * @brief Initialize an event loop, creating the underlying epoll instance.
+ *
+ * @param loop EventLoop to initialize
+ */
+void initialize_event_loop(EventLoop *loop);
+
+/**
+ * @brief Close the epoll instance of the event loop.
+ *
+ * @param loop EventLoop to free
+ */
+void free_event_loop(EventLoop *loop);
+
+/**
+ * @brief Register a file descriptor with an interest mask (EVENT_READ and/or
+ * EVENT_WRITE). Errors are always reported.
+ *
+ * @return int32_t 0 on success, -1 otherwise
+ */
+int32_t event_loop_add(EventLoop *loop, int fd, uint32_t mask);
+
+/**
+ * @brief Change the interest mask of an already registered file descriptor.
+ * This also re-arms the edge trigger, so an already ready fd fires again.
+ *
+ * @return int32_t 0 on success, -1 otherwise
+ */
+int32_t event_loop_modify(EventLoop *loop, int fd, uint32_t mask);
+
+/**
+ * @brief Unregister a file descriptor.
+ */
+void event_loop_delete(EventLoop *loop, int fd);
+
+/**
+ * @brief Wait for events for at most timeout_ms milliseconds. The fired events
+ * are stored in loop->fired.
+ *
+ * @return int number of fired events
+ */
+int event_loop_wait(EventLoop *loop, int timeout_ms);
+
+#endif /* EVENT_LOOP_H */
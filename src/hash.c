@@ -0,0 +1,343 @@
+#include <string.h>
+
+#include "common.h"
+#include "entry.h"
+#include "hash.h"
+#include "slab.h"
+
+#define K_PACKED_HEADER 8 // Field and value lengths before the bytes of an item
+
+/**
+ * A field of a hash in the Map encoding. The field bytes are followed by room
+ * for value_capacity bytes of value, so a value which fits is replaced in
+ * place.
+ */
+typedef struct {
+  HashNode node;
+  uint32_t field_length;
+  uint32_t value_length;
+  uint32_t value_capacity;
+  char data[];
+} HashField;
+
+/**
+ * A field to look a node up with in the Map
+ */
+typedef struct {
+  HashNode node;
+  const char *field;
+  uint32_t length;
+} FieldKey;
+
+// Packed encoding
+
+typedef struct {
+  uint32_t field_length;
+  uint32_t value_length;
+  const char *field;
+  const char *value;
+} PackedItem;
+
+static uint32_t read_packed(const uint8_t *packed, uint32_t offset,
+                            PackedItem *item) {
+  const uint8_t *p = &packed[offset];
+  memcpy(&item->field_length, p, 4);
+  memcpy(&item->value_length, p + 4, 4);
+  item->field = (const char *)p + K_PACKED_HEADER;
+  item->value = item->field + item->field_length;
+  return offset + K_PACKED_HEADER + item->field_length + item->value_length;
+}
+
+static bool find_packed(const Hash *hash, const char *field, uint32_t length,
+                        uint32_t *offset, PackedItem *item) {
+  for (uint32_t o = 0; o < hash->packed_used;) {
+    uint32_t next = read_packed(hash->packed, o, item);
+    if (item->field_length == length &&
+        memcmp(item->field, field, length) == 0) {
+      *offset = o;
+      return true;
+    }
+    o = next;
+  }
+  return false;
+}
+
+static void reserve_packed(Hash *hash, uint32_t needed) {
+  if (needed <= hash->packed_capacity) {
+    return;
+  }
+  uint32_t capacity = hash->packed_capacity ? hash->packed_capacity : 64;
+  while (capacity < needed) {
+    capacity *= 2;
+  }
+  uint8_t *packed = (uint8_t *)slab_alloc(capacity);
+  memcpy(packed, hash->packed, hash->packed_used);
+  slab_free(hash->packed, hash->packed_capacity);
+  hash->memory += capacity - hash->packed_capacity;
+  hash->packed = packed;
+  hash->packed_capacity = capacity;
+}
+
+static void remove_packed(Hash *hash, uint32_t offset,
+                          const PackedItem *item) {
+  uint32_t end =
+      offset + K_PACKED_HEADER + item->field_length + item->value_length;
+  memmove(&hash->packed[offset], &hash->packed[end], hash->packed_used - end);
+  hash->packed_used -= end - offset;
+  hash->size--;
+}
+
+static void append_packed(Hash *hash, const char *field, uint32_t field_length,
+                          const char *value, uint32_t value_length) {
+  reserve_packed(hash, hash->packed_used + K_PACKED_HEADER + field_length +
+                           value_length);
+  uint8_t *p = &hash->packed[hash->packed_used];
+  memcpy(p, &field_length, 4);
+  memcpy(p + 4, &value_length, 4);
+  memcpy(p + K_PACKED_HEADER, field, field_length);
+  memcpy(p + K_PACKED_HEADER + field_length, value, value_length);
+  hash->packed_used += K_PACKED_HEADER + field_length + value_length;
+  hash->size++;
+}
+
+/**
+ * Replace the value of the item at offset, moving the items after it if the
+ * length changes, so the order is kept
+ */
+static void replace_packed_value(Hash *hash, uint32_t offset,
+                                 const PackedItem *item, const char *value,
+                                 uint32_t length) {
+  uint32_t start = offset + K_PACKED_HEADER + item->field_length;
+  uint32_t end = start + item->value_length;
+  if (length > item->value_length) {
+    reserve_packed(hash, hash->packed_used + length - item->value_length);
+  }
+  memmove(&hash->packed[start + length], &hash->packed[end],
+          hash->packed_used - end);
+  memcpy(&hash->packed[start], value, length);
+  memcpy(&hash->packed[offset + 4], &length, 4);
+  hash->packed_used = hash->packed_used - item->value_length + length;
+}
+
+// Map encoding
+
+static inline char *field_value(HashField *node) {
+  return &node->data[node->field_length];
+}
+
+static size_t field_size(uint32_t field_length, uint32_t value_capacity) {
+  return sizeof(HashField) + field_length + value_capacity;
+}
+
+static HashField *create_field(Hash *hash, const char *field,
+                               uint32_t field_length, const char *value,
+                               uint32_t value_length) {
+  // Round up so a value growing by a few bytes, as counters do, still fits
+  uint32_t capacity = (value_length + 7) & ~(uint32_t)7;
+  size_t size = field_size(field_length, capacity);
+  HashField *node = (HashField *)slab_alloc(size);
+  node->node.next = NULL;
+  node->node.hashcode = hash_string(field, field_length);
+  node->field_length = field_length;
+  node->value_length = value_length;
+  node->value_capacity = capacity;
+  memcpy(node->data, field, field_length);
+  memcpy(field_value(node), value, value_length);
+  hash->memory += size;
+  return node;
+}
+
+static void destroy_field(Hash *hash, HashField *node) {
+  size_t size = field_size(node->field_length, node->value_capacity);
+  hash->memory -= size;
+  slab_free(node, size);
+}
+
+static bool field_eq(HashNode *lhs, HashNode *rhs) {
+  HashField *node = CONTAINER_OF(lhs, HashField, node);
+  FieldKey *key = CONTAINER_OF(rhs, FieldKey, node);
+  return node->field_length == key->length &&
+         memcmp(node->data, key->field, key->length) == 0;
+}
+
+static HashField *find_field(Hash *hash, const char *field, uint32_t length,
+                             bool detach) {
+  FieldKey key = {.field = field, .length = length};
+  key.node.next = NULL;
+  key.node.hashcode = hash_string(field, length);
+  HashNode *found = detach ? detach_map(&hash->fields, &key.node, &field_eq)
+                           : lookup_map(&hash->fields, &key.node, &field_eq);
+  return found ? CONTAINER_OF(found, HashField, node) : NULL;
+}
+
+static void convert_to_map(Hash *hash) {
+  hash->encoding = HASH_MAP;
+  reserve_map(&hash->fields, hash->size + 1);
+
+  for (uint32_t offset = 0; offset < hash->packed_used;) {
+    PackedItem item;
+    offset = read_packed(hash->packed, offset, &item);
+    HashField *node = create_field(hash, item.field, item.field_length,
+                                   item.value, item.value_length);
+    insert_map(&hash->fields, &node->node);
+  }
+
+  slab_free(hash->packed, hash->packed_capacity);
+  hash->memory -= hash->packed_capacity;
+  hash->packed = NULL;
+  hash->packed_used = 0;
+  hash->packed_capacity = 0;
+}
+
+/**
+ * Frees each node once the scan has moved past it: a chained table reads the
+ * link of a node after visiting it
+ */
+typedef struct {
+  Hash *hash;
+  HashField *previous;
+} FreeScan;
+
+static void free_field(HashNode *node, void *arg) {
+  FreeScan *scan = (FreeScan *)arg;
+  if (scan->previous) {
+    destroy_field(scan->hash, scan->previous);
+  }
+  scan->previous = CONTAINER_OF(node, HashField, node);
+}
+
+typedef struct {
+  void (*f)(const char *field, uint32_t field_length, const char *value,
+            uint32_t value_length, void *arg);
+  void *arg;
+} FieldScan;
+
+static void scan_field(HashNode *node, void *arg) {
+  FieldScan *scan = (FieldScan *)arg;
+  HashField *field = CONTAINER_OF(node, HashField, node);
+  scan->f(field->data, field->field_length, field_value(field),
+          field->value_length, scan->arg);
+}
+
+Hash *create_hash(void) {
+  Hash *hash = (Hash *)slab_alloc(sizeof(Hash));
+  memset(hash, 0, sizeof(Hash));
+  hash->encoding = HASH_PACKED;
+  hash->memory = sizeof(Hash);
+  return hash;
+}
+
+void free_hash(Hash *hash) {
+  if (hash->encoding == HASH_PACKED) {
+    slab_free(hash->packed, hash->packed_capacity);
+  } else {
+    FreeScan scan = {hash, NULL};
+    scan_map(&hash->fields, &free_field, &scan);
+    if (scan.previous) {
+      destroy_field(hash, scan.previous);
+    }
+    free_map(&hash->fields);
+  }
+  slab_free(hash, sizeof(Hash));
+}
+
+size_t get_hash_memory(Hash *hash) {
+  return hash->memory + get_map_memory(&hash->fields);
+}
+
+bool hash_set(Hash *hash, const char *field, uint32_t field_length,
+              const char *value, uint32_t value_length) {
+  if (hash->encoding == HASH_PACKED) {
+    bool fits = field_length <= K_HASH_PACKED_MAX_VALUE &&
+                value_length <= K_HASH_PACKED_MAX_VALUE;
+    uint32_t offset = 0;
+    PackedItem item;
+    if (find_packed(hash, field, field_length, &offset, &item)) {
+      if (fits) {
+        replace_packed_value(hash, offset, &item, value, value_length);
+        return false;
+      }
+    } else if (fits && hash->size < K_HASH_PACKED_MAX_SIZE) {
+      append_packed(hash, field, field_length, value, value_length);
+      return true;
+    }
+    convert_to_map(hash);
+  }
+
+  HashField *node = find_field(hash, field, field_length, false);
+  if (node && value_length <= node->value_capacity) {
+    memcpy(field_value(node), value, value_length);
+    node->value_length = value_length;
+    return false;
+  }
+  if (node) {
+    // A longer value needs a larger node
+    destroy_field(hash, find_field(hash, field, field_length, true));
+    hash->size--;
+  }
+
+  HashField *added =
+      create_field(hash, field, field_length, value, value_length);
+  insert_map(&hash->fields, &added->node);
+  hash->size++;
+  return node == NULL;
+}
+
+bool hash_remove(Hash *hash, const char *field, uint32_t field_length) {
+  if (hash->encoding == HASH_PACKED) {
+    uint32_t offset = 0;
+    PackedItem item;
+    if (!find_packed(hash, field, field_length, &offset, &item)) {
+      return false;
+    }
+    remove_packed(hash, offset, &item);
+    return true;
+  }
+
+  HashField *node = find_field(hash, field, field_length, true);
+  if (!node) {
+    return false;
+  }
+  destroy_field(hash, node);
+  hash->size--;
+  return true;
+}
+
+bool hash_get(Hash *hash, const char *field, uint32_t field_length,
+              const char **value, uint32_t *value_length) {
+  if (hash->encoding == HASH_PACKED) {
+    uint32_t offset = 0;
+    PackedItem item;
+    if (!find_packed(hash, field, field_length, &offset, &item)) {
+      return false;
+    }
+    *value = item.value;
+    *value_length = item.value_length;
+    return true;
+  }
+
+  HashField *node = find_field(hash, field, field_length, false);
+  if (!node) {
+    return false;
+  }
+  *value = field_value(node);
+  *value_length = node->value_length;
+  return true;
+}
+
+void hash_scan(Hash *hash,
+               void (*f)(const char *field, uint32_t field_length,
+                         const char *value, uint32_t value_length, void *arg),
+               void *arg) {
+  if (hash->encoding == HASH_PACKED) {
+    for (uint32_t offset = 0; offset < hash->packed_used;) {
+      PackedItem item;
+      offset = read_packed(hash->packed, offset, &item);
+      f(item.field, item.field_length, item.value, item.value_length, arg);
+    }
+    return;
+  }
+
+  FieldScan scan = {f, arg};
+  scan_map(&hash->fields, &scan_field, &scan);
+}
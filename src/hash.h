@@ -0,0 +1,80 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "map.h"
+
+#define K_HASH_PACKED_MAX_SIZE 128 // Larger hashes are converted to a Map
+#define K_HASH_PACKED_MAX_VALUE 64 // So are hashes with a longer field or value
+
+typedef enum {
+  HASH_PACKED,
+  HASH_MAP,
+} HashEncoding;
+
+/**
+ * A map of fields to values, both strings.
+ *
+ * Small hashes are packed in one buffer of items in insertion order, each a
+ * 32-bit field length, a 32-bit value length, the field bytes and the value
+ * bytes, and are searched linearly. Larger hashes are a Map of nodes holding
+ * a field and its value, resized incrementally like the keyspace.
+ */
+typedef struct {
+  HashEncoding encoding;
+  uint32_t size;
+  size_t memory; // Bytes allocated, besides the index tables
+
+  // HASH_PACKED
+  uint8_t *packed;
+  uint32_t packed_used;
+  uint32_t packed_capacity;
+
+  // HASH_MAP
+  Map fields;
+} Hash;
+
+Hash *create_hash(void);
+
+void free_hash(Hash *hash);
+
+/**
+ * @brief Bytes used by a hash, for the memory limit.
+ */
+size_t get_hash_memory(Hash *hash);
+
+/**
+ * @brief Set the value of a field, adding it if missing.
+ *
+ * @return bool true if the field was added, false if it was updated
+ */
+bool hash_set(Hash *hash, const char *field, uint32_t field_length,
+              const char *value, uint32_t value_length);
+
+/**
+ * @return bool true if the field was removed, false if it was missing
+ */
+bool hash_remove(Hash *hash, const char *field, uint32_t field_length);
+
+/**
+ * @brief Find the value of a field. The value stays valid until the hash is
+ * modified.
+ *
+ * @return bool false if the field is missing
+ */
+bool hash_get(Hash *hash, const char *field, uint32_t field_length,
+              const char **value, uint32_t *value_length);
+
+/**
+ * @brief Call f with each field and its value, once each, in no particular
+ * order. Nothing is allocated, so this also runs in a forked child.
+ */
+void hash_scan(Hash *hash,
+               void (*f)(const char *field, uint32_t field_length,
+                         const char *value, uint32_t value_length, void *arg),
+               void *arg);
+
+#endif /* HASH_H */
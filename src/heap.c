@@ -0,0 +1,87 @@
+#include <stdbool.h>
+
+#include "common.h"
+#include "heap.h"
+
+static void place(Heap *heap, uint32_t position, HeapItem item) {
+  heap->items[position] = item;
+  *item.ref = position + 1;
+}
+
+static void sift_up(Heap *heap, uint32_t position) {
+  HeapItem item = heap->items[position];
+  while (position > 0) {
+    uint32_t parent = (position - 1) / 2;
+    if (heap->items[parent].value <= item.value) {
+      break;
+    }
+    place(heap, position, heap->items[parent]);
+    position = parent;
+  }
+  place(heap, position, item);
+}
+
+static void sift_down(Heap *heap, uint32_t position) {
+  HeapItem item = heap->items[position];
+  while (true) {
+    uint32_t child = position * 2 + 1;
+    if (child >= heap->size) {
+      break;
+    }
+    if (child + 1 < heap->size &&
+        heap->items[child + 1].value < heap->items[child].value) {
+      child++;
+    }
+    if (item.value <= heap->items[child].value) {
+      break;
+    }
+    place(heap, position, heap->items[child]);
+    position = child;
+  }
+  place(heap, position, item);
+}
+
+void initialize_heap(Heap *heap) {
+  heap->items = NULL;
+  heap->size = 0;
+  heap->capacity = 0;
+}
+
+void free_heap(Heap *heap) {
+  free(heap->items);
+  initialize_heap(heap);
+}
+
+void heap_push(Heap *heap, HeapItem item) {
+  if (heap->size == heap->capacity) {
+    heap->capacity = heap->capacity ? heap->capacity * 2 : 64;
+    heap->items =
+        (HeapItem *)realloc(heap->items, heap->capacity * sizeof(HeapItem));
+    if (!heap->items) {
+      die("realloc()");
+    }
+  }
+  heap->items[heap->size++] = item;
+  sift_up(heap, heap->size - 1);
+}
+
+void heap_remove(Heap *heap, uint32_t position) {
+  *heap->items[position].ref = 0;
+
+  // Fill the hole with the last item, which may need to move either way
+  heap->size--;
+  if (position == heap->size) {
+    return;
+  }
+  heap->items[position] = heap->items[heap->size];
+  heap_update(heap, position, heap->items[position].value);
+}
+
+void heap_update(Heap *heap, uint32_t position, uint64_t value) {
+  heap->items[position].value = value;
+  if (position > 0 && heap->items[(position - 1) / 2].value > value) {
+    sift_up(heap, position);
+  } else {
+    sift_down(heap, position);
+  }
+}
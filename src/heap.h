@@ -0,0 +1,49 @@
+#ifndef HEAP_H
+#define HEAP_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/**
+ * An element of a Heap. ref points to a field of the owner which the heap
+ * keeps equal to the item's position + 1, so an item can be removed or updated
+ * in O(log n) from its owner. 0 means not in the heap.
+ */
+typedef struct {
+  uint64_t value;
+  uint32_t *ref;
+} HeapItem;
+
+/**
+ * Indexed binary min-heap, the smallest value at items[0]
+ */
+typedef struct {
+  HeapItem *items;
+  uint32_t size;
+  uint32_t capacity;
+} Heap;
+
+void initialize_heap(Heap *heap);
+
+void free_heap(Heap *heap);
+
+/**
+ * @brief Add an item, and set *item.ref to its position + 1.
+ */
+void heap_push(Heap *heap, HeapItem item);
+
+/**
+ * @brief Remove the item at a position, and set its ref to 0.
+ */
+void heap_remove(Heap *heap, uint32_t position);
+
+/**
+ * @brief Change the value of the item at a position.
+ */
+void heap_update(Heap *heap, uint32_t position, uint64_t value);
+
+static inline HeapItem *heap_top(Heap *heap) {
+  return heap->size ? &heap->items[0] : NULL;
+}
+
+#endif /* HEAP_H */
@@ -0,0 +1,77 @@
+#include <string.h>
+
+#include "histogram.h"
+
+static uint32_t bucket_of(uint64_t value) {
+  if (value < K_HISTOGRAM_SUB_COUNT) {
+    return (uint32_t)value;
+  }
+  if (value >> K_HISTOGRAM_MAX_BITS) {
+    value = (1ull << K_HISTOGRAM_MAX_BITS) - 1;
+  }
+
+  // The highest bit picks the power of 2, the next bits the bucket inside it
+  uint32_t shift = 63 - (uint32_t)__builtin_clzll(value) - K_HISTOGRAM_SUB_BITS;
+  uint32_t sub = (uint32_t)(value >> shift) & (K_HISTOGRAM_SUB_COUNT - 1);
+  return (shift + 1) * K_HISTOGRAM_SUB_COUNT + sub;
+}
+
+/**
+ * Largest value counted in a bucket
+ */
+static uint64_t bucket_upper_bound(uint32_t bucket) {
+  if (bucket < K_HISTOGRAM_SUB_COUNT) {
+    return bucket;
+  }
+  uint32_t shift = bucket / K_HISTOGRAM_SUB_COUNT - 1;
+  uint64_t sub = bucket % K_HISTOGRAM_SUB_COUNT;
+  return ((K_HISTOGRAM_SUB_COUNT + sub + 1) << shift) - 1;
+}
+
+void initialize_histogram(Histogram *histogram) {
+  memset(histogram, 0, sizeof(*histogram));
+}
+
+void histogram_record(Histogram *histogram, uint64_t value) {
+  histogram->counts[bucket_of(value)]++;
+  histogram->total++;
+  if (value > histogram->max) {
+    histogram->max = value;
+  }
+}
+
+void histogram_merge(Histogram *dst, const Histogram *src) {
+  for (uint32_t i = 0; i < K_HISTOGRAM_BUCKETS; i++) {
+    dst->counts[i] += src->counts[i];
+  }
+  dst->total += src->total;
+  if (src->max > dst->max) {
+    dst->max = src->max;
+  }
+}
+
+uint64_t histogram_percentile(const Histogram *histogram, double percentile) {
+  if (histogram->total == 0) {
+    return 0;
+  }
+
+  // Rank of the value, 1-based and rounded up
+  double exact = percentile / 100.0 * (double)histogram->total;
+  uint64_t rank = (uint64_t)exact;
+  if ((double)rank < exact) {
+    rank++;
+  }
+  if (rank < 1) {
+    rank = 1;
+  }
+
+  uint64_t seen = 0;
+  for (uint32_t i = 0; i < K_HISTOGRAM_BUCKETS; i++) {
+    seen += histogram->counts[i];
+    if (seen >= rank) {
+      uint64_t bound = bucket_upper_bound(i);
+      return bound < histogram->max ? bound : histogram->max;
+    }
+  }
+  return histogram->max;
+}
@@ -0,0 +1,45 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+// Each power of 2 is split in 2^K_HISTOGRAM_SUB_BITS buckets, so a recorded
+// value is off by less than 1/16
+#define K_HISTOGRAM_SUB_BITS 4
+#define K_HISTOGRAM_SUB_COUNT (1 << K_HISTOGRAM_SUB_BITS)
+#define K_HISTOGRAM_MAX_BITS 40 // Larger values are counted as 2^40 - 1
+#define K_HISTOGRAM_BUCKETS                                                    \
+  ((K_HISTOGRAM_MAX_BITS - K_HISTOGRAM_SUB_BITS + 1) * K_HISTOGRAM_SUB_COUNT)
+
+/**
+ * A log-bucketed histogram in the style of HDR histograms: buckets are linear
+ * below K_HISTOGRAM_SUB_COUNT, then each power of 2 is split in the same
+ * number of buckets, which keeps the relative error constant over the whole
+ * range with a fixed number of counters.
+ */
+typedef struct {
+  uint64_t counts[K_HISTOGRAM_BUCKETS];
+  uint64_t total;
+  uint64_t max;
+} Histogram;
+
+void initialize_histogram(Histogram *histogram);
+
+void histogram_record(Histogram *histogram, uint64_t value);
+
+/**
+ * @brief Add the values recorded in src to dst, as if recorded in dst.
+ */
+void histogram_merge(Histogram *dst, const Histogram *src);
+
+/**
+ * @brief Value at a percentile, as the upper bound of its bucket.
+ *
+ * @param percentile Between 0 and 100
+ *
+ * @return uint64_t the value, 0 if nothing was recorded
+ */
+uint64_t histogram_percentile(const Histogram *histogram, double percentile);
+
+#endif /* HISTOGRAM_H */
@@ -1,19 +1,30 @@
 #include <arpa/inet.h>
 #include <assert.h>
 #include <errno.h>
-#include <poll.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/poll.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
 #include "common.h"
 #include "connection.h"
-
-int main() {
+#include "map.h"
+#include "object.h"
+#include "request.h"
+#include "worker.h"
+
+/**
+ * @brief Create a non-blocking socket listening on the configured port. With
+ * reuseport, several sockets can be bound to the port and the kernel balances
+ * incoming connections between them.
+ *
+ * @param reuseport Whether to set SO_REUSEPORT on the socket
+ *
+ * @return int File descriptor of the listening socket
+ */
+static int create_listener(bool reuseport) {
   // fd for the TCP socket
   int fd = socket(AF_INET, SOCK_STREAM, 0);
 
@@ -23,10 +34,14 @@ int main() {
 
   int val = 1;
   setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+  if (reuseport &&
+      setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val))) {
+    die("setsockopt()");
+  }
 
   struct sockaddr_in addr = {0};
   addr.sin_family = AF_INET;
-  addr.sin_port = ntohs(4413);
+  addr.sin_port = ntohs(g_config.port);
   addr.sin_addr.s_addr = ntohl(0);
   int rv = bind(fd, (const struct sockaddr *)&addr, sizeof(addr));
   if (rv) {
@@ -38,65 +53,133 @@ int main() {
     die("listen()");
   }
 
-  ConnectionArray fd_to_connections;
-  initialize_connection_array(&fd_to_connections);
-
   // Set the listening fd to non-blocking mode
   fd_set_nb(fd);
+  return fd;
+}
 
-  // Event loop
-  PollArgs args;
-  initialize_poll_args(&args);
-  while (true) {
-    // Prepare the arguments of poll()
-    free_poll_args(&args);
-
-    // Listening fd is in the first position
-    struct pollfd pfd = {fd, POLLIN, 0};
-    write_poll_args(&args, pfd);
-
-    // Connection fds;
-    for (int i = 0; i < fd_to_connections.capacity; i++) {
-      Connection *connection = fd_to_connections.connections[i];
-      // Skip NULL connections
-      if (connection == NULL)
-        continue;
-
-      struct pollfd pfd = {};
-      pfd.fd = connection->fd;
-      pfd.events = (connection->state == STATE_REQUEST) ? POLLIN : POLLOUT;
-      pfd.events = pfd.events | POLLERR;
-      write_poll_args(&args, pfd);
-    }
+static int parse_port(const char *text, uint16_t *port) {
+  int n = atoi(text);
+  if (n < 1 || n > 65535) {
+    return -1;
+  }
+  *port = (uint16_t)n;
+  return 0;
+}
 
-    // Poll active fds, both listening and client fds
-    int rv = poll(args.pfds, (nfds_t)args.count, 1000);
-    if (rv < 0) {
-      die("poll()");
-    }
+static void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [--threads N] [--io-uring] [--max-msg-size BYTES]\n"
+          "       [--maxmemory BYTES] [--maxmemory-policy noeviction|"
+          "allkeys-lru|allkeys-lfu|volatile-ttl]\n"
+          "       [--snapshot PATH] [--appendonly PATH]\n"
+          "       [--appendfsync always|everysec|no] [--port N]\n"
+          "       [--replicaof HOST:PORT] [--repl-auth SECRET]\n"
+          "       [--repl-backlog-size BYTES]\n"
+          "       [--rehash-budget-us N] [--resizing-work N]\n",
+          name);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  uint32_t threads = 1;
+  bool use_uring = false;
 
-    // Process client fds
-    for (size_t i = 1; i < args.capacity; i++) {
-      if (args.pfds[i].revents) {
-        Connection *connection = fd_to_connections.connections[args.pfds[i].fd];
-        connection_io(connection);
-        if (connection->state == STATE_END) {
-          // Destroy
-          fd_to_connections.connections[connection->fd] = NULL;
-          (void)close(connection->fd);
-          free(connection);
-        }
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      int n = atoi(argv[++i]);
+      if (n < 1 || n > K_MAX_WORKERS) {
+        usage(argv[0]);
+      }
+      threads = (uint32_t)n;
+    } else if (strcmp(argv[i], "--max-msg-size") == 0 && i + 1 < argc) {
+      long long n = atoll(argv[++i]);
+      if (n < 1 || n > K_MAX_MSG_LIMIT) {
+        usage(argv[0]);
+      }
+      g_config.max_msg = (uint32_t)n;
+    } else if (strcmp(argv[i], "--maxmemory") == 0 && i + 1 < argc) {
+      long long n = atoll(argv[++i]);
+      if (n < 0) {
+        usage(argv[0]);
+      }
+      g_config.max_memory = (uint64_t)n;
+    } else if (strcmp(argv[i], "--maxmemory-policy") == 0 && i + 1 < argc) {
+      if (parse_eviction_policy(argv[++i], &g_config.eviction) != 0) {
+        usage(argv[0]);
       }
+    } else if (strcmp(argv[i], "--snapshot") == 0 && i + 1 < argc) {
+      g_config.snapshot_path = argv[++i];
+    } else if (strcmp(argv[i], "--appendonly") == 0 && i + 1 < argc) {
+      g_config.aof_path = argv[++i];
+    } else if (strcmp(argv[i], "--appendfsync") == 0 && i + 1 < argc) {
+      if (parse_aof_fsync(argv[++i], &g_config.aof_fsync) != 0) {
+        usage(argv[0]);
+      }
+    } else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+      if (parse_port(argv[++i], &g_config.port) != 0) {
+        usage(argv[0]);
+      }
+    } else if (strcmp(argv[i], "--replicaof") == 0 && i + 1 < argc) {
+      // HOST:PORT, the host is cut off in place
+      char *address = argv[++i];
+      char *colon = strrchr(address, ':');
+      if (!colon || colon == address ||
+          parse_port(colon + 1, &g_config.primary_port) != 0) {
+        usage(argv[0]);
+      }
+      *colon = '\0';
+      g_config.primary_host = address;
+    } else if (strcmp(argv[i], "--repl-auth") == 0 && i + 1 < argc) {
+      g_config.repl_auth = argv[++i];
+      if (g_config.repl_auth[0] == '\0') {
+        usage(argv[0]);
+      }
+    } else if (strcmp(argv[i], "--repl-backlog-size") == 0 && i + 1 < argc) {
+      long long n = atoll(argv[++i]);
+      if (n < 1) {
+        usage(argv[0]);
+      }
+      g_config.repl_backlog_size = (uint64_t)n;
+    } else if (strcmp(argv[i], "--rehash-budget-us") == 0 && i + 1 < argc) {
+      long long n = atoll(argv[++i]);
+      if (n < 0) {
+        usage(argv[0]);
+      }
+      g_config.rehash_budget_us = (uint64_t)n;
+    } else if (strcmp(argv[i], "--resizing-work") == 0 && i + 1 < argc) {
+      long long n = atoll(argv[++i]);
+      if (n < 1) {
+        usage(argv[0]);
+      }
+      g_resizing_work = (size_t)n;
+    } else if (strcmp(argv[i], "--io-uring") == 0) {
+      use_uring = true;
+    } else {
+      usage(argv[0]);
     }
+  }
 
-    // Try accepting new connection if the listening fd is active
-    if (args.pfds[0].revents) {
-      (void)accept_new_connection(&fd_to_connections, fd);
-    }
+  // The primary refuses a replica without the secret
+  if (g_config.primary_host && !g_config.repl_auth) {
+    usage(argv[0]);
   }
 
-  free_poll_args(&args);
-  free_connection_array(&fd_to_connections);
+  // A new seed on every start, the data loaded is routed to the shards again
+  initialize_hash_seed();
+  initialize_commands();
+
+  int listen_fds[K_MAX_WORKERS];
+  for (uint32_t i = 0; i < threads; i++) {
+    listen_fds[i] = create_listener(threads > 1);
+  }
+
+  // Event loops, one per thread
+  run_workers(listen_fds, threads, use_uring);
+
+  for (uint32_t i = 0; i < threads; i++) {
+    close(listen_fds[i]);
+  }
 
   return 0;
 }
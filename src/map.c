@@ -57,40 +57,58 @@ static void scan_table(Table *table, void (*f)(HashNode *, void *), void *arg) {
   }
 }
 
-static void start_resizing_map(Map *map) {
+size_t g_resizing_work = K_RESIZING_WORK;
+
+static void start_resizing_map(Map *map, size_t n) {
   assert(map->t2.table == NULL);
 
-  // Create a bigger hash table and swap them
+  // Create a table of n buckets and swap them, the nodes move over
+  // incrementally
 
   map->t2 = map->t1;
-  init_table(&map->t1, (map->t1.mask + 1) * 2);
+  init_table(&map->t1, n);
 
   map->resizing_position = 0;
 }
 
-static void help_resizing_map(Map *map) {
+static void help_resizing_map(Map *map, size_t work) {
   size_t nwork = 0;
 
-  while (nwork < K_RESIZING_WORK && map->t2.size > 0) {
+  // Empty buckets count as work too, or a sparse table being shrunk would
+  // take a long scan to find its next node
+  while (nwork < work && map->t2.size > 0) {
     // Scan for nodes from t2 and move to t1
     HashNode **from = &map->t2.table[map->resizing_position];
+    nwork++;
     if (!*from) {
       map->resizing_position++;
       continue;
     }
 
     insert_table(&map->t1, detach_table(&map->t2, from));
-    nwork++;
   }
 
   if (map->t2.size == 0 && map->t2.table) {
     // Finished
     free(map->t2.table);
+    map->t2.table = NULL;
     map->t2.size = 0;
     map->t2.mask = 0;
   }
 }
 
+/**
+ * Buckets for n nodes: the load factor is below half the maximum, so the
+ * table has to double its nodes before it grows again
+ */
+static size_t get_bucket_count(size_t n) {
+  size_t buckets = 4;
+  while (n / buckets >= K_MAX_LOAD_FACTOR / 2) {
+    buckets *= 2;
+  }
+  return buckets;
+}
+
 void insert_map(Map *map, HashNode *node) {
   if (!map->t1.table) {
     init_table(&map->t1, 4); // Initialize table if empty
@@ -101,18 +119,32 @@ void insert_map(Map *map, HashNode *node) {
     size_t load_factor = map->t1.size / (map->t1.mask + 1);
 
     if (load_factor >= K_MAX_LOAD_FACTOR) {
-      start_resizing_map(map); // Create a larger table
+      // Create a larger table
+      start_resizing_map(map, (map->t1.mask + 1) * 2);
     }
+  }
+
+  help_resizing_map(map, g_resizing_work);
+}
+
+void reserve_map(Map *map, size_t n) {
+  if (map->t1.table || map->t2.table) {
+    return;
+  }
 
-    help_resizing_map(map);
+  // Stay under the load factor which starts a resize
+  size_t buckets = 4;
+  while (n / buckets >= K_MAX_LOAD_FACTOR) {
+    buckets *= 2;
   }
+  init_table(&map->t1, buckets);
 }
 
 size_t get_map_size(Map *map) { return map->t1.size + map->t2.size; }
 
 HashNode *lookup_map(Map *map, HashNode *key,
                      bool (*eq)(HashNode *, HashNode *)) {
-  help_resizing_map(map);
+  help_resizing_map(map, g_resizing_work);
 
   HashNode **from = lookup_table(&map->t1, key, eq);
   from = from ? from : lookup_table(&map->t2, key, eq);
@@ -120,14 +152,29 @@ HashNode *lookup_map(Map *map, HashNode *key,
   return from ? *from : NULL;
 }
 
+/**
+ * Start shrinking the table once the load factor falls below the low-water
+ * mark, unless a resize is in progress
+ */
+static void check_shrinking_map(Map *map) {
+  size_t buckets = map->t1.mask + 1;
+  if (map->t2.table || buckets <= 4 ||
+      map->t1.size >= buckets * K_MIN_LOAD_FACTOR) {
+    return;
+  }
+  start_resizing_map(map, get_bucket_count(map->t1.size));
+}
+
 HashNode *detach_map(Map *map, HashNode *key,
                      bool (*eq)(HashNode *, HashNode *)) {
-  help_resizing_map(map);
+  help_resizing_map(map, g_resizing_work);
 
   // Try to delete in t1
   HashNode **from = lookup_table(&map->t1, key, eq);
   if (from != NULL) {
-    return detach_table(&map->t1, from);
+    HashNode *node = detach_table(&map->t1, from);
+    check_shrinking_map(map);
+    return node;
   }
 
   // Try to delete in t2
@@ -139,7 +186,133 @@ HashNode *detach_map(Map *map, HashNode *key,
   return NULL;
 }
 
+bool rehash_map(Map *map, size_t work) {
+  help_resizing_map(map, work);
+  if (work > 0) {
+    // Deletes made during a resize may call for another one
+    check_shrinking_map(map);
+  }
+  return map->t2.table != NULL;
+}
+
 void scan_map(Map *map, void (*f)(HashNode *, void *), void *arg) {
   scan_table(&map->t1, f, arg);
   scan_table(&map->t2, f, arg);
 }
+
+static size_t table_memory(Table *table) {
+  return table->table ? (table->mask + 1) * sizeof(HashNode *) : 0;
+}
+
+size_t get_map_memory(Map *map) {
+  return table_memory(&map->t1) + table_memory(&map->t2);
+}
+
+static HashNode *sample_table(Table *table, uint64_t random) {
+  if (table->size == 0)
+    return NULL;
+
+  for (size_t i = 0; i < table->mask + 1; ++i) {
+    HashNode *node = table->table[(random + i) & table->mask];
+    if (node) {
+      // Any node of the chain, the head is the most recently inserted
+      size_t length = 0;
+      for (HashNode *cur = node; cur; cur = cur->next) {
+        length++;
+      }
+      for (size_t skip = (random >> 16) % length; skip > 0; skip--) {
+        node = node->next;
+      }
+      return node;
+    }
+  }
+  return NULL;
+}
+
+HashNode *sample_map(Map *map, uint64_t random) {
+  // Pick a table in proportion to its size, then a slot in it
+  size_t size = get_map_size(map);
+  if (size == 0)
+    return NULL;
+
+  bool older = map->t2.size && (random >> 32) % size >= map->t1.size;
+  return sample_table(older ? &map->t2 : &map->t1, random);
+}
+
+void free_map(Map *map) {
+  free(map->t1.table);
+  free(map->t2.table);
+  map->t1.table = map->t2.table = NULL;
+  map->t1.mask = map->t2.mask = 0;
+  map->t1.size = map->t2.size = 0;
+  map->resizing_position = 0;
+}
+
+/**
+ * Visit the nodes of one bucket, those whose hash & mask is the index
+ */
+static void scan_bucket(Table *table, size_t index,
+                        void (*f)(HashNode *, void *), void *arg) {
+  if (!table->table)
+    return;
+
+  for (HashNode *node = table->table[index]; node; node = node->next) {
+    f(node, arg);
+  }
+}
+
+static size_t reverse_bits(size_t v) {
+  size_t r = 0;
+  for (size_t i = 0; i < sizeof(v) * 8; i++) {
+    r = (r << 1) | (v & 1);
+    v >>= 1;
+  }
+  return r;
+}
+
+/**
+ * Increment the bits of a cursor above the mask first, from the highest one
+ */
+static size_t next_cursor(size_t cursor, size_t mask) {
+  cursor |= ~mask;
+  cursor = reverse_bits(cursor);
+  cursor++;
+  return reverse_bits(cursor);
+}
+
+size_t scan_map_step(Map *map, size_t cursor, void (*f)(HashNode *, void *),
+                     void *arg) {
+  if (get_map_size(map) == 0)
+    return 0;
+
+  Table *small = &map->t1;
+  Table *large = &map->t2;
+  if (!large->table) {
+    scan_bucket(small, cursor & small->mask, f, arg);
+    return next_cursor(cursor, small->mask);
+  }
+
+  // While resizing, visit the bucket in the smaller table, then every bucket
+  // of the larger table whose nodes it would hold
+  if (small->mask > large->mask) {
+    small = &map->t2;
+    large = &map->t1;
+  }
+  scan_bucket(small, cursor & small->mask, f, arg);
+  do {
+    scan_bucket(large, cursor & large->mask, f, arg);
+    cursor = next_cursor(cursor, large->mask);
+  } while (cursor & (small->mask ^ large->mask));
+  return cursor;
+}
+
+static void prefetch_table(Table *table, uint64_t hashcode) {
+  if (table->table) {
+    __builtin_prefetch(&table->table[hashcode & table->mask]);
+  }
+}
+
+void prefetch_map(Map *map, uint64_t hashcode) {
+  prefetch_table(&map->t1, hashcode);
+  prefetch_table(&map->t2, hashcode);
+}
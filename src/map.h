@@ -6,6 +6,8 @@
 #include <stdlib.h>
 
 #define K_MAX_LOAD_FACTOR 8
+#define K_MIN_LOAD_FACTOR 1 // A chained table shrinks below that many nodes
+                            // per bucket
 #define K_RESIZING_WORK 128
 
 typedef struct HashNode_t {
@@ -13,20 +15,60 @@ typedef struct HashNode_t {
   uint64_t hashcode;
 } HashNode;
 
+#if defined(CACHIO_SWISS_MAP)
+
+/**
+ * Open-addressing table (map_swiss.c). Each slot has a control byte holding
+ * K_CTRL_EMPTY, K_CTRL_DELETED or the low 7 bits of the node's hash, and the
+ * control bytes of a group of slots are matched against a tag at once with
+ * SIMD compares. The first group of control bytes is mirrored after the last
+ * one so a group can be loaded from any position.
+ */
+#define K_CTRL_EMPTY ((uint8_t)0x80)
+#define K_CTRL_DELETED ((uint8_t)0xFE)
+
+typedef struct {
+  uint8_t *ctrl;
+  HashNode **slots;
+  size_t mask; // number of slots - 1
+  size_t size;
+  size_t deleted;
+} Table;
+
+#else
+
 typedef struct {
   HashNode **table;
   size_t mask;
   size_t size;
 } Table;
 
+#endif
+
 typedef struct {
   Table t1; // newer
   Table t2; // older
   size_t resizing_position;
 } Map;
 
+/**
+ * Nodes moved (or empty slots skipped) by each operation on a map being
+ * resized, K_RESIZING_WORK by default. A map grows once its load factor
+ * reaches the maximum and shrinks once it falls below the low-water mark; the
+ * nodes then move to the new table a few at a time, by the operations on the
+ * map and by rehash_map().
+ */
+extern size_t g_resizing_work;
+
 void insert_map(Map *map, HashNode *node);
 
+/**
+ * @brief Presize an empty map for n nodes, so inserting them does not go
+ * through a cascade of resizes. A map which already has a table is left as
+ * is.
+ */
+void reserve_map(Map *map, size_t n);
+
 size_t get_map_size(Map *map);
 
 HashNode *lookup_map(Map *map, HashNode *key,
@@ -35,5 +77,53 @@ HashNode *lookup_map(Map *map, HashNode *key,
 HashNode *detach_map(Map *map, HashNode *key,
                      bool (*eq)(HashNode *, HashNode *));
 
+/**
+ * @brief Advance a resize in progress by up to work nodes or empty slots, so
+ * an idle map does not keep both of its tables. With no work, only tells
+ * whether a resize is in progress.
+ *
+ * @return bool true if the resize is not finished
+ */
+bool rehash_map(Map *map, size_t work);
+
 void scan_map(Map *map, void (*f)(HashNode *, void *), void *arg);
+
+/**
+ * @brief Visit the nodes of the next bucket of a cursor scan. Buckets are
+ * visited in reverse-binary order of their index, so a node present during
+ * the whole scan is visited at least once, even if the tables grow or are
+ * being resized in between steps. Nodes may be visited twice.
+ *
+ * @param cursor 0 to start a scan, then the value returned by the last step
+ *
+ * @return size_t cursor of the next step, 0 when the scan is complete
+ */
+size_t scan_map_step(Map *map, size_t cursor, void (*f)(HashNode *, void *),
+                     void *arg);
+
+/**
+ * @brief Free the tables of a map, which is left empty. The nodes are owned
+ * by the caller and not freed.
+ */
+void free_map(Map *map);
+
+/**
+ * @brief Memory used by the tables of the map, not counting the nodes.
+ */
+size_t get_map_memory(Map *map);
+
+/**
+ * @brief Pick a node at a pseudo-random position: the first one found from a
+ * random slot. Not uniform, but cheap enough to sample eviction candidates.
+ *
+ * @return HashNode* a node, or NULL if the map is empty
+ */
+HashNode *sample_map(Map *map, uint64_t random);
+
+/**
+ * @brief Hint the cache to load where a lookup of hashcode would start, so the
+ * lookups of a batch of keys hashed up front overlap their misses. A hint
+ * only, the map is not changed.
+ */
+void prefetch_map(Map *map, uint64_t hashcode);
 #endif /* TABLE_H */
@@ -0,0 +1,453 @@
+#include <assert.h>
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define K_GROUP_SIZE 32
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define K_GROUP_SIZE 16
+#else
+#define K_GROUP_SIZE 8
+#endif
+
+#include "map.h"
+
+// Resize once full and deleted slots reach 7/8 of the table
+#define K_SWISS_MAX_LOAD(n) ((n) - (n) / 8)
+// Shrink once full slots are fewer than 1/8 of the table
+#define K_SWISS_MIN_LOAD(n) ((n) / 8)
+// A shrink divides the number of slots by at most this much, see
+// get_insert_work
+#define K_SWISS_MAX_SHRINK 4
+
+static inline uint8_t hash_tag(uint64_t hashcode) {
+  return (uint8_t)(hashcode & 0x7F);
+}
+
+static inline size_t hash_position(uint64_t hashcode) {
+  return (size_t)(hashcode >> 7);
+}
+
+/**
+ * Bit i of the result is set if control byte i of the group equals tag
+ */
+static inline uint32_t match_group(const uint8_t *group, uint8_t tag) {
+#if defined(__AVX2__)
+  __m256i ctrl = _mm256_loadu_si256((const __m256i *)group);
+  return (uint32_t)_mm256_movemask_epi8(
+      _mm256_cmpeq_epi8(ctrl, _mm256_set1_epi8((char)tag)));
+#elif defined(__SSE2__)
+  __m128i ctrl = _mm_loadu_si128((const __m128i *)group);
+  return (uint32_t)_mm_movemask_epi8(
+      _mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)tag)));
+#else
+  uint32_t mask = 0;
+  for (int i = 0; i < K_GROUP_SIZE; i++) {
+    mask |= (uint32_t)(group[i] == tag) << i;
+  }
+  return mask;
+#endif
+}
+
+/**
+ * Bit i of the result is set if slot i of the group is empty or deleted, i.e.
+ * has its high bit set
+ */
+static inline uint32_t match_free(const uint8_t *group) {
+#if defined(__AVX2__)
+  return (uint32_t)_mm256_movemask_epi8(
+      _mm256_loadu_si256((const __m256i *)group));
+#elif defined(__SSE2__)
+  return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)group));
+#else
+  uint32_t mask = 0;
+  for (int i = 0; i < K_GROUP_SIZE; i++) {
+    mask |= (uint32_t)(group[i] >> 7) << i;
+  }
+  return mask;
+#endif
+}
+
+static void init_table(Table *table, size_t n) {
+  assert(n >= K_GROUP_SIZE && ((n - 1) & n) == 0); // n is a power of 2
+  table->ctrl = (uint8_t *)malloc(n + K_GROUP_SIZE);
+  memset(table->ctrl, K_CTRL_EMPTY, n + K_GROUP_SIZE);
+  table->slots = (HashNode **)calloc(n, sizeof(HashNode *));
+  table->mask = n - 1;
+  table->size = 0;
+  table->deleted = 0;
+}
+
+static void free_table(Table *table) {
+  free(table->ctrl);
+  free(table->slots);
+  table->ctrl = NULL;
+  table->slots = NULL;
+  table->mask = 0;
+  table->size = 0;
+  table->deleted = 0;
+}
+
+static inline void set_ctrl(Table *table, size_t i, uint8_t ctrl) {
+  table->ctrl[i] = ctrl;
+  if (i < K_GROUP_SIZE) {
+    table->ctrl[table->mask + 1 + i] = ctrl; // Mirror of the first group
+  }
+}
+
+static void insert_table(Table *table, HashNode *node) {
+  // Probe group by group (triangular steps visit every group) for a free slot
+  size_t position = hash_position(node->hashcode) & table->mask;
+  for (size_t step = K_GROUP_SIZE;; step += K_GROUP_SIZE) {
+    uint32_t free_slots = match_free(&table->ctrl[position]);
+    if (free_slots) {
+      size_t i = (position + (size_t)__builtin_ctz(free_slots)) & table->mask;
+      if (table->ctrl[i] == K_CTRL_DELETED) {
+        table->deleted--;
+      }
+      set_ctrl(table, i, hash_tag(node->hashcode));
+      table->slots[i] = node;
+      table->size++;
+      return;
+    }
+    position = (position + step) & table->mask;
+  }
+}
+
+static HashNode **lookup_table(Table *table, HashNode *key,
+                               bool (*eq)(HashNode *, HashNode *)) {
+  if (!table->ctrl)
+    return NULL;
+
+  uint8_t tag = hash_tag(key->hashcode);
+  size_t position = hash_position(key->hashcode) & table->mask;
+  for (size_t step = K_GROUP_SIZE; step <= table->mask + K_GROUP_SIZE;
+       step += K_GROUP_SIZE) {
+    const uint8_t *group = &table->ctrl[position];
+
+    // Only slots whose 7-bit tag matches are dereferenced
+    for (uint32_t m = match_group(group, tag); m; m &= m - 1) {
+      size_t i = (position + (size_t)__builtin_ctz(m)) & table->mask;
+      HashNode *cur = table->slots[i];
+      if (cur->hashcode == key->hashcode && eq(cur, key)) {
+        return &table->slots[i];
+      }
+    }
+
+    // An empty slot ends the probe sequence
+    if (match_group(group, K_CTRL_EMPTY)) {
+      return NULL;
+    }
+    position = (position + step) & table->mask;
+  }
+  return NULL;
+}
+
+static HashNode *detach_table(Table *table, HashNode **from) {
+  size_t i = (size_t)(from - table->slots);
+  HashNode *node = *from;
+  *from = NULL;
+  set_ctrl(table, i, K_CTRL_DELETED); // Keep probe sequences going through
+  table->size--;
+  table->deleted++;
+  return node;
+}
+
+static void scan_table(Table *table, void (*f)(HashNode *, void *), void *arg) {
+  if (table->size == 0)
+    return;
+
+  for (size_t i = 0; i < table->mask + 1; ++i) {
+    if (!(table->ctrl[i] & 0x80)) {
+      f(table->slots[i], arg);
+    }
+  }
+}
+
+size_t g_resizing_work = K_RESIZING_WORK;
+
+static void help_resizing_map(Map *map, size_t work) {
+  size_t nwork = 0;
+
+  // Move nodes from t2 to t1, visiting a bounded number of slots
+  while (nwork < work && map->t2.size > 0) {
+    size_t i = map->resizing_position++;
+    nwork++;
+    if (map->t2.ctrl[i] & 0x80) {
+      continue;
+    }
+    HashNode *node = detach_table(&map->t2, &map->t2.slots[i]);
+    insert_table(&map->t1, node);
+  }
+
+  if (map->t2.size == 0 && map->t2.ctrl) {
+    // Finished
+    free_table(&map->t2);
+  }
+}
+
+static void start_resizing_map(Map *map, size_t n) {
+  assert(!map->t2.ctrl);
+  map->t2 = map->t1;
+  init_table(&map->t1, n);
+  map->resizing_position = 0;
+}
+
+/**
+ * Slots for n nodes: at most half the maximum load, so the table has to double
+ * its nodes before it grows again
+ */
+static size_t get_slot_count(size_t n) {
+  size_t slots = K_GROUP_SIZE;
+  while (K_SWISS_MAX_LOAD(slots) / 2 < n) {
+    slots *= 2;
+  }
+  return slots;
+}
+
+/**
+ * Slots of t2 an insert visits: g_resizing_work, or more if the resize would
+ * not finish otherwise before t1 reaches its maximum load. Each insert takes
+ * one slot of the headroom left, so a share of the slots left to visit per
+ * slot of headroom finishes in time. A grow leaves headroom for 7/8 of the
+ * old slots, and a shrink (K_SWISS_MAX_SHRINK) for about 3/32, so this stays
+ * a few slots per insert instead of a whole migration at once.
+ */
+static size_t get_insert_work(Map *map) {
+  if (!map->t2.ctrl) {
+    return g_resizing_work;
+  }
+  size_t remaining = map->t2.mask + 1 - map->resizing_position;
+  size_t load = map->t1.size + map->t1.deleted + map->t2.size;
+  size_t limit = K_SWISS_MAX_LOAD(map->t1.mask + 1);
+  size_t headroom = limit > load ? limit - load : 1;
+  size_t work = (remaining + headroom - 1) / headroom;
+  return work > g_resizing_work ? work : g_resizing_work;
+}
+
+void insert_map(Map *map, HashNode *node) {
+  if (!map->t1.ctrl) {
+    init_table(&map->t1, K_GROUP_SIZE); // Initialize table if empty
+  }
+  help_resizing_map(map, get_insert_work(map));
+
+  // The nodes still in t2 will move to t1 too, which matters when it is the
+  // smaller table of a shrink
+  size_t n = map->t1.mask + 1;
+  if (map->t1.size + map->t1.deleted + map->t2.size + 1 > K_SWISS_MAX_LOAD(n)) {
+    assert(!map->t2.ctrl); // Paced by get_insert_work
+    // Grow, or only purge the deleted slots if they make most of the load
+    if (map->t1.size >= K_SWISS_MAX_LOAD(n) / 2) {
+      n *= 2;
+    }
+    start_resizing_map(map, n); // Create a larger table
+  }
+  insert_table(&map->t1, node); // Insert key to the new table
+}
+
+void reserve_map(Map *map, size_t n) {
+  if (map->t1.ctrl || map->t2.ctrl) {
+    return;
+  }
+
+  size_t slots = K_GROUP_SIZE;
+  while (K_SWISS_MAX_LOAD(slots) < n) {
+    slots *= 2;
+  }
+  init_table(&map->t1, slots);
+}
+
+size_t get_map_size(Map *map) { return map->t1.size + map->t2.size; }
+
+HashNode *lookup_map(Map *map, HashNode *key,
+                     bool (*eq)(HashNode *, HashNode *)) {
+  help_resizing_map(map, g_resizing_work);
+
+  HashNode **from = lookup_table(&map->t1, key, eq);
+  from = from ? from : lookup_table(&map->t2, key, eq);
+
+  return from ? *from : NULL;
+}
+
+/**
+ * Start shrinking the table once its load falls below the low-water mark,
+ * unless a resize is in progress
+ */
+static void check_shrinking_map(Map *map) {
+  size_t n = map->t1.mask + 1;
+  if (map->t2.ctrl || n <= K_GROUP_SIZE ||
+      map->t1.size >= K_SWISS_MIN_LOAD(n)) {
+    return;
+  }
+  size_t slots = get_slot_count(map->t1.size);
+  if (slots < n / K_SWISS_MAX_SHRINK) {
+    slots = n / K_SWISS_MAX_SHRINK; // Shrinks again later if still sparse
+  }
+  start_resizing_map(map, slots);
+}
+
+HashNode *detach_map(Map *map, HashNode *key,
+                     bool (*eq)(HashNode *, HashNode *)) {
+  help_resizing_map(map, g_resizing_work);
+
+  // Try to delete in t1
+  HashNode **from = lookup_table(&map->t1, key, eq);
+  if (from != NULL) {
+    HashNode *node = detach_table(&map->t1, from);
+    check_shrinking_map(map);
+    return node;
+  }
+
+  // Try to delete in t2
+  from = lookup_table(&map->t2, key, eq);
+  if (from != NULL) {
+    return detach_table(&map->t2, from);
+  }
+
+  return NULL;
+}
+
+bool rehash_map(Map *map, size_t work) {
+  help_resizing_map(map, work);
+  if (work > 0) {
+    // Deletes made during a resize may call for another one
+    check_shrinking_map(map);
+  }
+  return map->t2.ctrl != NULL;
+}
+
+void scan_map(Map *map, void (*f)(HashNode *, void *), void *arg) {
+  scan_table(&map->t1, f, arg);
+  scan_table(&map->t2, f, arg);
+}
+
+static size_t table_memory(Table *table) {
+  if (!table->ctrl)
+    return 0;
+  return (table->mask + 1) * (1 + sizeof(HashNode *)) + K_GROUP_SIZE;
+}
+
+size_t get_map_memory(Map *map) {
+  return table_memory(&map->t1) + table_memory(&map->t2);
+}
+
+static HashNode *sample_table(Table *table, uint64_t random) {
+  if (table->size == 0)
+    return NULL;
+
+  for (size_t i = 0; i < table->mask + 1; ++i) {
+    size_t position = (random + i) & table->mask;
+    if (!(table->ctrl[position] & 0x80)) {
+      return table->slots[position];
+    }
+  }
+  return NULL;
+}
+
+HashNode *sample_map(Map *map, uint64_t random) {
+  // Pick a table in proportion to its size, then a slot in it
+  size_t size = get_map_size(map);
+  if (size == 0)
+    return NULL;
+
+  bool older = map->t2.size && (random >> 32) % size >= map->t1.size;
+  return sample_table(older ? &map->t2 : &map->t1, random);
+}
+
+void free_map(Map *map) {
+  free_table(&map->t1);
+  free_table(&map->t2);
+  map->resizing_position = 0;
+}
+
+/**
+ * Visit the nodes whose home position is the index. They all lie on the probe
+ * sequence from there, before the first group with an empty slot.
+ */
+static void scan_bucket(Table *table, size_t index,
+                        void (*f)(HashNode *, void *), void *arg) {
+  if (!table->ctrl || table->size == 0)
+    return;
+
+  size_t position = index;
+  for (size_t step = K_GROUP_SIZE; step <= table->mask + K_GROUP_SIZE;
+       step += K_GROUP_SIZE) {
+    const uint8_t *group = &table->ctrl[position];
+    uint32_t full = ~match_free(group);
+#if K_GROUP_SIZE < 32
+    full &= (1u << K_GROUP_SIZE) - 1;
+#endif
+
+    for (; full; full &= full - 1) {
+      size_t i = (position + (size_t)__builtin_ctz(full)) & table->mask;
+      HashNode *node = table->slots[i];
+      if ((hash_position(node->hashcode) & table->mask) == index) {
+        f(node, arg);
+      }
+    }
+
+    if (match_group(group, K_CTRL_EMPTY)) {
+      return;
+    }
+    position = (position + step) & table->mask;
+  }
+}
+
+static size_t reverse_bits(size_t v) {
+  size_t r = 0;
+  for (size_t i = 0; i < sizeof(v) * 8; i++) {
+    r = (r << 1) | (v & 1);
+    v >>= 1;
+  }
+  return r;
+}
+
+/**
+ * Increment the bits of a cursor above the mask first, from the highest one
+ */
+static size_t next_cursor(size_t cursor, size_t mask) {
+  cursor |= ~mask;
+  cursor = reverse_bits(cursor);
+  cursor++;
+  return reverse_bits(cursor);
+}
+
+size_t scan_map_step(Map *map, size_t cursor, void (*f)(HashNode *, void *),
+                     void *arg) {
+  if (get_map_size(map) == 0)
+    return 0;
+
+  Table *small = &map->t1;
+  Table *large = &map->t2;
+  if (!large->ctrl) {
+    scan_bucket(small, cursor & small->mask, f, arg);
+    return next_cursor(cursor, small->mask);
+  }
+
+  // While resizing, visit the bucket in the smaller table, then every bucket
+  // of the larger table whose nodes it would hold
+  if (small->mask > large->mask) {
+    small = &map->t2;
+    large = &map->t1;
+  }
+  scan_bucket(small, cursor & small->mask, f, arg);
+  do {
+    scan_bucket(large, cursor & large->mask, f, arg);
+    cursor = next_cursor(cursor, large->mask);
+  } while (cursor & (small->mask ^ large->mask));
+  return cursor;
+}
+
+static void prefetch_table(Table *table, uint64_t hashcode) {
+  if (table->ctrl) {
+    size_t position = hash_position(hashcode) & table->mask;
+    __builtin_prefetch(&table->ctrl[position]);
+    __builtin_prefetch(&table->slots[position]);
+  }
+}
+
+void prefetch_map(Map *map, uint64_t hashcode) {
+  prefetch_table(&map->t1, hashcode);
+  prefetch_table(&map->t2, hashcode);
+}
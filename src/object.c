@@ -1,39 +1,156 @@
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/random.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "object.h"
 
-void initialize_object_string(ObjectString *str) {
-  str->object.type = OBJECT_STRING;
-  str->value = NULL;
-  str->length = 0;
+static uint64_t g_hash_seed = 0;
+
+static const uint64_t K_HASH_P0 = 0xa0761d6478bd642full;
+static const uint64_t K_HASH_P1 = 0xe7037ed1a0b428dbull;
+static const uint64_t K_HASH_P2 = 0x8ebc6af09c88c6e3ull;
+static const uint64_t K_HASH_P3 = 0x589965cc75374cc3ull;
+
+void initialize_hash_seed(void) {
+  uint64_t seed = 0;
+  if (getrandom(&seed, sizeof(seed), 0) != sizeof(seed)) {
+    seed = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32);
+  }
+  g_hash_seed = seed;
+}
+
+uint64_t get_hash_seed(void) { return g_hash_seed; }
+
+static inline void hash_multiply(uint64_t *a, uint64_t *b) {
+  __uint128_t r = (__uint128_t)*a * *b;
+  *a = (uint64_t)r;
+  *b = (uint64_t)(r >> 64);
+}
+
+static inline uint64_t hash_mix(uint64_t a, uint64_t b) {
+  hash_multiply(&a, &b);
+  return a ^ b;
+}
+
+static inline uint64_t read_64(const uint8_t *p) {
+  uint64_t v = 0;
+  memcpy(&v, p, 8);
+  return v;
+}
+
+static inline uint64_t read_32(const uint8_t *p) {
+  uint32_t v = 0;
+  memcpy(&v, p, 4);
+  return v;
 }
 
-void create_string(ObjectString *str, char *chars) {
-  initialize_object_string(str);
-  size_t n = strlen(chars);
-  str->value = malloc(sizeof(char) * (n + 1));
-  memcpy(str->value, chars, strlen(chars));
-  str->value[n] = '\0';
-  str->length = n;
+static inline uint64_t hash_with_seed(uint64_t hash_seed, const char *key,
+                                      size_t length) {
+  const uint8_t *p = (const uint8_t *)key;
+  uint64_t seed = hash_seed ^ hash_mix(hash_seed ^ K_HASH_P0, K_HASH_P1);
+  uint64_t a = 0;
+  uint64_t b = 0;
+
+  if (length <= 16) {
+    if (length >= 4) {
+      // Two overlapping 4-byte reads from each end cover 4..16 bytes
+      size_t mid = (length >> 3) << 2;
+      a = (read_32(p) << 32) | read_32(p + mid);
+      b = (read_32(p + length - 4) << 32) | read_32(p + length - 4 - mid);
+    } else if (length > 0) {
+      a = ((uint64_t)p[0] << 16) | ((uint64_t)p[length >> 1] << 8) |
+          p[length - 1];
+    }
+  } else {
+    size_t i = length;
+    if (i > 48) {
+      // Three independent lanes of 16 bytes
+      uint64_t seed1 = seed;
+      uint64_t seed2 = seed;
+      do {
+        seed = hash_mix(read_64(p) ^ K_HASH_P1, read_64(p + 8) ^ seed);
+        seed1 = hash_mix(read_64(p + 16) ^ K_HASH_P2, read_64(p + 24) ^ seed1);
+        seed2 = hash_mix(read_64(p + 32) ^ K_HASH_P3, read_64(p + 40) ^ seed2);
+        p += 48;
+        i -= 48;
+      } while (i > 48);
+      seed ^= seed1 ^ seed2;
+    }
+    while (i > 16) {
+      seed = hash_mix(read_64(p) ^ K_HASH_P1, read_64(p + 8) ^ seed);
+      p += 16;
+      i -= 16;
+    }
+    // The last 16 bytes, overlapping the previous block if needed
+    a = read_64(p + i - 16);
+    b = read_64(p + i - 8);
+  }
+
+  a ^= K_HASH_P1;
+  b ^= seed;
+  hash_multiply(&a, &b);
+  return hash_mix(a ^ K_HASH_P0 ^ length, b ^ K_HASH_P1);
 }
 
-void replace_string(ObjectString *str, char *chars) {
-  free(str->value);
-  initialize_object_string(str);
-  create_string(str, chars);
+uint64_t hash_string(const char *key, size_t length) {
+  return hash_with_seed(g_hash_seed, key, length);
 }
 
-uint32_t hash_string(const char *key, int length) {
-  uint32_t hash = 2166136261u;
-  for (int i = 0; i < length; i++) {
-    hash ^= (uint8_t)key[i];
-    hash *= 16777619;
+uint64_t hash_string_seeded(uint64_t seed, const char *key, size_t length) {
+  return hash_with_seed(seed, key, length);
+}
+
+bool parse_number(const char *text, size_t length, Number *number) {
+  // The text of a number starts with a digit or a minus sign
+  if (length == 0 || length >= K_NUMBER_TEXT_MAX ||
+      !((text[0] >= '0' && text[0] <= '9') || text[0] == '-')) {
+    return false;
+  }
+  char buffer[K_NUMBER_TEXT_MAX];
+  memcpy(buffer, text, length);
+  buffer[length] = '\0';
+
+  Number parsed = {0};
+  char *end = NULL;
+  errno = 0;
+  parsed.integer = strtoll(buffer, &end, 10);
+  if (errno != 0 || *end != '\0') {
+    errno = 0;
+    parsed.is_double = true;
+    parsed.real = strtod(buffer, &end);
+    if (errno != 0 || *end != '\0' || !isfinite(parsed.real)) {
+      return false;
+    }
+  }
+
+  // Leading zeros, a plus sign, trailing zeros... format differently
+  char check[K_NUMBER_TEXT_MAX];
+  if (format_number(&parsed, check) != length ||
+      memcmp(check, text, length) != 0) {
+    return false;
   }
-  return hash;
+  *number = parsed;
+  return true;
 }
 
-void free_string(ObjectString *str) {
-  free(str->value);
-  initialize_object_string(str);
+uint32_t format_number(const Number *number, char *dst) {
+  if (!number->is_double) {
+    return (uint32_t)snprintf(dst, K_NUMBER_TEXT_MAX, "%lld",
+                              (long long)number->integer);
+  }
+
+  // 17 significant digits always read back to the same double, fewer often do
+  int length = 0;
+  for (int precision = 15; precision <= 17; precision++) {
+    length = snprintf(dst, K_NUMBER_TEXT_MAX, "%.*g", precision, number->real);
+    if (strtod(dst, NULL) == number->real) {
+      break;
+    }
+  }
+  return (uint32_t)length;
 }
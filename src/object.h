@@ -9,36 +9,72 @@ typedef enum {
   OBJECT_NUMBER,
   OBJECT_STRING,
   OBJECT_BOOLEAN,
+  OBJECT_ZSET,
+  OBJECT_HASH,
 } ObjectType;
 
 typedef struct {
   ObjectType type;
 } Object;
 
-typedef struct {
-  Object object;
-  char *value;
-  size_t length;
-} ObjectString;
+#define K_NUMBER_TEXT_MAX 32 // Longest text of a Number, NUL included
 
+/**
+ * A number stored unboxed in an entry of type OBJECT_NUMBER, in place of the
+ * string it was parsed from: a 64-bit integer, or a double
+ */
 typedef struct {
-  Object object;
-  double value;
-} ObjectNumber;
+  bool is_double;
+  int64_t integer;
+  double real;
+} Number;
 
 typedef struct {
   Object object;
   bool value;
 } ObjectBoolean;
 
-void initialize_object_string(ObjectString *str);
+/**
+ * @brief Read a number from a string, only if it is the text format_number()
+ * writes for it, so the string comes back unchanged from the number: "10",
+ * "-3" and "2.5" are numbers, "010", "+3", "2.50" and "1e3" are not.
+ * Integers are preferred, and doubles must be finite.
+ *
+ * @return bool false if the string is not such a number
+ */
+bool parse_number(const char *text, size_t length, Number *number);
+
+/**
+ * @brief Write the text of a number into dst, of K_NUMBER_TEXT_MAX bytes. A
+ * double takes the shortest text which reads back to it.
+ *
+ * @return uint32_t length of the text, without the NUL
+ */
+uint32_t format_number(const Number *number, char *dst);
 
-void create_string(ObjectString *str, char *chars);
+/**
+ * Pick the random seed of hash_string for this process. Must be called once at
+ * startup, before any key is hashed.
+ */
+void initialize_hash_seed(void);
 
-void replace_string(ObjectString *str, char *chars);
+/**
+ * The seed is never saved, so it cannot be learned from the files and carried
+ * over to the next start. Each shard filters the keys of every file it loads.
+ */
+uint64_t get_hash_seed(void);
 
-uint32_t hash_string(const char *key, int length);
+/**
+ * 64-bit keyed hash (wyhash construction): reads 8 bytes at a time and mixes
+ * with 64x64->128-bit multiplies. Seeded per process, so collisions cannot be
+ * precomputed by clients.
+ */
+uint64_t hash_string(const char *key, size_t length);
 
-void free_string(ObjectString *str);
+/**
+ * hash_string as another process computes it, for keys routed by the seed of
+ * a primary.
+ */
+uint64_t hash_string_seeded(uint64_t seed, const char *key, size_t length);
 
 #endif /* OBJECT_H */
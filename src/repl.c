@@ -0,0 +1,685 @@
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "object.h"
+#include "repl.h"
+#include "request.h"
+#include "spsc.h"
+#include "store.h"
+#include "worker.h"
+
+/**
+ * Records routed by the replica thread to a worker, or an order to drop the
+ * keys of a primary shard before it is synced again
+ */
+typedef struct {
+  bool drop;
+  uint32_t source;   // Primary shard to drop
+  uint32_t nsources; // Shards of the primary
+  uint64_t seed;     // Hash seed of the primary
+  size_t size;
+  uint8_t data[];
+} ReplicaChunk;
+
+// The backlog of the calling worker's shard
+static __thread struct {
+  uint8_t *ring;  // repl_backlog_size bytes, NULL until a replica syncs
+  uint64_t start; // Offset of the oldest byte kept
+  uint64_t end;   // Offset past the newest byte
+} g_backlog;
+
+static __thread bool tl_applying;  // Running records from the primary
+static __thread uint64_t tl_applied; // Records applied by the worker
+
+static pthread_once_t g_replication_once = PTHREAD_ONCE_INIT;
+static char g_replid[K_REPL_ID_LENGTH + 1];
+
+// Written by the replica thread only; the counters are read by INFO
+static struct {
+  SpscQueue *queues; // Chunks for each worker, NULL unless a replica
+  char replid[K_REPL_ID_LENGTH + 1]; // Of the primary, empty before a sync
+  uint64_t seed;
+  uint32_t nshards;
+  uint64_t offsets[K_MAX_WORKERS]; // Next offset of each primary shard
+  bool synced[K_MAX_WORKERS];      // Whether offsets[i] can be fetched from
+  Output staging[K_MAX_WORKERS];   // Records being routed to each worker
+  Command command;                 // Record being routed
+  atomic_bool link_up;
+  atomic_uint_fast64_t full_syncs;
+  atomic_uint_fast64_t partial_syncs;
+} g_replica;
+
+/**
+ * Connection of the replica thread to the primary, with blocking I/O
+ */
+typedef struct {
+  int fd;
+  Output requests; // Not sent yet
+  uint8_t *reply;  // Last reply read
+  size_t capacity;
+} PrimaryLink;
+
+/**
+ * Cursor over a reply
+ */
+typedef struct {
+  const uint8_t *data;
+  size_t size;
+  size_t position;
+} ReplyReader;
+
+static void pick_replication_id(void) {
+  uint8_t random[K_REPL_ID_LENGTH / 2];
+  if (getrandom(random, sizeof(random), 0) != (ssize_t)sizeof(random)) {
+    uint64_t fallback = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32);
+    for (size_t i = 0; i < sizeof(random); i++) {
+      random[i] = (uint8_t)(fallback >> (8 * (i % 8))) ^ (uint8_t)i;
+    }
+  }
+  for (size_t i = 0; i < sizeof(random); i++) {
+    snprintf(&g_replid[2 * i], 3, "%02x", random[i]);
+  }
+}
+
+bool is_read_only(void) {
+  return g_config.primary_host != NULL && !tl_applying;
+}
+
+bool is_replication_fed(void) { return g_backlog.ring != NULL; }
+
+void feed_replication(const void *record, size_t length) {
+  if (!g_backlog.ring) {
+    return;
+  }
+
+  const uint8_t *bytes = (const uint8_t *)record;
+  uint64_t size = g_config.repl_backlog_size;
+  if (length > size) {
+    // Only the tail fits, no replica can resume before this record
+    bytes += length - size;
+    g_backlog.end += length - size;
+    length = (size_t)size;
+  }
+
+  size_t at = (size_t)(g_backlog.end % size);
+  size_t first = length < size - at ? length : (size_t)(size - at);
+  memcpy(&g_backlog.ring[at], bytes, first);
+  memcpy(g_backlog.ring, &bytes[first], length - first);
+  g_backlog.end += length;
+  if (g_backlog.end - g_backlog.start > size) {
+    g_backlog.start = g_backlog.end - size;
+  }
+}
+
+/**
+ * Copy the bytes of the backlog from offset, which must be kept
+ */
+static void read_backlog(void *dst, uint64_t offset, size_t length) {
+  uint64_t size = g_config.repl_backlog_size;
+  size_t at = (size_t)(offset % size);
+  size_t first = length < size - at ? length : (size_t)(size - at);
+  memcpy(dst, &g_backlog.ring[at], first);
+  memcpy((uint8_t *)dst + first, g_backlog.ring, length - first);
+}
+
+/**
+ * Check that the shard argument names the calling worker, which it does when
+ * the request was routed to it
+ */
+static bool is_shard_argument(const StringView *view) {
+  int64_t shard = 0;
+  return view_to_int64(view, &shard) && shard == (int64_t)current_worker_id();
+}
+
+/**
+ * Check the secret a replica presents against --repl-auth, in a time which
+ * does not depend on how much of it matches. Without --repl-auth, replicas
+ * are refused.
+ */
+static bool is_replica_secret(const StringView *view) {
+  const char *secret = g_config.repl_auth;
+  if (!secret || view->length != strlen(secret)) {
+    return false;
+  }
+  uint8_t difference = 0;
+  for (uint32_t i = 0; i < view->length; i++) {
+    difference |= (uint8_t)(view->chars[i] ^ secret[i]);
+  }
+  return difference == 0;
+}
+
+void execute_replconf(Command *command, Output *out) {
+  // REPLCONF secret
+  if (!is_replica_secret(&command->strings[1])) {
+    return out_error(out, ERROR_ARGUMENT, "Invalid replication secret");
+  }
+  out_array(out, 3);
+  out_string(out, g_replid, K_REPL_ID_LENGTH);
+  out_integer(out, (int64_t)get_hash_seed());
+  out_integer(out, (int64_t)get_worker_count());
+}
+
+static void emit_to_output(const StringView *args, uint32_t n, void *arg) {
+  out_request((Output *)arg, args, n);
+}
+
+/**
+ * Start a string reply whose bytes are appended next, see end_records
+ */
+static size_t begin_records(Output *out) {
+  size_t header = out->size;
+  out_string(out, "", 0);
+  return header;
+}
+
+static void end_records(Output *out, size_t header) {
+  uint32_t length = (uint32_t)(out->size - header - 5);
+  memcpy(&out->chars[header + 1], &length, 4);
+}
+
+void execute_replsync(Command *command, Output *out) {
+  // REPLSYNC shard cursor secret
+  int64_t cursor = 0;
+  if (!is_replica_secret(&command->strings[3])) {
+    return out_error(out, ERROR_ARGUMENT, "Invalid replication secret");
+  }
+  if (!is_shard_argument(&command->strings[1])) {
+    return out_error(out, ERROR_ARGUMENT, "Invalid shard");
+  }
+  if (!view_to_int64(&command->strings[2], &cursor) || cursor < 0) {
+    return out_error(out, ERROR_ARGUMENT, "Invalid cursor");
+  }
+
+  if (!g_backlog.ring) {
+    // Writes are kept from now on, the stream starts at the current offset
+    g_backlog.ring = (uint8_t *)malloc(g_config.repl_backlog_size);
+    if (!g_backlog.ring) {
+      return out_error(out, ERROR_OUT_OF_MEMORY, "No memory for the backlog");
+    }
+    g_backlog.start = g_backlog.end;
+  }
+
+  out_array(out, 3);
+  out_integer(out, (int64_t)g_backlog.end);
+  size_t cursor_at = out->size;
+  out_integer(out, 0);
+  size_t header = begin_records(out);
+
+  size_t next = (size_t)cursor;
+  do {
+    next = scan_shard_commands(next, K_REPL_SYNC_STEP, &emit_to_output, out);
+  } while (next != 0 && out->size - header < K_REPL_FETCH_SIZE);
+
+  int64_t value = (int64_t)next;
+  memcpy(&out->chars[cursor_at + 1], &value, 8);
+  end_records(out, header);
+}
+
+void execute_replfetch(Command *command, Output *out) {
+  // REPLFETCH shard offset secret
+  int64_t offset = 0;
+  if (!is_replica_secret(&command->strings[3])) {
+    return out_error(out, ERROR_ARGUMENT, "Invalid replication secret");
+  }
+  if (!is_shard_argument(&command->strings[1])) {
+    return out_error(out, ERROR_ARGUMENT, "Invalid shard");
+  }
+  if (!view_to_int64(&command->strings[2], &offset) || offset < 0) {
+    return out_error(out, ERROR_ARGUMENT, "Invalid offset");
+  }
+  if (!g_backlog.ring || (uint64_t)offset < g_backlog.start ||
+      (uint64_t)offset > g_backlog.end) {
+    return out_error(out, ERROR_ARGUMENT, "Offset not in the backlog");
+  }
+
+  // Whole records only, at least one
+  uint64_t stop = (uint64_t)offset;
+  while (stop < g_backlog.end) {
+    uint32_t length = 0;
+    read_backlog(&length, stop, 4);
+    if (stop > (uint64_t)offset &&
+        stop + 4 + length - (uint64_t)offset > K_REPL_FETCH_SIZE) {
+      break;
+    }
+    stop += 4 + (uint64_t)length;
+  }
+
+  size_t length = (size_t)(stop - (uint64_t)offset);
+  out_array(out, 2);
+  out_integer(out, (int64_t)stop);
+  size_t header = begin_records(out);
+  reserve_output(out, length);
+  read_backlog(&out->chars[out->size], (uint64_t)offset, length);
+  out->size += length;
+  end_records(out, header);
+}
+
+void apply_replication(void) {
+  if (!g_replica.queues) {
+    return;
+  }
+
+  SpscQueue *queue = &g_replica.queues[current_worker_id()];
+  ReplicaChunk *chunk = NULL;
+  tl_applying = true;
+  while ((chunk = (ReplicaChunk *)pop_spsc_queue(queue)) != NULL) {
+    if (chunk->drop) {
+      drop_source_keys(chunk->seed, chunk->source, chunk->nsources);
+    } else {
+      execute_requests(chunk->data, chunk->size, false, &tl_applied);
+    }
+    free(chunk);
+  }
+  tl_applying = false;
+}
+
+static void push_chunk(uint32_t worker, ReplicaChunk *chunk) {
+  // The workers apply at their own pace, wait for room when they lag
+  while (!push_spsc_queue(&g_replica.queues[worker], chunk)) {
+    wake_worker(worker);
+    usleep(K_REPL_IDLE_WAIT_US);
+  }
+  wake_worker(worker);
+}
+
+static ReplicaChunk *create_chunk(size_t size) {
+  ReplicaChunk *chunk = (ReplicaChunk *)malloc(sizeof(ReplicaChunk) + size);
+  if (!chunk) {
+    die("malloc()");
+  }
+  memset(chunk, 0, sizeof(ReplicaChunk));
+  chunk->size = size;
+  return chunk;
+}
+
+static void push_drop(uint32_t source) {
+  for (uint32_t i = 0; i < get_worker_count(); i++) {
+    ReplicaChunk *chunk = create_chunk(0);
+    chunk->drop = true;
+    chunk->source = source;
+    chunk->nsources = g_replica.nshards;
+    chunk->seed = g_replica.seed;
+    push_chunk(i, chunk);
+  }
+}
+
+/**
+ * Split records from the primary among the workers owning their keys. Batch
+ * records go to every worker, each applies its own keys.
+ */
+static void route_records(const uint8_t *data, size_t size) {
+  uint32_t nworkers = get_worker_count();
+  Command *command = &g_replica.command;
+
+  size_t position = 0;
+  while (size - position >= 4) {
+    uint32_t length = 0;
+    memcpy(&length, &data[position], 4);
+    if (length > size - position - 4) {
+      break;
+    }
+    clear_command(command);
+    if (parse_request(&data[position + 4], length, command)) {
+      break;
+    }
+
+    int32_t shard = shard_of_request(command, nworkers);
+    for (uint32_t i = 0; i < nworkers; i++) {
+      if (shard == SHARD_ALL || (uint32_t)shard == i ||
+          (shard == SHARD_LOCAL && i == 0)) {
+        out_raw(&g_replica.staging[i], &data[position], 4 + (size_t)length);
+      }
+    }
+    position += 4 + (size_t)length;
+  }
+
+  for (uint32_t i = 0; i < nworkers; i++) {
+    Output *staging = &g_replica.staging[i];
+    if (staging->size > 0) {
+      ReplicaChunk *chunk = create_chunk(staging->size);
+      memcpy(chunk->data, staging->chars, staging->size);
+      staging->size = 0;
+      push_chunk(i, chunk);
+    }
+  }
+}
+
+static int connect_to_primary(void) {
+  char port[8];
+  snprintf(port, sizeof(port), "%u", (unsigned)g_config.primary_port);
+  struct addrinfo hints = {0};
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo *addresses = NULL;
+  if (getaddrinfo(g_config.primary_host, port, &hints, &addresses)) {
+    return -1;
+  }
+
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd >= 0 && connect(fd, addresses->ai_addr, addresses->ai_addrlen)) {
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(addresses);
+  if (fd >= 0) {
+    int val = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+  }
+  return fd;
+}
+
+static void queue_call(PrimaryLink *link, const StringView *args, uint32_t n) {
+  out_request(&link->requests, args, n);
+}
+
+static int send_calls(PrimaryLink *link) {
+  int rv = write_all(link->fd, link->requests.chars, link->requests.size);
+  link->requests.size = 0;
+  return rv;
+}
+
+/**
+ * Read the next reply, which stays valid until the following one is read
+ */
+static int read_reply(PrimaryLink *link, ReplyReader *reader) {
+  uint32_t length = 0;
+  if (read_all(link->fd, &length, 4) || length > K_MAX_MSG_LIMIT) {
+    return -1;
+  }
+  if (length > link->capacity) {
+    uint8_t *reply = (uint8_t *)realloc(link->reply, length);
+    if (!reply) {
+      return -1;
+    }
+    link->reply = reply;
+    link->capacity = length;
+  }
+  if (read_all(link->fd, link->reply, length)) {
+    return -1;
+  }
+  *reader = (ReplyReader){link->reply, length, 0};
+  return 0;
+}
+
+static int call_primary(PrimaryLink *link, const StringView *args, uint32_t n,
+                        ReplyReader *reader) {
+  queue_call(link, args, n);
+  return send_calls(link) || read_reply(link, reader) ? -1 : 0;
+}
+
+/**
+ * The take_ functions read the next value of a reply, and fail on another
+ * type, an error reply included
+ */
+static bool take_tag(ReplyReader *reader, uint8_t tag, size_t length) {
+  if (reader->size - reader->position < 1 + length ||
+      reader->data[reader->position] != tag) {
+    return false;
+  }
+  reader->position++;
+  return true;
+}
+
+static bool take_array(ReplyReader *reader, uint32_t n) {
+  uint32_t count = 0;
+  if (!take_tag(reader, SERIAL_ARRAY, 4)) {
+    return false;
+  }
+  memcpy(&count, &reader->data[reader->position], 4);
+  reader->position += 4;
+  return count == n;
+}
+
+static bool take_integer(ReplyReader *reader, int64_t *value) {
+  if (!take_tag(reader, SERIAL_INTEGER, 8)) {
+    return false;
+  }
+  memcpy(value, &reader->data[reader->position], 8);
+  reader->position += 8;
+  return true;
+}
+
+static bool take_string(ReplyReader *reader, const uint8_t **chars,
+                        uint32_t *length) {
+  if (!take_tag(reader, SERIAL_STRING, 4)) {
+    return false;
+  }
+  memcpy(length, &reader->data[reader->position], 4);
+  reader->position += 4;
+  if (*length > reader->size - reader->position) {
+    return false;
+  }
+  *chars = &reader->data[reader->position];
+  reader->position += *length;
+  return true;
+}
+
+/**
+ * The secret presented to the primary, last argument of each request
+ */
+static StringView get_secret(void) {
+  return (StringView){g_config.repl_auth,
+                      (uint32_t)strlen(g_config.repl_auth)};
+}
+
+/**
+ * Replace the keys of a primary shard with its current content
+ */
+static int full_sync(PrimaryLink *link, uint32_t shard) {
+  push_drop(shard);
+
+  char shard_text[16];
+  char cursor_text[24];
+  snprintf(shard_text, sizeof(shard_text), "%u", shard);
+  int64_t cursor = 0;
+  int64_t start = -1;
+  do {
+    snprintf(cursor_text, sizeof(cursor_text), "%lld", (long long)cursor);
+    StringView args[4] = {{"replsync", 8},
+                          {shard_text, (uint32_t)strlen(shard_text)},
+                          {cursor_text, (uint32_t)strlen(cursor_text)},
+                          get_secret()};
+    ReplyReader reader;
+    int64_t offset = 0;
+    const uint8_t *records = NULL;
+    uint32_t length = 0;
+    if (call_primary(link, args, 4, &reader) || !take_array(&reader, 3) ||
+        !take_integer(&reader, &offset) || !take_integer(&reader, &cursor) ||
+        !take_string(&reader, &records, &length)) {
+      return -1;
+    }
+    if (start < 0) {
+      start = offset;
+    }
+    route_records(records, length);
+  } while (cursor != 0);
+
+  g_replica.offsets[shard] = (uint64_t)start;
+  g_replica.synced[shard] = true;
+  atomic_fetch_add(&g_replica.full_syncs, 1);
+  return 0;
+}
+
+/**
+ * Fetch from every shard in turn, one round trip for all of them, and sync
+ * again the shards whose offset left the backlog
+ */
+static int stream_from_primary(PrimaryLink *link) {
+  uint32_t nshards = g_replica.nshards;
+  char shard_texts[K_MAX_WORKERS][16];
+  char offset_texts[K_MAX_WORKERS][24];
+
+  while (true) {
+    for (uint32_t i = 0; i < nshards; i++) {
+      snprintf(shard_texts[i], sizeof(shard_texts[i]), "%u", i);
+      snprintf(offset_texts[i], sizeof(offset_texts[i]), "%llu",
+               (unsigned long long)g_replica.offsets[i]);
+      StringView args[4] = {
+          {"replfetch", 9},
+          {shard_texts[i], (uint32_t)strlen(shard_texts[i])},
+          {offset_texts[i], (uint32_t)strlen(offset_texts[i])},
+          get_secret()};
+      queue_call(link, args, 4);
+    }
+    if (send_calls(link)) {
+      return -1;
+    }
+
+    bool idle = true;
+    for (uint32_t i = 0; i < nshards; i++) {
+      ReplyReader reader;
+      int64_t next = 0;
+      const uint8_t *records = NULL;
+      uint32_t length = 0;
+      if (read_reply(link, &reader)) {
+        return -1;
+      }
+      if (!take_array(&reader, 2) || !take_integer(&reader, &next) ||
+          !take_string(&reader, &records, &length)) {
+        g_replica.synced[i] = false; // Fell behind the backlog
+        continue;
+      }
+      route_records(records, length);
+      g_replica.offsets[i] = (uint64_t)next;
+      idle = idle && length == 0;
+    }
+
+    for (uint32_t i = 0; i < nshards; i++) {
+      if (!g_replica.synced[i] && full_sync(link, i)) {
+        return -1;
+      }
+    }
+    if (idle) {
+      usleep(K_REPL_IDLE_WAIT_US);
+    }
+  }
+}
+
+/**
+ * Replicate until the link breaks
+ */
+static int replicate(PrimaryLink *link) {
+  StringView args[2] = {{"replconf", 8}, get_secret()};
+  ReplyReader reader;
+  const uint8_t *replid = NULL;
+  uint32_t length = 0;
+  int64_t seed = 0;
+  int64_t nshards = 0;
+  if (call_primary(link, args, 2, &reader)) {
+    return -1;
+  }
+  if (reader.size > 0 && reader.data[0] == SERIAL_ERROR) {
+    msg("The primary refused the replication secret");
+    return -1;
+  }
+  if (!take_array(&reader, 3) || !take_string(&reader, &replid, &length) ||
+      length != K_REPL_ID_LENGTH || !take_integer(&reader, &seed) ||
+      !take_integer(&reader, &nshards) || nshards < 1 ||
+      nshards > K_MAX_WORKERS) {
+    return -1;
+  }
+
+  if (memcmp(replid, g_replica.replid, K_REPL_ID_LENGTH) != 0 ||
+      (uint64_t)seed != g_replica.seed ||
+      (uint32_t)nshards != g_replica.nshards) {
+    // Another primary, or the same one restarted: every shard starts over
+    memcpy(g_replica.replid, replid, K_REPL_ID_LENGTH);
+    g_replica.seed = (uint64_t)seed;
+    g_replica.nshards = (uint32_t)nshards;
+    memset(g_replica.synced, 0, sizeof(g_replica.synced));
+  } else {
+    atomic_fetch_add(&g_replica.partial_syncs, 1);
+  }
+  atomic_store(&g_replica.link_up, true);
+
+  for (uint32_t i = 0; i < g_replica.nshards; i++) {
+    if (!g_replica.synced[i] && full_sync(link, i)) {
+      return -1;
+    }
+  }
+  return stream_from_primary(link);
+}
+
+static void *run_replica(void *arg) {
+  (void)arg;
+  PrimaryLink link = {.fd = -1, .reply = NULL, .capacity = 0};
+  initialize_output(&link.requests);
+  initialize_command(&g_replica.command);
+
+  bool warned = false;
+  while (true) {
+    link.fd = connect_to_primary();
+    if (link.fd >= 0) {
+      warned = false;
+      replicate(&link);
+      close(link.fd);
+      link.requests.size = 0;
+      atomic_store(&g_replica.link_up, false);
+      msg("Lost the link to the primary, reconnecting");
+    } else if (!warned) {
+      msg("Cannot reach the primary, retrying");
+      warned = true;
+    }
+    sleep(K_REPL_RETRY_SECONDS);
+  }
+  return NULL;
+}
+
+static void initialize_replication_once(void) {
+  pick_replication_id();
+  if (!g_config.primary_host) {
+    return;
+  }
+
+  uint32_t n = get_worker_count();
+  g_replica.queues = (SpscQueue *)calloc(n, sizeof(SpscQueue));
+  for (uint32_t i = 0; i < n; i++) {
+    initialize_spsc_queue(&g_replica.queues[i], K_REPL_QUEUE_SIZE);
+    initialize_output(&g_replica.staging[i]);
+  }
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, run_replica, NULL)) {
+    die("pthread_create()");
+  }
+  pthread_detach(thread);
+}
+
+void start_replication(void) {
+  pthread_once(&g_replication_once, initialize_replication_once);
+}
+
+void out_replication_info(Output *out, uint32_t *count) {
+  bool replica = g_config.primary_host != NULL;
+  out_line(out, count, "role:%s", replica ? "replica" : "primary");
+  out_line(out, count, "repl_id:%s", g_replid);
+  out_line(out, count, "repl_backlog_active:%d", g_backlog.ring ? 1 : 0);
+  out_line(out, count, "repl_backlog_size:%llu",
+           (unsigned long long)g_config.repl_backlog_size);
+  out_line(out, count, "repl_backlog_first_offset:%llu",
+           (unsigned long long)g_backlog.start);
+  out_line(out, count, "repl_offset:%llu", (unsigned long long)g_backlog.end);
+  if (!replica) {
+    return;
+  }
+
+  out_line(out, count, "primary_host:%s:%u", g_config.primary_host,
+           (unsigned)g_config.primary_port);
+  out_line(out, count, "primary_link_status:%s",
+           atomic_load(&g_replica.link_up) ? "up" : "down");
+  out_line(out, count, "full_syncs:%llu",
+           (unsigned long long)atomic_load(&g_replica.full_syncs));
+  out_line(out, count, "partial_syncs:%llu",
+           (unsigned long long)atomic_load(&g_replica.partial_syncs));
+  out_line(out, count, "repl_applied:%llu", (unsigned long long)tl_applied);
+}
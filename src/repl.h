@@ -0,0 +1,88 @@
+#ifndef REPL_H
+#define REPL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "command.h"
+#include "encoding.h"
+
+#define K_REPL_ID_LENGTH 40           // Hex digits of a replication id
+#define K_REPL_SYNC_STEP 64           // Buckets scanned at a time by REPLSYNC
+#define K_REPL_FETCH_SIZE (256 << 10) // Bytes of records per reply, about
+#define K_REPL_QUEUE_SIZE 256         // Chunks in flight to each worker
+#define K_REPL_IDLE_WAIT_US 1000      // Pause of a caught up replica
+#define K_REPL_RETRY_SECONDS 1        // Between attempts to reach the primary
+
+/**
+ * Replication is pulled by the replica, shard by shard, over one connection
+ * and through the command table:
+ *
+ *   REPLCONF secret                -> [replication id, hash seed, shards]
+ *   REPLSYNC shard cursor secret   -> [offset, next cursor, records]
+ *   REPLFETCH shard offset secret  -> [next offset, records]
+ *
+ * The secret is the --repl-auth of both sides. Without it the primary refuses
+ * the commands, which reveal the hash seed and make every shard keep a
+ * backlog.
+ *
+ * The records are the effects the shard logs to its append-only log, framed
+ * by out_request(). Each shard keeps the last ones in a ring, its backlog,
+ * from the first REPLSYNC on; offsets count the bytes fed to it since. A full
+ * sync pages through the shard with a scan cursor and then fetches from the
+ * offset of its first page, so writes made during the scan are applied after
+ * it. A replica which reconnects to the same primary resumes from its offsets
+ * as long as the backlog still holds them, and syncs the shard again
+ * otherwise. The replication id changes with each start of the primary.
+ *
+ * On the replica, a thread runs the connection and routes the records it
+ * receives to the workers owning their keys, which apply them between
+ * requests. Clients can only read.
+ */
+
+/**
+ * @brief Pick the replication id, and on a replica start the thread pulling
+ * from the primary. Called by each worker before it starts serving, once its
+ * shard is loaded; only the first call does anything.
+ */
+void start_replication(void);
+
+/**
+ * @brief Whether a write request must be refused: the process is a replica,
+ * and the request does not come from its primary.
+ */
+bool is_read_only(void);
+
+/**
+ * @brief Whether the writes of the calling worker's shard are kept for
+ * replicas, which is the case once one synced from it.
+ */
+bool is_replication_fed(void);
+
+/**
+ * @brief Keep a write of the calling worker's shard, a record framed by
+ * out_request(), in its backlog.
+ */
+void feed_replication(const void *record, size_t length);
+
+/**
+ * @brief Apply the records the replica thread routed to the calling worker.
+ * Called when the worker is woken up.
+ */
+void apply_replication(void);
+
+void execute_replconf(Command *command, Output *out);
+
+void execute_replsync(Command *command, Output *out);
+
+void execute_replfetch(Command *command, Output *out);
+
+/**
+ * @brief Report the role, the replication id and the backlog of the calling
+ * worker's shard as "name:value" lines, with the state of the link to the
+ * primary on a replica.
+ */
+void out_replication_info(Output *out, uint32_t *count);
+
+#endif /* REPL_H */
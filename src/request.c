@@ -2,10 +2,16 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "aof.h"
+#include "arena.h"
 #include "command.h"
 #include "common.h"
+#include "histogram.h"
+#include "object.h"
+#include "repl.h"
 #include "request.h"
 #include "store.h"
+#include "worker.h"
 
 int32_t parse_request(const uint8_t *data, size_t length, Command *command) {
   if (length < 4) {
@@ -33,7 +39,8 @@ int32_t parse_request(const uint8_t *data, size_t length, Command *command) {
     if (position + 4 + size > length) {
       return -1;
     }
-    add_to_command(command, (char *)&data[position + 4], size);
+    // The argument stays in the request buffer, nothing is copied
+    add_to_command(command, (const char *)&data[position + 4], size);
     position += 4 + size;
   }
 
@@ -43,17 +50,366 @@ int32_t parse_request(const uint8_t *data, size_t length, Command *command) {
   return 0;
 }
 
+void out_request(Output *out, const StringView *args, uint32_t n) {
+  uint32_t length = 4;
+  for (uint32_t i = 0; i < n; i++) {
+    length += 4 + args[i].length;
+  }
+  reserve_output(out, 4 + (size_t)length);
+  out_raw(out, &length, 4);
+  out_raw(out, &n, 4);
+  for (uint32_t i = 0; i < n; i++) {
+    out_raw(out, &args[i].length, 4);
+    out_raw(out, args[i].chars, args[i].length);
+  }
+}
+
+size_t execute_requests(const uint8_t *data, size_t size, bool filter,
+                        uint64_t *count) {
+  Command command;
+  initialize_command(&command);
+  Output out;
+  initialize_output(&out);
+
+  size_t position = 0;
+  while (size - position >= 4) {
+    uint32_t length = 0;
+    memcpy(&length, &data[position], 4);
+    if (length > size - position - 4) {
+      break;
+    }
+
+    clear_command(&command);
+    if (parse_request(&data[position + 4], length, &command)) {
+      break;
+    }
+    int32_t shard = filter ? shard_of_request(&command, get_worker_count())
+                           : SHARD_LOCAL;
+    if (shard < 0 || (uint32_t)shard == current_worker_id()) {
+      execute_request(&command, &out);
+      out.size = 0;
+      reset_arena(request_arena());
+      (*count)++;
+    }
+    position += 4 + (size_t)length;
+  }
+
+  free_output(&out);
+  free_command(&command);
+  return position;
+}
+
+/**
+ * How a command's keys map to shards
+ */
+typedef enum {
+  ROUTE_NONE,   // Touches no key, runs on the receiving worker
+  ROUTE_KEY,    // The key is the first argument
+  ROUTE_BATCH,  // Keys spanning several shards run on all of them
+  ROUTE_ATOMIC, // A batch whose keys must all be on one shard
+  ROUTE_CURSOR, // The first argument is a scan cursor naming the shard
+  ROUTE_SHARD,  // The first argument is the index of the shard
+  ROUTE_ALL,    // Runs on every shard
+} RouteKind;
+
+/**
+ * How the replies of the shards to a command run on all of them are gathered
+ */
+typedef enum {
+  MERGE_CONCAT,   // Concatenate the arrays
+  MERGE_ELEMENTS, // Take each element from the shard owning its key
+  MERGE_SUM,      // Add up the integers
+} MergeKind;
+
+#define CMD_WRITE 1 // Changes the keyspace: logged, refused by a replica
+
+typedef struct {
+  const char *name;
+  int min_args; // Counting the name
+  int max_args; // -1 for no limit
+  int arg_step; // Arguments past min_args come in groups of arg_step
+  RouteKind route;
+  int key_step; // ROUTE_BATCH and ROUTE_ATOMIC: a key every key_step args
+  MergeKind merge;
+  uint32_t flags;
+  void (*handler)(Command *command, Output *out);
+} CommandSpec;
+
+/**
+ * Counters of one command on one shard
+ */
+typedef struct {
+  uint64_t calls;
+  uint64_t failed;   // Run, but replied with an error
+  uint64_t rejected; // Not run: wrong number of arguments, or read-only
+  uint64_t total_ns;
+  Histogram *latency; // Allocated on the first call
+} CommandStats;
+
+static void execute_expire_seconds(Command *command, Output *out) {
+  execute_expire(command, out, 1000);
+}
+
+static void execute_expire_ms(Command *command, Output *out) {
+  execute_expire(command, out, 1);
+}
+
+static void execute_incr_one(Command *command, Output *out) {
+  execute_incr(command, out, 1);
+}
+
+static void execute_decr_one(Command *command, Output *out) {
+  execute_incr(command, out, -1);
+}
+
+static void execute_ttl_seconds(Command *command, Output *out) {
+  execute_ttl(command, out, 1000);
+}
+
+static void execute_ttl_ms(Command *command, Output *out) {
+  execute_ttl(command, out, 1);
+}
+
+static const CommandSpec K_COMMANDS[] = {
+    {"keys", 1, 1, 1, ROUTE_ALL, 0, MERGE_CONCAT, 0, execute_keys},
+    {"get", 2, 2, 1, ROUTE_KEY, 0, MERGE_CONCAT, 0, execute_get},
+    {"set", 3, 5, 2, ROUTE_KEY, 0, MERGE_CONCAT, CMD_WRITE, execute_set},
+    {"delete", 2, 2, 1, ROUTE_KEY, 0, MERGE_CONCAT, CMD_WRITE, execute_delete},
+    {"incr", 2, 2, 1, ROUTE_KEY, 0, MERGE_CONCAT, CMD_WRITE, execute_incr_one},
+    {"decr", 2, 2, 1, ROUTE_KEY, 0, MERGE_CONCAT, CMD_WRITE, execute_decr_one},
+    {"incrby", 3, 3, 1, ROUTE_KEY, 0, MERGE_CONCAT, CMD_WRITE, execute_incrby},
+    {"incrbyfloat", 3, 3, 1, ROUTE_KEY, 0, MERGE_CONCAT, CMD_WRITE,
+     execute_incrbyfloat},
+    {"expire", 3, 3, 1, ROUTE_KEY, 0, MERGE_CONCAT, CMD_WRITE,
+     execute_expire_seconds},
+    {"pexpire", 3, 3, 1, ROUTE_KEY, 0, MERGE_CONCAT, CMD_WRITE,
+     execute_expire_ms},
+    {"ttl", 2, 2, 1, ROUTE_KEY, 0, MERGE_CONCAT, 0, execute_ttl_seconds},
+    {"pttl", 2, 2, 1, ROUTE_KEY, 0, MERGE_CONCAT, 0, execute_ttl_ms},
+    {"pexpireat", 3, 3, 1, ROUTE_KEY, 0, MERGE_CONCAT, CMD_WRITE,
+     execute_pexpireat},
+    {"persist", 2, 2, 1, ROUTE_KEY, 0, MERGE_CONCAT, CMD_WRITE,
+     execute_persist},
+    {"zadd", 4, -1, 2, ROUTE_KEY, 0, MERGE_CONCAT, CMD_WRITE, execute_zadd},
+    {"zrem", 3, -1, 1, ROUTE_KEY, 0, MERGE_CONCAT, CMD_WRITE, execute_zrem},
+    {"zscore", 3, 3, 1, ROUTE_KEY, 0, MERGE_CONCAT, 0, execute_zscore},
+    {"zrank", 3, 3, 1, ROUTE_KEY, 0, MERGE_CONCAT, 0, execute_zrank},
+    {"zrange", 4, 5, 1, ROUTE_KEY, 0, MERGE_CONCAT, 0, execute_zrange},
+    {"zrangebyscore", 4, -1, 1, ROUTE_KEY, 0, MERGE_CONCAT, 0,
+     execute_zrangebyscore},
+    {"zcount", 4, 4, 1, ROUTE_KEY, 0, MERGE_CONCAT, 0, execute_zcount},
+    {"hset", 4, -1, 2, ROUTE_KEY, 0, MERGE_CONCAT, CMD_WRITE, execute_hset},
+    {"hget", 3, 3, 1, ROUTE_KEY, 0, MERGE_CONCAT, 0, execute_hget},
+    {"hmget", 3, -1, 1, ROUTE_KEY, 0, MERGE_CONCAT, 0, execute_hmget},
+    {"hgetall", 2, 2, 1, ROUTE_KEY, 0, MERGE_CONCAT, 0, execute_hgetall},
+    {"hdel", 3, -1, 1, ROUTE_KEY, 0, MERGE_CONCAT, CMD_WRITE, execute_hdel},
+    {"hincrby", 4, 4, 1, ROUTE_KEY, 0, MERGE_CONCAT, CMD_WRITE,
+     execute_hincrby},
+    {"info", 1, 2, 1, ROUTE_ALL, 0, MERGE_CONCAT, 0, execute_info},
+    {"scan", 2, -1, 1, ROUTE_CURSOR, 0, MERGE_CONCAT, 0, execute_scan},
+    {"mget", 2, -1, 1, ROUTE_BATCH, 1, MERGE_ELEMENTS, 0, execute_mget},
+    {"mset", 3, -1, 2, ROUTE_BATCH, 2, MERGE_SUM, CMD_WRITE, execute_mset},
+    {"msetnx", 3, -1, 2, ROUTE_ATOMIC, 2, MERGE_CONCAT, CMD_WRITE,
+     execute_msetnx},
+    {"mdel", 2, -1, 1, ROUTE_BATCH, 1, MERGE_SUM, CMD_WRITE, execute_mdel},
+    {"save", 1, 1, 1, ROUTE_ALL, 0, MERGE_SUM, 0, execute_save},
+    {"bgsave", 1, 1, 1, ROUTE_ALL, 0, MERGE_SUM, 0, execute_bgsave},
+    {"bgrewriteaof", 1, 1, 1, ROUTE_ALL, 0, MERGE_SUM, 0,
+     execute_bgrewriteaof},
+    {"replconf", 2, 2, 1, ROUTE_NONE, 0, MERGE_CONCAT, 0, execute_replconf},
+    {"replsync", 4, 4, 1, ROUTE_SHARD, 0, MERGE_CONCAT, 0, execute_replsync},
+    {"replfetch", 4, 4, 1, ROUTE_SHARD, 0, MERGE_CONCAT, 0,
+     execute_replfetch},
+};
+
+#define K_COMMAND_COUNT (sizeof(K_COMMANDS) / sizeof(K_COMMANDS[0]))
+
+_Static_assert(K_COMMAND_COUNT * 2 <= K_COMMAND_INDEX_SIZE,
+               "the command index must stay at most half full");
+
+// Open-addressing index of the table by name hash, position + 1 or 0 if free.
+// Built once before the workers start, then only read.
+static uint8_t g_command_index[K_COMMAND_INDEX_SIZE];
+static uint32_t g_command_lengths[K_COMMAND_COUNT];
+
+static __thread CommandStats g_stats[K_COMMAND_COUNT];
+static __thread uint64_t g_unknown_calls;
+
+void initialize_commands(void) {
+  for (uint32_t i = 0; i < K_COMMAND_COUNT; i++) {
+    const char *name = K_COMMANDS[i].name;
+    g_command_lengths[i] = (uint32_t)strlen(name);
+
+    size_t position = hash_string(name, g_command_lengths[i]);
+    while (g_command_index[position & (K_COMMAND_INDEX_SIZE - 1)]) {
+      position++;
+    }
+    g_command_index[position & (K_COMMAND_INDEX_SIZE - 1)] = (uint8_t)(i + 1);
+  }
+}
+
+static const CommandSpec *lookup_command(Command *command) {
+  if (command->count < 1) {
+    return NULL;
+  }
+
+  const StringView *name = &command->strings[0];
+  size_t position = hash_string(name->chars, name->length);
+  for (;; position++) {
+    uint8_t slot = g_command_index[position & (K_COMMAND_INDEX_SIZE - 1)];
+    if (!slot) {
+      return NULL;
+    }
+    if (g_command_lengths[slot - 1] == name->length &&
+        memcmp(K_COMMANDS[slot - 1].name, name->chars, name->length) == 0) {
+      return &K_COMMANDS[slot - 1];
+    }
+  }
+}
+
+static bool is_arity_valid(const CommandSpec *spec, int count) {
+  return count >= spec->min_args &&
+         (spec->max_args < 0 || count <= spec->max_args) &&
+         (count - spec->min_args) % spec->arg_step == 0;
+}
+
 void execute_request(Command *command, Output *out) {
-  if (command->count == 1 && is_command_type(command, "keys")) {
-    execute_keys(command, out);
-  } else if (command->count == 2 && is_command_type(command, "get")) {
-    execute_get(command, out);
-  } else if (command->count == 3 && is_command_type(command, "set")) {
-    execute_set(command, out);
-  } else if (command->count == 2 && is_command_type(command, "delete")) {
-    execute_delete(command, out);
-  } else {
-    // Command not recognized
-    out_error(out, ERROR_UNKNOWN, "Unknown Command");
+  const CommandSpec *spec = lookup_command(command);
+  if (!spec) {
+    g_unknown_calls++;
+    return out_error(out, ERROR_UNKNOWN, "Unknown Command");
+  }
+
+  CommandStats *stats = &g_stats[spec - K_COMMANDS];
+  if (!is_arity_valid(spec, command->count)) {
+    stats->rejected++;
+    return out_error(out, ERROR_ARGUMENT, "Wrong number of arguments");
+  }
+  if ((spec->flags & CMD_WRITE) && is_read_only()) {
+    stats->rejected++;
+    return out_error(out, ERROR_READONLY, "Writes go to the primary");
+  }
+
+  size_t start = out->size;
+  uint64_t begin = get_monotonic_ns();
+  spec->handler(command, out);
+  uint64_t elapsed = get_monotonic_ns() - begin;
+
+  if (!stats->latency) {
+    stats->latency = (Histogram *)malloc(sizeof(Histogram));
+    initialize_histogram(stats->latency);
+  }
+  histogram_record(stats->latency, elapsed);
+  stats->calls++;
+  stats->total_ns += elapsed;
+  if (out->chars[start] == SERIAL_ERROR) {
+    stats->failed++;
+  }
+  if (spec->flags & CMD_WRITE) {
+    commit_aof();
+  }
+}
+
+void out_command_stats(Output *out, uint32_t *count) {
+  for (uint32_t i = 0; i < K_COMMAND_COUNT; i++) {
+    CommandStats *stats = &g_stats[i];
+    if (stats->calls == 0 && stats->rejected == 0) {
+      continue;
+    }
+
+    // Latencies in microseconds
+    double usec = (double)stats->total_ns / 1e3;
+    const Histogram *latency = stats->latency;
+    out_line(out, count,
+             "cmdstat_%s:calls=%llu,usec=%.0f,usec_per_call=%.3f,"
+             "rejected_calls=%llu,failed_calls=%llu,p50=%.3f,p99=%.3f,"
+             "p999=%.3f",
+             K_COMMANDS[i].name, (unsigned long long)stats->calls, usec,
+             stats->calls ? usec / (double)stats->calls : 0.0,
+             (unsigned long long)stats->rejected,
+             (unsigned long long)stats->failed,
+             latency ? (double)histogram_percentile(latency, 50.0) / 1e3 : 0.0,
+             latency ? (double)histogram_percentile(latency, 99.0) / 1e3 : 0.0,
+             latency ? (double)histogram_percentile(latency, 99.9) / 1e3
+                     : 0.0);
+  }
+  out_line(out, count, "unknown_calls:%llu",
+           (unsigned long long)g_unknown_calls);
+}
+
+/**
+ * Shard owning every key of a batch, the keys being every stride-th argument
+ * from the first one, or SHARD_ALL if they span several shards
+ */
+static int32_t shard_of_keys(Command *command, int stride, uint32_t nshards) {
+  int32_t shard = SHARD_LOCAL;
+  for (int i = 1; i < command->count; i += stride) {
+    const StringView *key = &command->strings[i];
+    int32_t owner =
+        (int32_t)shard_of_hash(hash_string(key->chars, key->length), nshards);
+    if (shard != SHARD_LOCAL && owner != shard) {
+      return SHARD_ALL;
+    }
+    shard = owner;
+  }
+  return shard;
+}
+
+int32_t shard_of_request(Command *command, uint32_t nshards) {
+  const CommandSpec *spec = lookup_command(command);
+  if (!spec || !is_arity_valid(spec, command->count)) {
+    return SHARD_LOCAL; // The error is replied right away
+  }
+
+  const StringView *key = &command->strings[1];
+  int32_t shard = SHARD_LOCAL;
+  switch (spec->route) {
+  case ROUTE_NONE:
+    return SHARD_LOCAL;
+  case ROUTE_KEY:
+    return (int32_t)shard_of_hash(hash_string(key->chars, key->length),
+                                  nshards);
+  case ROUTE_BATCH:
+    return shard_of_keys(command, spec->key_step, nshards);
+  case ROUTE_ATOMIC:
+    // All or nothing can only be decided by one shard, which rejects keys
+    // it does not own
+    shard = shard_of_keys(command, spec->key_step, nshards);
+    return shard == SHARD_ALL ? SHARD_LOCAL : shard;
+  case ROUTE_CURSOR: {
+    // Shards are scanned in turn, the cursor tells which one
+    int64_t cursor = 0;
+    if (!view_to_int64(key, &cursor) || cursor < 0) {
+      return SHARD_LOCAL;
+    }
+    return (int32_t)(((uint64_t)cursor >> K_SCAN_SHARD_SHIFT) % nshards);
+  }
+  case ROUTE_SHARD: {
+    // Out of range, the handler replies with the error
+    int64_t index = 0;
+    if (!view_to_int64(key, &index) || index < 0 ||
+        index >= (int64_t)nshards) {
+      return SHARD_LOCAL;
+    }
+    return (int32_t)index;
+  }
+  case ROUTE_ALL:
+    return SHARD_ALL;
+  }
+  return SHARD_LOCAL;
+}
+
+void merge_request_output(Command *command, Output *dst, const Output *src) {
+  const CommandSpec *spec = lookup_command(command);
+  switch (spec ? spec->merge : MERGE_CONCAT) {
+  case MERGE_CONCAT:
+    merge_array_output(dst, src);
+    break;
+  case MERGE_ELEMENTS:
+    merge_element_output(dst, src);
+    break;
+  case MERGE_SUM:
+    merge_integer_output(dst, src);
+    break;
   }
 }
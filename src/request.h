@@ -4,18 +4,91 @@
 #include "command.h"
 #include "encoding.h"
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 
 #define K_MAX_ARGS 1024
+#define K_COMMAND_INDEX_SIZE 128 // Slots of the command name index
 
 typedef enum {
   ERROR_TOO_BIG,
   ERROR_UNKNOWN,
+  ERROR_ARGUMENT,
+  ERROR_OUT_OF_MEMORY,
+  ERROR_WRONG_TYPE,
+  ERROR_IO,
+  ERROR_READONLY,
 } ErrorType;
 
+#define SHARD_LOCAL -1 // Run on the receiving worker
+#define SHARD_ALL -2   // Run on every worker and merge the replies
+
+/**
+ * @brief Shard owning a key. The high bits of the hash are used, the low bits
+ * pick the bucket inside the shard.
+ */
+static inline uint32_t shard_of_hash(uint64_t hash, uint32_t nshards) {
+  return (uint32_t)((hash >> 32) % nshards);
+}
+
 int32_t parse_request(const uint8_t *data, size_t length, Command *command);
 
+/**
+ * @brief Append a request framed as on the wire: a uint32 length, then the
+ * argument count and the length-prefixed arguments. The append-only log and
+ * the replication stream are runs of such records.
+ */
+void out_request(Output *out, const StringView *args, uint32_t n);
+
+/**
+ * @brief Execute a run of framed requests, dropping the replies. With filter,
+ * only the requests routed to the calling worker run; batch requests run on
+ * every worker, which skips the keys it does not own.
+ *
+ * @param count Incremented for each request run
+ *
+ * @return size_t Length of the prefix made of whole requests, less than size
+ * if the last one is cut short or malformed
+ */
+size_t execute_requests(const uint8_t *data, size_t size, bool filter,
+                        uint64_t *count);
+
+/**
+ * @brief Index the command table by name. Called once, after the hash seed is
+ * set and before the workers start.
+ */
+void initialize_commands(void);
+
+/**
+ * @brief Look the command up in the command table, check its number of
+ * arguments and run it. Each call is counted and timed in the statistics of
+ * the calling worker.
+ */
 void execute_request(Command *command, Output *out);
 
+/**
+ * @brief Report the calls, errors and latency percentiles of each command run
+ * by the calling worker, as "cmdstat_<name>:..." lines.
+ */
+void out_command_stats(Output *out, uint32_t *count);
+
+/**
+ * @brief Pick the worker owning the keyspace shard a command touches.
+ *
+ * @param command Parsed command
+ * @param nshards Number of shards (workers)
+ *
+ * @return int32_t index of the owning shard, SHARD_ALL for commands spanning
+ * the whole keyspace, or SHARD_LOCAL for commands touching no key
+ */
+int32_t shard_of_request(Command *command, uint32_t nshards);
+
+/**
+ * @brief Gather the reply of one shard to a SHARD_ALL command into the reply
+ * built so far, as the command table says: arrays are concatenated, except
+ * for batch commands whose replies are merged per key or added up.
+ */
+void merge_request_output(Command *command, Output *dst, const Output *src);
+
 #endif /* REQUEST_H */
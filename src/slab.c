@@ -0,0 +1,183 @@
+#include <stdbool.h>
+#include <string.h>
+
+#include "common.h"
+#include "slab.h"
+
+#define K_SLAB_HEADER_SIZE 64 // Slots start after the page header
+
+/**
+ * Header at the start of every page. The page of an object is found by
+ * masking its address, so freeing needs no lookup.
+ */
+typedef struct SlabPage {
+  struct SlabPage *prev; // Pages of the class with free slots
+  struct SlabPage *next;
+  void *free;        // Freed slots, linked through their first bytes
+  uint32_t used;     // Live slots
+  uint32_t bump;     // Slots never handed out start here
+  uint32_t capacity; // Slots in the page
+  uint32_t size_class;
+} SlabPage;
+
+typedef struct {
+  SlabPage *partial; // Pages with at least one free slot
+  SlabClassStats stats;
+} SlabClass;
+
+// Each worker thread owns the objects of its shard, no locking needed
+static __thread struct {
+  SlabClass classes[K_SLAB_CLASSES];
+  uint64_t large_count;
+  uint64_t large_bytes;
+} t_slab;
+
+static uint32_t size_class_of(size_t size) {
+  if (size <= 128) {
+    return size ? (uint32_t)(size - 1) / 16 : 0;
+  }
+
+  // 4 classes between consecutive powers of 2 above 128
+  uint32_t bit = 63 - (uint32_t)__builtin_clzll((uint64_t)(size - 1));
+  uint32_t step = (uint32_t)((size - 1 - ((size_t)1 << bit)) >> (bit - 2));
+  return 8 + (bit - 7) * 4 + step;
+}
+
+static uint32_t slot_size_of(uint32_t size_class) {
+  if (size_class < 8) {
+    return (size_class + 1) * 16;
+  }
+  uint32_t bit = 7 + (size_class - 8) / 4;
+  uint32_t step = (size_class - 8) % 4;
+  return (1u << bit) + (step + 1) * (1u << (bit - 2));
+}
+
+static void link_page(SlabClass *slab_class, SlabPage *page) {
+  page->prev = NULL;
+  page->next = slab_class->partial;
+  if (page->next) {
+    page->next->prev = page;
+  }
+  slab_class->partial = page;
+}
+
+static void unlink_page(SlabClass *slab_class, SlabPage *page) {
+  if (page->prev) {
+    page->prev->next = page->next;
+  } else {
+    slab_class->partial = page->next;
+  }
+  if (page->next) {
+    page->next->prev = page->prev;
+  }
+  page->prev = page->next = NULL;
+}
+
+static SlabPage *create_page(uint32_t size_class) {
+  SlabPage *page =
+      (SlabPage *)aligned_alloc(K_SLAB_PAGE_SIZE, K_SLAB_PAGE_SIZE);
+  if (!page) {
+    die("aligned_alloc()");
+  }
+
+  uint32_t slot_size = slot_size_of(size_class);
+  page->prev = page->next = NULL;
+  page->free = NULL;
+  page->used = 0;
+  page->bump = 0;
+  page->capacity = (K_SLAB_PAGE_SIZE - K_SLAB_HEADER_SIZE) / slot_size;
+  page->size_class = size_class;
+
+  SlabClassStats *stats = &t_slab.classes[size_class].stats;
+  stats->pages++;
+  stats->slots_capacity += page->capacity;
+  return page;
+}
+
+static void destroy_page(SlabPage *page) {
+  SlabClassStats *stats = &t_slab.classes[page->size_class].stats;
+  stats->pages--;
+  stats->slots_capacity -= page->capacity;
+  free(page);
+}
+
+void *slab_alloc(size_t size) {
+  if (size > K_SLAB_MAX_SIZE) {
+    void *ptr = malloc(size);
+    if (!ptr) {
+      die("malloc()");
+    }
+    t_slab.large_count++;
+    t_slab.large_bytes += size;
+    return ptr;
+  }
+
+  uint32_t size_class = size_class_of(size);
+  SlabClass *slab_class = &t_slab.classes[size_class];
+  SlabPage *page = slab_class->partial;
+  if (!page) {
+    page = create_page(size_class);
+    link_page(slab_class, page);
+  }
+
+  void *slot = page->free;
+  if (slot) {
+    memcpy(&page->free, slot, sizeof(void *));
+  } else {
+    // Fresh slots are handed out in order, pages are not touched up front
+    slot = (char *)page + K_SLAB_HEADER_SIZE +
+           (size_t)page->bump * slot_size_of(size_class);
+    page->bump++;
+  }
+
+  page->used++;
+  if (page->used == page->capacity) {
+    unlink_page(slab_class, page);
+  }
+
+  slab_class->stats.slots_used++;
+  slab_class->stats.requested += size;
+  return slot;
+}
+
+void slab_free(void *ptr, size_t size) {
+  if (!ptr) {
+    return;
+  }
+
+  if (size > K_SLAB_MAX_SIZE) {
+    t_slab.large_count--;
+    t_slab.large_bytes -= size;
+    free(ptr);
+    return;
+  }
+
+  SlabPage *page =
+      (SlabPage *)((uintptr_t)ptr & ~((uintptr_t)K_SLAB_PAGE_SIZE - 1));
+  SlabClass *slab_class = &t_slab.classes[page->size_class];
+  slab_class->stats.slots_used--;
+  slab_class->stats.requested -= size;
+
+  bool was_full = page->used == page->capacity;
+  memcpy(ptr, &page->free, sizeof(void *));
+  page->free = ptr;
+  page->used--;
+
+  if (was_full) {
+    link_page(slab_class, page);
+  }
+  if (page->used == 0 && (page->prev || page->next)) {
+    // Keep one page per class to avoid thrashing at the boundary
+    unlink_page(slab_class, page);
+    destroy_page(page);
+  }
+}
+
+void get_slab_stats(SlabStats *stats) {
+  for (uint32_t i = 0; i < K_SLAB_CLASSES; i++) {
+    stats->classes[i] = t_slab.classes[i].stats;
+    stats->classes[i].slot_size = slot_size_of(i);
+  }
+  stats->large_count = t_slab.large_count;
+  stats->large_bytes = t_slab.large_bytes;
+}
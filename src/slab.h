@@ -0,0 +1,54 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#define K_SLAB_PAGE_SIZE (64 * 1024) // Pages are aligned to their size
+#define K_SLAB_MAX_SIZE 4096         // Larger objects are malloc'd
+#define K_SLAB_CLASSES 28
+
+/**
+ * Usage of one size class of the calling thread's slab
+ */
+typedef struct {
+  uint32_t slot_size;
+  uint64_t pages;          // Pages owned by the class
+  uint64_t slots_used;     // Live objects
+  uint64_t slots_capacity; // Slots in all the pages of the class
+  uint64_t requested;      // Bytes requested by the live objects
+} SlabClassStats;
+
+typedef struct {
+  SlabClassStats classes[K_SLAB_CLASSES];
+  uint64_t large_count; // Objects above K_SLAB_MAX_SIZE
+  uint64_t large_bytes;
+} SlabStats;
+
+/**
+ * @brief Allocate an object for the store. Sizes up to K_SLAB_MAX_SIZE are
+ * rounded up to one of K_SLAB_CLASSES size classes (16-byte steps up to 128,
+ * then 4 steps per power of 2) and carved out of 64 KB pages owned by the
+ * calling thread. Objects must be freed by the thread which allocated them.
+ *
+ * @param size Number of bytes, must be non-zero
+ *
+ * @return void* the object, 16-byte aligned
+ */
+void *slab_alloc(size_t size);
+
+/**
+ * @brief Free an object from slab_alloc(). A page left empty is given back to
+ * the system, unless it is the last page of its class with room.
+ *
+ * @param ptr The object, may be NULL
+ * @param size The size passed to slab_alloc()
+ */
+void slab_free(void *ptr, size_t size);
+
+/**
+ * @brief Read the allocator statistics of the calling thread.
+ */
+void get_slab_stats(SlabStats *stats);
+
+#endif /* SLAB_H */
@@ -0,0 +1,174 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "snapshot.h"
+
+static const uint64_t K_CHECKSUM_SEED = 0x9e3779b97f4a7c15ull;
+static const uint64_t K_CHECKSUM_PRIME = 0xff51afd7ed558ccdull;
+
+/**
+ * Fold bytes in 8 at a time, a multiply per word. Chunks must be multiples of
+ * 8 bytes but the last, so the result does not depend on how data is split.
+ */
+static uint64_t update_checksum(uint64_t checksum, const uint8_t *data,
+                                size_t length) {
+  while (length >= 8) {
+    uint64_t word = 0;
+    memcpy(&word, data, 8);
+    checksum = (checksum ^ word) * K_CHECKSUM_PRIME;
+    checksum ^= checksum >> 32;
+    data += 8;
+    length -= 8;
+  }
+  while (length--) {
+    checksum = (checksum ^ *data++) * K_CHECKSUM_PRIME;
+  }
+  return checksum;
+}
+
+static void flush_snapshot_writer(SnapshotWriter *writer) {
+  writer->checksum =
+      update_checksum(writer->checksum, writer->buffer, writer->used);
+  if (!writer->failed && write_all(writer->fd, writer->buffer, writer->used)) {
+    writer->failed = true;
+  }
+  writer->used = 0;
+}
+
+int open_snapshot_writer(SnapshotWriter *writer, const char *path,
+                         const SnapshotHeader *header) {
+  int rv = snprintf(writer->temporary_path, sizeof(writer->temporary_path),
+                    "%s.tmp-%d", path, (int)getpid());
+  if (rv < 0 || (size_t)rv >= sizeof(writer->temporary_path) ||
+      strlen(path) >= sizeof(writer->path)) {
+    return -1;
+  }
+  strcpy(writer->path, path);
+
+  writer->fd = open(writer->temporary_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (writer->fd < 0) {
+    return -1;
+  }
+  writer->failed = false;
+  writer->checksum = K_CHECKSUM_SEED;
+  writer->used = 0;
+  snapshot_write(writer, header, sizeof(*header));
+  return 0;
+}
+
+void snapshot_write(SnapshotWriter *writer, const void *data, size_t length) {
+  const uint8_t *bytes = (const uint8_t *)data;
+  while (length > 0) {
+    size_t n = K_SNAPSHOT_BUFFER_SIZE - writer->used;
+    n = n < length ? n : length;
+    memcpy(&writer->buffer[writer->used], bytes, n);
+    writer->used += n;
+    bytes += n;
+    length -= n;
+
+    // Only full buffers are flushed before the end, see update_checksum
+    if (writer->used == K_SNAPSHOT_BUFFER_SIZE) {
+      flush_snapshot_writer(writer);
+    }
+  }
+}
+
+int close_snapshot_writer(SnapshotWriter *writer) {
+  flush_snapshot_writer(writer);
+
+  uint64_t checksum = writer->checksum;
+  if (!writer->failed &&
+      (write_all(writer->fd, (const uint8_t *)&checksum, 8) ||
+       fsync(writer->fd))) {
+    writer->failed = true;
+  }
+  if (close(writer->fd)) {
+    writer->failed = true;
+  }
+  if (!writer->failed && rename(writer->temporary_path, writer->path)) {
+    writer->failed = true;
+  }
+
+  if (writer->failed) {
+    unlink(writer->temporary_path);
+    return -1;
+  }
+  return 0;
+}
+
+static bool is_header_valid(const SnapshotHeader *header) {
+  return memcmp(header->magic, K_SNAPSHOT_MAGIC, 8) == 0 &&
+         header->version == K_SNAPSHOT_VERSION && header->nshards > 0 &&
+         header->shard < header->nshards;
+}
+
+int read_snapshot_header(const char *path, SnapshotHeader *header) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+  ssize_t rv = read(fd, header, sizeof(*header));
+  close(fd);
+  return rv == (ssize_t)sizeof(*header) && is_header_valid(header) ? 0 : -1;
+}
+
+int open_snapshot_reader(SnapshotReader *reader, const char *path) {
+  memset(reader, 0, sizeof(*reader));
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) || (size_t)st.st_size < sizeof(SnapshotHeader) + 8) {
+    close(fd);
+    return -1;
+  }
+
+  size_t mapped = (size_t)st.st_size;
+  // Fault the whole file in at once, it is read from start to end twice
+  void *data =
+      mmap(NULL, mapped, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+  close(fd); // The mapping holds its own reference
+  if (data == MAP_FAILED) {
+    return -1;
+  }
+
+  reader->data = (const uint8_t *)data;
+  reader->mapped = mapped;
+  reader->size = mapped - 8;
+  memcpy(&reader->header, reader->data, sizeof(SnapshotHeader));
+
+  uint64_t checksum = 0;
+  memcpy(&checksum, &reader->data[reader->size], 8);
+  if (!is_header_valid(&reader->header) ||
+      update_checksum(K_CHECKSUM_SEED, reader->data, reader->size) !=
+          checksum) {
+    close_snapshot_reader(reader);
+    return -1;
+  }
+
+  reader->position = sizeof(SnapshotHeader);
+  return 0;
+}
+
+const uint8_t *snapshot_read(SnapshotReader *reader, size_t length) {
+  if (length > reader->size - reader->position) {
+    return NULL;
+  }
+  const uint8_t *data = &reader->data[reader->position];
+  reader->position += length;
+  return data;
+}
+
+void close_snapshot_reader(SnapshotReader *reader) {
+  if (reader->data) {
+    munmap((void *)reader->data, reader->mapped);
+  }
+  memset(reader, 0, sizeof(*reader));
+}
@@ -0,0 +1,108 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define K_SNAPSHOT_MAGIC "CACHIOS1"
+#define K_SNAPSHOT_VERSION 1
+#define K_SNAPSHOT_BUFFER_SIZE (64 * 1024) // A multiple of 8, see checksum
+
+#define SNAPSHOT_HAS_DEADLINE 1 // Record flag
+
+/**
+ * A snapshot file holds one shard: this header, one record per entry and an
+ * 8-byte checksum of everything before it. Integers are in host byte order. A
+ * record is
+ *
+ *   uint8 type, uint8 flags, uint32 key length, [int64 deadline,] key, value
+ *
+ * where the deadline is in Unix milliseconds, and the value of a string is a
+ * uint32 length and the bytes, of a sorted set a uint32 member count and for
+ * each member a double score, a uint32 length and the bytes, and of a hash a
+ * uint32 field count and for each field a uint32 length and the bytes, then
+ * the same for its value. Numbers are saved as strings, their text.
+ */
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t shard;
+  uint32_t nshards;
+  uint32_t reserved;
+  uint64_t unused; // 0, was the hash seed
+  uint64_t count;  // Records, expired ones included
+  int64_t saved_at_ms;
+} SnapshotHeader;
+
+/**
+ * Buffered writer of a snapshot. The file is written under a temporary name
+ * and renamed when complete, so a crash never leaves a partial snapshot. It
+ * does not allocate, so it can run in a forked child.
+ */
+typedef struct {
+  int fd;
+  bool failed; // A write failed, the snapshot is abandoned on close
+  uint64_t checksum;
+  size_t used;
+  char path[PATH_MAX];
+  char temporary_path[PATH_MAX];
+  uint8_t buffer[K_SNAPSHOT_BUFFER_SIZE];
+} SnapshotWriter;
+
+/**
+ * Reader of a snapshot mapped in memory: values are read in place, without a
+ * copy.
+ */
+typedef struct {
+  const uint8_t *data;
+  size_t size;     // Of the records, up to the checksum
+  size_t position; // Next byte to read
+  size_t mapped;
+  SnapshotHeader header;
+} SnapshotReader;
+
+/**
+ * @brief Create the temporary file and write the header.
+ *
+ * @return int 0 on success, -1 on error
+ */
+int open_snapshot_writer(SnapshotWriter *writer, const char *path,
+                         const SnapshotHeader *header);
+
+void snapshot_write(SnapshotWriter *writer, const void *data, size_t length);
+
+/**
+ * @brief Flush, append the checksum, sync and rename the file over path. The
+ * temporary file is removed if anything failed.
+ *
+ * @return int 0 on success, -1 on error
+ */
+int close_snapshot_writer(SnapshotWriter *writer);
+
+/**
+ * @brief Read the header of a snapshot, without checking the rest.
+ *
+ * @return int 0 on success, -1 if the file is missing or not a snapshot
+ */
+int read_snapshot_header(const char *path, SnapshotHeader *header);
+
+/**
+ * @brief Map a snapshot and check its header and checksum.
+ *
+ * @return int 0 on success, -1 if the file is missing, unreadable or corrupt
+ */
+int open_snapshot_reader(SnapshotReader *reader, const char *path);
+
+/**
+ * @brief Take the next length bytes.
+ *
+ * @return const uint8_t* the bytes, valid until the reader is closed, or NULL
+ * past the end
+ */
+const uint8_t *snapshot_read(SnapshotReader *reader, size_t length);
+
+void close_snapshot_reader(SnapshotReader *reader);
+
+#endif /* SNAPSHOT_H */
@@ -0,0 +1,43 @@
+#include <assert.h>
+
+#include "spsc.h"
+
+void initialize_spsc_queue(SpscQueue *queue, size_t n) {
+  assert(n > 0 && ((n - 1) & n) == 0); // n is a power of 2
+  atomic_init(&queue->head, 0);
+  atomic_init(&queue->tail, 0);
+  queue->slots = (void **)calloc(n, sizeof(void *));
+  queue->mask = n - 1;
+}
+
+void free_spsc_queue(SpscQueue *queue) {
+  free(queue->slots);
+  queue->slots = NULL;
+  queue->mask = 0;
+}
+
+bool push_spsc_queue(SpscQueue *queue, void *item) {
+  size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+  if (tail - head > queue->mask) {
+    return false; // Full
+  }
+
+  queue->slots[tail & queue->mask] = item;
+  // Publish the slot before the new tail
+  atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+  return true;
+}
+
+void *pop_spsc_queue(SpscQueue *queue) {
+  size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+  if (head == tail) {
+    return NULL; // Empty
+  }
+
+  void *item = queue->slots[head & queue->mask];
+  // Hand the slot back to the producer
+  atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+  return item;
+}
@@ -0,0 +1,45 @@
+#ifndef SPSC_H
+#define SPSC_H
+
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#define K_CACHE_LINE 64
+
+/**
+ * This structure is a bounded, lock-free, single-producer single-consumer ring
+ * of pointers. The producer only writes tail and the consumer only writes head,
+ * each on its own cache line, so the two threads never contend on a lock or on
+ * the same line.
+ */
+typedef struct SpscQueue {
+  alignas(K_CACHE_LINE) atomic_size_t head; // next slot to pop (consumer)
+  alignas(K_CACHE_LINE) atomic_size_t tail; // next slot to push (producer)
+  alignas(K_CACHE_LINE) void **slots;
+  size_t mask;
+} SpscQueue;
+
+/**
+ * @brief Initialize a queue holding up to n pointers. n must be a power of 2.
+ */
+void initialize_spsc_queue(SpscQueue *queue, size_t n);
+
+void free_spsc_queue(SpscQueue *queue);
+
+/**
+ * @brief Push a pointer. Must only be called by the producer thread.
+ *
+ * @return bool false if the queue is full
+ */
+bool push_spsc_queue(SpscQueue *queue, void *item);
+
+/**
+ * @brief Pop a pointer. Must only be called by the consumer thread.
+ *
+ * @return void* the oldest item, or NULL if the queue is empty
+ */
+void *pop_spsc_queue(SpscQueue *queue);
+
+#endif /* SPSC_H */
@@ -1,82 +1,2102 @@
 #include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
+#include "aof.h"
+#include "arena.h"
 #include "common.h"
 #include "encoding.h"
 #include "entry.h"
+#include "hash.h"
+#include "heap.h"
 #include "map.h"
 #include "object.h"
+#include "repl.h"
+#include "request.h"
+#include "slab.h"
+#include "snapshot.h"
 #include "store.h"
+#include "worker.h"
+#include "zset.h"
+
+// Cursors are replied as int64, the last shard must stay below the sign bit
+_Static_assert((uint64_t)(K_MAX_WORKERS - 1) <= INT64_MAX >> K_SCAN_SHARD_SHIFT,
+               "the shard index of a SCAN cursor must fit in 63 bits");
+
+/**
+ * A key sampled for eviction. The key is copied, as the entry may be deleted
+ * before the candidate is used.
+ */
+typedef struct {
+  uint64_t score; // Higher is evicted first
+  uint64_t hashcode;
+  char *key;
+  uint32_t length;
+} EvictionCandidate;
+
+// Every worker thread owns a private shard of the keyspace
+static __thread struct {
+  Map db;
+  Heap expiry;           // Deadlines in monotonic ms of the entries with a TTL
+  uint64_t entry_memory; // Bytes allocated for the entries and their values
+  uint64_t evicted;      // Keys evicted to stay under the memory limit
+  uint64_t random;       // State of the sampling generator
+  EvictionCandidate pool[K_EVICTION_POOL_SIZE]; // Sorted by score
+  uint32_t pool_size;
+  pid_t save_child;        // Writing a snapshot for BGSAVE, 0 if none
+  uint64_t save_keys;      // Keys in the shard when save_child was forked
+  bool last_save_failed;   // Whether the last save failed
+  uint64_t last_save_keys; // Keys written by the last successful save
+  int64_t last_save_ms;    // Unix time of the last successful save
+  uint64_t loaded_keys;    // Keys loaded from a snapshot at startup
+  Output record;           // Scratch for the record of a propagated write
+} g_data;
 
 static bool entry_eq(HashNode *lhs, HashNode *rhs) {
-  Entry *le = CONTAINER_OF(lhs, Entry, node);
-  Entry *re = CONTAINER_OF(rhs, Entry, node);
+  Entry *entry = CONTAINER_OF(lhs, Entry, node);
+  EntryKey *key = CONTAINER_OF(rhs, EntryKey, node);
 
-  if (le->key.length != re->key.length)
+  if (entry->key_length != key->length)
     return false;
 
-  return memcmp(le->key.value, re->key.value, le->key.length) == 0;
+  return memcmp(entry_key(entry), key->key, key->length) == 0;
+}
+
+static void set_entry_deadline(Entry *entry, uint64_t deadline) {
+  if (entry->heap_index) {
+    heap_update(&g_data.expiry, entry->heap_index - 1, deadline);
+  } else {
+    heap_push(&g_data.expiry, (HeapItem){deadline, &entry->heap_index});
+  }
+}
+
+static void clear_entry_deadline(Entry *entry) {
+  if (entry->heap_index) {
+    heap_remove(&g_data.expiry, entry->heap_index - 1);
+  }
+}
+
+static bool is_entry_expired(Entry *entry, uint64_t now) {
+  return entry->heap_index &&
+         g_data.expiry.items[entry->heap_index - 1].value <= now;
+}
+
+/**
+ * Free an entry detached from the map, with its deadline
+ */
+static void destroy_entry(Entry *entry) {
+  clear_entry_deadline(entry);
+  g_data.entry_memory -= entry_memory(entry);
+  free_entry(entry);
+}
+
+/**
+ * Detach an entry from the map and free it
+ */
+static void delete_entry(Entry *entry) {
+  EntryKey key = {.node = entry->node,
+                  .key = entry_key(entry),
+                  .length = entry->key_length};
+  detach_map(&g_data.db, &key.node, &entry_eq);
+  destroy_entry(entry);
 }
 
+static bool is_option(const StringView *view, const char *option) {
+  size_t length = strlen(option);
+  return view->length == length && memcmp(view->chars, option, length) == 0;
+}
+
+static void out_wrong_type(Output *out) {
+  out_error(out, ERROR_WRONG_TYPE,
+            "Operation against a key holding the wrong kind of value");
+}
+
+/**
+ * Pass the effect of a write on the shard to the append-only log and to the
+ * replicas, framed once for both
+ */
+static void propagate(const StringView *args, uint32_t n) {
+  if (!is_aof_logging() && !is_replication_fed()) {
+    return;
+  }
+  g_data.record.size = 0;
+  out_request(&g_data.record, args, n);
+  aof_append(g_data.record.chars, g_data.record.size);
+  feed_replication(g_data.record.chars, g_data.record.size);
+}
+
+static void propagate_command(Command *command) {
+  propagate(command->strings, (uint32_t)command->count);
+}
+
+/**
+ * Evictions and expirations are propagated as deletions, so a replay does not
+ * depend on memory pressure or on time
+ */
+static void propagate_delete(Entry *entry) {
+  StringView args[2] = {{"delete", 6}, {entry_key(entry), entry->key_length}};
+  propagate(args, 2);
+}
+
+/**
+ * Convert a monotonic deadline to the absolute Unix time logged and saved
+ */
+static int64_t deadline_to_unix_ms(uint64_t deadline, uint64_t now,
+                                   int64_t now_unix) {
+  uint64_t left = deadline > now ? deadline - now : 0;
+  if (left > (uint64_t)(INT64_MAX - now_unix)) {
+    return INT64_MAX;
+  }
+  return now_unix + (int64_t)left;
+}
+
+/**
+ * Convert back a Unix time to a monotonic deadline, 0 if it has passed
+ */
+static uint64_t unix_ms_to_deadline(int64_t unix_ms, uint64_t now,
+                                    int64_t now_unix) {
+  if (unix_ms <= now_unix) {
+    return 0;
+  }
+  return now + (uint64_t)(unix_ms - now_unix);
+}
+
+static void propagate_deadline(Entry *entry, uint64_t deadline) {
+  char text[24];
+  int64_t unix_ms =
+      deadline_to_unix_ms(deadline, get_monotonic_ms(), get_realtime_ms());
+  int length = snprintf(text, sizeof(text), "%lld", (long long)unix_ms);
+  StringView args[3] = {{"pexpireat", 9},
+                        {entry_key(entry), entry->key_length},
+                        {text, (uint32_t)length}};
+  propagate(args, 3);
+}
+
+static uint64_t next_random(void) {
+  // splitmix64
+  uint64_t z = (g_data.random += 0x9e3779b97f4a7c15ull);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return z ^ (z >> 31);
+}
+
+/**
+ * With allkeys-lfu, Entry.access holds the minute of the last decay in its
+ * upper 24 bits and a logarithmic access counter in its low 8 bits. The
+ * counter starts at K_LFU_INIT, grows with probability 1 / ((counter -
+ * K_LFU_INIT) * K_LFU_LOG_FACTOR + 1) on each access, and drops by one every
+ * K_LFU_DECAY_MINUTES minutes without access.
+ */
+static uint32_t lfu_counter(const Entry *entry, uint32_t minutes) {
+  uint32_t counter = entry->access & 0xFF;
+  uint32_t elapsed = (minutes - (entry->access >> 8)) & 0xFFFFFF;
+  uint32_t decay = elapsed / K_LFU_DECAY_MINUTES;
+  return decay >= counter ? 0 : counter - decay;
+}
+
+static uint32_t lfu_minutes(uint64_t now) {
+  return (uint32_t)(now / 60000) & 0xFFFFFF;
+}
+
+/**
+ * Record an access to an entry for the eviction policy
+ */
+static void touch_entry(Entry *entry, uint64_t now, bool created) {
+  if (g_config.eviction == EVICTION_ALLKEYS_LRU) {
+    entry->access = (uint32_t)now; // Wraps after 49 days of idleness
+  } else if (g_config.eviction == EVICTION_ALLKEYS_LFU) {
+    uint32_t minutes = lfu_minutes(now);
+    uint32_t counter = created ? K_LFU_INIT : lfu_counter(entry, minutes);
+    if (!created && counter < 255) {
+      uint32_t base = counter > K_LFU_INIT ? counter - K_LFU_INIT : 0;
+      uint64_t odds = (uint64_t)base * K_LFU_LOG_FACTOR + 1;
+      if (next_random() % odds == 0) {
+        counter++;
+      }
+    }
+    entry->access = minutes << 8 | counter;
+  }
+}
+
+/**
+ * Point a lookup key at a key argument, so lookups need no copy
+ */
+static void view_key(EntryKey *key, const StringView *view) {
+  key->key = view->chars;
+  key->length = view->length;
+  key->node.next = NULL;
+  key->node.hashcode = hash_string(view->chars, view->length);
+}
+
+/**
+ * Look a key up, deleting it first if its deadline has passed
+ */
+static Entry *lookup_entry(EntryKey *key) {
+  HashNode *node = lookup_map(&g_data.db, &key->node, &entry_eq);
+  if (!node) {
+    return NULL;
+  }
+
+  Entry *entry = CONTAINER_OF(node, Entry, node);
+  uint64_t now = get_monotonic_ms();
+  if (is_entry_expired(entry, now)) {
+    propagate_delete(entry);
+    detach_map(&g_data.db, &key->node, &entry_eq);
+    destroy_entry(entry);
+    return NULL;
+  }
+  touch_entry(entry, now, false);
+  return entry;
+}
+
+static uint64_t get_shard_memory(void) {
+  return g_data.entry_memory + get_map_memory(&g_data.db) +
+         (uint64_t)g_data.expiry.capacity * sizeof(HeapItem);
+}
+
+static uint64_t get_shard_memory_limit(void) {
+  return g_config.max_memory / get_worker_count();
+}
+
+static void sample_candidates(void) {
+  uint64_t now = get_monotonic_ms();
+  for (uint32_t i = 0; i < K_EVICTION_SAMPLES; i++) {
+    HashNode *node = sample_map(&g_data.db, next_random());
+    if (!node) {
+      return;
+    }
+
+    Entry *entry = CONTAINER_OF(node, Entry, node);
+    uint64_t score = 0;
+    if (g_config.eviction == EVICTION_ALLKEYS_LRU) {
+      score = (uint32_t)((uint32_t)now - entry->access); // Idle time
+    } else {
+      score = 255 - lfu_counter(entry, lfu_minutes(now));
+    }
+
+    EvictionCandidate *pool = g_data.pool;
+    uint32_t *size = &g_data.pool_size;
+    if (*size == K_EVICTION_POOL_SIZE && score <= pool[0].score) {
+      continue; // Not better than any candidate already in the pool
+    }
+
+    bool known = false;
+    for (uint32_t j = 0; j < *size && !known; j++) {
+      known = pool[j].hashcode == node->hashcode &&
+              pool[j].length == entry->key_length &&
+              memcmp(pool[j].key, entry_key(entry), entry->key_length) == 0;
+    }
+    if (known) {
+      continue;
+    }
+
+    if (*size == K_EVICTION_POOL_SIZE) {
+      // Make room by dropping the worst candidate
+      slab_free(pool[0].key, pool[0].length);
+      memmove(&pool[0], &pool[1], (*size - 1) * sizeof(EvictionCandidate));
+      (*size)--;
+    }
+
+    uint32_t position = *size;
+    while (position > 0 && pool[position - 1].score > score) {
+      pool[position] = pool[position - 1];
+      position--;
+    }
+    pool[position].score = score;
+    pool[position].hashcode = node->hashcode;
+    pool[position].length = entry->key_length;
+    pool[position].key = (char *)slab_alloc(entry->key_length);
+    memcpy(pool[position].key, entry_key(entry), entry->key_length);
+    (*size)++;
+  }
+}
+
+/**
+ * Pick the entry to evict next under the configured policy
+ */
+static Entry *pick_eviction_victim(void) {
+  if (g_config.eviction == EVICTION_VOLATILE_TTL) {
+    // The heap gives the nearest deadline exactly, no need to sample
+    HeapItem *top = heap_top(&g_data.expiry);
+    return top ? CONTAINER_OF(top->ref, Entry, heap_index) : NULL;
+  }
+
+  while (get_map_size(&g_data.db) > 0) {
+    sample_candidates();
+
+    // The best candidates may have been deleted since they were sampled
+    while (g_data.pool_size > 0) {
+      EvictionCandidate candidate = g_data.pool[--g_data.pool_size];
+      EntryKey key = {.key = candidate.key, .length = candidate.length};
+      key.node.next = NULL;
+      key.node.hashcode = candidate.hashcode;
+      HashNode *node = lookup_map(&g_data.db, &key.node, &entry_eq);
+      slab_free(candidate.key, candidate.length);
+      if (node) {
+        return CONTAINER_OF(node, Entry, node);
+      }
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Evict keys until the shard is under its memory limit. Called before the
+ * commands which allocate; on failure an error is written to out.
+ */
+static bool ensure_memory(Output *out) {
+  if (g_config.max_memory == 0) {
+    return true;
+  }
+
+  uint64_t limit = get_shard_memory_limit();
+  while (get_shard_memory() > limit) {
+    Entry *victim = g_config.eviction == EVICTION_NONE
+                        ? NULL
+                        : pick_eviction_victim();
+    if (!victim) {
+      out_error(out, ERROR_OUT_OF_MEMORY,
+                "Command not allowed when used memory > maxmemory");
+      return false;
+    }
+
+    propagate_delete(victim);
+    delete_entry(victim);
+    g_data.evicted++;
+  }
+  return true;
+}
+
+int expire_keys(int timeout_ms) {
+  HeapItem *top = heap_top(&g_data.expiry);
+  if (!top) {
+    return timeout_ms;
+  }
+
+  uint64_t now = get_monotonic_ms();
+  for (uint32_t work = 0; top && top->value <= now; work++) {
+    if (work == K_EXPIRE_WORK) {
+      return 0; // More keys are due, come back right after the next poll
+    }
+
+    Entry *entry = CONTAINER_OF(top->ref, Entry, heap_index);
+    propagate_delete(entry);
+    delete_entry(entry);
+    top = heap_top(&g_data.expiry);
+  }
+
+  if (top && top->value - now < (uint64_t)timeout_ms) {
+    return (int)(top->value - now);
+  }
+  return timeout_ms;
+}
+
+int rehash_keys(int timeout_ms, bool idle) {
+  if (g_config.rehash_budget_us == 0 || !rehash_map(&g_data.db, 0)) {
+    return timeout_ms;
+  }
+  if (!idle) {
+    return 0;
+  }
+
+  uint64_t deadline = get_monotonic_ns() + g_config.rehash_budget_us * 1000;
+  while (rehash_map(&g_data.db, K_REHASH_STEP)) {
+    if (get_monotonic_ns() >= deadline) {
+      return 0; // Carry on after the next poll, if it is idle too
+    }
+  }
+  return timeout_ms;
+}
+
+/**
+ * Glob-style match: "*" matches any run of bytes, "?" one byte, "[...]" a byte
+ * of the set ("^" negates it, "a-z" is a range), "\\" escapes the next byte
+ */
+static bool match_pattern(const char *pattern, uint32_t pattern_length,
+                          const char *string, uint32_t length) {
+  uint32_t p = 0;
+  uint32_t s = 0;
+  uint32_t star = UINT32_MAX; // Position after the last "*" seen
+  uint32_t star_s = 0;        // Bytes of string it matches so far, from there
+
+  while (s < length) {
+    if (p < pattern_length && pattern[p] == '*') {
+      star = ++p;
+      star_s = s;
+      continue;
+    }
+
+    if (p < pattern_length) {
+      bool matched = false;
+      uint32_t next = p + 1;
+      if (pattern[p] == '?') {
+        matched = true;
+      } else if (pattern[p] == '[') {
+        uint32_t i = p + 1;
+        bool negate = i < pattern_length && pattern[i] == '^';
+        i += negate;
+        bool in_set = false;
+        for (; i < pattern_length && pattern[i] != ']'; i++) {
+          if (pattern[i] == '\\' && i + 1 < pattern_length) {
+            i++;
+            in_set |= pattern[i] == string[s];
+          } else if (i + 2 < pattern_length && pattern[i + 1] == '-' &&
+                     pattern[i + 2] != ']') {
+            unsigned char lo = (unsigned char)pattern[i];
+            unsigned char hi = (unsigned char)pattern[i + 2];
+            unsigned char c = (unsigned char)string[s];
+            in_set |= lo <= hi ? (c >= lo && c <= hi) : (c >= hi && c <= lo);
+            i += 2;
+          } else {
+            in_set |= pattern[i] == string[s];
+          }
+        }
+        matched = in_set != negate;
+        next = i < pattern_length ? i + 1 : i;
+      } else if (pattern[p] == '\\' && p + 1 < pattern_length) {
+        matched = pattern[p + 1] == string[s];
+        next = p + 2;
+      } else {
+        matched = pattern[p] == string[s];
+      }
+
+      if (matched) {
+        p = next;
+        s++;
+        continue;
+      }
+    }
+
+    // Mismatch: let the last "*" swallow one more byte, if any
+    if (star == UINT32_MAX) {
+      return false;
+    }
+    p = star;
+    s = ++star_s;
+  }
+
+  while (p < pattern_length && pattern[p] == '*') {
+    p++;
+  }
+  return p == pattern_length;
+}
+
+typedef struct {
+  Output *out;
+  uint32_t count;
+  uint64_t now;
+  const StringView *pattern; // NULL to match every key
+} KeysScan;
+
 static void get_key_scan(HashNode *node, void *arg) {
-  Output *out = (Output *)arg;
+  KeysScan *scan = (KeysScan *)arg;
   Entry *entry = CONTAINER_OF(node, Entry, node);
-  out_string(out, entry->key.value, entry->key.length);
+  if (is_entry_expired(entry, scan->now)) {
+    return; // Not deleted while the map is being scanned
+  }
+  if (scan->pattern &&
+      !match_pattern(scan->pattern->chars, scan->pattern->length,
+                     entry_key(entry), entry->key_length)) {
+    return;
+  }
+  out_string(scan->out, entry_key(entry), entry->key_length);
+  scan->count++;
 }
 
 void execute_keys(Command *command, Output *out) {
   (void)command;
-  out_array(out, (uint32_t)get_map_size(&g_data.db));
-  scan_map(&g_data.db, get_key_scan, out);
+
+  // Expired keys are skipped, patch the array header once they are counted
+  size_t header = out->size;
+  out_array(out, 0);
+
+  KeysScan scan = {.out = out, .count = 0, .now = get_monotonic_ms()};
+  scan_map(&g_data.db, get_key_scan, &scan);
+  memcpy(&out->chars[header + 1], &scan.count, 4);
 }
 
-void execute_get(Command *command, Output *out) {
-  Entry key;
-  create_string(&key.key, command->strings[1]);
-  key.node.hashcode = hash_string(key.key.value, key.key.length);
+void execute_scan(Command *command, Output *out) {
+  // SCAN cursor [match pattern] [count n]
+  int64_t cursor = 0;
+  if (!view_to_int64(&command->strings[1], &cursor) || cursor < 0) {
+    return out_error(out, ERROR_ARGUMENT, "Invalid cursor");
+  }
 
-  HashNode *node = lookup_map(&g_data.db, &key.node, &entry_eq);
+  const StringView *pattern = NULL;
+  int64_t count = K_SCAN_DEFAULT_COUNT;
+  if (command->count % 2 != 0) {
+    return out_error(out, ERROR_ARGUMENT, "Syntax error");
+  }
+  for (int i = 2; i < command->count; i += 2) {
+    const StringView *option = &command->strings[i];
+    if (is_option(option, "match")) {
+      pattern = &command->strings[i + 1];
+    } else if (!is_option(option, "count") ||
+               !view_to_int64(&command->strings[i + 1], &count) || count < 1) {
+      return out_error(out, ERROR_ARGUMENT, "Syntax error");
+    }
+  }
+  // Also keeps the step budget below from overflowing
+  if (count > K_SCAN_MAX_COUNT) {
+    count = K_SCAN_MAX_COUNT;
+  }
 
-  if (!node) {
+  // The high bits of the cursor pick the shard, the low bits are its own
+  uint64_t shard = (uint64_t)cursor >> K_SCAN_SHARD_SHIFT;
+  size_t local = (size_t)((uint64_t)cursor & K_SCAN_LOCAL_MASK);
+  if (shard >= get_worker_count()) {
+    return out_error(out, ERROR_ARGUMENT, "Invalid cursor");
+  }
+
+  out_array(out, 2);
+  size_t cursor_at = out->size;
+  out_integer(out, 0);
+  size_t header = out->size;
+  out_array(out, 0);
+
+  // Bound the work when few keys match
+  KeysScan scan = {.out = out, .count = 0, .now = get_monotonic_ms(),
+                   .pattern = pattern};
+  int64_t steps = count * 10;
+  do {
+    local = scan_map_step(&g_data.db, local, get_key_scan, &scan);
+  } while (local != 0 && --steps > 0 && scan.count < (uint64_t)count);
+
+  int64_t next = 0;
+  if (local != 0) {
+    next = (int64_t)(shard << K_SCAN_SHARD_SHIFT | local);
+  } else if (shard + 1 < get_worker_count()) {
+    next = (int64_t)((shard + 1) << K_SCAN_SHARD_SHIFT);
+  }
+  memcpy(&out->chars[cursor_at + 1], &next, 8);
+  memcpy(&out->chars[header + 1], &scan.count, 4);
+}
+
+/**
+ * Write the value of a string entry, formatting it if it is a number
+ */
+static void out_entry_string(Output *out, Entry *entry) {
+  if (entry->type == OBJECT_NUMBER) {
+    char text[K_NUMBER_TEXT_MAX];
+    Number number = entry_number(entry);
+    return out_string(out, text, format_number(&number, text));
+  }
+  out_string(out, entry_value(entry), entry->value_length);
+}
+
+void execute_get(Command *command, Output *out) {
+  EntryKey key;
+  view_key(&key, &command->strings[1]);
+
+  Entry *entry = lookup_entry(&key);
+  if (!entry) {
     return out_nil(out);
   }
+  if (!is_string_entry(entry)) {
+    return out_wrong_type(out);
+  }
 
-  ObjectString *value = &CONTAINER_OF(node, Entry, node)->value;
-  assert(value->length < K_MAX_MSG);
-  return out_string(out, value->value, value->length);
+  return out_entry_string(out, entry);
 }
 
-void execute_set(Command *command, Output *out) {
-  Entry *key = malloc(sizeof(Entry));
-  create_string(&key->key, command->strings[1]);
-  key->node.hashcode = hash_string(key->key.value, key->key.length);
+/**
+ * Read a relative TTL argument as an absolute deadline. Deadlines in the past
+ * are kept as such, the key then expires on its next access.
+ */
+static bool parse_deadline(const StringView *view, int64_t unit_ms,
+                           uint64_t *deadline) {
+  int64_t ttl = 0;
+  if (!view_to_int64(view, &ttl) || ttl > INT64_MAX / unit_ms ||
+      ttl < INT64_MIN / unit_ms) {
+    return false;
+  }
 
-  HashNode *node = lookup_map(&g_data.db, &key->node, &entry_eq);
+  int64_t now = (int64_t)get_monotonic_ms();
+  ttl *= unit_ms;
+  if (ttl <= 0) {
+    *deadline = 0;
+  } else if (ttl > INT64_MAX - now) {
+    *deadline = INT64_MAX;
+  } else {
+    *deadline = (uint64_t)(now + ttl);
+  }
+  return true;
+}
 
-  if (!node) {
-    create_string(&key->value, command->strings[2]);
-    insert_map(&g_data.db, &key->node);
+/**
+ * Store a string value under a key, replacing a value of any type. Overwriting
+ * a key also clears its TTL.
+ */
+static Entry *set_string(EntryKey *key, const StringView *value) {
+  Entry *entry = lookup_entry(key);
+  if (entry && !is_string_entry(entry)) {
+    delete_entry(entry);
+    entry = NULL;
+  }
+  if (!entry) {
+    // Copy the key and the value once, into the new entry
+    entry = create_entry(key->key, key->length, value->chars, value->length,
+                         key->node.hashcode);
+    insert_map(&g_data.db, &entry->node);
+    touch_entry(entry, get_monotonic_ms(), true);
   } else {
-    replace_string(&CONTAINER_OF(node, Entry, node)->value,
-                   command->strings[2]);
+    g_data.entry_memory -= entry_memory(entry);
+    set_entry_value(entry, value->chars, value->length);
+    clear_entry_deadline(entry);
   }
-  out_string(out, key->key.value, key->key.length);
+  g_data.entry_memory += entry_memory(entry);
+  return entry;
+}
+
+void execute_set(Command *command, Output *out) {
+  EntryKey key;
+  view_key(&key, &command->strings[1]);
+  const StringView *value = &command->strings[2];
+
+  // SET key value [PX milliseconds | EX seconds]
+  bool has_deadline = command->count == 5;
+  uint64_t deadline = 0;
+  if (has_deadline) {
+    const StringView *option = &command->strings[3];
+    int64_t unit_ms = 0;
+    if (is_option(option, "px")) {
+      unit_ms = 1;
+    } else if (is_option(option, "ex")) {
+      unit_ms = 1000;
+    }
+    if (!unit_ms || !parse_deadline(&command->strings[4], unit_ms, &deadline) ||
+        deadline == 0) {
+      return out_error(out, ERROR_ARGUMENT, "Invalid expire time");
+    }
+  }
+
+  if (!ensure_memory(out)) {
+    return;
+  }
+
+  Entry *entry = set_string(&key, value);
+  propagate(command->strings, 3);
+  if (has_deadline) {
+    set_entry_deadline(entry, deadline);
+    propagate_deadline(entry, deadline);
+  }
+  out_string(out, key.key, key.length);
 }
 
 void execute_delete(Command *command, Output *out) {
-  Entry key;
-  create_string(&key.key, command->strings[1]);
-  key.node.hashcode = hash_string(key.key.value, key.key.length);
+  EntryKey key;
+  view_key(&key, &command->strings[1]);
 
   HashNode *node = detach_map(&g_data.db, &key.node, &entry_eq);
+  if (!node) {
+    return out_integer(out, 0);
+  }
 
-  if (node) {
-    Entry *entry = CONTAINER_OF(node, Entry, node);
-    free_entry(entry);
-    free(entry);
+  // An expired key counts as missing. Its deadline is logged already, so the
+  // replay drops it without a record.
+  Entry *entry = CONTAINER_OF(node, Entry, node);
+  bool expired = is_entry_expired(entry, get_monotonic_ms());
+  destroy_entry(entry);
+  if (!expired) {
+    propagate_command(command);
+  }
+  return out_integer(out, expired ? 0 : 1);
+}
+
+/**
+ * Whether the calling worker's shard owns a key. A batch spanning several
+ * shards runs on all of them, each one handling its own keys.
+ */
+static bool owns_key(const EntryKey *key) {
+  uint32_t nshards = get_worker_count();
+  return nshards < 2 ||
+         shard_of_hash(key->node.hashcode, nshards) == current_worker_id();
+}
+
+/**
+ * Hash the keys of a batch, every stride-th argument from the first one, in a
+ * first pass which also prefetches their buckets, so the lookups which follow
+ * overlap their cache misses. The keys live in the request arena.
+ */
+static EntryKey *view_keys(Command *command, int stride, uint32_t *n) {
+  *n = (uint32_t)(command->count - 1 + stride - 1) / (uint32_t)stride;
+  EntryKey *keys =
+      (EntryKey *)arena_alloc(request_arena(), *n * sizeof(EntryKey));
+  for (uint32_t i = 0; i < *n; i++) {
+    view_key(&keys[i], &command->strings[1 + i * stride]);
+    prefetch_map(&g_data.db, keys[i].node.hashcode);
+  }
+  return keys;
+}
+
+void execute_mget(Command *command, Output *out) {
+  uint32_t n = 0;
+  EntryKey *keys = view_keys(command, 1, &n);
+
+  out_array(out, n);
+  for (uint32_t i = 0; i < n; i++) {
+    Entry *entry = owns_key(&keys[i]) ? lookup_entry(&keys[i]) : NULL;
+    if (!entry || !is_string_entry(entry)) {
+      out_nil(out);
+    } else {
+      out_entry_string(out, entry);
+    }
+  }
+}
+
+void execute_mset(Command *command, Output *out) {
+  uint32_t n = 0;
+  EntryKey *keys = view_keys(command, 2, &n);
+
+  int64_t count = 0;
+  for (uint32_t i = 0; i < n; i++) {
+    count += owns_key(&keys[i]);
+  }
+  if (count > 0 && !ensure_memory(out)) {
+    return;
+  }
+
+  // Only the pairs of this shard are logged
+  StringView *args = (StringView *)arena_alloc(
+      request_arena(), (1 + 2 * (size_t)count) * sizeof(StringView));
+  uint32_t nargs = 0;
+  args[nargs++] = command->strings[0];
+  for (uint32_t i = 0; i < n; i++) {
+    if (owns_key(&keys[i])) {
+      set_string(&keys[i], &command->strings[2 + i * 2]);
+      args[nargs++] = command->strings[1 + i * 2];
+      args[nargs++] = command->strings[2 + i * 2];
+    }
+  }
+  if (count > 0) {
+    propagate(args, nargs);
+  }
+  out_integer(out, count);
+}
+
+void execute_msetnx(Command *command, Output *out) {
+  uint32_t n = 0;
+  EntryKey *keys = view_keys(command, 2, &n);
+
+  for (uint32_t i = 0; i < n; i++) {
+    if (!owns_key(&keys[i])) {
+      return out_error(out, ERROR_ARGUMENT,
+                       "Keys in request don't hash to the same shard");
+    }
+  }
+  for (uint32_t i = 0; i < n; i++) {
+    if (lookup_entry(&keys[i])) {
+      return out_integer(out, 0);
+    }
+  }
+
+  if (!ensure_memory(out)) {
+    return;
+  }
+  for (uint32_t i = 0; i < n; i++) {
+    set_string(&keys[i], &command->strings[2 + i * 2]);
+  }
+
+  // Logged as the MSET it amounts to, which replays without a condition
+  StringView *args = (StringView *)arena_alloc(
+      request_arena(), (size_t)command->count * sizeof(StringView));
+  memcpy(args, command->strings, (size_t)command->count * sizeof(StringView));
+  args[0] = (StringView){"mset", 4};
+  propagate(args, (uint32_t)command->count);
+  out_integer(out, 1);
+}
+
+void execute_mdel(Command *command, Output *out) {
+  uint32_t n = 0;
+  EntryKey *keys = view_keys(command, 1, &n);
+
+  // Only the keys deleted from this shard are logged
+  StringView *args = (StringView *)arena_alloc(
+      request_arena(), (1 + (size_t)n) * sizeof(StringView));
+  uint32_t nargs = 0;
+  args[nargs++] = command->strings[0];
+
+  int64_t count = 0;
+  for (uint32_t i = 0; i < n; i++) {
+    if (!owns_key(&keys[i])) {
+      continue;
+    }
+    HashNode *node = detach_map(&g_data.db, &keys[i].node, &entry_eq);
+    if (node) {
+      Entry *entry = CONTAINER_OF(node, Entry, node);
+      // An expired key counts as missing
+      if (!is_entry_expired(entry, get_monotonic_ms())) {
+        count++;
+      }
+      args[nargs++] = command->strings[1 + i];
+      destroy_entry(entry);
+    }
+  }
+  if (nargs > 1) {
+    propagate(args, nargs);
+  }
+  out_integer(out, count);
+}
+
+/**
+ * Look up the value of a key for an increment. *entry is NULL if the key is
+ * missing, and the number is then 0. Returns -1 after writing an error if the
+ * key holds another type than a string.
+ */
+static int lookup_number(EntryKey *key, Entry **entry, Number *number,
+                         Output *out) {
+  *entry = lookup_entry(key);
+  *number = (Number){0};
+  if (!*entry) {
+    return 0;
+  }
+  if (!is_string_entry(*entry)) {
+    out_wrong_type(out);
+    return -1;
+  }
+  if ((*entry)->type == OBJECT_NUMBER) {
+    *number = entry_number(*entry);
+    return 0;
+  }
+
+  // A string which is not the canonical text of a number, such as "1e3",
+  // still reads as a double
+  StringView value = {entry_value(*entry), (*entry)->value_length};
+  number->is_double = true;
+  if (!view_to_double(&value, &number->real)) {
+    out_error(out, ERROR_ARGUMENT, "Value is not a number");
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Store the result of an increment in place, keeping the TTL, or under a new
+ * entry if the key was missing. Returns the entry holding it.
+ */
+static Entry *store_number(EntryKey *key, Entry *entry, const Number *number) {
+  if (!entry) {
+    char text[K_NUMBER_TEXT_MAX];
+    uint32_t length = format_number(number, text);
+    entry = create_entry(key->key, key->length, text, length,
+                         key->node.hashcode);
+    insert_map(&g_data.db, &entry->node);
+    touch_entry(entry, get_monotonic_ms(), true);
+  } else {
+    g_data.entry_memory -= entry_memory(entry);
+    set_entry_number(entry, number);
+  }
+  g_data.entry_memory += entry_memory(entry);
+  return entry;
+}
+
+/**
+ * Log the value an increment stored rather than the increment, then the TTL
+ * it kept. A full sync streams the changes made while the shard is scanned,
+ * so a change to a key not scanned yet is applied twice, which only a value
+ * survives.
+ */
+static void propagate_number(const StringView *name, Entry *entry,
+                             const Number *number) {
+  char text[K_NUMBER_TEXT_MAX];
+  StringView args[3] = {{"set", 3}, *name, {text, 0}};
+  args[2].length = format_number(number, text);
+  propagate(args, 3);
+  if (entry->heap_index) {
+    propagate_deadline(entry,
+                       g_data.expiry.items[entry->heap_index - 1].value);
+  }
+}
+
+void execute_incr(Command *command, Output *out, int64_t delta) {
+  EntryKey key;
+  view_key(&key, &command->strings[1]);
+
+  Entry *entry = NULL;
+  Number number;
+  if (lookup_number(&key, &entry, &number, out) != 0) {
+    return;
+  }
+  if (number.is_double) {
+    return out_error(out, ERROR_ARGUMENT, "Value is not an integer");
+  }
+  if ((delta > 0 && number.integer > INT64_MAX - delta) ||
+      (delta < 0 && number.integer < INT64_MIN - delta)) {
+    return out_error(out, ERROR_ARGUMENT, "Increment would overflow");
+  }
+  if (!entry && !ensure_memory(out)) {
+    return;
+  }
+
+  number.integer += delta;
+  entry = store_number(&key, entry, &number);
+  propagate_number(&command->strings[1], entry, &number);
+  out_integer(out, number.integer);
+}
+
+void execute_incrby(Command *command, Output *out) {
+  int64_t delta = 0;
+  if (!view_to_int64(&command->strings[2], &delta)) {
+    return out_error(out, ERROR_ARGUMENT, "Increment is not an integer");
+  }
+  execute_incr(command, out, delta);
+}
+
+void execute_incrbyfloat(Command *command, Output *out) {
+  double delta = 0;
+  if (!view_to_double(&command->strings[2], &delta)) {
+    return out_error(out, ERROR_ARGUMENT, "Increment is not a valid number");
+  }
+
+  EntryKey key;
+  view_key(&key, &command->strings[1]);
+  Entry *entry = NULL;
+  Number number;
+  if (lookup_number(&key, &entry, &number, out) != 0) {
+    return;
+  }
+  double result =
+      (number.is_double ? number.real : (double)number.integer) + delta;
+  if (!isfinite(result)) {
+    return out_error(out, ERROR_ARGUMENT,
+                     "Increment would produce NaN or Infinity");
+  }
+  if (!entry && !ensure_memory(out)) {
+    return;
+  }
+
+  // Stored as its text would be, so an integral result is an integer again
+  char text[K_NUMBER_TEXT_MAX];
+  number = (Number){.is_double = true, .real = result};
+  uint32_t length = format_number(&number, text);
+  parse_number(text, length, &number);
+  entry = store_number(&key, entry, &number);
+  propagate_number(&command->strings[1], entry, &number);
+  out_string(out, text, length);
+}
+
+/**
+ * Set the deadline of a key, 0 for one in the past
+ */
+static void expire_key(Command *command, Output *out, uint64_t deadline) {
+  EntryKey key;
+  view_key(&key, &command->strings[1]);
+
+  Entry *entry = lookup_entry(&key);
+  if (!entry) {
+    return out_integer(out, 0);
+  }
+
+  if (deadline == 0) {
+    // A deadline in the past deletes the key right away
+    propagate_delete(entry);
+    detach_map(&g_data.db, &key.node, &entry_eq);
+    destroy_entry(entry);
+  } else {
+    set_entry_deadline(entry, deadline);
+    propagate_deadline(entry, deadline);
+  }
+  return out_integer(out, 1);
+}
+
+void execute_expire(Command *command, Output *out, int64_t unit_ms) {
+  uint64_t deadline = 0;
+  if (!parse_deadline(&command->strings[2], unit_ms, &deadline)) {
+    return out_error(out, ERROR_ARGUMENT, "Invalid expire time");
+  }
+  expire_key(command, out, deadline);
+}
+
+void execute_pexpireat(Command *command, Output *out) {
+  int64_t unix_ms = 0;
+  if (!view_to_int64(&command->strings[2], &unix_ms)) {
+    return out_error(out, ERROR_ARGUMENT, "Invalid expire time");
+  }
+  expire_key(command, out,
+             unix_ms_to_deadline(unix_ms, get_monotonic_ms(),
+                                 get_realtime_ms()));
+}
+
+void execute_ttl(Command *command, Output *out, int64_t unit_ms) {
+  EntryKey key;
+  view_key(&key, &command->strings[1]);
+
+  Entry *entry = lookup_entry(&key);
+  if (!entry) {
+    return out_integer(out, -2);
+  }
+  if (!entry->heap_index) {
+    return out_integer(out, -1);
+  }
+
+  uint64_t deadline = g_data.expiry.items[entry->heap_index - 1].value;
+  // The clock may have passed the deadline since lookup_entry read it
+  uint64_t now = get_monotonic_ms();
+  uint64_t left = deadline > now ? deadline - now : 0;
+  return out_integer(out, (int64_t)((left + (uint64_t)unit_ms / 2) / unit_ms));
+}
+
+void execute_persist(Command *command, Output *out) {
+  EntryKey key;
+  view_key(&key, &command->strings[1]);
+
+  Entry *entry = lookup_entry(&key);
+  if (!entry || !entry->heap_index) {
+    return out_integer(out, 0);
+  }
+
+  clear_entry_deadline(entry);
+  propagate_command(command);
+  return out_integer(out, 1);
+}
+
+/**
+ * Look up the sorted set of a key, *zset is NULL if the key is missing.
+ * Returns -1 after writing an error if the key holds another type.
+ */
+static int lookup_zset(const StringView *view, Entry **entry, ZSet **zset,
+                       Output *out) {
+  EntryKey key;
+  view_key(&key, view);
+  *entry = lookup_entry(&key);
+  *zset = NULL;
+  if (!*entry) {
+    return 0;
+  }
+  if ((*entry)->type != OBJECT_ZSET) {
+    out_wrong_type(out);
+    return -1;
+  }
+  *zset = (ZSet *)entry_object(*entry);
+  return 0;
+}
+
+void execute_zadd(Command *command, Output *out) {
+  // ZADD key score member [score member ...]
+  uint32_t pairs = (uint32_t)(command->count - 2) / 2;
+  double *scores = (double *)arena_alloc(request_arena(),
+                                         pairs * sizeof(double));
+  for (uint32_t i = 0; i < pairs; i++) {
+    if (!view_to_double(&command->strings[2 + 2 * i], &scores[i])) {
+      return out_error(out, ERROR_ARGUMENT, "Score is not a valid number");
+    }
+  }
+
+  if (!ensure_memory(out)) {
+    return;
+  }
+
+  Entry *entry = NULL;
+  ZSet *zset = NULL;
+  if (lookup_zset(&command->strings[1], &entry, &zset, out) != 0) {
+    return;
+  }
+  if (!zset) {
+    zset = create_zset();
+    const StringView *name = &command->strings[1];
+    entry = create_object_entry(name->chars, name->length, OBJECT_ZSET, zset,
+                                hash_string(name->chars, name->length));
+    insert_map(&g_data.db, &entry->node);
+    touch_entry(entry, get_monotonic_ms(), true);
+  } else {
+    g_data.entry_memory -= entry_memory(entry);
+  }
+
+  int64_t added = 0;
+  for (uint32_t i = 0; i < pairs; i++) {
+    const StringView *member = &command->strings[3 + 2 * i];
+    added += zset_add(zset, member->chars, member->length, scores[i]);
+  }
+  g_data.entry_memory += entry_memory(entry);
+  propagate_command(command);
+  return out_integer(out, added);
+}
+
+void execute_zrem(Command *command, Output *out) {
+  Entry *entry = NULL;
+  ZSet *zset = NULL;
+  if (lookup_zset(&command->strings[1], &entry, &zset, out) != 0) {
+    return;
+  }
+  if (!zset) {
+    return out_integer(out, 0);
+  }
+
+  g_data.entry_memory -= entry_memory(entry);
+  int64_t removed = 0;
+  for (int i = 2; i < command->count; i++) {
+    const StringView *member = &command->strings[i];
+    removed += zset_remove(zset, member->chars, member->length);
+  }
+  g_data.entry_memory += entry_memory(entry);
+
+  if (zset->size == 0) {
+    delete_entry(entry); // Empty sets do not exist
+  }
+  if (removed) {
+    propagate_command(command);
+  }
+  return out_integer(out, removed);
+}
+
+void execute_zscore(Command *command, Output *out) {
+  Entry *entry = NULL;
+  ZSet *zset = NULL;
+  if (lookup_zset(&command->strings[1], &entry, &zset, out) != 0) {
+    return;
+  }
+  if (!zset) {
+    return out_nil(out);
+  }
+
+  const StringView *member = &command->strings[2];
+  double score = 0;
+  if (!zset_score(zset, member->chars, member->length, &score)) {
+    return out_nil(out);
+  }
+  return out_double(out, score);
+}
+
+void execute_zrank(Command *command, Output *out) {
+  Entry *entry = NULL;
+  ZSet *zset = NULL;
+  if (lookup_zset(&command->strings[1], &entry, &zset, out) != 0) {
+    return;
+  }
+  if (!zset) {
+    return out_nil(out);
+  }
+
+  const StringView *member = &command->strings[2];
+  int64_t rank = zset_rank(zset, member->chars, member->length);
+  return rank < 0 ? out_nil(out) : out_integer(out, rank);
+}
+
+/**
+ * Write count members from a rank on, with their scores if requested
+ */
+static void out_zset_range(Output *out, ZSet *zset, uint32_t rank,
+                           uint32_t count, bool with_scores) {
+  out_array(out, with_scores ? count * 2 : count);
+
+  ZSetIterator it;
+  zset_seek(zset, rank, &it);
+  const char *member = NULL;
+  uint32_t length = 0;
+  double score = 0;
+  for (uint32_t i = 0; i < count && zset_next(&it, &member, &length, &score);
+       i++) {
+    out_string(out, member, length);
+    if (with_scores) {
+      out_double(out, score);
+    }
+  }
+}
+
+void execute_zrange(Command *command, Output *out) {
+  // ZRANGE key start stop [withscores]
+  int64_t start = 0;
+  int64_t stop = 0;
+  if (!view_to_int64(&command->strings[2], &start) ||
+      !view_to_int64(&command->strings[3], &stop)) {
+    return out_error(out, ERROR_ARGUMENT, "Index is not an integer");
+  }
+  bool with_scores = command->count == 5;
+  if (with_scores && !is_option(&command->strings[4], "withscores")) {
+    return out_error(out, ERROR_ARGUMENT, "Syntax error");
+  }
+
+  Entry *entry = NULL;
+  ZSet *zset = NULL;
+  if (lookup_zset(&command->strings[1], &entry, &zset, out) != 0) {
+    return;
+  }
+  if (!zset) {
+    return out_array(out, 0);
+  }
+
+  // Negative indexes count from the end
+  int64_t size = zset->size;
+  start = start < 0 ? (start + size < 0 ? 0 : start + size) : start;
+  stop = stop < 0 ? stop + size : (stop >= size ? size - 1 : stop);
+  if (start > stop || start >= size) {
+    return out_array(out, 0);
+  }
+  out_zset_range(out, zset, (uint32_t)start, (uint32_t)(stop - start + 1),
+                 with_scores);
+}
+
+/**
+ * Read a score bound: a number, "-inf" / "+inf", or "(" and a number for an
+ * exclusive bound
+ */
+static bool parse_score_bound(const StringView *view, double *score,
+                              bool *exclusive) {
+  StringView number = *view;
+  *exclusive = number.length > 0 && number.chars[0] == '(';
+  if (*exclusive) {
+    number.chars++;
+    number.length--;
+  }
+  return view_to_double(&number, score);
+}
+
+/**
+ * Ranks [*first, *last) of the members whose score is within min and max
+ */
+static bool parse_score_range(Command *command, ZSet *zset, uint32_t *first,
+                              uint32_t *last) {
+  double min = 0;
+  double max = 0;
+  bool min_exclusive = false;
+  bool max_exclusive = false;
+  if (!parse_score_bound(&command->strings[2], &min, &min_exclusive) ||
+      !parse_score_bound(&command->strings[3], &max, &max_exclusive)) {
+    return false;
+  }
+
+  *first = zset ? zset_count_below(zset, min, min_exclusive) : 0;
+  *last = zset ? zset_count_below(zset, max, !max_exclusive) : 0;
+  if (*last < *first) {
+    *last = *first;
+  }
+  return true;
+}
+
+void execute_zcount(Command *command, Output *out) {
+  Entry *entry = NULL;
+  ZSet *zset = NULL;
+  if (lookup_zset(&command->strings[1], &entry, &zset, out) != 0) {
+    return;
+  }
+
+  uint32_t first = 0;
+  uint32_t last = 0;
+  if (!parse_score_range(command, zset, &first, &last)) {
+    return out_error(out, ERROR_ARGUMENT, "Min or max is not a valid number");
+  }
+  return out_integer(out, last - first);
+}
+
+void execute_zrangebyscore(Command *command, Output *out) {
+  // ZRANGEBYSCORE key min max [withscores] [limit offset count]
+  bool with_scores = false;
+  int64_t offset = 0;
+  int64_t limit = -1;
+  for (int i = 4; i < command->count; i++) {
+    if (is_option(&command->strings[i], "withscores")) {
+      with_scores = true;
+    } else if (is_option(&command->strings[i], "limit") &&
+               i + 2 < command->count &&
+               view_to_int64(&command->strings[i + 1], &offset) &&
+               view_to_int64(&command->strings[i + 2], &limit)) {
+      i += 2;
+    } else {
+      return out_error(out, ERROR_ARGUMENT, "Syntax error");
+    }
+  }
+
+  Entry *entry = NULL;
+  ZSet *zset = NULL;
+  if (lookup_zset(&command->strings[1], &entry, &zset, out) != 0) {
+    return;
+  }
+
+  uint32_t first = 0;
+  uint32_t last = 0;
+  if (!parse_score_range(command, zset, &first, &last)) {
+    return out_error(out, ERROR_ARGUMENT, "Min or max is not a valid number");
+  }
+
+  // A negative limit returns every member after the offset
+  uint64_t count = last - first;
+  if (offset < 0 || (uint64_t)offset >= count) {
+    return out_array(out, 0);
+  }
+  count -= (uint64_t)offset;
+  if (limit >= 0 && (uint64_t)limit < count) {
+    count = (uint64_t)limit;
+  }
+  out_zset_range(out, zset, first + (uint32_t)offset, (uint32_t)count,
+                 with_scores);
+}
+
+/**
+ * Look up the hash of a key, *hash is NULL if the key is missing. Returns -1
+ * after writing an error if the key holds another type.
+ */
+static int lookup_hash(const StringView *view, Entry **entry, Hash **hash,
+                       Output *out) {
+  EntryKey key;
+  view_key(&key, view);
+  *entry = lookup_entry(&key);
+  *hash = NULL;
+  if (!*entry) {
+    return 0;
+  }
+  if ((*entry)->type != OBJECT_HASH) {
+    out_wrong_type(out);
+    return -1;
+  }
+  *hash = (Hash *)entry_object(*entry);
+  return 0;
+}
+
+/**
+ * Store a new, empty hash under a missing key
+ */
+static Entry *create_hash_entry(const StringView *name, Hash **hash) {
+  *hash = create_hash();
+  Entry *entry = create_object_entry(name->chars, name->length, OBJECT_HASH,
+                                     *hash,
+                                     hash_string(name->chars, name->length));
+  insert_map(&g_data.db, &entry->node);
+  touch_entry(entry, get_monotonic_ms(), true);
+  return entry;
+}
+
+void execute_hset(Command *command, Output *out) {
+  // HSET key field value [field value ...]
+  if (!ensure_memory(out)) {
+    return;
+  }
+
+  Entry *entry = NULL;
+  Hash *hash = NULL;
+  if (lookup_hash(&command->strings[1], &entry, &hash, out) != 0) {
+    return;
+  }
+  if (!hash) {
+    entry = create_hash_entry(&command->strings[1], &hash);
+  } else {
+    g_data.entry_memory -= entry_memory(entry);
+  }
+
+  int64_t added = 0;
+  for (int i = 2; i + 1 < command->count; i += 2) {
+    const StringView *field = &command->strings[i];
+    const StringView *value = &command->strings[i + 1];
+    added += hash_set(hash, field->chars, field->length, value->chars,
+                      value->length);
+  }
+  g_data.entry_memory += entry_memory(entry);
+  propagate_command(command);
+  return out_integer(out, added);
+}
+
+void execute_hget(Command *command, Output *out) {
+  Entry *entry = NULL;
+  Hash *hash = NULL;
+  if (lookup_hash(&command->strings[1], &entry, &hash, out) != 0) {
+    return;
+  }
+
+  const StringView *field = &command->strings[2];
+  const char *value = NULL;
+  uint32_t length = 0;
+  if (!hash || !hash_get(hash, field->chars, field->length, &value, &length)) {
+    return out_nil(out);
+  }
+  return out_string(out, value, length);
+}
+
+void execute_hmget(Command *command, Output *out) {
+  Entry *entry = NULL;
+  Hash *hash = NULL;
+  if (lookup_hash(&command->strings[1], &entry, &hash, out) != 0) {
+    return;
+  }
+
+  out_array(out, (uint32_t)command->count - 2);
+  for (int i = 2; i < command->count; i++) {
+    const StringView *field = &command->strings[i];
+    const char *value = NULL;
+    uint32_t length = 0;
+    if (hash && hash_get(hash, field->chars, field->length, &value, &length)) {
+      out_string(out, value, length);
+    } else {
+      out_nil(out);
+    }
+  }
+}
+
+static void out_hash_field(const char *field, uint32_t field_length,
+                           const char *value, uint32_t value_length,
+                           void *arg) {
+  Output *out = (Output *)arg;
+  out_string(out, field, field_length);
+  out_string(out, value, value_length);
+}
+
+void execute_hgetall(Command *command, Output *out) {
+  Entry *entry = NULL;
+  Hash *hash = NULL;
+  if (lookup_hash(&command->strings[1], &entry, &hash, out) != 0) {
+    return;
+  }
+  if (!hash) {
+    return out_array(out, 0);
+  }
+
+  out_array(out, hash->size * 2);
+  hash_scan(hash, &out_hash_field, out);
+}
+
+void execute_hdel(Command *command, Output *out) {
+  Entry *entry = NULL;
+  Hash *hash = NULL;
+  if (lookup_hash(&command->strings[1], &entry, &hash, out) != 0) {
+    return;
+  }
+  if (!hash) {
+    return out_integer(out, 0);
+  }
+
+  g_data.entry_memory -= entry_memory(entry);
+  int64_t removed = 0;
+  for (int i = 2; i < command->count; i++) {
+    const StringView *field = &command->strings[i];
+    removed += hash_remove(hash, field->chars, field->length);
+  }
+  g_data.entry_memory += entry_memory(entry);
+
+  if (hash->size == 0) {
+    delete_entry(entry); // Empty hashes do not exist
+  }
+  if (removed) {
+    propagate_command(command);
+  }
+  return out_integer(out, removed);
+}
+
+void execute_hincrby(Command *command, Output *out) {
+  int64_t delta = 0;
+  if (!view_to_int64(&command->strings[3], &delta)) {
+    return out_error(out, ERROR_ARGUMENT, "Increment is not an integer");
+  }
+  if (!ensure_memory(out)) {
+    return;
+  }
+
+  Entry *entry = NULL;
+  Hash *hash = NULL;
+  if (lookup_hash(&command->strings[1], &entry, &hash, out) != 0) {
+    return;
+  }
+
+  // A missing field counts from 0
+  const StringView *field = &command->strings[2];
+  StringView value = {NULL, 0};
+  int64_t number = 0;
+  bool found = hash && hash_get(hash, field->chars, field->length,
+                                &value.chars, &value.length);
+  if (found && !view_to_int64(&value, &number)) {
+    return out_error(out, ERROR_ARGUMENT, "Hash value is not an integer");
+  }
+  if ((delta > 0 && number > INT64_MAX - delta) ||
+      (delta < 0 && number < INT64_MIN - delta)) {
+    return out_error(out, ERROR_ARGUMENT, "Increment would overflow");
+  }
+
+  if (!hash) {
+    entry = create_hash_entry(&command->strings[1], &hash);
+  } else {
+    g_data.entry_memory -= entry_memory(entry);
+  }
+  number += delta;
+  char text[24];
+  int length = snprintf(text, sizeof(text), "%lld", (long long)number);
+  hash_set(hash, field->chars, field->length, text, (uint32_t)length);
+  g_data.entry_memory += entry_memory(entry);
+
+  // Logged as the value it sets, like increments of strings, see
+  // propagate_number. HSET keeps the TTL.
+  StringView args[4] = {
+      {"hset", 4}, command->strings[1], *field, {text, (uint32_t)length}};
+  propagate(args, 4);
+  return out_integer(out, number);
+}
+
+/**
+ * Clocks read once per snapshot, to convert deadlines between the monotonic
+ * clock and the Unix time saved in the file
+ */
+typedef struct {
+  SnapshotWriter *writer;
+  uint64_t now;
+  int64_t now_unix;
+} SnapshotScan;
+
+static void write_snapshot_field(const char *field, uint32_t field_length,
+                                 const char *value, uint32_t value_length,
+                                 void *arg) {
+  SnapshotWriter *writer = (SnapshotWriter *)arg;
+  snapshot_write(writer, &field_length, 4);
+  snapshot_write(writer, field, field_length);
+  snapshot_write(writer, &value_length, 4);
+  snapshot_write(writer, value, value_length);
+}
+
+static void write_snapshot_entry(HashNode *node, void *arg) {
+  SnapshotScan *scan = (SnapshotScan *)arg;
+  SnapshotWriter *writer = scan->writer;
+  Entry *entry = CONTAINER_OF(node, Entry, node);
+
+  // Numbers are saved as their text, and parsed again when loaded
+  uint8_t head[2] = {is_string_entry(entry) ? OBJECT_STRING : entry->type, 0};
+  if (entry->heap_index) {
+    head[1] |= SNAPSHOT_HAS_DEADLINE;
+  }
+  snapshot_write(writer, head, 2);
+  snapshot_write(writer, &entry->key_length, 4);
+  if (entry->heap_index) {
+    uint64_t deadline = g_data.expiry.items[entry->heap_index - 1].value;
+    int64_t unix_deadline =
+        deadline_to_unix_ms(deadline, scan->now, scan->now_unix);
+    snapshot_write(writer, &unix_deadline, 8);
+  }
+  snapshot_write(writer, entry_key(entry), entry->key_length);
+
+  if (entry->type == OBJECT_NUMBER) {
+    char text[K_NUMBER_TEXT_MAX];
+    Number number = entry_number(entry);
+    uint32_t length = format_number(&number, text);
+    snapshot_write(writer, &length, 4);
+    snapshot_write(writer, text, length);
+    return;
+  }
+  if (entry->type == OBJECT_STRING) {
+    snapshot_write(writer, &entry->value_length, 4);
+    snapshot_write(writer, entry_value(entry), entry->value_length);
+    return;
+  }
+
+  if (entry->type == OBJECT_HASH) {
+    Hash *hash = (Hash *)entry_object(entry);
+    snapshot_write(writer, &hash->size, 4);
+    hash_scan(hash, &write_snapshot_field, writer);
+    return;
+  }
+
+  assert(entry->type == OBJECT_ZSET);
+  ZSet *zset = (ZSet *)entry_object(entry);
+  snapshot_write(writer, &zset->size, 4);
+
+  ZSetIterator it;
+  const char *member = NULL;
+  uint32_t length = 0;
+  double score = 0;
+  zset_seek(zset, 0, &it);
+  while (zset_next(&it, &member, &length, &score)) {
+    snapshot_write(writer, &score, 8);
+    snapshot_write(writer, &length, 4);
+    snapshot_write(writer, member, length);
+  }
+}
+
+/**
+ * Write the shard of the calling worker to its snapshot file. Nothing is
+ * allocated, so this also runs in a child forked by BGSAVE.
+ */
+static int save_shard(void) {
+  char path[PATH_MAX];
+  if (get_shard_path(path, sizeof(path), g_config.snapshot_path,
+                        current_worker_id())) {
+    return -1;
+  }
+
+  SnapshotHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, K_SNAPSHOT_MAGIC, 8);
+  header.version = K_SNAPSHOT_VERSION;
+  header.shard = current_worker_id();
+  header.nshards = get_worker_count();
+  header.count = get_map_size(&g_data.db);
+  header.saved_at_ms = get_realtime_ms();
+
+  SnapshotWriter writer;
+  if (open_snapshot_writer(&writer, path, &header)) {
+    return -1;
+  }
+  SnapshotScan scan = {&writer, get_monotonic_ms(), header.saved_at_ms};
+  scan_map(&g_data.db, &write_snapshot_entry, &scan);
+  return close_snapshot_writer(&writer);
+}
+
+static void finish_save(bool ok, uint64_t keys) {
+  g_data.last_save_failed = !ok;
+  if (ok) {
+    g_data.last_save_keys = keys;
+    g_data.last_save_ms = get_realtime_ms();
+  }
+}
+
+void execute_save(Command *command, Output *out) {
+  (void)command;
+  uint64_t keys = get_map_size(&g_data.db);
+  if (save_shard()) {
+    finish_save(false, 0);
+    return out_error(out, ERROR_IO, "Snapshot failed");
+  }
+  finish_save(true, keys);
+  out_integer(out, (int64_t)keys);
+}
+
+void execute_bgsave(Command *command, Output *out) {
+  (void)command;
+  if (g_data.save_child) {
+    return out_error(out, ERROR_IO, "Background save already in progress");
+  }
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    return out_error(out, ERROR_IO, "fork() failed");
+  }
+  if (pid == 0) {
+    // The child has a copy-on-write image of the shard as of now
+    _exit(save_shard() ? 1 : 0);
+  }
+
+  g_data.save_child = pid;
+  g_data.save_keys = get_map_size(&g_data.db);
+  out_integer(out, 1);
+}
+
+void check_background_save(void) {
+  if (!g_data.save_child) {
+    return;
+  }
+
+  int status = 0;
+  pid_t pid = waitpid(g_data.save_child, &status, WNOHANG);
+  if (pid == 0 || (pid < 0 && errno == EINTR)) {
+    return; // Still running
+  }
+
+  bool ok = pid > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+  if (!ok) {
+    msg("Background save failed");
+  }
+  finish_save(ok, g_data.save_keys);
+  g_data.save_child = 0;
+}
+
+/**
+ * Read one record into the shard, or skip it if the key belongs to another
+ * shard or has expired. Returns -1 if the record is truncated or unknown.
+ */
+static int load_snapshot_entry(SnapshotReader *reader, uint64_t now,
+                               int64_t now_unix) {
+  const uint8_t *head = snapshot_read(reader, 6);
+  if (!head) {
+    return -1;
+  }
+  uint8_t type = head[0];
+  uint32_t key_length = 0;
+  memcpy(&key_length, &head[2], 4);
+
+  int64_t deadline = 0;
+  if (head[1] & SNAPSHOT_HAS_DEADLINE) {
+    const uint8_t *p = snapshot_read(reader, 8);
+    if (!p) {
+      return -1;
+    }
+    memcpy(&deadline, p, 8);
+  }
+
+  const char *key = (const char *)snapshot_read(reader, key_length);
+  if (!key) {
+    return -1;
+  }
+  StringView view = {key, key_length};
+  EntryKey probe;
+  view_key(&probe, &view);
+
+  // Files hold keys of every shard, and may repeat keys
+  uint64_t expiry = unix_ms_to_deadline(deadline, now, now_unix);
+  bool keep = !(deadline && !expiry) && owns_key(&probe) &&
+              !lookup_map(&g_data.db, &probe.node, &entry_eq);
+
+  Entry *entry = NULL;
+  const uint8_t *p = snapshot_read(reader, 4);
+  if (!p) {
+    return -1;
+  }
+  uint32_t length = 0;
+  memcpy(&length, p, 4);
+
+  if (type == OBJECT_STRING) {
+    const char *value = (const char *)snapshot_read(reader, length);
+    if (!value) {
+      return -1;
+    }
+    if (keep) {
+      entry = create_entry(key, key_length, value, length, probe.node.hashcode);
+    }
+  } else if (type == OBJECT_ZSET) {
+    ZSet *zset = keep ? create_zset() : NULL;
+    for (uint32_t i = 0; i < length; i++) {
+      const uint8_t *item = snapshot_read(reader, 12);
+      uint32_t member_length = 0;
+      const char *member = NULL;
+      if (item) {
+        memcpy(&member_length, &item[8], 4);
+        member = (const char *)snapshot_read(reader, member_length);
+      }
+      if (!member) {
+        if (zset) {
+          free_zset(zset);
+        }
+        return -1;
+      }
+      if (zset) {
+        double score = 0;
+        memcpy(&score, item, 8);
+        zset_add(zset, member, member_length, score);
+      }
+    }
+    if (keep) {
+      entry = create_object_entry(key, key_length, OBJECT_ZSET, zset,
+                                  probe.node.hashcode);
+    }
+  } else if (type == OBJECT_HASH) {
+    Hash *hash = keep ? create_hash() : NULL;
+    for (uint32_t i = 0; i < length; i++) {
+      uint32_t field_length = 0;
+      uint32_t value_length = 0;
+      const char *field = NULL;
+      const char *value = NULL;
+      if ((p = snapshot_read(reader, 4))) {
+        memcpy(&field_length, p, 4);
+        field = (const char *)snapshot_read(reader, field_length);
+      }
+      if (field && (p = snapshot_read(reader, 4))) {
+        memcpy(&value_length, p, 4);
+        value = (const char *)snapshot_read(reader, value_length);
+      }
+      if (!value) {
+        if (hash) {
+          free_hash(hash);
+        }
+        return -1;
+      }
+      if (hash) {
+        hash_set(hash, field, field_length, value, value_length);
+      }
+    }
+    if (keep) {
+      entry = create_object_entry(key, key_length, OBJECT_HASH, hash,
+                                  probe.node.hashcode);
+    }
+  } else {
+    return -1;
+  }
+
+  if (entry) {
+    insert_map(&g_data.db, &entry->node);
+    g_data.entry_memory += entry_memory(entry);
+    touch_entry(entry, now, true);
+    if (deadline) {
+      set_entry_deadline(entry, expiry);
+    }
+    g_data.loaded_keys++;
+  }
+  return 0;
+}
+
+void load_snapshot(void) {
+  char path[PATH_MAX];
+  SnapshotHeader first;
+  if (get_shard_path(path, sizeof(path), g_config.snapshot_path, 0) ||
+      read_snapshot_header(path, &first)) {
+    return; // No snapshot
+  }
+
+  // The hash seed is new, so the keys of this shard may be in any file
+  uint32_t nshards = get_worker_count();
+  uint64_t now = get_monotonic_ms();
+  int64_t now_unix = get_realtime_ms();
+  for (uint32_t i = 0; i < first.nshards; i++) {
+    SnapshotReader reader;
+    if (get_shard_path(path, sizeof(path), g_config.snapshot_path, i) ||
+        open_snapshot_reader(&reader, path)) {
+      fprintf(stderr, "Ignoring missing or corrupt snapshot %s\n", path);
+      continue;
+    }
+    if (reader.header.nshards != first.nshards) {
+      fprintf(stderr, "Ignoring snapshot %s of another save\n", path);
+      close_snapshot_reader(&reader);
+      continue;
+    }
+
+    // Skip the resizes of the map, only the first presize takes effect
+    reserve_map(&g_data.db, reader.header.count * first.nshards / nshards);
+
+    for (uint64_t n = 0; n < reader.header.count; n++) {
+      if (load_snapshot_entry(&reader, now, now_unix)) {
+        fprintf(stderr, "Snapshot %s is truncated\n", path);
+        break;
+      }
+    }
+    close_snapshot_reader(&reader);
+  }
+}
+
+typedef struct {
+  void (*emit)(const StringView *args, uint32_t n, void *arg);
+  void *arg;
+  uint64_t now;
+  int64_t now_unix;
+} CommandScan;
+
+/**
+ * Fields of a hash being added to HSET commands, in batches
+ */
+typedef struct {
+  CommandScan *scan;
+  StringView args[2 + 2 * K_REWRITE_HSET_BATCH];
+  uint32_t n;
+} HashRewrite;
+
+static void emit_hash_field(const char *field, uint32_t field_length,
+                            const char *value, uint32_t value_length,
+                            void *arg) {
+  HashRewrite *rewrite = (HashRewrite *)arg;
+  rewrite->args[2 + 2 * rewrite->n] = (StringView){field, field_length};
+  rewrite->args[3 + 2 * rewrite->n] = (StringView){value, value_length};
+  if (++rewrite->n == K_REWRITE_HSET_BATCH) {
+    rewrite->scan->emit(rewrite->args, 2 + 2 * rewrite->n, rewrite->scan->arg);
+    rewrite->n = 0;
+  }
+}
+
+static void emit_entry_commands(HashNode *node, void *arg) {
+  CommandScan *scan = (CommandScan *)arg;
+  Entry *entry = CONTAINER_OF(node, Entry, node);
+  if (is_entry_expired(entry, scan->now)) {
+    return;
+  }
+
+  StringView key = {entry_key(entry), entry->key_length};
+  if (entry->type == OBJECT_NUMBER) {
+    char text[K_NUMBER_TEXT_MAX];
+    Number number = entry_number(entry);
+    StringView args[3] = {
+        {"set", 3}, key, {text, format_number(&number, text)}};
+    scan->emit(args, 3, scan->arg);
+  } else if (entry->type == OBJECT_STRING) {
+    StringView args[3] = {
+        {"set", 3}, key, {entry_value(entry), entry->value_length}};
+    scan->emit(args, 3, scan->arg);
+  } else if (entry->type == OBJECT_HASH) {
+    HashRewrite rewrite;
+    rewrite.scan = scan;
+    rewrite.args[0] = (StringView){"hset", 4};
+    rewrite.args[1] = key;
+    rewrite.n = 0;
+    hash_scan((Hash *)entry_object(entry), &emit_hash_field, &rewrite);
+    if (rewrite.n > 0) {
+      scan->emit(rewrite.args, 2 + 2 * rewrite.n, scan->arg);
+    }
+  } else {
+    // Members are added in batches, the scores written back exactly
+    StringView args[2 + 2 * K_REWRITE_ZADD_BATCH];
+    char scores[K_REWRITE_ZADD_BATCH][32];
+    args[0] = (StringView){"zadd", 4};
+    args[1] = key;
+
+    ZSetIterator it;
+    const char *member = NULL;
+    uint32_t length = 0;
+    double score = 0;
+    uint32_t n = 0;
+    zset_seek((ZSet *)entry_object(entry), 0, &it);
+    while (zset_next(&it, &member, &length, &score)) {
+      int size = snprintf(scores[n], sizeof(scores[n]), "%.17g", score);
+      args[2 + 2 * n] = (StringView){scores[n], (uint32_t)size};
+      args[3 + 2 * n] = (StringView){member, length};
+      if (++n == K_REWRITE_ZADD_BATCH) {
+        scan->emit(args, 2 + 2 * n, scan->arg);
+        n = 0;
+      }
+    }
+    if (n > 0) {
+      scan->emit(args, 2 + 2 * n, scan->arg);
+    }
+  }
+
+  if (entry->heap_index) {
+    char text[24];
+    uint64_t deadline = g_data.expiry.items[entry->heap_index - 1].value;
+    int length = snprintf(
+        text, sizeof(text), "%lld",
+        (long long)deadline_to_unix_ms(deadline, scan->now, scan->now_unix));
+    StringView args[3] = {{"pexpireat", 9}, key, {text, (uint32_t)length}};
+    scan->emit(args, 3, scan->arg);
+  }
+}
+
+void write_shard_commands(void (*emit)(const StringView *args, uint32_t n,
+                                       void *arg),
+                          void *arg) {
+  CommandScan scan = {emit, arg, get_monotonic_ms(), get_realtime_ms()};
+  scan_map(&g_data.db, &emit_entry_commands, &scan);
+}
+
+size_t scan_shard_commands(size_t cursor, size_t count,
+                           void (*emit)(const StringView *args, uint32_t n,
+                                        void *arg),
+                           void *arg) {
+  CommandScan scan = {emit, arg, get_monotonic_ms(), get_realtime_ms()};
+  do {
+    cursor = scan_map_step(&g_data.db, cursor, &emit_entry_commands, &scan);
+  } while (cursor != 0 && --count > 0);
+  return cursor;
+}
+
+typedef struct {
+  uint64_t seed;
+  uint32_t source;
+  uint32_t nsources;
+  Entry *found[K_DROP_BATCH];
+  uint32_t count;
+  bool missed; // found was full, another pass is needed
+} DropScan;
+
+static void find_source_keys(HashNode *node, void *arg) {
+  DropScan *scan = (DropScan *)arg;
+  Entry *entry = CONTAINER_OF(node, Entry, node);
+  uint64_t hash =
+      hash_string_seeded(scan->seed, entry_key(entry), entry->key_length);
+  if (shard_of_hash(hash, scan->nsources) != scan->source) {
+    return;
+  }
+  if (scan->count < K_DROP_BATCH) {
+    scan->found[scan->count++] = entry;
+  } else {
+    scan->missed = true;
+  }
+}
+
+void drop_source_keys(uint64_t seed, uint32_t source, uint32_t nsources) {
+  // Entries are deleted between scan steps, which the cursor survives. A step
+  // visits a bucket or two; entries past K_DROP_BATCH are left to another pass
+  DropScan scan = {seed, source, nsources, {NULL}, 0, false};
+  do {
+    scan.missed = false;
+    size_t cursor = 0;
+    do {
+      cursor = scan_map_step(&g_data.db, cursor, &find_source_keys, &scan);
+      for (uint32_t i = 0; i < scan.count; i++) {
+        propagate_delete(scan.found[i]);
+        delete_entry(scan.found[i]);
+      }
+      scan.count = 0;
+    } while (cursor != 0);
+  } while (scan.missed);
+}
+
+void execute_bgrewriteaof(Command *command, Output *out) {
+  (void)command;
+  if (!g_config.aof_path) {
+    return out_error(out, ERROR_IO, "The append-only log is disabled");
+  }
+  if (start_aof_rewrite()) {
+    return out_error(out, ERROR_IO,
+                     "Rewrite already in progress, or fork() failed");
+  }
+  out_integer(out, 1);
+}
+
+static double fragmentation(uint64_t requested, uint64_t reserved) {
+  return reserved ? 1.0 - (double)requested / (double)reserved : 0.0;
+}
+
+static void info_memory(Output *out, uint32_t *count) {
+  SlabStats stats;
+  get_slab_stats(&stats);
+
+  uint64_t requested = 0;
+  uint64_t reserved = 0;
+  for (uint32_t i = 0; i < K_SLAB_CLASSES; i++) {
+    SlabClassStats *c = &stats.classes[i];
+    if (c->pages == 0) {
+      continue;
+    }
+    requested += c->requested;
+    reserved += c->pages * K_SLAB_PAGE_SIZE;
+    out_line(out, count,
+             "slab_class_%u:pages=%llu,used=%llu,slots=%llu,"
+             "fragmentation=%.3f",
+             c->slot_size, (unsigned long long)c->pages,
+             (unsigned long long)c->slots_used,
+             (unsigned long long)c->slots_capacity,
+             fragmentation(c->requested, c->pages * K_SLAB_PAGE_SIZE));
+  }
+
+  out_line(out, count, "slab_bytes_in_use:%llu", (unsigned long long)requested);
+  out_line(out, count, "slab_bytes_reserved:%llu",
+           (unsigned long long)reserved);
+  out_line(out, count, "slab_fragmentation:%.3f",
+           fragmentation(requested, reserved));
+  out_line(out, count, "large_objects:%llu",
+           (unsigned long long)stats.large_count);
+  out_line(out, count, "large_bytes:%llu",
+           (unsigned long long)stats.large_bytes);
+  out_line(out, count, "keyspace_table_bytes:%llu",
+           (unsigned long long)get_map_memory(&g_data.db));
+  out_line(out, count, "request_arena_peak:%llu",
+           (unsigned long long)request_arena()->peak);
+  out_line(out, count, "used_memory:%llu",
+           (unsigned long long)get_shard_memory());
+  out_line(out, count, "maxmemory:%llu",
+           (unsigned long long)get_shard_memory_limit());
+  out_line(out, count, "maxmemory_policy:%s",
+           get_eviction_policy_name(g_config.eviction));
+  out_line(out, count, "evicted_keys:%llu", (unsigned long long)g_data.evicted);
+}
+
+void execute_info(Command *command, Output *out) {
+  bool all = command->count < 2;
+  const StringView *section = all ? NULL : &command->strings[1];
+
+  // The number of lines is only known at the end, patch the array header
+  size_t header = out->size;
+  uint32_t count = 0;
+  out_array(out, 0);
+
+  out_line(out, &count, "shard:%u", current_worker_id());
+  out_line(out, &count, "keys:%llu",
+           (unsigned long long)get_map_size(&g_data.db));
+  out_line(out, &count, "expires:%u", g_data.expiry.size);
+  if (all || is_option(section, "memory")) {
+    info_memory(out, &count);
+  }
+  if (all || is_option(section, "persistence")) {
+    out_line(out, &count, "loaded_keys:%llu",
+             (unsigned long long)g_data.loaded_keys);
+    out_line(out, &count, "bgsave_in_progress:%d", g_data.save_child ? 1 : 0);
+    out_line(out, &count, "last_save_status:%s",
+             g_data.last_save_failed ? "err" : "ok");
+    out_line(out, &count, "last_save_keys:%llu",
+             (unsigned long long)g_data.last_save_keys);
+    out_line(out, &count, "last_save_time:%lld",
+             (long long)(g_data.last_save_ms / 1000));
+    out_aof_info(out, &count);
+  }
+  if (all || is_option(section, "replication")) {
+    out_replication_info(out, &count);
+  }
+  if (all || is_option(section, "commandstats")) {
+    out_command_stats(out, &count);
   }
 
-  return out_integer(out, node ? 1 : 0);
+  memcpy(&out->chars[header + 1], &count, 4);
 }
@@ -7,16 +7,265 @@
 
 #include <stdint.h>
 
-static struct {
-  Map db;
-} g_data;
+#define K_EXPIRE_WORK 128 // Most keys expired per event-loop iteration
+#define K_REHASH_STEP 1024 // Nodes rehashed between clock reads when idle
+
+#define K_SCAN_DEFAULT_COUNT 10
+#define K_SCAN_MAX_COUNT (1 << 20) // Larger SCAN counts are clamped
+#define K_SCAN_SHARD_SHIFT 55 // Cursor bits above hold the shard index
+#define K_SCAN_LOCAL_MASK ((1ull << K_SCAN_SHARD_SHIFT) - 1)
+
+#define K_REWRITE_ZADD_BATCH 64 // Members per ZADD of a log rewrite
+#define K_REWRITE_HSET_BATCH 64 // Fields per HSET of a log rewrite
+#define K_DROP_BATCH 64         // Entries deleted per step of drop_source_keys
+
+#define K_EVICTION_SAMPLES 5    // Keys sampled per eviction round
+#define K_EVICTION_POOL_SIZE 16 // Best candidates kept across rounds
+#define K_LFU_INIT 5            // Counter of new keys, not evicted at once
+#define K_LFU_LOG_FACTOR 10
+#define K_LFU_DECAY_MINUTES 1
 
 void execute_keys(Command *command, Output *out);
 
+/**
+ * @brief SCAN cursor [match pattern] [count n]: replies with the next cursor
+ * and a batch of about n keys (10 by default) matching the glob pattern. A
+ * full scan starts and ends with cursor 0, and returns every key present for
+ * its whole duration at least once. The top bits of the cursor select the
+ * shard, which are scanned one after the other.
+ */
+void execute_scan(Command *command, Output *out);
+
 void execute_get(Command *command, Output *out);
 
 void execute_set(Command *command, Output *out);
 
 void execute_delete(Command *command, Output *out);
 
+/**
+ * @brief MGET key [key ...]: an array with the value of each key, nil for
+ * missing keys and keys holding another type.
+ */
+void execute_mget(Command *command, Output *out);
+
+/**
+ * @brief MSET key value [key value ...]: set every key, clearing their TTLs.
+ * Replies with the number of keys set. A batch spanning several shards is not
+ * atomic.
+ */
+void execute_mset(Command *command, Output *out);
+
+/**
+ * @brief MSETNX key value [key value ...]: set every key if none of them
+ * exists, replies with 1 if they were set and 0 otherwise. The keys must hash
+ * to the same shard.
+ */
+void execute_msetnx(Command *command, Output *out);
+
+/**
+ * @brief MDEL key [key ...]: replies with the number of keys deleted.
+ */
+void execute_mdel(Command *command, Output *out);
+
+/**
+ * @brief INCR / DECR: add delta to the integer of a key, 0 if the key is
+ * missing, keeping its TTL. Replies with the new value.
+ */
+void execute_incr(Command *command, Output *out, int64_t delta);
+
+/**
+ * @brief INCRBY key increment: as INCR, by an integer increment.
+ */
+void execute_incrby(Command *command, Output *out);
+
+/**
+ * @brief INCRBYFLOAT key increment: add a double to the number of a key, 0 if
+ * the key is missing, keeping its TTL. Replies with the new value as text.
+ */
+void execute_incrbyfloat(Command *command, Output *out);
+
+/**
+ * @brief EXPIRE / PEXPIRE: set the TTL of a key, in units of unit_ms. A TTL
+ * which is not positive deletes the key.
+ */
+void execute_expire(Command *command, Output *out, int64_t unit_ms);
+
+/**
+ * @brief PEXPIREAT key unix_ms: set the deadline of a key as a Unix time in
+ * milliseconds, the form in which TTLs are logged. A deadline in the past
+ * deletes the key.
+ */
+void execute_pexpireat(Command *command, Output *out);
+
+/**
+ * @brief TTL / PTTL: time left before a key expires, in units of unit_ms. -1
+ * if the key has no TTL, -2 if it does not exist.
+ */
+void execute_ttl(Command *command, Output *out, int64_t unit_ms);
+
+void execute_persist(Command *command, Output *out);
+
+/**
+ * @brief ZADD key score member [score member ...]: add members to a sorted set
+ * or update their scores. Replies with the number of members added.
+ */
+void execute_zadd(Command *command, Output *out);
+
+/**
+ * @brief ZREM key member [member ...]: replies with the number of members
+ * removed. The key is deleted with its last member.
+ */
+void execute_zrem(Command *command, Output *out);
+
+void execute_zscore(Command *command, Output *out);
+
+void execute_zrank(Command *command, Output *out);
+
+/**
+ * @brief ZRANGE key start stop [withscores]: members by rank, negative ranks
+ * counting from the end.
+ */
+void execute_zrange(Command *command, Output *out);
+
+/**
+ * @brief ZRANGEBYSCORE key min max [withscores] [limit offset count]: members
+ * by score. Bounds are inclusive unless prefixed with "(", and may be "-inf" or
+ * "+inf".
+ */
+void execute_zrangebyscore(Command *command, Output *out);
+
+/**
+ * @brief ZCOUNT key min max: number of members with a score within the bounds.
+ */
+void execute_zcount(Command *command, Output *out);
+
+/**
+ * @brief HSET key field value [field value ...]: set fields of a hash.
+ * Replies with the number of fields added.
+ */
+void execute_hset(Command *command, Output *out);
+
+void execute_hget(Command *command, Output *out);
+
+/**
+ * @brief HMGET key field [field ...]: the value of each field, nil if it is
+ * missing.
+ */
+void execute_hmget(Command *command, Output *out);
+
+/**
+ * @brief HGETALL key: the fields of a hash and their values, alternating, in
+ * no particular order.
+ */
+void execute_hgetall(Command *command, Output *out);
+
+/**
+ * @brief HDEL key field [field ...]: replies with the number of fields
+ * removed. The key is deleted with its last field.
+ */
+void execute_hdel(Command *command, Output *out);
+
+/**
+ * @brief HINCRBY key field increment: add to the integer value of a field, a
+ * missing field counting as 0. Replies with the new value.
+ */
+void execute_hincrby(Command *command, Output *out);
+
+/**
+ * @brief Delete keys whose deadline has passed, at most K_EXPIRE_WORK of
+ * them. Called by the worker owning the shard before each poll; keys are also
+ * deleted lazily when accessed.
+ *
+ * @param timeout_ms Longest time the worker would sleep
+ *
+ * @return int how long the worker may sleep before the next deadline, capped
+ * to timeout_ms, 0 if expired keys are left
+ */
+int expire_keys(int timeout_ms);
+
+/**
+ * @brief Advance a resize of the keyspace for up to the configured rehash
+ * budget, so an idle shard finishes its resizes instead of keeping both
+ * tables until the next requests. Called by the worker owning the shard
+ * before each poll.
+ *
+ * @param timeout_ms Longest time the worker would sleep
+ * @param idle Whether the last poll found nothing to do. Otherwise nothing is
+ * moved yet, but the worker does not sleep either, so the next poll tells.
+ *
+ * @return int timeout_ms, or 0 if the resize is not finished
+ */
+int rehash_keys(int timeout_ms, bool idle);
+
+/**
+ * @brief SAVE: write the shard of the calling worker to its snapshot file,
+ * blocking it meanwhile. Replies with the number of keys saved. Every shard
+ * saves its own file, the counts are added up.
+ */
+void execute_save(Command *command, Output *out);
+
+/**
+ * @brief BGSAVE: fork a child writing the shard to its snapshot file, from a
+ * copy-on-write image, while the worker goes on serving. Replies with 1 per
+ * shard whose child started.
+ */
+void execute_bgsave(Command *command, Output *out);
+
+/**
+ * @brief BGREWRITEAOF: compact the append-only log of every shard in the
+ * background. Replies with 1 per shard whose rewrite started.
+ */
+void execute_bgrewriteaof(Command *command, Output *out);
+
+/**
+ * @brief Call emit with the commands rebuilding the shard of the calling
+ * worker: SET or batches of ZADD or HSET, then PEXPIREAT for keys with a
+ * TTL.
+ * Nothing is allocated, so this also runs in a forked child.
+ */
+void write_shard_commands(void (*emit)(const StringView *args, uint32_t n,
+                                       void *arg),
+                          void *arg);
+
+/**
+ * @brief Like write_shard_commands, a step at a time: emit the commands of
+ * the entries in about count buckets, from a scan_map_step cursor. Entries
+ * present during the whole scan are emitted at least once.
+ *
+ * @return size_t cursor of the next step, 0 when the scan is complete
+ */
+size_t scan_shard_commands(size_t cursor, size_t count,
+                           void (*emit)(const StringView *args, uint32_t n,
+                                        void *arg),
+                           void *arg);
+
+/**
+ * @brief Delete the keys of the calling worker's shard which another process
+ * routes to shard source of nsources with its hash seed: those a primary
+ * sends again from that shard on a full sync.
+ */
+void drop_source_keys(uint64_t seed, uint32_t source, uint32_t nsources);
+
+/**
+ * @brief Reap the BGSAVE child of the calling worker if it has exited, and
+ * record the outcome. Called by the worker before each poll.
+ */
+void check_background_save(void);
+
+/**
+ * @brief Fill the shard of the calling worker from the snapshot files, if
+ * any. Called by each worker before it starts serving. The hash seed is new
+ * on every start, so every file is read and the keys are filtered.
+ */
+void load_snapshot(void);
+
+/**
+ * @brief Report the state of the calling worker's shard as an array of
+ * "name:value" lines: key count, slab and arena usage for the "memory"
+ * section, snapshot and log state for "persistence", role and stream
+ * offsets for "replication", and per-command calls and latencies for
+ * "commandstats". Every shard reports, the replies are concatenated.
+ */
+void execute_info(Command *command, Output *out);
+
 #endif /* STORE_H */
@@ -0,0 +1,577 @@
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aof.h"
+#include "common.h"
+#include "connection.h"
+#include "store.h"
+#include "uring.h"
+#include "worker.h"
+
+enum {
+  OP_ACCEPT = 1,
+  OP_RECV = 2,
+  OP_SEND = 3,
+  OP_WAKE = 4,
+  OP_CANCEL = 5,
+};
+
+#define USER_DATA(op, fd) (((uint64_t)(op) << 32) | (uint32_t)(fd))
+#define USER_DATA_OP(data) ((uint32_t)((data) >> 32))
+#define USER_DATA_FD(data) ((int)(uint32_t)(data))
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                              unsigned flags, void *arg, size_t argsz) {
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                      arg, argsz);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg,
+                                 unsigned nr_args) {
+  return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/**
+ * Whether the kernel implements the opcodes the backend submits. Flags such
+ * as IORING_RECV_MULTISHOT are not listed by the probe, see on_recv for the
+ * fallback when they are missing.
+ */
+static bool probe_opcodes(int fd) {
+  static const uint8_t K_OPS[] = {IORING_OP_ACCEPT, IORING_OP_RECV,
+                                  IORING_OP_SEND, IORING_OP_READ,
+                                  IORING_OP_ASYNC_CANCEL};
+  size_t size = sizeof(struct io_uring_probe) +
+                IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe *probe = (struct io_uring_probe *)calloc(1, size);
+  if (!probe) {
+    return false;
+  }
+
+  bool supported =
+      sys_io_uring_register(fd, IORING_REGISTER_PROBE, probe,
+                            IORING_OP_LAST) == 0;
+  for (size_t i = 0; supported && i < sizeof(K_OPS); i++) {
+    supported = K_OPS[i] <= probe->last_op &&
+                (probe->ops[K_OPS[i]].flags & IO_URING_OP_SUPPORTED);
+  }
+  free(probe);
+  return supported;
+}
+
+static void recycle_buffer(Uring *ring, uint16_t bid) {
+  unsigned mask = K_URING_BUFFERS - 1;
+  struct io_uring_buf *buf = &ring->buf_ring->bufs[ring->buf_tail & mask];
+  buf->addr = (uint64_t)(uintptr_t)&ring->buffers[(size_t)bid *
+                                                   K_URING_BUFFER_SIZE];
+  buf->len = K_URING_BUFFER_SIZE;
+  buf->bid = bid;
+  ring->buf_tail++;
+  __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+  ring->free_buffers++;
+}
+
+static int32_t setup_buffer_ring(Uring *ring) {
+  ring->buf_ring_size = K_URING_BUFFERS * sizeof(struct io_uring_buf);
+  ring->buf_ring = mmap(NULL, ring->buf_ring_size, PROT_READ | PROT_WRITE,
+                        MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+  if (ring->buf_ring == MAP_FAILED) {
+    ring->buf_ring = NULL;
+    return -1;
+  }
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)(uintptr_t)ring->buf_ring;
+  reg.ring_entries = K_URING_BUFFERS;
+  reg.bgid = K_URING_GROUP;
+  if (sys_io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1)) {
+    return -1;
+  }
+
+  ring->buffers = (uint8_t *)malloc((size_t)K_URING_BUFFERS *
+                                    K_URING_BUFFER_SIZE);
+  if (!ring->buffers) {
+    return -1;
+  }
+  ring->buf_tail = 0;
+  ring->free_buffers = 0;
+  for (uint16_t bid = 0; bid < K_URING_BUFFERS; bid++) {
+    recycle_buffer(ring, bid);
+  }
+  return 0;
+}
+
+Uring *create_uring(void) {
+  Uring *ring = (Uring *)calloc(1, sizeof(Uring));
+  if (!ring) {
+    return NULL;
+  }
+  ring->fd = -1;
+
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_CQSIZE;
+  params.cq_entries = K_URING_ENTRIES * 8; // Room for multishot bursts
+  ring->fd = sys_io_uring_setup(K_URING_ENTRIES, &params);
+  if (ring->fd < 0 || !(params.features & IORING_FEAT_SINGLE_MMAP) ||
+      !(params.features & IORING_FEAT_EXT_ARG) || !probe_opcodes(ring->fd)) {
+    free_uring(ring);
+    return NULL;
+  }
+
+  // SQ and CQ rings share one mapping
+  size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cq_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  ring->rings_size = sq_size > cq_size ? sq_size : cq_size;
+  ring->rings = mmap(NULL, ring->rings_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->rings == MAP_FAILED || ring->sqes == MAP_FAILED) {
+    if (ring->rings == MAP_FAILED)
+      ring->rings = NULL;
+    if (ring->sqes == MAP_FAILED)
+      ring->sqes = NULL;
+    free_uring(ring);
+    return NULL;
+  }
+
+  uint8_t *base = (uint8_t *)ring->rings;
+  ring->sq_head = (unsigned *)(base + params.sq_off.head);
+  ring->sq_tail = (unsigned *)(base + params.sq_off.tail);
+  ring->sq_mask = *(unsigned *)(base + params.sq_off.ring_mask);
+  ring->sq_entries = params.sq_entries;
+  ring->sq_local_tail = *ring->sq_tail;
+  unsigned *array = (unsigned *)(base + params.sq_off.array);
+  for (unsigned i = 0; i < params.sq_entries; i++) {
+    array[i] = i; // SQEs are used in ring order
+  }
+  ring->cq_head = (unsigned *)(base + params.cq_off.head);
+  ring->cq_tail = (unsigned *)(base + params.cq_off.tail);
+  ring->cq_mask = *(unsigned *)(base + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(base + params.cq_off.cqes);
+
+  // Provided buffer rings came with multishot accept, multishot recv only
+  // came after them
+  if (setup_buffer_ring(ring) != 0) {
+    free_uring(ring);
+    return NULL;
+  }
+  ring->multishot_recv = true;
+  return ring;
+}
+
+void free_uring(Uring *ring) {
+  if (!ring)
+    return;
+  if (ring->sqes)
+    munmap(ring->sqes, ring->sqes_size);
+  if (ring->rings)
+    munmap(ring->rings, ring->rings_size);
+  if (ring->buf_ring)
+    munmap(ring->buf_ring, ring->buf_ring_size);
+  if (ring->fd >= 0)
+    close(ring->fd);
+  free(ring->buffers);
+  free(ring->starved);
+  free(ring);
+}
+
+/**
+ * Publish the prepared SQEs, submit them and wait for at least min_complete
+ * completions or the timeout.
+ */
+static void submit_and_wait(Uring *ring, unsigned min_complete,
+                            int timeout_ms) {
+  unsigned to_submit = ring->sq_local_tail - *ring->sq_tail;
+  __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+
+  struct __kernel_timespec ts;
+  ts.tv_sec = timeout_ms / 1000;
+  ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+
+  struct io_uring_getevents_arg arg;
+  memset(&arg, 0, sizeof(arg));
+  arg.sigmask_sz = _NSIG / 8;
+  arg.ts = (uint64_t)(uintptr_t)&ts;
+
+  unsigned flags = IORING_ENTER_EXT_ARG;
+  if (min_complete > 0) {
+    flags |= IORING_ENTER_GETEVENTS;
+  }
+
+  int rv = 0;
+  do {
+    rv = sys_io_uring_enter(ring->fd, to_submit, min_complete, flags, &arg,
+                            sizeof(arg));
+    if (rv > 0) {
+      to_submit -= (unsigned)rv < to_submit ? (unsigned)rv : to_submit;
+    }
+  } while (rv < 0 && (errno == EINTR || errno == EBUSY) && to_submit);
+
+  if (rv < 0 && errno != ETIME && errno != EINTR && errno != EBUSY) {
+    die("io_uring_enter()");
+  }
+}
+
+static struct io_uring_sqe *get_sqe(Uring *ring) {
+  unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  if (ring->sq_local_tail - head >= ring->sq_entries) {
+    // Submission queue full, submit what we have without waiting
+    submit_and_wait(ring, 0, 0);
+    head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sq_local_tail - head >= ring->sq_entries) {
+      die("io_uring submission queue full");
+    }
+  }
+
+  struct io_uring_sqe *sqe = &ring->sqes[ring->sq_local_tail & ring->sq_mask];
+  ring->sq_local_tail++;
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+static void prep_accept(Uring *ring, int listen_fd) {
+  struct io_uring_sqe *sqe = get_sqe(ring);
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = listen_fd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_CLOEXEC;
+  sqe->user_data = USER_DATA(OP_ACCEPT, listen_fd);
+}
+
+static void prep_wake(Uring *ring, int wake_fd) {
+  struct io_uring_sqe *sqe = get_sqe(ring);
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = wake_fd;
+  sqe->addr = (uint64_t)(uintptr_t)&ring->wake_value;
+  sqe->len = sizeof(ring->wake_value);
+  sqe->user_data = USER_DATA(OP_WAKE, wake_fd);
+}
+
+static void prep_recv(Uring *ring, Connection *conn) {
+  struct io_uring_sqe *sqe = get_sqe(ring);
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = conn->fd;
+  sqe->ioprio = ring->multishot_recv ? IORING_RECV_MULTISHOT : 0;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = K_URING_GROUP;
+  sqe->user_data = USER_DATA(OP_RECV, conn->fd);
+  conn->flags |= CONN_RECV_ARMED;
+  conn->inflight++;
+}
+
+static void prep_send(Uring *ring, Connection *conn) {
+  struct io_uring_sqe *sqe = get_sqe(ring);
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = conn->fd;
+  sqe->addr = (uint64_t)(uintptr_t)&conn->wbuf[conn->wbuf_sent];
+  sqe->len = (uint32_t)(conn->wbuf_size - conn->wbuf_sent);
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = USER_DATA(OP_SEND, conn->fd);
+  conn->flags |= CONN_SENDING;
+  conn->inflight++;
+}
+
+static void prep_cancel(Uring *ring, Connection *conn) {
+  struct io_uring_sqe *sqe = get_sqe(ring);
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = conn->fd;
+  sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+  sqe->user_data = USER_DATA(OP_CANCEL, conn->fd);
+}
+
+static void release_held_buffers(Uring *ring, Connection *conn) {
+  while (conn->held_head != K_NO_BUFFER) {
+    uint16_t bid = conn->held_head;
+    conn->held_head = ring->next[bid];
+    recycle_buffer(ring, bid);
+  }
+  conn->held_tail = K_NO_BUFFER;
+}
+
+static void hold_buffer(Uring *ring, Connection *conn, uint16_t bid,
+                        uint32_t length) {
+  ring->free_buffers--;
+  ring->next[bid] = K_NO_BUFFER;
+  ring->offset[bid] = 0;
+  ring->length[bid] = length;
+  if (conn->held_tail == K_NO_BUFFER) {
+    conn->held_head = bid;
+  } else {
+    ring->next[conn->held_tail] = bid;
+  }
+  conn->held_tail = bid;
+}
+
+static void mark_starved(Uring *ring, Connection *conn) {
+  if (conn->flags & CONN_STARVED)
+    return;
+
+  if (ring->starved_count == ring->starved_capacity) {
+    ring->starved_capacity =
+        ring->starved_capacity == 0 ? 8 : ring->starved_capacity * 2;
+    ring->starved =
+        realloc(ring->starved, ring->starved_capacity * sizeof(int));
+  }
+  ring->starved[ring->starved_count++] = conn->fd;
+  conn->flags |= CONN_STARVED;
+}
+
+/**
+ * End a connection whose socket failed or reached EOF. While other shards
+ * execute its request (STATE_WAIT), their messages point at the connection
+ * and its reading buffer, so it is only closed once the last reply is in.
+ */
+static void end_connection(Connection *conn) {
+  if (conn->state == STATE_WAIT) {
+    conn->flags |= CONN_PEER_CLOSED;
+  } else {
+    conn->state = STATE_END;
+  }
+}
+
+void pump_uring_connection(Worker *worker, Connection *conn) {
+  Uring *ring = worker->uring;
+
+  if ((conn->flags & CONN_PEER_CLOSED) && conn->state != STATE_WAIT) {
+    conn->state = STATE_END;
+  }
+
+  if (conn->flags & CONN_CLOSING) {
+    if (conn->inflight == 0) {
+      release_held_buffers(ring, conn);
+      destroy_connection(&worker->connections, NULL, conn);
+    }
+    return;
+  }
+
+  // Feed the held buffers while the connection accepts requests
+  if (conn->state == STATE_REQUEST) {
+    (void)connection_feed(conn, NULL, 0);
+  }
+  while (conn->state == STATE_REQUEST && conn->held_head != K_NO_BUFFER) {
+    uint16_t bid = conn->held_head;
+    uint8_t *data = &ring->buffers[(size_t)bid * K_URING_BUFFER_SIZE];
+    size_t n = connection_feed(conn, &data[ring->offset[bid]],
+                               ring->length[bid] - ring->offset[bid]);
+    ring->offset[bid] += (uint32_t)n;
+    if (ring->offset[bid] == ring->length[bid]) {
+      conn->held_head = ring->next[bid];
+      if (conn->held_head == K_NO_BUFFER) {
+        conn->held_tail = K_NO_BUFFER;
+      }
+      recycle_buffer(ring, bid);
+    }
+    if (n == 0) {
+      break; // The batched responses must be sent first
+    }
+  }
+
+  // One send for the whole batch of responses
+  if (conn->state == STATE_REQUEST && conn->wbuf_size > 0) {
+    conn->state = STATE_RESPOND;
+  }
+
+  if (conn->state == STATE_END) {
+    // Cancel what is in flight, the connection is freed on the last completion
+    conn->flags |= CONN_CLOSING;
+    if (conn->inflight == 0) {
+      release_held_buffers(ring, conn);
+      destroy_connection(&worker->connections, NULL, conn);
+    } else {
+      prep_cancel(ring, conn);
+    }
+    return;
+  }
+
+  if (conn->state == STATE_RESPOND && !(conn->flags & CONN_SENDING)) {
+    prep_send(ring, conn);
+  }
+
+  if (!(conn->flags & (CONN_RECV_ARMED | CONN_STARVED | CONN_PEER_CLOSED))) {
+    if (ring->free_buffers > 0) {
+      prep_recv(ring, conn);
+    } else {
+      mark_starved(ring, conn);
+    }
+  }
+
+  if (conn->held_head == K_NO_BUFFER) {
+    release_idle_buffers(conn);
+  }
+}
+
+static void rearm_starved(Worker *worker) {
+  Uring *ring = worker->uring;
+  while (ring->starved_count > 0 && ring->free_buffers > 0) {
+    int fd = ring->starved[--ring->starved_count];
+    if (fd >= worker->connections.capacity)
+      continue;
+    Connection *conn = worker->connections.connections[fd];
+    if (!conn || !(conn->flags & CONN_STARVED))
+      continue;
+    conn->flags &= ~CONN_STARVED;
+    pump_uring_connection(worker, conn);
+  }
+}
+
+static void on_accept(Worker *worker, struct io_uring_cqe *cqe) {
+  Uring *ring = worker->uring;
+
+  if (!(cqe->flags & IORING_CQE_F_MORE)) {
+    prep_accept(ring, worker->listen_fd); // Multishot ended, re-arm
+  }
+  if (cqe->res < 0) {
+    if (cqe->res != -EAGAIN && cqe->res != -EINTR) {
+      msg("accept() error");
+    }
+    return;
+  }
+
+  Connection *conn = create_connection(&worker->connections, cqe->res);
+  if (!conn) {
+    close(cqe->res);
+    return;
+  }
+  conn->flags |= CONN_ASYNC_IO;
+  pump_uring_connection(worker, conn);
+}
+
+static void on_recv(Worker *worker, Connection *conn,
+                    struct io_uring_cqe *cqe) {
+  Uring *ring = worker->uring;
+
+  if (!(cqe->flags & IORING_CQE_F_MORE)) {
+    conn->flags &= ~CONN_RECV_ARMED;
+    conn->inflight--;
+  }
+
+  if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+    uint16_t bid = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    if (conn->flags & CONN_CLOSING) {
+      recycle_buffer(ring, bid);
+    } else {
+      // Kept until the connection can take it
+      hold_buffer(ring, conn, bid, (uint32_t)cqe->res);
+    }
+  } else if (conn->flags & CONN_CLOSING) {
+    // Cancelled
+  } else if (cqe->res == -ENOBUFS) {
+    mark_starved(ring, conn);
+  } else if (cqe->res == -EINVAL && ring->multishot_recv) {
+    // The kernel has no multishot recv, re-armed as a single-shot one
+    msg("Multishot recv unsupported, using single-shot recv");
+    ring->multishot_recv = false;
+  } else if (cqe->res == 0) {
+    if (conn->rbuf_size > 0 || conn->held_head != K_NO_BUFFER) {
+      msg("Unexpected EOF");
+    } else {
+      msg("EOF");
+    }
+    end_connection(conn);
+  } else if (cqe->res < 0) {
+    msg("recv() error");
+    end_connection(conn);
+  }
+  pump_uring_connection(worker, conn);
+}
+
+static void on_send(Worker *worker, Connection *conn,
+                    struct io_uring_cqe *cqe) {
+  conn->flags &= ~CONN_SENDING;
+  conn->inflight--;
+
+  if (cqe->res < 0) {
+    if (!(conn->flags & CONN_CLOSING)) {
+      msg("write() error");
+      end_connection(conn);
+    }
+  } else if (!(conn->flags & CONN_CLOSING)) {
+    (void)connection_sent(conn, (size_t)cqe->res);
+  }
+  pump_uring_connection(worker, conn);
+}
+
+/**
+ * @return unsigned number of completions processed
+ */
+static unsigned process_completions(Worker *worker) {
+  Uring *ring = worker->uring;
+  unsigned head = *ring->cq_head;
+  unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+  unsigned count = tail - head;
+
+  for (; head != tail; head++) {
+    struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+    uint32_t op = USER_DATA_OP(cqe->user_data);
+    int fd = USER_DATA_FD(cqe->user_data);
+
+    if (op == OP_ACCEPT) {
+      on_accept(worker, cqe);
+      continue;
+    }
+    if (op == OP_WAKE) {
+      drain_inbox(worker);
+      prep_wake(ring, worker->wake_fd);
+      continue;
+    }
+    if (op == OP_CANCEL) {
+      continue;
+    }
+
+    Connection *conn = fd < worker->connections.capacity
+                           ? worker->connections.connections[fd]
+                           : NULL;
+    if (!conn) {
+      if (op == OP_RECV && (cqe->flags & IORING_CQE_F_BUFFER)) {
+        recycle_buffer(ring, (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT));
+      }
+      continue;
+    }
+
+    if (op == OP_RECV) {
+      on_recv(worker, conn, cqe);
+    } else if (op == OP_SEND) {
+      on_send(worker, conn, cqe);
+    }
+  }
+
+  __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+  return count;
+}
+
+void run_uring_worker(Worker *worker) {
+  Uring *ring = worker->uring;
+  prep_accept(ring, worker->listen_fd);
+  prep_wake(ring, worker->wake_fd);
+
+  bool idle = false; // The last wait completed nothing
+  while (true) {
+    flush_messages(worker);
+
+    // One submission for every SQE prepared in the last iteration
+    check_background_save();
+    flush_aof();
+    int timeout_ms = expire_keys(K_POLL_TIMEOUT_MS);
+    timeout_ms = rehash_keys(timeout_ms, idle);
+    bool wait = !worker->backlog && timeout_ms > 0;
+    submit_and_wait(ring, wait ? 1 : 0, timeout_ms);
+    idle = process_completions(worker) == 0;
+    rearm_starved(worker);
+  }
+}
@@ -0,0 +1,83 @@
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "connection.h"
+
+#define K_URING_ENTRIES 1024
+#define K_URING_BUFFERS 1024     // Provided buffers, must be a power of 2
+#define K_URING_BUFFER_SIZE 4096 // Bytes per provided buffer
+#define K_URING_GROUP 0          // Buffer group id of the provided buffer ring
+
+struct Worker;
+
+/**
+ * This structure is an io_uring instance driven through the raw syscalls: the
+ * mmap'ed submission and completion rings, plus a ring of provided buffers that
+ * the kernel picks from for multishot recv. Buffers received by a connection
+ * are chained through next[] until the connection consumed them.
+ */
+typedef struct Uring {
+  int fd;
+  // submission queue
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  unsigned sq_local_tail; // SQEs prepared but not published yet
+  struct io_uring_sqe *sqes;
+  // completion queue
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+  // mappings
+  void *rings;
+  size_t rings_size;
+  size_t sqes_size;
+  // provided buffers
+  struct io_uring_buf_ring *buf_ring;
+  size_t buf_ring_size;
+  uint8_t *buffers;
+  uint16_t buf_tail;
+  uint32_t free_buffers;
+  uint16_t next[K_URING_BUFFERS];
+  uint32_t offset[K_URING_BUFFERS];
+  uint32_t length[K_URING_BUFFERS];
+  // connections waiting for free buffers to re-arm their recv
+  int *starved;
+  size_t starved_count;
+  size_t starved_capacity;
+  uint64_t wake_value;
+  bool multishot_recv; // Cleared when the kernel rejects multishot recv
+} Uring;
+
+/**
+ * @brief Set up an io_uring instance with a provided buffer ring.
+ *
+ * @return Uring* the instance, or NULL if the kernel lacks io_uring, one of
+ * the opcodes used or provided buffer rings, in which case epoll must be used.
+ * Without multishot recv, each recv is re-armed after it completes.
+ */
+Uring *create_uring(void);
+
+void free_uring(Uring *ring);
+
+/**
+ * @brief Run the event loop of a worker on io_uring: multishot accept on the
+ * listener, multishot recv into provided buffers, and all sends of an
+ * iteration submitted with one io_uring_enter(). Never returns.
+ */
+void run_uring_worker(struct Worker *worker);
+
+/**
+ * @brief Continue driving a connection after its state changed: feed it the
+ * buffers it holds, submit its response, or start closing it.
+ */
+void pump_uring_connection(struct Worker *worker, Connection *connection);
+
+#endif /* URING_H */
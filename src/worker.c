@@ -0,0 +1,287 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "aof.h"
+#include "arena.h"
+#include "common.h"
+#include "connection.h"
+#include "event_loop.h"
+#include "repl.h"
+#include "request.h"
+#include "slab.h"
+#include "spsc.h"
+#include "store.h"
+#include "uring.h"
+#include "worker.h"
+
+static Worker *g_workers = NULL;
+static uint32_t g_nworkers = 0;
+static bool g_use_uring = false;
+static __thread Worker *tl_worker = NULL;
+
+static void initialize_worker(Worker *worker, uint32_t id, int listen_fd) {
+  worker->id = id;
+  worker->listen_fd = listen_fd;
+  worker->backlog = NULL;
+  worker->uring = NULL;
+  memset(worker->wake, 0, sizeof(worker->wake));
+  initialize_connection_array(&worker->connections);
+
+  worker->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (worker->wake_fd < 0) {
+    die("eventfd()");
+  }
+
+  worker->inbox = (SpscQueue *)calloc(g_nworkers, sizeof(SpscQueue));
+  for (uint32_t i = 0; i < g_nworkers; i++) {
+    initialize_spsc_queue(&worker->inbox[i], K_QUEUE_SIZE);
+  }
+}
+
+static bool try_send_message(Worker *self, Message *message) {
+  if (!push_spsc_queue(&g_workers[message->to].inbox[self->id], message)) {
+    return false;
+  }
+  self->wake[message->to] = true;
+  return true;
+}
+
+static void send_message(Worker *self, Message *message) {
+  if (!self->backlog && try_send_message(self, message)) {
+    return;
+  }
+
+  // Queue full: keep the message and retry on the next loop iteration
+  message->next = self->backlog;
+  self->backlog = message;
+}
+
+void flush_messages(Worker *self) {
+  Message **from = &self->backlog;
+  while (*from) {
+    Message *message = *from;
+    if (try_send_message(self, message)) {
+      *from = message->next;
+    } else {
+      from = &message->next;
+    }
+  }
+
+  // One wake-up per destination per loop iteration
+  for (uint32_t i = 0; i < g_nworkers; i++) {
+    if (self->wake[i]) {
+      wake_worker(i);
+      self->wake[i] = false;
+    }
+  }
+}
+
+void wake_worker(uint32_t id) {
+  uint64_t one = 1;
+  ssize_t rv = write(g_workers[id].wake_fd, &one, sizeof(one));
+  (void)rv; // EAGAIN means the counter is already non-zero
+}
+
+static Message *create_message(Worker *self, Connection *conn, uint32_t to) {
+  // Replies come back to this worker, which frees the message
+  Message *message = (Message *)slab_alloc(sizeof(Message));
+  message->next = NULL;
+  message->kind = MESSAGE_REQUEST;
+  message->from = self->id;
+  message->to = to;
+  message->connection = conn;
+  message->command = &conn->command;
+  initialize_output(&message->out);
+  return message;
+}
+
+uint32_t current_worker_id(void) { return tl_worker ? tl_worker->id : 0; }
+
+uint32_t get_worker_count(void) { return g_nworkers ? g_nworkers : 1; }
+
+bool dispatch_request(Connection *conn) {
+  Worker *self = tl_worker;
+  if (!self || g_nworkers < 2) {
+    return false;
+  }
+
+  int32_t shard = shard_of_request(&conn->command, g_nworkers);
+  if (shard == SHARD_LOCAL || shard == (int32_t)self->id) {
+    return false;
+  }
+
+  if (shard == SHARD_ALL) {
+    // Scatter to every other shard, the local part is gathered in conn->out
+    execute_request(&conn->command, &conn->out);
+    conn->pending = g_nworkers - 1;
+    for (uint32_t i = 0; i < g_nworkers; i++) {
+      if (i != self->id) {
+        send_message(self, create_message(self, conn, i));
+      }
+    }
+    return true;
+  }
+
+  conn->pending = 1;
+  send_message(self, create_message(self, conn, (uint32_t)shard));
+  return true;
+}
+
+static void finish_connection_io(Worker *self, Connection *conn) {
+  if (self->uring) {
+    pump_uring_connection(self, conn);
+    return;
+  }
+
+  if (conn->state != STATE_END) {
+    update_connection_interest(&self->loop, conn);
+  }
+  if (conn->state == STATE_END) {
+    // Destroy
+    destroy_connection(&self->connections, &self->loop, conn);
+  }
+}
+
+static void on_reply(Worker *self, Message *message) {
+  Connection *conn = message->connection;
+
+  if (conn->out.size == 0) {
+    // Take the response over
+    free_output(&conn->out);
+    conn->out = message->out;
+  } else {
+    merge_request_output(&conn->command, &conn->out, &message->out);
+    free_output(&message->out);
+  }
+  slab_free(message, sizeof(Message));
+
+  if (--conn->pending > 0) {
+    return;
+  }
+
+  complete_request(conn);
+  resume_connection(conn);
+  finish_connection_io(self, conn);
+}
+
+void drain_inbox(Worker *self) {
+  uint64_t count = 0;
+  ssize_t rv = read(self->wake_fd, &count, sizeof(count));
+  (void)rv; // Reset the counter before draining, EAGAIN is fine
+
+  for (uint32_t i = 0; i < g_nworkers; i++) {
+    Message *message = NULL;
+    while ((message = pop_spsc_queue(&self->inbox[i])) != NULL) {
+      if (message->kind == MESSAGE_REPLY) {
+        on_reply(self, message);
+        continue;
+      }
+
+      // Execute against the local shard and send the response back
+      execute_request(message->command, &message->out);
+      reset_arena(request_arena());
+      message->kind = MESSAGE_REPLY;
+      message->to = message->from;
+      message->from = self->id;
+      send_message(self, message);
+    }
+  }
+  apply_replication();
+}
+
+static void run_epoll_worker(Worker *self) {
+  initialize_event_loop(&self->loop);
+  if (event_loop_add(&self->loop, self->listen_fd, EVENT_READ) != 0 ||
+      event_loop_add(&self->loop, self->wake_fd, EVENT_READ) != 0) {
+    die("epoll_ctl()");
+  }
+
+  bool idle = false; // The last poll found nothing to do
+  while (true) {
+    flush_messages(self);
+
+    // Do not sleep while messages are waiting for room in a queue
+    check_background_save();
+    flush_aof();
+    int timeout_ms = expire_keys(K_POLL_TIMEOUT_MS);
+    timeout_ms = rehash_keys(timeout_ms, idle);
+    int n = event_loop_wait(&self->loop, self->backlog ? 0 : timeout_ms);
+    idle = n == 0;
+
+    for (int i = 0; i < n; i++) {
+      FiredEvent *event = &self->loop.fired[i];
+
+      if (event->fd == self->listen_fd) {
+        // Accept until the backlog is drained (edge-triggered)
+        while (accept_new_connection(&self->connections, &self->loop,
+                                     self->listen_fd) == 0) {
+        }
+        continue;
+      }
+
+      if (event->fd == self->wake_fd) {
+        drain_inbox(self);
+        continue;
+      }
+
+      // Process client fds
+      Connection *connection = self->connections.connections[event->fd];
+      if (connection == NULL)
+        continue;
+
+      connection_io(connection);
+      finish_connection_io(self, connection);
+    }
+  }
+}
+
+static void *run_worker(void *arg) {
+  Worker *self = (Worker *)arg;
+  tl_worker = self;
+  if (g_config.aof_path) {
+    open_aof();
+  } else {
+    load_snapshot();
+  }
+  start_replication();
+
+  if (g_use_uring) {
+    self->uring = create_uring();
+    if (self->uring) {
+      run_uring_worker(self);
+    } else {
+      msg("io_uring is not available, falling back to epoll");
+    }
+  }
+  run_epoll_worker(self);
+  return NULL;
+}
+
+void run_workers(int *listen_fds, uint32_t n, bool use_uring) {
+  if (n < 1 || n > K_MAX_WORKERS) {
+    die("run_workers()");
+  }
+
+  g_nworkers = n;
+  g_use_uring = use_uring;
+  g_workers = (Worker *)calloc(n, sizeof(Worker));
+  for (uint32_t i = 0; i < n; i++) {
+    initialize_worker(&g_workers[i], i, listen_fds[i]);
+  }
+
+  for (uint32_t i = 1; i < n; i++) {
+    if (pthread_create(&g_workers[i].thread, NULL, run_worker, &g_workers[i])) {
+      die("pthread_create()");
+    }
+  }
+  run_worker(&g_workers[0]);
+
+  for (uint32_t i = 1; i < n; i++) {
+    pthread_join(g_workers[i].thread, NULL);
+  }
+}
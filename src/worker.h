@@ -0,0 +1,106 @@
+#ifndef WORKER_H
+#define WORKER_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "connection.h"
+#include "encoding.h"
+#include "event_loop.h"
+#include "spsc.h"
+#include "uring.h"
+
+#define K_MAX_WORKERS 256
+#define K_QUEUE_SIZE 1024
+
+enum {
+  MESSAGE_REQUEST = 0,
+  MESSAGE_REPLY = 1,
+};
+
+/**
+ * This structure is a request forwarded to the worker owning its shard, and
+ * then sent back with the response. The command stays owned by the connection
+ * of the sending worker, which does not touch it until the reply arrives.
+ */
+typedef struct Message {
+  struct Message *next; // Link in the backlog of unsent messages
+  uint32_t kind;        // Either MESSAGE_REQUEST / MESSAGE_REPLY
+  uint32_t from;        // Worker the request came from
+  uint32_t to;          // Worker the message is sent to
+  Connection *connection;
+  Command *command;
+  Output out;
+} Message;
+
+/**
+ * This structure represents an event-loop thread. Each worker accepts on its
+ * own SO_REUSEPORT listener, serves its own connections and owns a private
+ * shard of the keyspace. inbox[i] carries the messages sent by worker i.
+ */
+typedef struct Worker {
+  uint32_t id;
+  pthread_t thread;
+  int listen_fd;
+  int wake_fd;
+  EventLoop loop;
+  ConnectionArray connections;
+  SpscQueue *inbox;
+  Message *backlog; // Messages which did not fit in a full queue
+  bool wake[K_MAX_WORKERS];
+  Uring *uring; // io_uring backend, NULL when running on epoll
+} Worker;
+
+/**
+ * @brief Start n workers serving the given listening sockets. Worker 0 runs on
+ * the calling thread, so this function only returns on shutdown.
+ *
+ * @param listen_fds Array of n non-blocking listening sockets
+ * @param n Number of workers
+ * @param use_uring Run the workers on io_uring when the kernel supports it,
+ * falling back to epoll otherwise
+ */
+void run_workers(int *listen_fds, uint32_t n, bool use_uring);
+
+/**
+ * @brief Index of the worker running on the calling thread, which is also the
+ * index of the shard it owns. 0 outside of the workers.
+ */
+uint32_t current_worker_id(void);
+
+/**
+ * @brief Number of workers, which is also the number of shards.
+ */
+uint32_t get_worker_count(void);
+
+/**
+ * @brief Forward the in-flight request of a connection to the workers owning
+ * its keys. Does nothing when the request belongs to the calling worker.
+ *
+ * @param connection Connection holding the parsed request
+ *
+ * @return bool true if the request was forwarded and will be completed when
+ * the replies arrive, false if it must be executed locally
+ */
+bool dispatch_request(Connection *connection);
+
+/**
+ * @brief Make a worker drain its inbox. Safe from any thread.
+ */
+void wake_worker(uint32_t id);
+
+/**
+ * @brief Execute the requests and apply the replies sent to a worker by the
+ * other workers, then the records from the primary on a replica. Called when
+ * the worker's wake_fd becomes readable.
+ */
+void drain_inbox(Worker *worker);
+
+/**
+ * @brief Retry the messages kept back by full queues, and wake up every worker
+ * which was sent a message since the last call.
+ */
+void flush_messages(Worker *worker);
+
+#endif /* WORKER_H */
@@ -0,0 +1,536 @@
+#include <string.h>
+
+#include "common.h"
+#include "entry.h"
+#include "object.h"
+#include "slab.h"
+#include "zset.h"
+
+#define K_PACKED_HEADER 12 // Score and length before the member of an item
+
+/**
+ * A member to look a node up with in the index
+ */
+typedef struct {
+  HashNode node;
+  const char *member;
+  uint32_t length;
+} ZMemberKey;
+
+static int compare_members(const char *lhs, uint32_t lhs_length,
+                           const char *rhs, uint32_t rhs_length) {
+  uint32_t n = lhs_length < rhs_length ? lhs_length : rhs_length;
+  int rv = memcmp(lhs, rhs, n);
+  if (rv != 0) {
+    return rv;
+  }
+  return lhs_length < rhs_length ? -1 : lhs_length > rhs_length ? 1 : 0;
+}
+
+/**
+ * Order of (score, member) pairs
+ */
+static int compare_items(double lhs_score, const char *lhs, uint32_t lhs_length,
+                         double rhs_score, const char *rhs,
+                         uint32_t rhs_length) {
+  if (lhs_score != rhs_score) {
+    return lhs_score < rhs_score ? -1 : 1;
+  }
+  return compare_members(lhs, lhs_length, rhs, rhs_length);
+}
+
+// Packed encoding
+
+typedef struct {
+  double score;
+  uint32_t length;
+  const char *member;
+} PackedItem;
+
+static uint32_t read_packed(const uint8_t *packed, uint32_t offset,
+                            PackedItem *item) {
+  const uint8_t *p = &packed[offset];
+  memcpy(&item->score, p, 8);
+  memcpy(&item->length, p + 8, 4);
+  item->member = (const char *)p + K_PACKED_HEADER;
+  return offset + K_PACKED_HEADER + item->length;
+}
+
+static bool find_packed(const ZSet *zset, const char *member, uint32_t length,
+                        uint32_t *offset, PackedItem *item) {
+  for (uint32_t o = 0; o < zset->packed_used;) {
+    uint32_t next = read_packed(zset->packed, o, item);
+    if (item->length == length && memcmp(item->member, member, length) == 0) {
+      *offset = o;
+      return true;
+    }
+    o = next;
+  }
+  return false;
+}
+
+static void remove_packed(ZSet *zset, uint32_t offset, uint32_t length) {
+  uint32_t end = offset + K_PACKED_HEADER + length;
+  memmove(&zset->packed[offset], &zset->packed[end], zset->packed_used - end);
+  zset->packed_used -= end - offset;
+  zset->size--;
+}
+
+static void insert_packed(ZSet *zset, const char *member, uint32_t length,
+                          double score) {
+  uint32_t needed = zset->packed_used + K_PACKED_HEADER + length;
+  if (needed > zset->packed_capacity) {
+    uint32_t capacity = zset->packed_capacity ? zset->packed_capacity : 64;
+    while (capacity < needed) {
+      capacity *= 2;
+    }
+    uint8_t *packed = (uint8_t *)slab_alloc(capacity);
+    memcpy(packed, zset->packed, zset->packed_used);
+    slab_free(zset->packed, zset->packed_capacity);
+    zset->memory += capacity - zset->packed_capacity;
+    zset->packed = packed;
+    zset->packed_capacity = capacity;
+  }
+
+  // Find the first item ordered after the new one
+  uint32_t offset = 0;
+  while (offset < zset->packed_used) {
+    PackedItem item;
+    uint32_t next = read_packed(zset->packed, offset, &item);
+    if (compare_items(item.score, item.member, item.length, score, member,
+                      length) > 0) {
+      break;
+    }
+    offset = next;
+  }
+
+  uint8_t *p = &zset->packed[offset];
+  memmove(p + K_PACKED_HEADER + length, p, zset->packed_used - offset);
+  memcpy(p, &score, 8);
+  memcpy(p + 8, &length, 4);
+  memcpy(p + K_PACKED_HEADER, member, length);
+  zset->packed_used += K_PACKED_HEADER + length;
+  zset->size++;
+}
+
+// Skiplist encoding
+
+static inline char *node_member(ZNode *node) {
+  return (char *)&node->levels[node->level];
+}
+
+static size_t node_size(uint32_t level, uint32_t length) {
+  return sizeof(ZNode) + level * sizeof(((ZNode *)NULL)->levels[0]) + length;
+}
+
+static uint32_t random_level(void) {
+  // Each level is kept with probability 1/4
+  static __thread uint64_t state = 0x2545f4914f6cdd1dull;
+  state ^= state << 13;
+  state ^= state >> 7;
+  state ^= state << 17;
+
+  uint32_t level = 1;
+  uint64_t bits = state;
+  while (level < K_ZSET_MAX_LEVEL && (bits & 3) == 0) {
+    level++;
+    bits >>= 2;
+  }
+  return level;
+}
+
+static ZNode *create_node(ZSet *zset, uint32_t level, const char *member,
+                          uint32_t length, double score) {
+  size_t size = node_size(level, length);
+  ZNode *node = (ZNode *)slab_alloc(size);
+  node->node.next = NULL;
+  node->node.hashcode = hash_string(member, length);
+  node->score = score;
+  node->backward = NULL;
+  node->length = length;
+  node->level = level;
+  for (uint32_t i = 0; i < level; i++) {
+    node->levels[i].forward = NULL;
+    node->levels[i].span = 0;
+  }
+  if (length) {
+    memcpy(node_member(node), member, length);
+  }
+  zset->memory += size;
+  return node;
+}
+
+static void destroy_node(ZSet *zset, ZNode *node) {
+  size_t size = node_size(node->level, node->length);
+  zset->memory -= size;
+  slab_free(node, size);
+}
+
+static bool node_eq(HashNode *lhs, HashNode *rhs) {
+  ZNode *node = CONTAINER_OF(lhs, ZNode, node);
+  ZMemberKey *key = CONTAINER_OF(rhs, ZMemberKey, node);
+  return node->length == key->length &&
+         memcmp(node_member(node), key->member, key->length) == 0;
+}
+
+static HashNode *find_node(ZSet *zset, const char *member, uint32_t length,
+                           bool detach) {
+  ZMemberKey key = {.member = member, .length = length};
+  key.node.next = NULL;
+  key.node.hashcode = hash_string(member, length);
+  return detach ? detach_map(&zset->index, &key.node, &node_eq)
+                : lookup_map(&zset->index, &key.node, &node_eq);
+}
+
+/**
+ * Link a node at its position in the skiplist, using its own level
+ */
+static void link_node(ZSet *zset, ZNode *node) {
+  ZNode *update[K_ZSET_MAX_LEVEL];
+  uint32_t rank[K_ZSET_MAX_LEVEL];
+  const char *member = node_member(node);
+
+  // Find the last node before the new one at each level
+  ZNode *x = zset->header;
+  for (int i = (int)zset->level - 1; i >= 0; i--) {
+    rank[i] = i == (int)zset->level - 1 ? 0 : rank[i + 1];
+    while (x->levels[i].forward &&
+           compare_items(x->levels[i].forward->score,
+                         node_member(x->levels[i].forward),
+                         x->levels[i].forward->length, node->score, member,
+                         node->length) < 0) {
+      rank[i] += x->levels[i].span;
+      x = x->levels[i].forward;
+    }
+    update[i] = x;
+  }
+
+  if (node->level > zset->level) {
+    for (uint32_t i = zset->level; i < node->level; i++) {
+      rank[i] = 0;
+      update[i] = zset->header;
+      update[i]->levels[i].span = zset->size;
+    }
+    zset->level = node->level;
+  }
+
+  for (uint32_t i = 0; i < node->level; i++) {
+    node->levels[i].forward = update[i]->levels[i].forward;
+    update[i]->levels[i].forward = node;
+    node->levels[i].span = update[i]->levels[i].span - (rank[0] - rank[i]);
+    update[i]->levels[i].span = (rank[0] - rank[i]) + 1;
+  }
+  // Levels above the node now skip one more node
+  for (uint32_t i = node->level; i < zset->level; i++) {
+    update[i]->levels[i].span++;
+  }
+
+  node->backward = update[0] == zset->header ? NULL : update[0];
+  if (node->levels[0].forward) {
+    node->levels[0].forward->backward = node;
+  } else {
+    zset->tail = node;
+  }
+  zset->size++;
+}
+
+static void unlink_node(ZSet *zset, ZNode *node) {
+  ZNode *update[K_ZSET_MAX_LEVEL];
+  const char *member = node_member(node);
+
+  ZNode *x = zset->header;
+  for (int i = (int)zset->level - 1; i >= 0; i--) {
+    while (x->levels[i].forward &&
+           compare_items(x->levels[i].forward->score,
+                         node_member(x->levels[i].forward),
+                         x->levels[i].forward->length, node->score, member,
+                         node->length) < 0) {
+      x = x->levels[i].forward;
+    }
+    update[i] = x;
+  }
+
+  for (uint32_t i = 0; i < zset->level; i++) {
+    if (update[i]->levels[i].forward == node) {
+      update[i]->levels[i].span += node->levels[i].span - 1;
+      update[i]->levels[i].forward = node->levels[i].forward;
+    } else {
+      update[i]->levels[i].span--;
+    }
+  }
+
+  if (node->levels[0].forward) {
+    node->levels[0].forward->backward = node->backward;
+  } else {
+    zset->tail = node->backward;
+  }
+  while (zset->level > 1 && !zset->header->levels[zset->level - 1].forward) {
+    zset->level--;
+  }
+  zset->size--;
+}
+
+static void add_node(ZSet *zset, const char *member, uint32_t length,
+                     double score) {
+  ZNode *node = create_node(zset, random_level(), member, length, score);
+  link_node(zset, node);
+  insert_map(&zset->index, &node->node);
+}
+
+static void convert_to_skiplist(ZSet *zset) {
+  uint8_t *packed = zset->packed;
+  uint32_t used = zset->packed_used;
+  uint32_t capacity = zset->packed_capacity;
+
+  zset->encoding = ZSET_SKIPLIST;
+  zset->size = 0;
+  zset->header = create_node(zset, K_ZSET_MAX_LEVEL, NULL, 0, 0);
+  zset->tail = NULL;
+  zset->level = 1;
+
+  // Items are already in order, so each is linked at the end
+  for (uint32_t offset = 0; offset < used;) {
+    PackedItem item;
+    offset = read_packed(packed, offset, &item);
+    add_node(zset, item.member, item.length, item.score);
+  }
+
+  slab_free(packed, capacity);
+  zset->memory -= capacity;
+  zset->packed = NULL;
+  zset->packed_used = 0;
+  zset->packed_capacity = 0;
+}
+
+ZSet *create_zset(void) {
+  ZSet *zset = (ZSet *)slab_alloc(sizeof(ZSet));
+  memset(zset, 0, sizeof(ZSet));
+  zset->encoding = ZSET_PACKED;
+  zset->memory = sizeof(ZSet);
+  return zset;
+}
+
+void free_zset(ZSet *zset) {
+  if (zset->encoding == ZSET_PACKED) {
+    slab_free(zset->packed, zset->packed_capacity);
+  } else {
+    ZNode *node = zset->header;
+    while (node) {
+      ZNode *next = node->levels[0].forward;
+      destroy_node(zset, node);
+      node = next;
+    }
+    free_map(&zset->index);
+  }
+  slab_free(zset, sizeof(ZSet));
+}
+
+size_t get_zset_memory(ZSet *zset) {
+  return zset->memory + get_map_memory(&zset->index);
+}
+
+bool zset_add(ZSet *zset, const char *member, uint32_t length, double score) {
+  if (zset->encoding == ZSET_PACKED) {
+    uint32_t offset = 0;
+    PackedItem item;
+    if (find_packed(zset, member, length, &offset, &item)) {
+      if (item.score != score) {
+        remove_packed(zset, offset, length);
+        insert_packed(zset, member, length, score);
+      }
+      return false;
+    }
+
+    if (zset->size < K_ZSET_PACKED_MAX_SIZE &&
+        length <= K_ZSET_PACKED_MAX_MEMBER) {
+      insert_packed(zset, member, length, score);
+      return true;
+    }
+    convert_to_skiplist(zset);
+  }
+
+  HashNode *found = find_node(zset, member, length, false);
+  if (!found) {
+    add_node(zset, member, length, score);
+    return true;
+  }
+
+  ZNode *node = CONTAINER_OF(found, ZNode, node);
+  if (node->score == score) {
+    return false;
+  }
+
+  // Moving within its neighbours keeps the node in place
+  ZNode *next = node->levels[0].forward;
+  if ((!node->backward || node->backward->score < score) &&
+      (!next || next->score > score)) {
+    node->score = score;
+    return false;
+  }
+
+  unlink_node(zset, node);
+  node->score = score;
+  link_node(zset, node);
+  return false;
+}
+
+bool zset_remove(ZSet *zset, const char *member, uint32_t length) {
+  if (zset->encoding == ZSET_PACKED) {
+    uint32_t offset = 0;
+    PackedItem item;
+    if (!find_packed(zset, member, length, &offset, &item)) {
+      return false;
+    }
+    remove_packed(zset, offset, length);
+    return true;
+  }
+
+  HashNode *found = find_node(zset, member, length, true);
+  if (!found) {
+    return false;
+  }
+  ZNode *node = CONTAINER_OF(found, ZNode, node);
+  unlink_node(zset, node);
+  destroy_node(zset, node);
+  return true;
+}
+
+bool zset_score(ZSet *zset, const char *member, uint32_t length,
+                double *score) {
+  if (zset->encoding == ZSET_PACKED) {
+    uint32_t offset = 0;
+    PackedItem item;
+    if (!find_packed(zset, member, length, &offset, &item)) {
+      return false;
+    }
+    *score = item.score;
+    return true;
+  }
+
+  HashNode *found = find_node(zset, member, length, false);
+  if (!found) {
+    return false;
+  }
+  *score = CONTAINER_OF(found, ZNode, node)->score;
+  return true;
+}
+
+int64_t zset_rank(ZSet *zset, const char *member, uint32_t length) {
+  if (zset->encoding == ZSET_PACKED) {
+    int64_t rank = 0;
+    for (uint32_t offset = 0; offset < zset->packed_used; rank++) {
+      PackedItem item;
+      offset = read_packed(zset->packed, offset, &item);
+      if (item.length == length && memcmp(item.member, member, length) == 0) {
+        return rank;
+      }
+    }
+    return -1;
+  }
+
+  HashNode *found = find_node(zset, member, length, false);
+  if (!found) {
+    return -1;
+  }
+  ZNode *node = CONTAINER_OF(found, ZNode, node);
+
+  // Add up the spans of the path to the node
+  uint64_t rank = 0;
+  ZNode *x = zset->header;
+  for (int i = (int)zset->level - 1; i >= 0; i--) {
+    while (x->levels[i].forward &&
+           compare_items(x->levels[i].forward->score,
+                         node_member(x->levels[i].forward),
+                         x->levels[i].forward->length, node->score, member,
+                         length) <= 0) {
+      rank += x->levels[i].span;
+      x = x->levels[i].forward;
+    }
+    if (x == node) {
+      break;
+    }
+  }
+  return (int64_t)rank - 1;
+}
+
+uint32_t zset_count_below(ZSet *zset, double score, bool inclusive) {
+  if (zset->encoding == ZSET_PACKED) {
+    uint32_t count = 0;
+    for (uint32_t offset = 0; offset < zset->packed_used; count++) {
+      PackedItem item;
+      offset = read_packed(zset->packed, offset, &item);
+      if (item.score > score || (!inclusive && item.score == score)) {
+        break;
+      }
+    }
+    return count;
+  }
+
+  uint32_t count = 0;
+  ZNode *x = zset->header;
+  for (int i = (int)zset->level - 1; i >= 0; i--) {
+    ZNode *next = NULL;
+    while ((next = x->levels[i].forward) &&
+           (next->score < score || (inclusive && next->score == score))) {
+      count += x->levels[i].span;
+      x = next;
+    }
+  }
+  return count;
+}
+
+void zset_seek(ZSet *zset, uint32_t rank, ZSetIterator *it) {
+  it->zset = zset;
+  it->offset = 0;
+  it->node = NULL;
+
+  if (zset->encoding == ZSET_PACKED) {
+    for (uint32_t i = 0; i < rank && it->offset < zset->packed_used; i++) {
+      PackedItem item;
+      it->offset = read_packed(zset->packed, it->offset, &item);
+    }
+    return;
+  }
+
+  if (rank >= zset->size) {
+    return;
+  }
+
+  // Follow the spans down to the node at 1-based rank + 1
+  uint32_t traversed = 0;
+  ZNode *x = zset->header;
+  for (int i = (int)zset->level - 1; i >= 0; i--) {
+    while (x->levels[i].forward && traversed + x->levels[i].span <= rank + 1) {
+      traversed += x->levels[i].span;
+      x = x->levels[i].forward;
+    }
+    if (traversed == rank + 1) {
+      break;
+    }
+  }
+  it->node = x;
+}
+
+bool zset_next(ZSetIterator *it, const char **member, uint32_t *length,
+               double *score) {
+  if (it->zset->encoding == ZSET_PACKED) {
+    if (it->offset >= it->zset->packed_used) {
+      return false;
+    }
+    PackedItem item;
+    it->offset = read_packed(it->zset->packed, it->offset, &item);
+    *member = item.member;
+    *length = item.length;
+    *score = item.score;
+    return true;
+  }
+
+  if (!it->node) {
+    return false;
+  }
+  *member = node_member(it->node);
+  *length = it->node->length;
+  *score = it->node->score;
+  it->node = it->node->levels[0].forward;
+  return true;
+}
@@ -0,0 +1,123 @@
+#ifndef ZSET_H
+#define ZSET_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "map.h"
+
+#define K_ZSET_PACKED_MAX_SIZE 128  // Larger sets are converted to a skiplist
+#define K_ZSET_PACKED_MAX_MEMBER 64 // So are sets with a longer member
+#define K_ZSET_MAX_LEVEL 32
+
+typedef enum {
+  ZSET_PACKED,
+  ZSET_SKIPLIST,
+} ZSetEncoding;
+
+/**
+ * A node of the skiplist, also linked in the member index. The member bytes
+ * are stored right after the levels.
+ */
+typedef struct ZNode {
+  HashNode node;
+  double score;
+  struct ZNode *backward;
+  uint32_t length; // Of the member
+  uint32_t level;
+  struct {
+    struct ZNode *forward;
+    uint32_t span; // Number of nodes skipped by forward
+  } levels[];
+} ZNode;
+
+/**
+ * A set of members ordered by (score, member).
+ *
+ * Small sets are packed in one buffer of items sorted by (score, member),
+ * each a double score, a 32-bit length and the member bytes, and are searched
+ * linearly. Larger sets are an order-statistic skiplist, whose spans give the
+ * rank of a node in O(log n), with a Map from member to node.
+ */
+typedef struct {
+  ZSetEncoding encoding;
+  uint32_t size;
+  size_t memory; // Bytes allocated, besides the index tables
+
+  // ZSET_PACKED
+  uint8_t *packed;
+  uint32_t packed_used;
+  uint32_t packed_capacity;
+
+  // ZSET_SKIPLIST
+  ZNode *header;
+  ZNode *tail;
+  uint32_t level;
+  Map index;
+} ZSet;
+
+/**
+ * A cursor over the members of a set in order
+ */
+typedef struct {
+  ZSet *zset;
+  uint32_t offset; // Next packed item
+  ZNode *node;     // Next skiplist node
+} ZSetIterator;
+
+ZSet *create_zset(void);
+
+void free_zset(ZSet *zset);
+
+/**
+ * @brief Bytes used by a set, for the memory limit.
+ */
+size_t get_zset_memory(ZSet *zset);
+
+/**
+ * @brief Add a member, or change its score.
+ *
+ * @return bool true if the member was added, false if it was updated
+ */
+bool zset_add(ZSet *zset, const char *member, uint32_t length, double score);
+
+/**
+ * @return bool true if the member was removed, false if it was missing
+ */
+bool zset_remove(ZSet *zset, const char *member, uint32_t length);
+
+/**
+ * @return bool false if the member is missing
+ */
+bool zset_score(ZSet *zset, const char *member, uint32_t length,
+                double *score);
+
+/**
+ * @brief 0-based rank of a member, in ascending order.
+ *
+ * @return int64_t the rank, or -1 if the member is missing
+ */
+int64_t zset_rank(ZSet *zset, const char *member, uint32_t length);
+
+/**
+ * @brief Number of members whose score is below a value, or at most the value
+ * if inclusive. This is also the rank of the first member above it.
+ */
+uint32_t zset_count_below(ZSet *zset, double score, bool inclusive);
+
+/**
+ * @brief Position an iterator on the member of a 0-based rank.
+ */
+void zset_seek(ZSet *zset, uint32_t rank, ZSetIterator *it);
+
+/**
+ * @brief Read the member under an iterator and move it forward. The member
+ * stays valid until the set is modified.
+ *
+ * @return bool false past the last member
+ */
+bool zset_next(ZSetIterator *it, const char **member, uint32_t *length,
+               double *score);
+
+#endif /* ZSET_H */
@@ -0,0 +1,134 @@
+/**
+ * Checks of the hash against a simple model, across its packed -> Map
+ * conversion.
+ *
+ * Usage: hash_test, exits with 1 on the first failed check
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+#include "object.h"
+#include "test.h"
+
+#define K_HASH_FIELDS 300
+
+typedef struct {
+  char field[16];
+  uint32_t field_length;
+  char value[128];
+  uint32_t value_length;
+  bool present;
+  uint32_t visits;
+} HModel;
+
+typedef struct {
+  HModel *model;
+  size_t n;
+} HashCheck;
+
+static void visit_field(const char *field, uint32_t field_length,
+                        const char *value, uint32_t value_length, void *arg) {
+  HashCheck *check = (HashCheck *)arg;
+  size_t i = 0;
+  while (i < check->n && !(check->model[i].field_length == field_length &&
+                           memcmp(check->model[i].field, field,
+                                  field_length) == 0)) {
+    i++;
+  }
+  CHECK(i < check->n && check->model[i].present);
+  CHECK(value_length == check->model[i].value_length &&
+        memcmp(value, check->model[i].value, value_length) == 0);
+  check->model[i].visits++;
+}
+
+static void check_hash(Hash *hash, HModel *model, size_t n) {
+  uint32_t size = 0;
+  for (size_t i = 0; i < n; i++) {
+    model[i].visits = 0;
+    size += model[i].present;
+
+    const char *value = NULL;
+    uint32_t length = 0;
+    CHECK(hash_get(hash, model[i].field, model[i].field_length, &value,
+                   &length) == model[i].present);
+    CHECK(!model[i].present || (length == model[i].value_length &&
+                                memcmp(value, model[i].value, length) == 0));
+  }
+  CHECK(hash->size == size);
+
+  HashCheck check = {model, n};
+  hash_scan(hash, &visit_field, &check);
+  for (size_t i = 0; i < n; i++) {
+    CHECK(model[i].visits == (model[i].present ? 1u : 0u));
+  }
+}
+
+static void test_hash(bool long_value) {
+  HModel *model = (HModel *)calloc(K_HASH_FIELDS, sizeof(HModel));
+  for (size_t i = 0; i < K_HASH_FIELDS; i++) {
+    model[i].field_length =
+        (uint32_t)snprintf(model[i].field, sizeof(model[i].field), "f%zu", i);
+  }
+  Hash *hash = create_hash();
+
+  // Few fields, until a long value converts the hash if requested
+  for (size_t step = 0; step < 200; step++) {
+    HModel *m = &model[next_random() % 20];
+    m->value_length = (uint32_t)(next_random() % 40);
+    if (long_value && step == 150) {
+      m->value_length = K_HASH_PACKED_MAX_VALUE + 1;
+    }
+    memset(m->value, 'a' + (int)(step % 26), m->value_length);
+    CHECK(hash_set(hash, m->field, m->field_length, m->value,
+                   m->value_length) == !m->present);
+    m->present = true;
+    if (step % 3 == 0) {
+      CHECK(hash_remove(hash, m->field, m->field_length));
+      m->present = false;
+    }
+    check_hash(hash, model, K_HASH_FIELDS);
+  }
+  CHECK(hash->encoding == (long_value ? HASH_MAP : HASH_PACKED));
+
+  // Past the packed size, with values growing and shrinking in place
+  for (size_t step = 0; step < 4 * K_HASH_FIELDS; step++) {
+    HModel *m = &model[next_random() % K_HASH_FIELDS];
+    if (step % 4 == 3) {
+      CHECK(hash_remove(hash, m->field, m->field_length) == m->present);
+      m->present = false;
+    } else {
+      m->value_length = (uint32_t)(next_random() % sizeof(m->value));
+      memset(m->value, 'a' + (int)(step % 26), m->value_length);
+      CHECK(hash_set(hash, m->field, m->field_length, m->value,
+                     m->value_length) == !m->present);
+      m->present = true;
+    }
+    if (step % 31 == 0) {
+      check_hash(hash, model, K_HASH_FIELDS);
+    }
+  }
+  check_hash(hash, model, K_HASH_FIELDS);
+  CHECK(hash->encoding == HASH_MAP);
+
+  for (size_t i = 0; i < K_HASH_FIELDS; i++) {
+    CHECK(hash_remove(hash, model[i].field, model[i].field_length) ==
+          model[i].present);
+    model[i].present = false;
+  }
+  check_hash(hash, model, K_HASH_FIELDS);
+  CHECK(hash->size == 0);
+  free_hash(hash);
+  free(model);
+}
+
+int main(void) {
+  initialize_hash_seed();
+
+  test_hash(false);
+  test_hash(true);
+  printf("ok\n");
+  return 0;
+}
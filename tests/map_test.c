@@ -0,0 +1,159 @@
+/**
+ * Checks of the map engine it is built with against a simple model: insert,
+ * detach and scans across grows and shrinks, with the resize paced by a small
+ * or a large g_resizing_work.
+ *
+ * Usage: map_test, exits with 1 on the first failed check
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "entry.h"
+#include "map.h"
+#include "object.h"
+#include "test.h"
+
+#define K_MAP_KEYS 50000
+
+typedef struct {
+  HashNode node;
+  uint64_t key;
+  bool present;
+  uint32_t visits;
+} TestNode;
+
+static bool test_node_eq(HashNode *lhs, HashNode *rhs) {
+  return CONTAINER_OF(lhs, TestNode, node)->key ==
+         CONTAINER_OF(rhs, TestNode, node)->key;
+}
+
+static void set_test_key(TestNode *node, uint64_t key) {
+  node->key = key;
+  node->node.next = NULL;
+  node->node.hashcode = hash_string((const char *)&key, sizeof(key));
+}
+
+static HashNode *find(Map *map, uint64_t key, bool detach) {
+  TestNode probe;
+  set_test_key(&probe, key);
+  return detach ? detach_map(map, &probe.node, &test_node_eq)
+                : lookup_map(map, &probe.node, &test_node_eq);
+}
+
+static void count_visit(HashNode *node, void *arg) {
+  (void)arg;
+  CONTAINER_OF(node, TestNode, node)->visits++;
+}
+
+/**
+ * Every present node is in the map, once, and the others are not
+ */
+static void check_map(Map *map, TestNode *nodes, size_t n) {
+  size_t present = 0;
+  for (size_t i = 0; i < n; i++) {
+    nodes[i].visits = 0;
+    present += nodes[i].present;
+  }
+  CHECK(get_map_size(map) == present);
+
+  scan_map(map, &count_visit, NULL);
+  for (size_t i = 0; i < n; i++) {
+    CHECK(nodes[i].visits == (nodes[i].present ? 1u : 0u));
+    HashNode *found = find(map, nodes[i].key, false);
+    CHECK(found == (nodes[i].present ? &nodes[i].node : NULL));
+  }
+  CHECK(!find(map, n + 1, false));
+}
+
+/**
+ * A cursor scan interleaved with inserts and detaches visits every node
+ * present during the whole scan
+ */
+static void check_cursor_scan(Map *map, TestNode *nodes, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    nodes[i].visits = 0;
+  }
+  bool *kept = (bool *)calloc(n, sizeof(bool));
+  for (size_t i = 0; i < n; i++) {
+    kept[i] = nodes[i].present;
+  }
+
+  size_t cursor = 0;
+  do {
+    cursor = scan_map_step(map, cursor, &count_visit, NULL);
+    uint64_t i = next_random() % n;
+    if (nodes[i].present) {
+      CHECK(find(map, nodes[i].key, true) == &nodes[i].node);
+      nodes[i].present = false;
+      kept[i] = false;
+    } else {
+      insert_map(map, &nodes[i].node);
+      nodes[i].present = true;
+    }
+  } while (cursor != 0);
+
+  for (size_t i = 0; i < n; i++) {
+    CHECK(!kept[i] || nodes[i].visits > 0);
+  }
+  free(kept);
+}
+
+static void test_map(size_t work) {
+  g_resizing_work = work;
+  TestNode *nodes = (TestNode *)calloc(K_MAP_KEYS, sizeof(TestNode));
+  for (size_t i = 0; i < K_MAP_KEYS; i++) {
+    set_test_key(&nodes[i], i);
+  }
+  Map map = {0};
+
+  // Grow, checking the map in the middle of resizes
+  for (size_t i = 0; i < K_MAP_KEYS; i++) {
+    insert_map(&map, &nodes[i].node);
+    nodes[i].present = true;
+    if (i % 9973 == 0) {
+      check_map(&map, nodes, K_MAP_KEYS);
+    }
+  }
+  check_map(&map, nodes, K_MAP_KEYS);
+  check_cursor_scan(&map, nodes, K_MAP_KEYS);
+  check_map(&map, nodes, K_MAP_KEYS);
+
+  // Shrink to a few nodes
+  size_t full = get_map_memory(&map);
+  for (size_t i = 0; i < K_MAP_KEYS; i++) {
+    if (nodes[i].present && i % 64 != 0) {
+      CHECK(find(&map, nodes[i].key, true) == &nodes[i].node);
+      nodes[i].present = false;
+    }
+    if (i % 9973 == 0) {
+      check_map(&map, nodes, K_MAP_KEYS);
+    }
+  }
+  while (rehash_map(&map, 1024)) {
+  }
+  CHECK(get_map_memory(&map) < full / 4);
+  check_map(&map, nodes, K_MAP_KEYS);
+
+  // Grow again right after the shrink
+  for (size_t i = 0; i < K_MAP_KEYS; i++) {
+    if (!nodes[i].present) {
+      insert_map(&map, &nodes[i].node);
+      nodes[i].present = true;
+    }
+  }
+  check_map(&map, nodes, K_MAP_KEYS);
+
+  free_map(&map);
+  CHECK(get_map_memory(&map) == 0);
+  free(nodes);
+}
+
+int main(void) {
+  initialize_hash_seed();
+
+  test_map(1);
+  test_map(K_RESIZING_WORK);
+  printf("ok\n");
+  return 0;
+}
@@ -0,0 +1,221 @@
+/**
+ * Checks of the commands of the keyspace. Most run on the calling thread as
+ * the only shard, their writes observed through the replication backlog which
+ * the first REPLSYNC with the secret starts. SCAN is then checked across the
+ * shards of K_MAX_WORKERS workers, served on a local port.
+ *
+ * Usage: store_test, exits with 1 on the first failed check
+ */
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "command.h"
+#include "common.h"
+#include "connection.h"
+#include "encoding.h"
+#include "object.h"
+#include "request.h"
+#include "test.h"
+#include "worker.h"
+
+#define K_SCAN_KEYS 5000
+
+static Command g_command;
+static Output g_out;
+
+/**
+ * Execute a command given as NUL-terminated arguments, the reply is left in
+ * g_out
+ */
+static void call(const char *const *args, uint32_t n) {
+  clear_command(&g_command);
+  for (uint32_t i = 0; i < n; i++) {
+    add_to_command(&g_command, args[i], (uint32_t)strlen(args[i]));
+  }
+  g_out.size = 0;
+  execute_request(&g_command, &g_out);
+}
+
+#define CALL(...)                                                              \
+  call((const char *const[]){__VA_ARGS__},                                     \
+       sizeof((const char *const[]){__VA_ARGS__}) / sizeof(const char *))
+
+/**
+ * Send the command to the server and read its reply into g_out
+ */
+static void send_call(int fd, const char *const *args, uint32_t n) {
+  StringView views[8];
+  for (uint32_t i = 0; i < n; i++) {
+    views[i] = (StringView){args[i], (uint32_t)strlen(args[i])};
+  }
+  g_out.size = 0;
+  out_request(&g_out, views, n);
+  CHECK(write_all(fd, g_out.chars, g_out.size) == 0);
+
+  uint32_t length = 0;
+  CHECK(read_all(fd, &length, 4) == 0);
+  g_out.size = 0;
+  reserve_output(&g_out, length);
+  CHECK(read_all(fd, g_out.chars, length) == 0);
+  g_out.size = length;
+}
+
+#define SEND(fd, ...)                                                          \
+  send_call(fd, (const char *const[]){__VA_ARGS__},                            \
+            sizeof((const char *const[]){__VA_ARGS__}) / sizeof(const char *))
+
+static int64_t reply_integer(size_t at) {
+  int64_t value = 0;
+  CHECK(g_out.size >= at + 9 && g_out.chars[at] == SERIAL_INTEGER);
+  memcpy(&value, &g_out.chars[at + 1], 8);
+  return value;
+}
+
+/**
+ * Offset past the last record fed to the backlog of the shard
+ */
+static int64_t backlog_end(void) {
+  CALL("replfetch", "0", "0", "secret");
+  return reply_integer(5);
+}
+
+static void test_replication_secret(void) {
+  CALL("replconf", "secreT");
+  CHECK(g_out.chars[0] == SERIAL_ERROR);
+  CALL("replconf", "secret2");
+  CHECK(g_out.chars[0] == SERIAL_ERROR);
+  CALL("replsync", "0", "0", "");
+  CHECK(g_out.chars[0] == SERIAL_ERROR);
+
+  // No backlog was started
+  CALL("replfetch", "0", "0", "secret");
+  CHECK(g_out.chars[0] == SERIAL_ERROR);
+  CALL("replconf", "secret");
+  CHECK(g_out.chars[0] == SERIAL_ARRAY);
+}
+
+static void test_delete(void) {
+  CALL("replsync", "0", "0", "secret");
+  CHECK(g_out.chars[0] == SERIAL_ARRAY);
+
+  CALL("set", "live", "v", "px", "60000");
+  CALL("set", "gone", "v", "px", "1");
+  usleep(5000);
+
+  // An expired key is missing, and its deletion is not logged
+  int64_t end = backlog_end();
+  CALL("delete", "gone");
+  CHECK(reply_integer(0) == 0);
+  CHECK(backlog_end() == end);
+  CALL("get", "gone");
+  CHECK(g_out.chars[0] == SERIAL_NIL);
+
+  CALL("delete", "live");
+  CHECK(reply_integer(0) == 1);
+  CHECK(backlog_end() > end);
+  CALL("delete", "live");
+  CHECK(reply_integer(0) == 0);
+}
+
+static int g_listen_fds[K_MAX_WORKERS];
+
+static void *serve(void *arg) {
+  (void)arg;
+  run_workers(g_listen_fds, K_MAX_WORKERS, false);
+  return NULL;
+}
+
+/**
+ * Listen on a free port with one socket per worker, as the server does
+ */
+static uint16_t listen_for_workers(void) {
+  struct sockaddr_in addr = {0};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  for (uint32_t i = 0; i < K_MAX_WORKERS; i++) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int val = 1;
+    CHECK(fd >= 0 &&
+          setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val)) == 0);
+    CHECK(bind(fd, (const struct sockaddr *)&addr, sizeof(addr)) == 0);
+    CHECK(listen(fd, SOMAXCONN) == 0);
+    socklen_t length = sizeof(addr);
+    CHECK(getsockname(fd, (struct sockaddr *)&addr, &length) == 0);
+    fd_set_nb(fd);
+    g_listen_fds[i] = fd;
+  }
+  return ntohs(addr.sin_port);
+}
+
+static void test_scan(void) {
+  struct sockaddr_in addr = {0};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(listen_for_workers());
+  pthread_t server;
+  CHECK(pthread_create(&server, NULL, &serve, NULL) == 0);
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  CHECK(connect(fd, (const struct sockaddr *)&addr, sizeof(addr)) == 0);
+
+  char key[16];
+  for (int i = 0; i < K_SCAN_KEYS; i++) {
+    snprintf(key, sizeof(key), "k%d", i);
+    SEND(fd, "set", key, "v");
+  }
+
+  // Every key, some may be visited twice if a shard resizes in between
+  uint32_t *visits = (uint32_t *)calloc(K_SCAN_KEYS, sizeof(uint32_t));
+  char cursor[24] = "0";
+  uint32_t calls = 0;
+  do {
+    SEND(fd, "scan", cursor, "count", "100");
+    CHECK(g_out.chars[0] == SERIAL_ARRAY);
+    int64_t next = reply_integer(5);
+    CHECK(next >= 0);
+    snprintf(cursor, sizeof(cursor), "%lld", (long long)next);
+
+    uint32_t n = 0;
+    CHECK(g_out.chars[14] == SERIAL_ARRAY);
+    memcpy(&n, &g_out.chars[15], 4);
+    size_t at = 19;
+    for (uint32_t i = 0; i < n; i++) {
+      uint32_t length = 0;
+      CHECK(g_out.chars[at] == SERIAL_STRING);
+      memcpy(&length, &g_out.chars[at + 1], 4);
+      CHECK(length > 1 && length < sizeof(key));
+      memcpy(key, &g_out.chars[at + 5], length);
+      key[length] = '\0';
+      int index = atoi(&key[1]);
+      CHECK(index >= 0 && index < K_SCAN_KEYS);
+      visits[index]++;
+      at += 5 + length;
+    }
+    CHECK(++calls <= K_SCAN_KEYS + K_MAX_WORKERS);
+  } while (strcmp(cursor, "0") != 0);
+
+  for (int i = 0; i < K_SCAN_KEYS; i++) {
+    CHECK(visits[i] > 0);
+  }
+  free(visits);
+  close(fd);
+}
+
+int main(void) {
+  initialize_hash_seed();
+  initialize_commands();
+  initialize_command(&g_command);
+  initialize_output(&g_out);
+  g_config.repl_auth = "secret";
+
+  test_replication_secret();
+  test_delete();
+  test_scan();
+  printf("ok\n");
+  return 0;
+}
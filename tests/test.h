@@ -0,0 +1,26 @@
+#ifndef TEST_H
+#define TEST_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define CHECK(condition)                                                       \
+  do {                                                                         \
+    if (!(condition)) {                                                        \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__,         \
+              #condition);                                                     \
+      exit(1);                                                                 \
+    }                                                                          \
+  } while (0)
+
+static uint64_t g_random = 0x9e3779b97f4a7c15ull;
+
+static inline uint64_t next_random(void) {
+  g_random ^= g_random << 13;
+  g_random ^= g_random >> 7;
+  g_random ^= g_random << 17;
+  return g_random;
+}
+
+#endif /* TEST_H */
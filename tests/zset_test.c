@@ -0,0 +1,147 @@
+/**
+ * Checks of the sorted set against a simple model, across its packed ->
+ * skiplist conversion.
+ *
+ * Usage: zset_test, exits with 1 on the first failed check
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "object.h"
+#include "test.h"
+#include "zset.h"
+
+#define K_ZSET_MEMBERS 300
+
+typedef struct {
+  char member[80];
+  uint32_t length;
+  double score;
+  bool present;
+} ZModel;
+
+static int compare_zmodel(const void *lhs, const void *rhs) {
+  const ZModel *a = (const ZModel *)lhs;
+  const ZModel *b = (const ZModel *)rhs;
+  if (a->present != b->present) {
+    return a->present ? -1 : 1; // Missing members last
+  }
+  if (a->score != b->score) {
+    return a->score < b->score ? -1 : 1;
+  }
+  uint32_t n = a->length < b->length ? a->length : b->length;
+  int rv = memcmp(a->member, b->member, n);
+  return rv ? rv : (int)a->length - (int)b->length;
+}
+
+static void check_zset(ZSet *zset, const ZModel *model, size_t n) {
+  ZModel *sorted = (ZModel *)malloc(n * sizeof(ZModel));
+  memcpy(sorted, model, n * sizeof(ZModel));
+  qsort(sorted, n, sizeof(ZModel), &compare_zmodel);
+  uint32_t size = 0;
+  while (size < n && sorted[size].present) {
+    size++;
+  }
+  CHECK(zset->size == size);
+
+  // Ranks and the whole range in order
+  ZSetIterator it;
+  zset_seek(zset, 0, &it);
+  for (uint32_t rank = 0; rank < size; rank++) {
+    const char *member = NULL;
+    uint32_t length = 0;
+    double score = 0;
+    CHECK(zset_next(&it, &member, &length, &score));
+    CHECK(length == sorted[rank].length &&
+          memcmp(member, sorted[rank].member, length) == 0);
+    CHECK(score == sorted[rank].score);
+    CHECK(zset_rank(zset, member, length) == (int64_t)rank);
+  }
+  const char *member = NULL;
+  uint32_t length = 0;
+  double score = 0;
+  CHECK(!zset_next(&it, &member, &length, &score));
+
+  // Ranges from a rank, and counts below scores
+  for (uint32_t rank = 0; rank < size; rank += 7) {
+    zset_seek(zset, rank, &it);
+    CHECK(zset_next(&it, &member, &length, &score));
+    CHECK(length == sorted[rank].length &&
+          memcmp(member, sorted[rank].member, length) == 0);
+
+    double bound = sorted[rank].score;
+    uint32_t below = 0;
+    uint32_t at_most = 0;
+    for (uint32_t i = 0; i < size; i++) {
+      below += sorted[i].score < bound;
+      at_most += sorted[i].score <= bound;
+    }
+    CHECK(zset_count_below(zset, bound, false) == below);
+    CHECK(zset_count_below(zset, bound, true) == at_most);
+  }
+  zset_seek(zset, size, &it);
+  CHECK(!zset_next(&it, &member, &length, &score));
+
+  for (size_t i = 0; i < n; i++) {
+    double found = 0;
+    CHECK(zset_score(zset, model[i].member, model[i].length, &found) ==
+          model[i].present);
+    CHECK(!model[i].present || found == model[i].score);
+  }
+  free(sorted);
+}
+
+static void test_zset(bool long_member) {
+  ZModel *model = (ZModel *)calloc(K_ZSET_MEMBERS, sizeof(ZModel));
+  for (size_t i = 0; i < K_ZSET_MEMBERS; i++) {
+    // The last member is too long to be packed, if requested
+    size_t pad = long_member && i == K_ZSET_MEMBERS - 1
+                     ? K_ZSET_PACKED_MAX_MEMBER
+                     : 0;
+    model[i].length = (uint32_t)snprintf(model[i].member, 16, "m%zu", i);
+    memset(&model[i].member[model[i].length], 'x', pad);
+    model[i].length += (uint32_t)pad;
+  }
+  ZSet *zset = create_zset();
+
+  // Scores with many ties, so members order the equal ones
+  for (size_t step = 0; step < 4 * K_ZSET_MEMBERS; step++) {
+    size_t i = long_member && step == 10 ? K_ZSET_MEMBERS - 1
+                                         : next_random() % K_ZSET_MEMBERS;
+    ZModel *m = &model[i];
+    if (step % 5 == 4 && m->present) {
+      CHECK(zset_remove(zset, m->member, m->length));
+      m->present = false;
+    } else {
+      double score = (double)(next_random() % 50) / 2;
+      CHECK(zset_add(zset, m->member, m->length, score) == !m->present);
+      m->score = score;
+      m->present = true;
+    }
+    if (step % 37 == 0) {
+      check_zset(zset, model, K_ZSET_MEMBERS);
+    }
+  }
+  check_zset(zset, model, K_ZSET_MEMBERS);
+  CHECK(zset->encoding == ZSET_SKIPLIST);
+
+  for (size_t i = 0; i < K_ZSET_MEMBERS; i++) {
+    CHECK(zset_remove(zset, model[i].member, model[i].length) ==
+          model[i].present);
+    model[i].present = false;
+  }
+  check_zset(zset, model, K_ZSET_MEMBERS);
+  free_zset(zset);
+  free(model);
+}
+
+int main(void) {
+  initialize_hash_seed();
+
+  test_zset(false);
+  test_zset(true);
+  printf("ok\n");
+  return 0;
+}